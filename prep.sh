@@ -153,7 +153,8 @@ if [ "${SKIP_APT:-0}" != 1 ]; then
 		libsqlite3-dev \
 		pkgconf \
 		uuid-runtime \
-		uuid-dev
+		uuid-dev \
+		libxxhash-dev
 fi
 
 # Check if binary is installed. Setup for build if it is not
@@ -76,6 +76,33 @@ TEST(VarintTest, DecodeErrors) {
   EXPECT_EQ("integer overflow", error_message);
 }
 
+TEST(VarintTest, DecodeWord) {
+  const uint32_t kValues[] = {0,          1,          127,        128,
+                              300,        UINT32_C(1) << 21,
+                              UINT32_C(1) << 28,      UINT32_MAX};
+  for (uint32_t value : kValues) {
+    std::string buf;
+    AppendVar32(value, &buf);
+    int len = buf.size();
+    buf.resize(8, '\xff');  // trailing garbage must be ignored.
+    uint32_t out;
+    EXPECT_EQ(len, DecodeVar32Word(reinterpret_cast<const uint8_t *>(
+                                       buf.data()),
+                                   &out))
+        << value;
+    EXPECT_EQ(value, out);
+  }
+
+  // Overflow and over-long varints are left to DecodeVar32.
+  uint32_t out;
+  EXPECT_EQ(0, DecodeVar32Word(reinterpret_cast<const uint8_t *>(
+                                   "\x80\x80\x80\x80\x10\x00\x00\x00"),
+                               &out));
+  EXPECT_EQ(0, DecodeVar32Word(reinterpret_cast<const uint8_t *>(
+                                   "\x80\x80\x80\x80\x80\x00\x00\x00"),
+                               &out));
+}
+
 TEST(ZigzagTest, Encode) {
   EXPECT_EQ(UINT32_C(0), Zigzag32(INT32_C(0)));
   EXPECT_EQ(UINT32_C(1), Zigzag32(INT32_C(-1)));
@@ -35,6 +35,7 @@
 
 #include <endian.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <string>
 
@@ -123,6 +124,31 @@ inline bool DecodeVar32(re2::StringPiece *in, uint32_t *out,
   }
 }
 
+// Decode the varint at |p|, which must have at least 8 readable bytes, saving
+// it to |out|. Returns the number of bytes consumed, or 0 if |p| doesn't start
+// with a valid 32-bit varint (use DecodeVar32 for a description of why). This
+// examines a whole 64-bit word at once rather than looping over its bytes, so
+// it has no branches on the varint's length.
+inline int DecodeVar32Word(const uint8_t *p, uint32_t *out) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  word = le64toh(word);
+  uint64_t stops = ~word & UINT64_C(0x0000008080808080);
+  if (stops == 0) {
+    return 0;  // longer than 5 bytes.
+  }
+  int len = (__builtin_ctzll(stops) >> 3) + 1;
+  if (len == 5 && p[4] > 0x0f) {
+    return 0;  // overflow.
+  }
+  word &= ~UINT64_C(0) >> (64 - 8 * len);
+  *out = static_cast<uint32_t>((word & 0x7f) | ((word >> 1) & (0x7f << 7)) |
+                               ((word >> 2) & (0x7f << 14)) |
+                               ((word >> 3) & (0x7f << 21)) |
+                               ((word >> 4) & (UINT64_C(0x7f) << 28)));
+  return len;
+}
+
 // Zigzag encoding for signed integers, as in
 // https://developers.google.com/protocol-buffers/docs/encoding#types
 // Use the low bit to indicate signedness (1 = negative, 0 = non-negative).
@@ -164,6 +190,20 @@ inline void Append64(int64_t in, std::string *out) {
   out->append(reinterpret_cast<const char *>(&net), sizeof(int64_t));
 }
 
+// Read big-endian values, as written by AppendU32 and AppendU64. |in| needn't
+// be aligned.
+inline uint32_t ReadU32(const char *in) {
+  uint32_t net;
+  memcpy(&net, in, sizeof(uint32_t));
+  return ToNetworkU32(net);
+}
+
+inline uint64_t ReadU64(const char *in) {
+  uint64_t net;
+  memcpy(&net, in, sizeof(uint64_t));
+  return ToNetworkU64(net);
+}
+
 }  // namespace moonfire_nvr
 
 #endif  // MOONFIRE_NVR_CODING_H
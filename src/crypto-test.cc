@@ -30,6 +30,9 @@
 //
 // crypto-test.cc: tests of the crypto.h interface.
 
+#include <memory>
+#include <vector>
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
@@ -55,6 +58,56 @@ TEST(DigestTest, Sha1) {
             ToHex(sha1->Finalize()));
 }
 
+TEST(DigestTest, Xxh3_128) {
+  auto xxh3 = Digest::XXH3_128();
+  EXPECT_EQ("99aa06d3014798d86001c324468d497f", ToHex(xxh3->Finalize()));
+
+  xxh3 = Digest::ForAlgorithm(HashAlgorithm::kXxh3_128);
+  xxh3->Update("hello");
+  xxh3->Update(" world");
+  EXPECT_EQ("df8d09e93f874900a99b8775cc15b6c7", ToHex(xxh3->Finalize()));
+}
+
+TEST(DigestTest, ParseHashAlgorithm) {
+  HashAlgorithm algorithm;
+  ASSERT_TRUE(ParseHashAlgorithm("sha1", &algorithm));
+  EXPECT_TRUE(algorithm == HashAlgorithm::kSha1);
+  ASSERT_TRUE(ParseHashAlgorithm("xxh3_128", &algorithm));
+  EXPECT_TRUE(algorithm == HashAlgorithm::kXxh3_128);
+  EXPECT_FALSE(ParseHashAlgorithm("md5", &algorithm));
+}
+
+TEST(AsyncDigestTest, MatchesDigest) {
+  std::string data;
+  for (int i = 0; i < 1000; ++i) {
+    data.append(StrCat("packet ", i, "\n"));
+  }
+  auto expected = Digest::SHA1();
+  expected->Update(data);
+  std::string expected_hex = ToHex(expected->Finalize());
+
+  // Interleave several digests on a worker whose queue limit is small
+  // enough that Update often blocks.
+  DigestWorker worker(64);
+  std::vector<std::unique_ptr<AsyncDigest>> digests;
+  for (int i = 0; i < 3; ++i) {
+    digests.emplace_back(new AsyncDigest(&worker, Digest::SHA1()));
+  }
+  for (size_t pos = 0; pos < data.size(); pos += 10) {
+    for (auto &d : digests) {
+      d->Update(re2::StringPiece(data).substr(pos, 10));
+    }
+  }
+  for (auto &d : digests) {
+    EXPECT_EQ(expected_hex, ToHex(d->Finalize()));
+  }
+
+  // A null worker hashes inline.
+  AsyncDigest inline_digest(nullptr, Digest::SHA1());
+  inline_digest.Update(data);
+  EXPECT_EQ(expected_hex, ToHex(inline_digest.Finalize()));
+}
+
 }  // namespace
 }  // namespace moonfire_nvr
 
@@ -33,29 +33,180 @@
 #include "crypto.h"
 
 #include <glog/logging.h>
+#include <openssl/evp.h>
+#include <xxhash.h>
 
 namespace moonfire_nvr {
 
+namespace {
+
+class EvpDigest : public Digest {
+ public:
+  explicit EvpDigest(const EVP_MD *md) {
+    ctx_ = CHECK_NOTNULL(EVP_MD_CTX_create());
+    CHECK_EQ(1, EVP_DigestInit_ex(ctx_, md, nullptr));
+  }
+  ~EvpDigest() final { EVP_MD_CTX_destroy(ctx_); }
+
+  void Update(re2::StringPiece data) final {
+    CHECK_EQ(1, EVP_DigestUpdate(ctx_, data.data(), data.size()));
+  }
+
+  std::string Finalize() final {
+    std::string out;
+    out.resize(EVP_MD_CTX_size(ctx_));
+    auto *p = reinterpret_cast<unsigned char *>(&out[0]);
+    CHECK_EQ(1, EVP_DigestFinal_ex(ctx_, p, nullptr));
+    return out;
+  }
+
+ private:
+  EVP_MD_CTX *ctx_ = nullptr;
+};
+
+class Xxh3Digest : public Digest {
+ public:
+  Xxh3Digest() {
+    state_ = CHECK_NOTNULL(XXH3_createState());
+    CHECK_EQ(XXH_OK, XXH3_128bits_reset(state_));
+  }
+  ~Xxh3Digest() final { XXH3_freeState(state_); }
+
+  void Update(re2::StringPiece data) final {
+    CHECK_EQ(XXH_OK, XXH3_128bits_update(state_, data.data(), data.size()));
+  }
+
+  std::string Finalize() final {
+    // The canonical representation is big-endian, as with SHA-1.
+    XXH128_canonical_t canonical;
+    XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state_));
+    return std::string(reinterpret_cast<const char *>(canonical.digest),
+                       sizeof(canonical.digest));
+  }
+
+ private:
+  XXH3_state_t *state_ = nullptr;
+};
+
+}  // namespace
+
+bool ParseHashAlgorithm(re2::StringPiece name, HashAlgorithm *algorithm) {
+  if (name == "sha1") {
+    *algorithm = HashAlgorithm::kSha1;
+  } else if (name == "xxh3_128") {
+    *algorithm = HashAlgorithm::kXxh3_128;
+  } else {
+    return false;
+  }
+  return true;
+}
+
 std::unique_ptr<Digest> Digest::SHA1() {
-  std::unique_ptr<Digest> d(new Digest);
-  CHECK_EQ(1, EVP_DigestInit_ex(d->ctx_, EVP_sha1(), nullptr));
-  return d;
+  return std::unique_ptr<Digest>(new EvpDigest(EVP_sha1()));
+}
+
+std::unique_ptr<Digest> Digest::XXH3_128() {
+  return std::unique_ptr<Digest>(new Xxh3Digest);
+}
+
+std::unique_ptr<Digest> Digest::ForAlgorithm(HashAlgorithm algorithm) {
+  switch (algorithm) {
+    case HashAlgorithm::kSha1:
+      return SHA1();
+    case HashAlgorithm::kXxh3_128:
+      return XXH3_128();
+  }
+  LOG(FATAL) << "unknown hash algorithm " << static_cast<int>(algorithm);
+  return nullptr;
+}
+
+AsyncDigest::AsyncDigest(DigestWorker *worker, std::unique_ptr<Digest> digest)
+    : worker_(worker), digest_(std::move(digest)) {}
+
+AsyncDigest::~AsyncDigest() {
+  if (worker_ != nullptr) {
+    worker_->WaitFor(this);
+  }
 }
 
-Digest::Digest() { ctx_ = CHECK_NOTNULL(EVP_MD_CTX_create()); }
+void AsyncDigest::Update(re2::StringPiece data) {
+  if (worker_ == nullptr) {
+    digest_->Update(data);
+  } else if (!data.empty()) {
+    worker_->Enqueue(this, data);
+  }
+}
+
+std::string AsyncDigest::Finalize() {
+  if (worker_ != nullptr) {
+    worker_->WaitFor(this);
+  }
+  return digest_->Finalize();
+}
 
-Digest::~Digest() { EVP_MD_CTX_destroy(ctx_); }
+DigestWorker::DigestWorker(size_t max_pending_bytes)
+    : max_pending_bytes_(max_pending_bytes) {
+  thread_ = std::thread([this]() { Run(); });
+}
 
-void Digest::Update(re2::StringPiece data) {
-  CHECK_EQ(1, EVP_DigestUpdate(ctx_, data.data(), data.size()));
+DigestWorker::~DigestWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    CHECK(queue_.empty());
+    shutdown_ = true;
+  }
+  queue_cv_.notify_all();
+  thread_.join();
 }
 
-std::string Digest::Finalize() {
-  std::string out;
-  out.resize(EVP_MD_CTX_size(ctx_));
-  auto *p = reinterpret_cast<unsigned char *>(&out[0]);
-  CHECK_EQ(1, EVP_DigestFinal_ex(ctx_, p, nullptr));
-  return out;
+void DigestWorker::Enqueue(AsyncDigest *digest, re2::StringPiece data) {
+  // The copy is deliberate: callers reuse their buffers (a Stream's packet is
+  // overwritten by the next one read), and it's cheap next to the hashing it
+  // moves off the caller's thread, about 1 usec versus 29 usec for the SHA-1
+  // of a 30 KiB packet. Make it before taking the lock so the worker isn't
+  // held up meanwhile.
+  std::string copy = data.as_string();
+  std::unique_lock<std::mutex> lock(mu_);
+
+  // Always admit an update when nothing is pending, even one larger than the
+  // limit.
+  done_cv_.wait(lock, [&]() {
+    return pending_bytes_ == 0 ||
+           pending_bytes_ + data.size() <= max_pending_bytes_;
+  });
+  queue_.push_back(PendingUpdate{digest, std::move(copy)});
+  pending_bytes_ += data.size();
+  ++digest->pending_updates_;
+  lock.unlock();
+  queue_cv_.notify_one();
+}
+
+void DigestWorker::WaitFor(AsyncDigest *digest) {
+  std::unique_lock<std::mutex> lock(mu_);
+  done_cv_.wait(lock, [digest]() { return digest->pending_updates_ == 0; });
+}
+
+void DigestWorker::Run() {
+  std::unique_lock<std::mutex> lock(mu_);
+  while (true) {
+    queue_cv_.wait(lock, [this]() { return shutdown_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;  // shutdown.
+    }
+    PendingUpdate update = std::move(queue_.front());
+    queue_.pop_front();
+
+    // The digest's owner doesn't touch digest_ while it has pending updates,
+    // so it's safe to apply this one without the lock. Updates to a given
+    // digest are applied in order, as this is the only thread applying them.
+    lock.unlock();
+    update.digest->digest_->Update(update.data);
+    lock.lock();
+
+    pending_bytes_ -= update.data.size();
+    --update.digest->pending_updates_;
+    done_cv_.notify_all();
+  }
 }
 
 }  // namespace moonfire_nvr
@@ -33,29 +33,116 @@
 #ifndef MOONFIRE_NVR_CRYPTO_H
 #define MOONFIRE_NVR_CRYPTO_H
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 
-#include <openssl/evp.h>
 #include <re2/stringpiece.h>
 
 namespace moonfire_nvr {
 
+// The algorithm used to hash a sample file's contents.
+// See the recording.sample_file_hash_algorithm column in schema.sql.
+enum class HashAlgorithm { kSha1 = 0, kXxh3_128 = 1 };
+
+// Parses a HashAlgorithm from its name ("sha1" or "xxh3_128").
+// Returns false if |name| is unrecognized.
+bool ParseHashAlgorithm(re2::StringPiece name, HashAlgorithm *algorithm);
+
 class Digest {
  public:
   static std::unique_ptr<Digest> SHA1();
-  ~Digest();
+
+  // XXH3-128, a non-cryptographic hash which is an order of magnitude faster
+  // than SHA-1. It's suitable for detecting corruption but not tampering.
+  static std::unique_ptr<Digest> XXH3_128();
+
+  static std::unique_ptr<Digest> ForAlgorithm(HashAlgorithm algorithm);
+
+  Digest(const Digest &) = delete;
+  void operator=(const Digest &) = delete;
+  virtual ~Digest() {}
+
+  // PRE: Finalize() has not been called.
+  virtual void Update(re2::StringPiece data) = 0;
 
+  // PRE: Finalize() has not been called.
+  virtual std::string Finalize() = 0;
+
+ protected:
+  Digest() {}
+};
+
+class DigestWorker;
+
+// A Digest whose updates may be applied on a DigestWorker's thread rather than
+// the caller's. The result is identical either way. Thread-compatible.
+class AsyncDigest {
+ public:
+  // If |worker| is null, updates are applied inline. Otherwise |worker| must
+  // outlive this object.
+  AsyncDigest(DigestWorker *worker, std::unique_ptr<Digest> digest);
+  AsyncDigest(const AsyncDigest &) = delete;
+  void operator=(const AsyncDigest &) = delete;
+
+  // Waits for any pending updates.
+  ~AsyncDigest();
+
+  // Copies |data| for the worker. May block if the worker is far behind.
   // PRE: Finalize() has not been called.
   void Update(re2::StringPiece data);
 
+  // Waits for any pending updates and returns the result.
   // PRE: Finalize() has not been called.
   std::string Finalize();
 
  private:
-  Digest();
-  Digest(const Digest &) = delete;
-  void operator=(const Digest &) = delete;
-  EVP_MD_CTX *ctx_ = nullptr;
+  friend class DigestWorker;
+
+  DigestWorker *const worker_;
+  std::unique_ptr<Digest> digest_;
+  int pending_updates_ = 0;  // protected by worker_->mu_.
+};
+
+// A thread which applies AsyncDigest updates, so that hashing doesn't compete
+// with the thread producing the data (such as a Stream's capture loop). One
+// worker is typically shared by all streams. Thread-safe.
+class DigestWorker {
+ public:
+  // At most |max_pending_bytes| of data is queued at once; beyond that,
+  // AsyncDigest::Update blocks.
+  explicit DigestWorker(size_t max_pending_bytes = 16 << 20);
+  DigestWorker(const DigestWorker &) = delete;
+  void operator=(const DigestWorker &) = delete;
+
+  // PRE: all AsyncDigests using this worker have been destroyed.
+  ~DigestWorker();
+
+ private:
+  friend class AsyncDigest;
+
+  struct PendingUpdate {
+    AsyncDigest *digest;
+    std::string data;
+  };
+
+  void Enqueue(AsyncDigest *digest, re2::StringPiece data);
+  void WaitFor(AsyncDigest *digest);
+  void Run();
+
+  const size_t max_pending_bytes_;
+
+  std::mutex mu_;
+  std::condition_variable queue_cv_;  // signalled when queue_ grows.
+  std::condition_variable done_cv_;   // signalled when an update is applied.
+  std::deque<PendingUpdate> queue_;
+  size_t pending_bytes_ = 0;
+  bool shutdown_ = false;
+
+  std::thread thread_;
 };
 
 }  // namespace moonfire_nvr
@@ -0,0 +1,235 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// db-bench.cc: a benchmark of MoonfireDatabase under mixed load.
+//
+// Creates a write-ahead-logged database in a temporary directory, preloads
+// --preload recordings of --samples frames each, then runs one writer thread
+// inserting --inserts recordings while --reader_threads threads repeatedly
+// list all recordings via ListMp4Recordings, as .mp4 requests do, sleeping
+// --row_delay_us per row to stand in for work done while the query is open.
+// Prints latency percentiles for each. Compare --readers=0 (all queries share the
+// writer's connection and lock) with --readers=N (a pool of N read-only
+// connections). Run from the build directory so ../src/schema.sql is found.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "moonfire-db.h"
+#include "recording.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+#include "uuid.h"
+
+DEFINE_int32(readers, 4, "");
+DEFINE_int32(reader_threads, 4, "");
+DEFINE_int32(preload, 500, "");
+DEFINE_int32(inserts, 500, "");
+DEFINE_int32(samples, 1800, "");
+DEFINE_int32(row_delay_us, 20, "");
+
+namespace moonfire_nvr {
+namespace {
+
+double NowSec() {
+  struct timespec now;
+  CHECK_EQ(0, clock_gettime(CLOCK_MONOTONIC, &now));
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void PrintLatencies(const char *name, std::vector<double> *latencies) {
+  if (latencies->empty()) {
+    printf("%-7s no operations\n", name);
+    return;
+  }
+  std::sort(latencies->begin(), latencies->end());
+  auto percentile = [&](double p) {
+    return (*latencies)[static_cast<size_t>(p * (latencies->size() - 1))] *
+           1e3;
+  };
+  printf("%-7s %6zu ops; p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n", name,
+         latencies->size(), percentile(0.5), percentile(0.99),
+         percentile(1.0));
+}
+
+int64_t AddCamera(Database *db, Uuid uuid) {
+  DatabaseContext ctx(db);
+  auto run = ctx.UseOnce(
+      R"(
+      insert into camera (uuid,  short_name,  host,  username,  password,
+                          main_rtsp_path,  sub_rtsp_path,  retain_bytes)
+                  values (:uuid, 'bench', 'bench-camera', 'foo', 'bar',
+                          '/main', '/sub', 0);
+      )");
+  run.BindBlob(":uuid", uuid.binary_view());
+  CHECK_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  return ctx.last_insert_rowid();
+}
+
+// Inserts a recording of --samples frames, returning the time taken by
+// InsertRecording itself.
+double InsertRecording(MoonfireDatabase *mdb, int64_t camera_id,
+                       int64_t video_sample_entry_id, int64_t start_90k) {
+  std::string error_message;
+  std::vector<Uuid> uuids = mdb->ReserveSampleFiles(1, &error_message);
+  CHECK_EQ(1u, uuids.size()) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash_algorithm = HashAlgorithm::kXxh3_128;
+  recording.sample_file_hash.resize(16);
+  recording.video_sample_entry_id = video_sample_entry_id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, start_90k);
+  for (int i = 0; i < FLAGS_samples; ++i) {
+    encoder.AddSample(3000, i % 30 == 0 ? 60000 : 4000, i % 30 == 0);
+  }
+  encoder.Flush();
+  double start = NowSec();
+  CHECK(mdb->InsertRecording(&recording, &error_message)) << error_message;
+  return NowSec() - start;
+}
+
+int RunBenchmark() {
+  std::string tmpdir = PrepareTempDirOrDie("db-bench");
+  std::string path = StrCat(tmpdir, "/db");
+  std::string error_message;
+  Database db;
+  DatabaseOptions options;
+  options.wal = true;
+  CHECK(db.Open(path.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                options, &error_message))
+      << error_message;
+  {
+    DatabaseContext ctx(&db);
+    CHECK(RunStatements(&ctx, ReadFileOrDie("../src/schema.sql"),
+                        &error_message))
+        << error_message;
+  }
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(&db, camera_uuid);
+  if (FLAGS_readers > 0) {
+    CHECK(db.OpenReaders(FLAGS_readers, options, &error_message))
+        << error_message;
+  }
+
+  MoonfireDatabase mdb;
+  CHECK(mdb.Init(&db, &error_message)) << error_message;
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 1920;
+  entry.height = 1080;
+  entry.data.resize(100);
+  CHECK(mdb.InsertVideoSampleEntry(&entry, &error_message)) << error_message;
+
+  const int64_t kRecordingDuration90k = int64_t{3000} * FLAGS_samples;
+  int64_t start_90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  for (int i = 0; i < FLAGS_preload; ++i) {
+    InsertRecording(&mdb, camera_id, entry.id, start_90k);
+    start_90k += kRecordingDuration90k;
+  }
+  printf("%d preloaded recordings; %d reader connections, %d reader threads.\n",
+         FLAGS_preload, FLAGS_readers, FLAGS_reader_threads);
+
+  std::atomic<bool> done(false);
+  std::mutex reads_mu;
+  std::vector<double> reads;
+  std::vector<std::thread> reader_threads;
+  for (int i = 0; i < FLAGS_reader_threads; ++i) {
+    reader_threads.emplace_back([&]() {
+      std::vector<double> local_reads;
+      std::string error_message;
+      while (!done.load()) {
+        size_t rows = 0;
+        double start = NowSec();
+        CHECK(mdb.ListMp4Recordings(
+            camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+            [&](Recording &recording, const VideoSampleEntry &entry) {
+              ++rows;
+              if (FLAGS_row_delay_us > 0) {
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(FLAGS_row_delay_us));
+              }
+              return IterationControl::kContinue;
+            },
+            &error_message))
+            << error_message;
+        local_reads.push_back(NowSec() - start);
+        CHECK_GE(rows, static_cast<size_t>(FLAGS_preload));
+      }
+      std::lock_guard<std::mutex> lock(reads_mu);
+      reads.insert(reads.end(), local_reads.begin(), local_reads.end());
+    });
+  }
+
+  std::vector<double> inserts;
+  double start = NowSec();
+  for (int i = 0; i < FLAGS_inserts; ++i) {
+    inserts.push_back(InsertRecording(&mdb, camera_id, entry.id, start_90k));
+    start_90k += kRecordingDuration90k;
+  }
+  double elapsed = NowSec() - start;
+  done.store(true);
+  for (auto &thread : reader_threads) {
+    thread.join();
+  }
+  printf("%.2f sec elapsed.\n", elapsed);
+  PrintLatencies("insert", &inserts);
+  PrintLatencies("list", &reads);
+  return 0;
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_readers < 0 || FLAGS_reader_threads < 0 || FLAGS_preload < 0 ||
+      FLAGS_row_delay_us < 0 || FLAGS_inserts < 1 || FLAGS_samples < 1) {
+    LOG(ERROR) << "--inserts and --samples must be positive and other flags "
+               << "non-negative; exiting.";
+    return 1;
+  }
+  return moonfire_nvr::RunBenchmark();
+}
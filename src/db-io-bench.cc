@@ -0,0 +1,267 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// db-io-bench.cc: a benchmark of the database pages MoonfireDatabase
+// operations touch.
+//
+// Creates a write-ahead-logged database in a temporary directory, inserts
+// --recordings one-minute recordings of --samples frames each (measuring the
+// last --inserts of them), then lists them all via ListCameraRecordings, lists
+// an hour of them via ListMp4Recordings, and deletes the oldest --deletes via
+// ListOldestSampleFiles and DeleteRecordings, as retention does. Prints the
+// pages each step read (whether or not they were already cached) and wrote,
+// as counted by sqlite3_db_status, and the database's size. Run from the build
+// directory so ../src/schema.sql is found.
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "moonfire-db.h"
+#include "recording.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+#include "uuid.h"
+
+DEFINE_int32(recordings, 2000, "");
+DEFINE_int32(inserts, 100, "");
+DEFINE_int32(deletes, 100, "");
+DEFINE_int32(samples, 1800, "");
+
+namespace moonfire_nvr {
+namespace {
+
+// Counts the pages read and written on |db|'s connection between
+// construction and Print.
+class PageCounter {
+ public:
+  explicit PageCounter(Database *db) : db_(db) {
+    DatabaseContext ctx(db_);
+    ctx.db_status(SQLITE_DBSTATUS_CACHE_HIT, true);
+    ctx.db_status(SQLITE_DBSTATUS_CACHE_MISS, true);
+    ctx.db_status(SQLITE_DBSTATUS_CACHE_WRITE, true);
+  }
+
+  void Print(const char *name, int ops) {
+    DatabaseContext ctx(db_);
+    int64_t read = ctx.db_status(SQLITE_DBSTATUS_CACHE_HIT, false) +
+                   ctx.db_status(SQLITE_DBSTATUS_CACHE_MISS, false);
+    int64_t written = ctx.db_status(SQLITE_DBSTATUS_CACHE_WRITE, false);
+    printf("%-7s %5d ops; %9.1f pages read, %7.1f written per op\n", name, ops,
+           static_cast<double>(read) / ops,
+           static_cast<double>(written) / ops);
+  }
+
+ private:
+  Database *db_;
+};
+
+int64_t QueryInt64(Database *db, const char *sql) {
+  DatabaseContext ctx(db);
+  auto run = ctx.UseOnce(sql);
+  CHECK_EQ(SQLITE_ROW, run.Step()) << run.error_message();
+  return run.ColumnInt64(0);
+}
+
+int64_t AddCamera(Database *db, Uuid uuid) {
+  DatabaseContext ctx(db);
+  auto run = ctx.UseOnce(
+      R"(
+      insert into camera (uuid,  short_name,  host,  username,  password,
+                          main_rtsp_path,  sub_rtsp_path,  retain_bytes)
+                  values (:uuid, 'bench', 'bench-camera', 'foo', 'bar',
+                          '/main', '/sub', 0);
+      )");
+  run.BindBlob(":uuid", uuid.binary_view());
+  CHECK_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  return ctx.last_insert_rowid();
+}
+
+void InsertRecording(MoonfireDatabase *mdb, int64_t camera_id,
+                     int64_t video_sample_entry_id, int64_t start_90k) {
+  std::string error_message;
+  std::vector<Uuid> uuids = mdb->ReserveSampleFiles(1, &error_message);
+  CHECK_EQ(1u, uuids.size()) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash_algorithm = HashAlgorithm::kXxh3_128;
+  recording.sample_file_hash.resize(16);
+  recording.video_sample_entry_id = video_sample_entry_id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, start_90k);
+  for (int i = 0; i < FLAGS_samples; ++i) {
+    encoder.AddSample(3000, i % 30 == 0 ? 60000 + i : 4000 + i % 997,
+                      i % 30 == 0);
+  }
+  encoder.Flush();
+  CHECK(mdb->InsertRecording(&recording, &error_message)) << error_message;
+}
+
+int RunBenchmark() {
+  std::string tmpdir = PrepareTempDirOrDie("db-io-bench");
+  std::string path = StrCat(tmpdir, "/db");
+  std::string error_message;
+  Database db;
+  DatabaseOptions options;
+  options.wal = true;
+  CHECK(db.Open(path.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                options, &error_message))
+      << error_message;
+  {
+    DatabaseContext ctx(&db);
+    CHECK(RunStatements(&ctx, ReadFileOrDie("../src/schema.sql"),
+                        &error_message))
+        << error_message;
+  }
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(&db, camera_uuid);
+
+  MoonfireDatabase mdb;
+  CHECK(mdb.Init(&db, &error_message)) << error_message;
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 1920;
+  entry.height = 1080;
+  entry.data.resize(100);
+  CHECK(mdb.InsertVideoSampleEntry(&entry, &error_message)) << error_message;
+
+  const int64_t kRecordingDuration90k = int64_t{3000} * FLAGS_samples;
+  const int64_t kFirstStart90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  int64_t start_90k = kFirstStart90k;
+  for (int i = 0; i < FLAGS_recordings - FLAGS_inserts; ++i) {
+    InsertRecording(&mdb, camera_id, entry.id, start_90k);
+    start_90k += kRecordingDuration90k;
+  }
+  {
+    PageCounter counter(&db);
+    for (int i = 0; i < FLAGS_inserts; ++i) {
+      InsertRecording(&mdb, camera_id, entry.id, start_90k);
+      start_90k += kRecordingDuration90k;
+    }
+    counter.Print("insert", FLAGS_inserts);
+  }
+  printf("%d recordings of %d samples; %" PRId64 " pages of %" PRId64
+         " bytes.\n",
+         FLAGS_recordings, FLAGS_samples,
+         QueryInt64(&db, "pragma page_count;"),
+         QueryInt64(&db, "pragma page_size;"));
+
+  {
+    PageCounter counter(&db);
+    int rows = 0;
+    CHECK(mdb.ListCameraRecordings(
+        camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+        [&](const ListCameraRecordingsRow &row) {
+          ++rows;
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    CHECK_EQ(FLAGS_recordings, rows);
+    counter.Print("list", 1);
+  }
+
+  {
+    PageCounter counter(&db);
+    int rows = 0;
+    CHECK(mdb.ListMp4Recordings(
+        camera_uuid, kFirstStart90k,
+        kFirstStart90k + 3600 * kTimeUnitsPerSecond,
+        [&](Recording &recording, const VideoSampleEntry &entry) {
+          ++rows;
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    CHECK_GT(rows, 0);
+    counter.Print("mp4", 1);
+  }
+
+  {
+    PageCounter counter(&db);
+    int rows = 0;
+    CHECK(mdb.ListOldestHotSampleFiles(
+        std::numeric_limits<int64_t>::max(),
+        [&](const ListOldestSampleFilesRow &row) {
+          ++rows;
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    CHECK_EQ(FLAGS_recordings, rows);
+    counter.Print("hot", 1);
+  }
+
+  std::vector<ListOldestSampleFilesRow> rows;
+  {
+    PageCounter counter(&db);
+    CHECK(mdb.ListOldestSampleFiles(
+        camera_uuid,
+        [&](const ListOldestSampleFilesRow &row) {
+          rows.push_back(row);
+          return rows.size() < static_cast<size_t>(FLAGS_deletes)
+                     ? IterationControl::kContinue
+                     : IterationControl::kBreak;
+        },
+        &error_message))
+        << error_message;
+    counter.Print("oldest", FLAGS_deletes);
+  }
+  {
+    PageCounter counter(&db);
+    CHECK(mdb.DeleteRecordings(&rows, &error_message)) << error_message;
+    counter.Print("delete", FLAGS_deletes);
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_inserts < 1 || FLAGS_deletes < 1 || FLAGS_samples < 1 ||
+      FLAGS_recordings < FLAGS_inserts || FLAGS_recordings < FLAGS_deletes) {
+    LOG(ERROR) << "--inserts, --deletes, and --samples must be positive, and "
+               << "--recordings must be at least --inserts and --deletes; "
+               << "exiting.";
+    return 1;
+  }
+  return moonfire_nvr::RunBenchmark();
+}
@@ -0,0 +1,139 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// disk-stats-test.cc: tests of the disk-stats.h interface.
+
+#include <fcntl.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "disk-stats.h"
+#include "http.h"
+#include "time.h"
+
+DECLARE_bool(alsologtostderr);
+
+namespace moonfire_nvr {
+namespace {
+
+TEST(DiskTimeFractionTest, Bound) {
+  EXPECT_DOUBLE_EQ(0, DiskTimeFraction(0, 0));
+  EXPECT_DOUBLE_EQ(1, DiskTimeFraction(50, 0));
+  EXPECT_DOUBLE_EQ(1, DiskTimeFraction(0, 100e6));
+  EXPECT_DOUBLE_EQ(0.75, DiskTimeFraction(25, 25e6));
+}
+
+TEST(DiskMonitorTest, CountsStreamAndDisk) {
+  std::unique_ptr<Filesystem> fs = NewMemoryFilesystem();
+  ASSERT_EQ(0, fs->Mkdir("/dir", 0700));
+  std::unique_ptr<File> dir;
+  ASSERT_EQ(0, fs->Open("/dir", O_DIRECTORY | O_RDONLY, &dir));
+  SimulatedClock clock;
+  DiskMonitor monitor(&clock, 0.8);
+  File *disk_dir = monitor.AddDisk("disk", dir.get());
+  File *stream_dir = monitor.GetStreamDir("stream", disk_dir);
+  EXPECT_EQ(stream_dir, monitor.GetStreamDir("stream", disk_dir));
+  monitor.Sample();
+
+  // Write and sync a file through the stream's directory.
+  std::string data(1000, 'x');
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, stream_dir->Open("f", O_WRONLY | O_CREAT, 0600, &f));
+  size_t written;
+  ASSERT_EQ(0, f->Write(data, &written));
+  ASSERT_EQ(data.size(), written);
+  ASSERT_EQ(0, f->Sync());
+  ASSERT_EQ(0, f->Close());
+  ASSERT_EQ(0, stream_dir->Sync());
+
+  // Serve it through a raw file descriptor, then unlink it.
+  RealFileSlice slice;
+  slice.Init(stream_dir, "f", ByteRange(0, data.size()));
+  EvBuffer buf;
+  std::string error_message;
+  ASSERT_EQ(data.size(), slice.AddRange(ByteRange(0, data.size()), &buf,
+                                        &error_message))
+      << error_message;
+  ASSERT_EQ(0, stream_dir->Unlink("f"));
+
+  // Failures aren't counted; I/O directly through the disk's directory is
+  // counted only toward the disk.
+  EXPECT_EQ(ENOENT, stream_dir->Unlink("f"));
+  ASSERT_EQ(0, disk_dir->Sync());
+
+  clock.Sleep({10, 0});
+  monitor.Sample();
+  std::vector<DiskUsage> usage = monitor.GetUsage();
+  ASSERT_EQ(2, usage.size());
+
+  EXPECT_EQ("disk", usage[0].name);
+  EXPECT_TRUE(usage[0].is_disk);
+  EXPECT_EQ(1000, usage[0].totals.bytes_read);
+  EXPECT_EQ(1000, usage[0].totals.bytes_written);
+  EXPECT_EQ(2, usage[0].totals.opens);
+  EXPECT_EQ(3, usage[0].totals.syncs);
+  EXPECT_EQ(1, usage[0].totals.unlinks);
+  EXPECT_EQ(6, usage[0].totals.seeks);
+  EXPECT_DOUBLE_EQ(0.6, usage[0].seeks_per_sec);
+  EXPECT_DOUBLE_EQ(100, usage[0].read_bytes_per_sec);
+  EXPECT_DOUBLE_EQ(100, usage[0].write_bytes_per_sec);
+  EXPECT_DOUBLE_EQ(DiskTimeFraction(0.6, 200), usage[0].disk_time_fraction);
+
+  EXPECT_EQ("stream", usage[1].name);
+  EXPECT_FALSE(usage[1].is_disk);
+  EXPECT_EQ(1000, usage[1].totals.bytes_read);
+  EXPECT_EQ(1000, usage[1].totals.bytes_written);
+  EXPECT_EQ(2, usage[1].totals.opens);
+  EXPECT_EQ(2, usage[1].totals.syncs);
+  EXPECT_EQ(1, usage[1].totals.unlinks);
+  EXPECT_EQ(5, usage[1].totals.seeks);
+  EXPECT_DOUBLE_EQ(DiskTimeFraction(0.5, 200), usage[1].disk_time_fraction);
+
+  // Rates are over the latest interval only.
+  clock.Sleep({10, 0});
+  monitor.Sample();
+  usage = monitor.GetUsage();
+  EXPECT_EQ(6, usage[0].totals.seeks);
+  EXPECT_DOUBLE_EQ(0, usage[0].disk_time_fraction);
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
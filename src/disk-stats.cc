@@ -0,0 +1,244 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// disk-stats.cc: implementation of disk-stats.h interface.
+
+#include "disk-stats.h"
+
+#include <glog/logging.h>
+
+namespace moonfire_nvr {
+
+namespace {
+
+class DiskStatsFile : public File {
+ public:
+  DiskStatsFile(File *base, DiskStats *stats) : base_(base), stats_(stats) {}
+  DiskStatsFile(std::unique_ptr<File> base, DiskStats *stats)
+      : owned_(std::move(base)), base_(owned_.get()), stats_(stats) {}
+  DiskStatsFile(const DiskStatsFile &) = delete;
+  void operator=(const DiskStatsFile &) = delete;
+
+  int Allocate(off_t offset, off_t len) final {
+    return base_->Allocate(offset, len);
+  }
+
+  int Close() final { return base_->Close(); }
+
+  bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    return base_->DirForEach(fn, error_message);
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    return Count(base_->Mkdir(path, mode), &DiskStats::AddSeek);
+  }
+
+  void NoteRawRead(int64_t bytes) final {
+    stats_->AddRead(bytes);
+    base_->NoteRawRead(bytes);
+  }
+
+  int Open(const char *path, int flags, int *fd) final {
+    return Open(path, flags, 0, fd);
+  }
+
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return Open(path, flags, 0, f);
+  }
+
+  int Open(const char *path, int flags, mode_t mode, int *fd) final {
+    return Count(base_->Open(path, flags, mode, fd), &DiskStats::AddOpen);
+  }
+
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final {
+    std::unique_ptr<File> base;
+    int ret = base_->Open(path, flags, mode, &base);
+    if (ret != 0) {
+      return ret;
+    }
+    stats_->AddOpen();
+    f->reset(new DiskStatsFile(std::move(base), stats_));
+    return 0;
+  }
+
+  int Read(void *buf, size_t count, size_t *bytes_read) final {
+    int ret = base_->Read(buf, count, bytes_read);
+    if (ret == 0) {
+      stats_->AddRead(*bytes_read);
+    }
+    return ret;
+  }
+
+  int Rename(const char *oldpath, const char *newpath) final {
+    return Count(base_->Rename(oldpath, newpath), &DiskStats::AddSeek);
+  }
+
+  int Seek(off_t offset) final { return base_->Seek(offset); }
+  int Stat(struct stat *buf) final { return base_->Stat(buf); }
+
+  int Sync() final { return Count(base_->Sync(), &DiskStats::AddSync); }
+
+  int SyncFilesystem() final {
+    return Count(base_->SyncFilesystem(), &DiskStats::AddSync);
+  }
+
+  int Truncate(off_t length) final { return base_->Truncate(length); }
+
+  int Unlink(const char *path) final {
+    return Count(base_->Unlink(path), &DiskStats::AddUnlink);
+  }
+
+  int Write(re2::StringPiece data, size_t *bytes_written) final {
+    int ret = base_->Write(data, bytes_written);
+    if (ret == 0) {
+      stats_->AddWrite(*bytes_written);
+    }
+    return ret;
+  }
+
+ private:
+  // Call |add| on |stats_| if |ret| indicates success; return |ret|.
+  int Count(int ret, void (DiskStats::*add)()) {
+    if (ret == 0) {
+      (stats_->*add)();
+    }
+    return ret;
+  }
+
+  std::unique_ptr<File> owned_;
+  File *base_;
+  DiskStats *stats_;
+};
+
+}  // namespace
+
+DiskCounters DiskStats::Get() const {
+  DiskCounters counters;
+  counters.bytes_read = bytes_read_;
+  counters.bytes_written = bytes_written_;
+  counters.opens = opens_;
+  counters.syncs = syncs_;
+  counters.unlinks = unlinks_;
+  counters.seeks = seeks_;
+  return counters;
+}
+
+std::unique_ptr<File> NewDiskStatsFile(File *base, DiskStats *stats) {
+  return std::unique_ptr<File>(new DiskStatsFile(base, stats));
+}
+
+File *DiskMonitor::AddDisk(const std::string &name, File *dir) {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::unique_ptr<Entry> entry(new Entry);
+  entry->usage.name = name;
+  entry->usage.is_disk = true;
+  entry->dir = NewDiskStatsFile(dir, &entry->stats);
+  File *wrapped = entry->dir.get();
+  disks_.push_back(std::move(entry));
+  return wrapped;
+}
+
+File *DiskMonitor::GetStreamDir(const std::string &name, File *disk_dir) {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::unique_ptr<File> &dir = stream_dirs_[std::make_pair(name, disk_dir)];
+  if (dir == nullptr) {
+    std::unique_ptr<Entry> &entry = streams_[name];
+    if (entry == nullptr) {
+      entry.reset(new Entry);
+      entry->usage.name = name;
+    }
+    dir = NewDiskStatsFile(disk_dir, &entry->stats);
+  }
+  return dir.get();
+}
+
+void DiskMonitor::Sample() {
+  struct timespec now = clock_->Now();
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto &disk : disks_) {
+    SampleEntry(now, disk.get());
+    const DiskUsage &usage = disk->usage;
+    if (!disk->warned && usage.disk_time_fraction >= warn_fraction_) {
+      LOG(WARNING) << "Disk " << usage.name << " is at an estimated "
+                   << static_cast<int>(100 * usage.disk_time_fraction)
+                   << "% of its capacity (" << usage.seeks_per_sec
+                   << " seeks/sec, "
+                   << (usage.read_bytes_per_sec + usage.write_bytes_per_sec) /
+                          1e6
+                   << " MB/sec); recording may fall behind. See /disk.";
+      disk->warned = true;
+    } else if (disk->warned && usage.disk_time_fraction < warn_fraction_) {
+      LOG(INFO) << "Disk " << usage.name << " is back to an estimated "
+                << static_cast<int>(100 * usage.disk_time_fraction)
+                << "% of its capacity.";
+      disk->warned = false;
+    }
+  }
+  for (auto &stream : streams_) {
+    SampleEntry(now, stream.second.get());
+  }
+}
+
+void DiskMonitor::SampleEntry(const struct timespec &now, Entry *entry) {
+  DiskCounters counters = entry->stats.Get();
+  DiskUsage &usage = entry->usage;
+  double elapsed_sec =
+      TimespecToSec(now) - TimespecToSec(entry->last_sample);
+  if (entry->sampled && elapsed_sec > 0) {
+    const DiskCounters &prev = usage.totals;
+    usage.read_bytes_per_sec =
+        (counters.bytes_read - prev.bytes_read) / elapsed_sec;
+    usage.write_bytes_per_sec =
+        (counters.bytes_written - prev.bytes_written) / elapsed_sec;
+    usage.seeks_per_sec = (counters.seeks - prev.seeks) / elapsed_sec;
+    usage.disk_time_fraction = DiskTimeFraction(
+        usage.seeks_per_sec,
+        usage.read_bytes_per_sec + usage.write_bytes_per_sec);
+  }
+  usage.totals = counters;
+  entry->last_sample = now;
+  entry->sampled = true;
+}
+
+std::vector<DiskUsage> DiskMonitor::GetUsage() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::vector<DiskUsage> usage;
+  for (const auto &disk : disks_) {
+    usage.push_back(disk->usage);
+  }
+  for (const auto &stream : streams_) {
+    usage.push_back(stream.second->usage);
+  }
+  return usage;
+}
+
+}  // namespace moonfire_nvr
@@ -0,0 +1,178 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// disk-stats.h: accounting of the disk time used by sample file I/O.
+
+#ifndef MOONFIRE_NVR_DISK_STATS_H
+#define MOONFIRE_NVR_DISK_STATS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "filesystem.h"
+#include "time.h"
+
+namespace moonfire_nvr {
+
+// The nominal capabilities of a hard drive, as in design/schema.md.
+constexpr double kDiskSeeksPerSec = 50;
+constexpr double kDiskBytesPerSec = 100e6;
+
+// The estimated fraction of a hard drive's time needed to sustain the given
+// rates, as bounded in design/schema.md:
+//
+//     disk time fraction <= (seek rate) / (50 seeks/sec) +
+//                           (bandwidth) / (100 MB/sec)
+inline double DiskTimeFraction(double seeks_per_sec, double bytes_per_sec) {
+  return seeks_per_sec / kDiskSeeksPerSec + bytes_per_sec / kDiskBytesPerSec;
+}
+
+// Cumulative I/O counts.
+struct DiskCounters {
+  int64_t bytes_read = 0;
+  int64_t bytes_written = 0;
+  int64_t opens = 0;
+  int64_t syncs = 0;
+  int64_t unlinks = 0;
+
+  // Estimated random accesses. Sequential reads and writes within a file are
+  // assumed free of seeks; each open (including each file switch while
+  // serving a .mp4), sync, unlink, and rename is assumed to need one.
+  int64_t seeks = 0;
+};
+
+// Counts the I/O of one disk or stream. Thread-safe.
+class DiskStats {
+ public:
+  DiskStats() {}
+  DiskStats(const DiskStats &) = delete;
+  void operator=(const DiskStats &) = delete;
+
+  void AddRead(int64_t bytes) { bytes_read_ += bytes; }
+  void AddWrite(int64_t bytes) { bytes_written_ += bytes; }
+  void AddOpen() { ++opens_; ++seeks_; }
+  void AddSync() { ++syncs_; ++seeks_; }
+  void AddUnlink() { ++unlinks_; ++seeks_; }
+  void AddSeek() { ++seeks_; }
+
+  DiskCounters Get() const;
+
+ private:
+  std::atomic<int64_t> bytes_read_{0};
+  std::atomic<int64_t> bytes_written_{0};
+  std::atomic<int64_t> opens_{0};
+  std::atomic<int64_t> syncs_{0};
+  std::atomic<int64_t> unlinks_{0};
+  std::atomic<int64_t> seeks_{0};
+};
+
+// Wrap |base| so that its successful operations are counted in |stats|. Both
+// must outlive the returned file. Files opened through it, other than raw
+// file descriptors, are wrapped likewise; reads through raw file descriptors
+// are counted as reported via File::NoteRawRead.
+std::unique_ptr<File> NewDiskStatsFile(File *base, DiskStats *stats);
+
+// The I/O of one disk or stream, as reported by DiskMonitor.
+struct DiskUsage {
+  std::string name;
+  bool is_disk = false;  // false for a stream.
+  DiskCounters totals;
+
+  // Rates over the most recent sampling interval.
+  double read_bytes_per_sec = 0;
+  double write_bytes_per_sec = 0;
+  double seeks_per_sec = 0;
+
+  // For a stream, the portion of its disk's time that it's responsible for.
+  double disk_time_fraction = 0;
+};
+
+// Tracks the disk time fraction of each sample file directory and each
+// stream, warning when a disk approaches saturation. Thread-safe.
+//
+// Each disk's directory is wrapped (see AddDisk) so that all I/O through it
+// is counted toward the disk. A stream's I/O is counted toward both the
+// stream and the disk by going through a further wrapper from GetStreamDir.
+class DiskMonitor {
+ public:
+  // |clock| must outlive the DiskMonitor. A warning is logged when a disk's
+  // time fraction rises to |warn_fraction|.
+  DiskMonitor(WallClock *clock, double warn_fraction)
+      : clock_(clock), warn_fraction_(warn_fraction) {}
+  DiskMonitor(const DiskMonitor &) = delete;
+  void operator=(const DiskMonitor &) = delete;
+
+  // Start counting the I/O to the disk holding |dir|, which must outlive the
+  // DiskMonitor. Returns a wrapped directory, owned by the DiskMonitor, to use
+  // in place of |dir|.
+  File *AddDisk(const std::string &name, File *dir);
+
+  // Returns |disk_dir| (as returned by AddDisk) wrapped to also count I/O
+  // toward the stream |name|. The result is owned by the DiskMonitor and is
+  // the same on each call with the same arguments.
+  File *GetStreamDir(const std::string &name, File *disk_dir);
+
+  // Compute rates since the previous call, logging a warning if any disk has
+  // crossed |warn_fraction|. Should be called periodically.
+  void Sample();
+
+  // Returns the disks, in the order added, then the streams, by name.
+  std::vector<DiskUsage> GetUsage() const;
+
+ private:
+  struct Entry {
+    DiskStats stats;
+    std::unique_ptr<File> dir;  // for a disk, the wrapped directory.
+    DiskUsage usage;
+    struct timespec last_sample = {0, 0};
+    bool sampled = false;  // true once last_sample has been set.
+    bool warned = false;
+  };
+
+  void SampleEntry(const struct timespec &now, Entry *entry);
+
+  WallClock *const clock_;
+  const double warn_fraction_;
+
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<Entry>> disks_;  // protected by mu_.
+  std::map<std::string, std::unique_ptr<Entry>> streams_;  // protected by mu_.
+  std::map<std::pair<std::string, File *>, std::unique_ptr<File>>
+      stream_dirs_;  // protected by mu_.
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_DISK_STATS_H
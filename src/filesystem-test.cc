@@ -0,0 +1,258 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// filesystem-test.cc: tests of the filesystem.h interface.
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "filesystem.h"
+#include "http.h"
+#include "string.h"
+#include "time.h"
+
+DECLARE_bool(alsologtostderr);
+
+namespace moonfire_nvr {
+namespace {
+
+class MemoryFilesystemTest : public testing::Test {
+ protected:
+  MemoryFilesystemTest() : fs_(NewMemoryFilesystem()) {}
+
+  std::set<std::string> List(File *dir) {
+    std::set<std::string> names;
+    std::string error_message;
+    EXPECT_TRUE(dir->DirForEach(
+        [&](const dirent *ent) {
+          names.insert(ent->d_name);
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    return names;
+  }
+
+  std::unique_ptr<Filesystem> fs_;
+};
+
+TEST_F(MemoryFilesystemTest, DirectoryHandles) {
+  ASSERT_EQ(0, fs_->Mkdir("/dir", 0700));
+  EXPECT_EQ(EEXIST, fs_->Mkdir("/dir", 0700));
+  std::unique_ptr<File> dir;
+  ASSERT_EQ(0, fs_->Open("/dir", O_DIRECTORY | O_RDONLY, &dir));
+
+  // Files are created and found relative to the directory handle.
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, dir->Open("a", O_WRONLY | O_CREAT | O_EXCL, 0600, &f));
+  size_t written;
+  ASSERT_EQ(0, f->Write("hello", &written));
+  EXPECT_EQ(5, written);
+  EXPECT_EQ(0, f->Close());
+  EXPECT_EQ(EEXIST, dir->Open("a", O_WRONLY | O_CREAT | O_EXCL, 0600, &f));
+  EXPECT_EQ(ENOTDIR, dir->Open("a", O_DIRECTORY | O_RDONLY, &f));
+  EXPECT_EQ(EISDIR, fs_->Open("/dir", O_WRONLY, &f));
+  EXPECT_EQ(ENOENT, dir->Open("b", O_RDONLY, &f));
+  ASSERT_EQ(0, dir->Mkdir("sub", 0700));
+  EXPECT_EQ(0, dir->Rename("a", "sub/b"));
+  EXPECT_THAT(List(dir.get()), testing::ElementsAre(".", "..", "sub"));
+
+  struct stat buf;
+  ASSERT_EQ(0, fs_->Stat("/dir/sub/../sub/b", &buf));
+  EXPECT_TRUE(S_ISREG(buf.st_mode));
+  EXPECT_EQ(5, buf.st_size);
+  ASSERT_EQ(0, fs_->Stat("dir/sub", &buf));
+  EXPECT_TRUE(S_ISDIR(buf.st_mode));
+
+  // An unlinked file remains readable while open.
+  ASSERT_EQ(0, dir->Open("sub/b", O_RDONLY, &f));
+  EXPECT_EQ(EISDIR, dir->Unlink("sub"));
+  EXPECT_EQ(ENOTEMPTY, fs_->Rmdir("/dir/sub"));
+  EXPECT_EQ(EINVAL, dir->Rename("sub", "sub/inner"));
+  ASSERT_EQ(0, dir->Unlink("sub/b"));
+  EXPECT_EQ(ENOENT, dir->Unlink("sub/b"));
+  char contents[16];
+  size_t bytes_read;
+  ASSERT_EQ(0, f->Read(contents, sizeof(contents), &bytes_read));
+  EXPECT_EQ("hello", std::string(contents, bytes_read));
+  EXPECT_EQ(0, fs_->Rmdir("/dir/sub"));
+  EXPECT_THAT(List(dir.get()), testing::ElementsAre(".", ".."));
+}
+
+TEST_F(MemoryFilesystemTest, SparseFiles) {
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, fs_->Open("/sparse", O_RDWR | O_CREAT, 0600, &f));
+  const off_t kOffset = 1 << 30;
+  ASSERT_EQ(0, f->Seek(kOffset));
+  size_t written;
+  ASSERT_EQ(0, f->Write("x", &written));
+  struct stat buf;
+  ASSERT_EQ(0, f->Stat(&buf));
+  EXPECT_EQ(kOffset + 1, buf.st_size);
+  EXPECT_LT(buf.st_blocks * 512, 1 << 20);
+
+  char contents[4] = {1, 1, 1, 1};
+  size_t bytes_read;
+  ASSERT_EQ(0, f->Seek(kOffset - 3));
+  ASSERT_EQ(0, f->Read(contents, sizeof(contents), &bytes_read));
+  EXPECT_EQ(std::string("\0\0\0x", 4), std::string(contents, bytes_read));
+  ASSERT_EQ(0, f->Truncate(0));
+  ASSERT_EQ(0, fs_->Stat("/sparse", &buf));
+  EXPECT_EQ(0, buf.st_size);
+}
+
+TEST_F(MemoryFilesystemTest, RawDescriptors) {
+  std::unique_ptr<File> root;
+  ASSERT_EQ(0, fs_->Open("/", O_DIRECTORY | O_RDONLY, &root));
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, root->Open("f", O_WRONLY | O_CREAT, 0600, &f));
+  size_t written;
+  ASSERT_EQ(0, f->Write("0123456789", &written));
+  int fd;
+  EXPECT_EQ(EOPNOTSUPP, root->Open(".", O_RDONLY, &fd));
+
+  // Each descriptor has its own offset, and can be mmap()ed.
+  ASSERT_EQ(0, root->Open("f", O_RDONLY, &fd));
+  void *p = mmap(nullptr, 10, PROT_READ, MAP_SHARED, fd, 0);
+  ASSERT_NE(MAP_FAILED, p) << strerror(errno);
+  EXPECT_EQ("0123456789", std::string(static_cast<char *>(p), 10));
+  munmap(p, 10);
+
+  EvBuffer buf;
+  std::string error_message;
+  ASSERT_TRUE(buf.AddFile(fd, 2, 5, &error_message)) << error_message;
+  std::string out(5, '\0');
+  ASSERT_EQ(5, evbuffer_remove(buf.get(), &out[0], out.size()));
+  EXPECT_EQ("23456", out);
+}
+
+TEST(FaultInjectorTest, LatencyAndErrors) {
+  SimulatedClock clock;
+  FaultInjector injector(&clock);
+  FaultSpec sync;
+  sync.latency = {0, 5000000};
+  sync.tail_latency = {1, 0};
+  sync.tail_probability = 1;
+  injector.set_spec(FaultInjector::Op::kSync, sync);
+  FaultSpec write;
+  write.latency = {0, 1000000};
+  write.error_probability = 1;
+  write.error = ENOSPC;
+  injector.set_spec(FaultInjector::Op::kWrite, write);
+
+  auto base = NewMemoryFilesystem();
+  auto fs = NewFaultInjectingFilesystem(base.get(), &injector);
+  std::unique_ptr<File> dir;
+  ASSERT_EQ(0, fs->Open("/", O_DIRECTORY | O_RDONLY, &dir));
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, dir->Open("f", O_WRONLY | O_CREAT, 0600, &f));
+  EXPECT_EQ(0, clock.Now().tv_sec);
+
+  // Files opened through a wrapped directory are wrapped too.
+  size_t written;
+  EXPECT_EQ(ENOSPC, f->Write("x", &written));
+  EXPECT_EQ(1000000, clock.Now().tv_nsec);
+  EXPECT_EQ(0, f->Sync());
+  EXPECT_EQ(0, dir->SyncFilesystem());
+  EXPECT_EQ(2, clock.Now().tv_sec);
+  EXPECT_EQ(2, injector.tail_count(FaultInjector::Op::kSync));
+  EXPECT_EQ(1, injector.error_count(FaultInjector::Op::kWrite));
+  EXPECT_EQ(0, dir->Unlink("f"));
+  struct stat buf;
+  EXPECT_EQ(ENOENT, base->Stat("/f", &buf));
+}
+
+TEST(FilesystemSyncerTest, SequentialCallsEachSync) {
+  FilesystemSyncer syncer;
+  testing::StrictMock<MockFile> dir;
+  EXPECT_CALL(dir, SyncFilesystem())
+      .WillOnce(testing::Return(0))
+      .WillOnce(testing::Return(EIO));
+  EXPECT_EQ(0, syncer.Sync(&dir));
+  EXPECT_EQ(EIO, syncer.Sync(&dir));
+}
+
+TEST(FilesystemSyncerTest, ConcurrentCallsShareSyncs) {
+  FilesystemSyncer syncer;
+  testing::StrictMock<MockFile> dir;
+  std::atomic<int> calls{0};
+  std::atomic<bool> release{false};
+
+  // The first syncfs() blocks until two more callers are waiting; they
+  // share the second.
+  EXPECT_CALL(dir, SyncFilesystem())
+      .Times(2)
+      .WillRepeatedly(testing::Invoke([&]() {
+        if (calls++ == 0) {
+          while (!release) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+        }
+        return 0;
+      }));
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 3; ++i) {
+    threads.emplace_back([&]() { EXPECT_EQ(0, syncer.Sync(&dir)); });
+  }
+  while (calls == 0 || syncer.waiting() < 2) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  release = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(2, calls);
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
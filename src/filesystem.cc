@@ -34,15 +34,24 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdlib>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
 
 #include <event2/buffer.h>
 #include <event2/event.h>
@@ -57,6 +66,25 @@ namespace moonfire_nvr {
 
 namespace {
 
+// Execute |fn| for each entry in |owned_dir|, then close it.
+bool ReadDir(DIR *owned_dir, std::function<IterationControl(const dirent *)> fn,
+             std::string *error_message) {
+  struct dirent *ent;
+  while (errno = 0, (ent = readdir(owned_dir)) != nullptr) {
+    if (fn(ent) == IterationControl::kBreak) {
+      closedir(owned_dir);
+      return true;
+    }
+  }
+  int err = errno;
+  closedir(owned_dir);
+  if (err != 0) {
+    *error_message = StrCat("readdir failed: ", strerror(err));
+    return false;
+  }
+  return true;
+}
+
 class RealFile : public File {
  public:
   explicit RealFile(int fd) : fd_(fd) {}
@@ -65,6 +93,10 @@ class RealFile : public File {
 
   ~RealFile() final { Close(); }
 
+  int Allocate(off_t offset, off_t len) final {
+    return posix_fallocate(fd_, offset, len);
+  }
+
   int Close() final {
     if (fd_ < 0) {
       return 0;
@@ -79,6 +111,31 @@ class RealFile : public File {
     return 0;
   }
 
+  bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    // fdopendir() takes ownership of its fd, so supply a fresh one.
+    int dir_fd = openat(fd_, ".", O_DIRECTORY | O_RDONLY);
+    if (dir_fd < 0) {
+      int err = errno;
+      *error_message = StrCat("Unable to open directory: ", strerror(err));
+      return false;
+    }
+    DIR *owned_dir = fdopendir(dir_fd);
+    if (owned_dir == nullptr) {
+      int err = errno;
+      close(dir_fd);
+      *error_message = StrCat("Unable to examine directory: ", strerror(err));
+      return false;
+    }
+    return ReadDir(owned_dir, fn, error_message);
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    return (mkdirat(fd_, path, mode) < 0) ? errno : 0;
+  }
+
+  void NoteRawRead(int64_t bytes) final {}
+
   int Open(const char *path, int flags, int *fd) final {
     return Open(path, flags, 0, fd);
   }
@@ -117,10 +174,20 @@ class RealFile : public File {
     return 0;
   }
 
+  int Rename(const char *oldpath, const char *newpath) final {
+    return (renameat(fd_, oldpath, fd_, newpath) < 0) ? errno : 0;
+  }
+
+  int Seek(off_t offset) final {
+    return (lseek(fd_, offset, SEEK_SET) < 0) ? errno : 0;
+  }
+
   int Stat(struct stat *buf) final { return (fstat(fd_, buf) < 0) ? errno : 0; }
 
   int Sync() final { return (fsync(fd_) < 0) ? errno : 0; }
 
+  int SyncFilesystem() final { return (syncfs(fd_) < 0) ? errno : 0; }
+
   int Truncate(off_t length) final {
     return (ftruncate(fd_, length) < 0) ? errno : 0;
   }
@@ -156,20 +223,7 @@ class RealFilesystem : public Filesystem {
           StrCat("Unable to examine ", dir_path, ": ", strerror(err));
       return false;
     }
-    struct dirent *ent;
-    while (errno = 0, (ent = readdir(owned_dir)) != nullptr) {
-      if (fn(ent) == IterationControl::kBreak) {
-        closedir(owned_dir);
-        return true;
-      }
-    }
-    int err = errno;
-    closedir(owned_dir);
-    if (err != 0) {
-      *error_message = StrCat("readdir failed: ", strerror(err));
-      return false;
-    }
-    return true;
+    return ReadDir(owned_dir, fn, error_message);
   }
 
   int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
@@ -199,11 +253,805 @@ class RealFilesystem : public Filesystem {
   int Unlink(const char *path) final { return (unlink(path) < 0) ? errno : 0; }
 };
 
+// A file or directory of a MemoryFilesystem.
+struct MemoryNode {
+  MemoryNode() {}
+  MemoryNode(const MemoryNode &) = delete;
+  void operator=(const MemoryNode &) = delete;
+  ~MemoryNode() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  bool is_dir() const { return S_ISDIR(mode); }
+
+  ino_t ino = 0;
+  mode_t mode = 0;  // including the file type bits.
+  nlink_t nlink = 1;
+
+  // For regular files, the backing memfd.
+  int fd = -1;
+
+  // For directories. |parent| is unset for the root and removed directories.
+  std::map<std::string, std::shared_ptr<MemoryNode>> children;
+  std::weak_ptr<MemoryNode> parent;
+};
+
+// The state shared by a MemoryFilesystem and all files opened from it.
+struct MemoryFilesystemState {
+  std::mutex mu;  // protects the tree of MemoryNodes.
+  std::shared_ptr<MemoryNode> root;
+  ino_t next_ino = 1;
+};
+
+// Split |path| into its components, omitting empty and "." ones.
+std::vector<std::string> SplitPath(const char *path) {
+  std::vector<std::string> components;
+  const char *p = path;
+  while (*p != '\0') {
+    const char *end = strchrnul(p, '/');
+    std::string component(p, end - p);
+    if (!component.empty() && component != ".") {
+      components.push_back(std::move(component));
+    }
+    p = (*end == '/') ? end + 1 : end;
+  }
+  return components;
+}
+
+// Resolve the first |n| |components| starting from |node|.
+// Returns 0 on success or errno>0 on failure. Requires the state's lock.
+int WalkPath(std::shared_ptr<MemoryNode> node,
+             const std::vector<std::string> &components, size_t n,
+             std::shared_ptr<MemoryNode> *out) {
+  for (size_t i = 0; i < n; ++i) {
+    if (!node->is_dir()) {
+      return ENOTDIR;
+    }
+    if (components[i] == "..") {
+      auto parent = node->parent.lock();
+      if (parent != nullptr) {
+        node = std::move(parent);
+      }
+      continue;
+    }
+    auto it = node->children.find(components[i]);
+    if (it == node->children.end()) {
+      return ENOENT;
+    }
+    node = it->second;
+  }
+  *out = std::move(node);
+  return 0;
+}
+
+// Resolve all but the final component of |path|, relative to |dir| (or to
+// the root if |path| is absolute), filling |parent| and |name|. If |path|
+// has no final component to name (such as "/" or "foo/.."), |parent| is the
+// node |path| refers to and |name| is empty. Requires the state's lock.
+int ResolveParent(MemoryFilesystemState *state,
+                  const std::shared_ptr<MemoryNode> &dir, const char *path,
+                  std::shared_ptr<MemoryNode> *parent, std::string *name) {
+  if (path[0] == '\0') {
+    return ENOENT;
+  }
+  std::vector<std::string> components = SplitPath(path);
+  const auto &start = (path[0] == '/') ? state->root : dir;
+  if (components.empty() || components.back() == "..") {
+    name->clear();
+    return WalkPath(start, components, components.size(), parent);
+  }
+  int ret = WalkPath(start, components, components.size() - 1, parent);
+  if (ret != 0) {
+    return ret;
+  }
+  if (!(*parent)->is_dir()) {
+    return ENOTDIR;
+  }
+  if (components.back().size() > NAME_MAX) {
+    return ENAMETOOLONG;
+  }
+  *name = std::move(components.back());
+  return 0;
+}
+
+// Resolve |path| relative to |dir|. Requires the state's lock.
+int Resolve(MemoryFilesystemState *state,
+            const std::shared_ptr<MemoryNode> &dir, const char *path,
+            std::shared_ptr<MemoryNode> *node) {
+  std::shared_ptr<MemoryNode> parent;
+  std::string name;
+  int ret = ResolveParent(state, dir, path, &parent, &name);
+  if (ret != 0) {
+    return ret;
+  }
+  if (name.empty()) {
+    *node = std::move(parent);
+    return 0;
+  }
+  auto it = parent->children.find(name);
+  if (it == parent->children.end()) {
+    return ENOENT;
+  }
+  *node = it->second;
+  return 0;
+}
+
+// fstat() for |node|. Regular files take their sizes from the memfd.
+// Requires the state's lock.
+int StatNode(const MemoryNode &node, struct stat *buf) {
+  if (node.is_dir()) {
+    memset(buf, 0, sizeof(*buf));
+    buf->st_blksize = 4096;
+  } else if (fstat(node.fd, buf) < 0) {
+    return errno;
+  }
+  buf->st_ino = node.ino;
+  buf->st_mode = node.mode;
+  buf->st_nlink = node.nlink;
+  return 0;
+}
+
+// Open |path| relative to |dir| following open(2)'s |flags| and |mode|,
+// creating a regular file if requested. Doesn't create a descriptor.
+int OpenNode(MemoryFilesystemState *state,
+             const std::shared_ptr<MemoryNode> &dir, const char *path,
+             int flags, mode_t mode, std::shared_ptr<MemoryNode> *node) {
+  std::lock_guard<std::mutex> lock(state->mu);
+  std::shared_ptr<MemoryNode> parent;
+  std::string name;
+  int ret = ResolveParent(state, dir, path, &parent, &name);
+  if (ret != 0) {
+    return ret;
+  }
+  if (name.empty()) {
+    if ((flags & O_CREAT) != 0) {
+      return EISDIR;
+    }
+    *node = std::move(parent);
+  } else {
+    auto it = parent->children.find(name);
+    if (it != parent->children.end()) {
+      if ((flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+        return EEXIST;
+      }
+      *node = it->second;
+    } else if ((flags & O_CREAT) == 0 || parent->nlink == 0) {
+      return ENOENT;
+    } else {
+      int fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+      if (fd < 0) {
+        return errno;
+      }
+      auto created = std::make_shared<MemoryNode>();
+      created->ino = state->next_ino++;
+      created->mode = S_IFREG | (mode & 07777);
+      created->fd = fd;
+      parent->children[name] = created;
+      *node = std::move(created);
+    }
+  }
+  bool writable = (flags & O_ACCMODE) != O_RDONLY;
+  if ((*node)->is_dir()) {
+    return (writable || (flags & O_CREAT) != 0) ? EISDIR : 0;
+  }
+  if ((flags & O_DIRECTORY) != 0) {
+    return ENOTDIR;
+  }
+  if ((flags & O_TRUNC) != 0 && writable && ftruncate((*node)->fd, 0) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+// Open a new descriptor for the memfd of a regular file, with its own
+// offset and the access mode of |flags|.
+int ReopenMemfd(const MemoryNode &node, int flags, int *fd) {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", node.fd);
+  int ret = open(path, (flags & (O_ACCMODE | O_APPEND)) | O_CLOEXEC);
+  if (ret < 0) {
+    return errno;
+  }
+  *fd = ret;
+  return 0;
+}
+
+// A directory of a MemoryFilesystem. Regular files are simply RealFiles
+// wrapping their own descriptors.
+class MemoryDir : public File {
+ public:
+  MemoryDir(std::shared_ptr<MemoryFilesystemState> state,
+            std::shared_ptr<MemoryNode> node)
+      : state_(std::move(state)), node_(std::move(node)) {}
+  MemoryDir(const MemoryDir &) = delete;
+  void operator=(const MemoryDir &) = delete;
+
+  int Allocate(off_t offset, off_t len) final { return ENODEV; }
+  int Close() final { return 0; }
+
+  bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    // Take a snapshot so that |fn| can modify the directory.
+    std::vector<dirent> entries;
+    {
+      std::lock_guard<std::mutex> lock(state_->mu);
+      auto parent = node_->parent.lock();
+      AddEntry(".", *node_, &entries);
+      AddEntry("..", parent != nullptr ? *parent : *node_, &entries);
+      for (const auto &child : node_->children) {
+        AddEntry(child.first, *child.second, &entries);
+      }
+    }
+    for (const auto &ent : entries) {
+      if (fn(&ent) == IterationControl::kBreak) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    std::shared_ptr<MemoryNode> parent;
+    std::string name;
+    int ret = ResolveParent(state_.get(), node_, path, &parent, &name);
+    if (ret != 0) {
+      return ret;
+    }
+    if (name.empty() || parent->children.count(name) != 0) {
+      return EEXIST;
+    }
+    if (parent->nlink == 0) {
+      return ENOENT;
+    }
+    auto created = std::make_shared<MemoryNode>();
+    created->ino = state_->next_ino++;
+    created->mode = S_IFDIR | (mode & 07777);
+    created->nlink = 2;
+    created->parent = parent;
+    parent->children[name] = std::move(created);
+    return 0;
+  }
+
+  void NoteRawRead(int64_t bytes) final {}
+
+  int Open(const char *path, int flags, int *fd) final {
+    return Open(path, flags, 0, fd);
+  }
+
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return Open(path, flags, 0, f);
+  }
+
+  int Open(const char *path, int flags, mode_t mode, int *fd) final {
+    std::shared_ptr<MemoryNode> node;
+    int ret = OpenNode(state_.get(), node_, path, flags, mode, &node);
+    if (ret != 0) {
+      return ret;
+    }
+    return node->is_dir() ? EOPNOTSUPP : ReopenMemfd(*node, flags, fd);
+  }
+
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final {
+    std::shared_ptr<MemoryNode> node;
+    int ret = OpenNode(state_.get(), node_, path, flags, mode, &node);
+    if (ret != 0) {
+      return ret;
+    }
+    if (node->is_dir()) {
+      f->reset(new MemoryDir(state_, std::move(node)));
+      return 0;
+    }
+    int fd;
+    ret = ReopenMemfd(*node, flags, &fd);
+    if (ret != 0) {
+      return ret;
+    }
+    f->reset(new RealFile(fd));
+    return 0;
+  }
+
+  int Read(void *buf, size_t count, size_t *bytes_read) final { return EISDIR; }
+
+  int Rename(const char *oldpath, const char *newpath) final {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    std::shared_ptr<MemoryNode> old_parent;
+    std::shared_ptr<MemoryNode> new_parent;
+    std::string old_name;
+    std::string new_name;
+    int ret = ResolveParent(state_.get(), node_, oldpath, &old_parent,
+                            &old_name);
+    if (ret != 0) {
+      return ret;
+    }
+    ret = ResolveParent(state_.get(), node_, newpath, &new_parent, &new_name);
+    if (ret != 0) {
+      return ret;
+    }
+    if (old_name.empty() || new_name.empty()) {
+      return EBUSY;
+    }
+    auto old_it = old_parent->children.find(old_name);
+    if (old_it == old_parent->children.end()) {
+      return ENOENT;
+    }
+    std::shared_ptr<MemoryNode> node = old_it->second;
+    if (new_parent->nlink == 0) {
+      return ENOENT;
+    }
+    if (node->is_dir()) {
+      // A directory can't be moved within itself.
+      for (auto p = new_parent; p != nullptr; p = p->parent.lock()) {
+        if (p == node) {
+          return EINVAL;
+        }
+      }
+    }
+    auto new_it = new_parent->children.find(new_name);
+    if (new_it != new_parent->children.end()) {
+      MemoryNode &replaced = *new_it->second;
+      if (&replaced == node.get()) {
+        return 0;
+      }
+      if (node->is_dir() && !replaced.is_dir()) {
+        return ENOTDIR;
+      }
+      if (!node->is_dir() && replaced.is_dir()) {
+        return EISDIR;
+      }
+      if (replaced.is_dir() && !replaced.children.empty()) {
+        return ENOTEMPTY;
+      }
+      replaced.nlink = 0;
+      replaced.parent.reset();
+    }
+    old_parent->children.erase(old_it);
+    if (node->is_dir()) {
+      node->parent = new_parent;
+    }
+    new_parent->children[new_name] = std::move(node);
+    return 0;
+  }
+
+  int Seek(off_t offset) final { return 0; }
+
+  int Stat(struct stat *buf) final {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    return StatNode(*node_, buf);
+  }
+
+  int Sync() final { return 0; }
+  int SyncFilesystem() final { return 0; }
+  int Truncate(off_t length) final { return EINVAL; }
+
+  int Unlink(const char *path) final {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    std::shared_ptr<MemoryNode> parent;
+    std::string name;
+    int ret = ResolveParent(state_.get(), node_, path, &parent, &name);
+    if (ret != 0) {
+      return ret;
+    }
+    if (name.empty()) {
+      return EISDIR;
+    }
+    auto it = parent->children.find(name);
+    if (it == parent->children.end()) {
+      return ENOENT;
+    }
+    if (it->second->is_dir()) {
+      return EISDIR;
+    }
+    it->second->nlink = 0;
+    parent->children.erase(it);
+    return 0;
+  }
+
+  int Write(re2::StringPiece data, size_t *bytes_written) final {
+    return EBADF;
+  }
+
+  // rmdir() relative to this directory, for MemoryFilesystem.
+  int Rmdir(const char *path) {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    std::shared_ptr<MemoryNode> parent;
+    std::string name;
+    int ret = ResolveParent(state_.get(), node_, path, &parent, &name);
+    if (ret != 0) {
+      return ret;
+    }
+    if (name.empty()) {
+      return EBUSY;
+    }
+    auto it = parent->children.find(name);
+    if (it == parent->children.end()) {
+      return ENOENT;
+    }
+    MemoryNode &dir = *it->second;
+    if (!dir.is_dir()) {
+      return ENOTDIR;
+    }
+    if (!dir.children.empty()) {
+      return ENOTEMPTY;
+    }
+    dir.nlink = 0;
+    dir.parent.reset();
+    parent->children.erase(it);
+    return 0;
+  }
+
+  // stat() relative to this directory, for MemoryFilesystem.
+  int StatPath(const char *path, struct stat *buf) {
+    std::lock_guard<std::mutex> lock(state_->mu);
+    std::shared_ptr<MemoryNode> node;
+    int ret = Resolve(state_.get(), node_, path, &node);
+    return ret != 0 ? ret : StatNode(*node, buf);
+  }
+
+ private:
+  static void AddEntry(const std::string &name, const MemoryNode &node,
+                       std::vector<dirent> *entries) {
+    entries->emplace_back();
+    dirent &ent = entries->back();
+    memset(&ent, 0, sizeof(ent));
+    ent.d_ino = node.ino;
+    ent.d_type = node.is_dir() ? DT_DIR : DT_REG;
+    memcpy(ent.d_name, name.data(), name.size());  // NUL from memset.
+  }
+
+  std::shared_ptr<MemoryFilesystemState> state_;
+  std::shared_ptr<MemoryNode> node_;
+};
+
+class MemoryFilesystem : public Filesystem {
+ public:
+  MemoryFilesystem() : state_(std::make_shared<MemoryFilesystemState>()) {
+    state_->root = std::make_shared<MemoryNode>();
+    state_->root->ino = state_->next_ino++;
+    state_->root->mode = S_IFDIR | 0755;
+    state_->root->nlink = 2;
+    root_.reset(new MemoryDir(state_, state_->root));
+  }
+  MemoryFilesystem(const MemoryFilesystem &) = delete;
+  void operator=(const MemoryFilesystem &) = delete;
+
+  bool DirForEach(const char *dir_path,
+                  std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    std::unique_ptr<File> dir;
+    int ret = root_->Open(dir_path, O_DIRECTORY | O_RDONLY, &dir);
+    if (ret != 0) {
+      *error_message =
+          StrCat("Unable to examine ", dir_path, ": ", strerror(ret));
+      return false;
+    }
+    return dir->DirForEach(fn, error_message);
+  }
+
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return root_->Open(path, flags, 0, f);
+  }
+
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final {
+    return root_->Open(path, flags, mode, f);
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    return root_->Mkdir(path, mode);
+  }
+
+  int Rmdir(const char *path) final { return root_->Rmdir(path); }
+
+  int Stat(const char *path, struct stat *buf) final {
+    return root_->StatPath(path, buf);
+  }
+
+  int Unlink(const char *path) final { return root_->Unlink(path); }
+
+ private:
+  std::shared_ptr<MemoryFilesystemState> state_;
+  std::unique_ptr<MemoryDir> root_;
+};
+
+class FaultInjectingFile : public File {
+ public:
+  FaultInjectingFile(std::unique_ptr<File> base, FaultInjector *injector)
+      : base_(std::move(base)), injector_(injector) {}
+  FaultInjectingFile(const FaultInjectingFile &) = delete;
+  void operator=(const FaultInjectingFile &) = delete;
+
+  int Allocate(off_t offset, off_t len) final {
+    return base_->Allocate(offset, len);
+  }
+
+  int Close() final { return base_->Close(); }
+
+  bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    return base_->DirForEach(fn, error_message);
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    return base_->Mkdir(path, mode);
+  }
+
+  void NoteRawRead(int64_t bytes) final { base_->NoteRawRead(bytes); }
+
+  int Open(const char *path, int flags, int *fd) final {
+    return Open(path, flags, 0, fd);
+  }
+
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return Open(path, flags, 0, f);
+  }
+
+  int Open(const char *path, int flags, mode_t mode, int *fd) final {
+    int ret = injector_->Inject(FaultInjector::Op::kOpen);
+    return ret != 0 ? ret : base_->Open(path, flags, mode, fd);
+  }
+
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final {
+    int ret = injector_->Inject(FaultInjector::Op::kOpen);
+    if (ret != 0) {
+      return ret;
+    }
+    std::unique_ptr<File> base;
+    ret = base_->Open(path, flags, mode, &base);
+    if (ret != 0) {
+      return ret;
+    }
+    f->reset(new FaultInjectingFile(std::move(base), injector_));
+    return 0;
+  }
+
+  int Read(void *buf, size_t count, size_t *bytes_read) final {
+    return base_->Read(buf, count, bytes_read);
+  }
+
+  int Rename(const char *oldpath, const char *newpath) final {
+    return base_->Rename(oldpath, newpath);
+  }
+
+  int Seek(off_t offset) final { return base_->Seek(offset); }
+  int Stat(struct stat *buf) final { return base_->Stat(buf); }
+
+  int Sync() final {
+    int ret = injector_->Inject(FaultInjector::Op::kSync);
+    return ret != 0 ? ret : base_->Sync();
+  }
+
+  int SyncFilesystem() final {
+    int ret = injector_->Inject(FaultInjector::Op::kSync);
+    return ret != 0 ? ret : base_->SyncFilesystem();
+  }
+
+  int Truncate(off_t length) final { return base_->Truncate(length); }
+
+  int Unlink(const char *path) final {
+    int ret = injector_->Inject(FaultInjector::Op::kUnlink);
+    return ret != 0 ? ret : base_->Unlink(path);
+  }
+
+  int Write(re2::StringPiece data, size_t *bytes_written) final {
+    int ret = injector_->Inject(FaultInjector::Op::kWrite);
+    return ret != 0 ? ret : base_->Write(data, bytes_written);
+  }
+
+ private:
+  std::unique_ptr<File> base_;
+  FaultInjector *injector_;
+};
+
+class FaultInjectingFilesystem : public Filesystem {
+ public:
+  FaultInjectingFilesystem(Filesystem *base, FaultInjector *injector)
+      : base_(base), injector_(injector) {}
+  FaultInjectingFilesystem(const FaultInjectingFilesystem &) = delete;
+  void operator=(const FaultInjectingFilesystem &) = delete;
+
+  bool DirForEach(const char *dir_path,
+                  std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    return base_->DirForEach(dir_path, fn, error_message);
+  }
+
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return Open(path, flags, 0, f);
+  }
+
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final {
+    int ret = injector_->Inject(FaultInjector::Op::kOpen);
+    if (ret != 0) {
+      return ret;
+    }
+    std::unique_ptr<File> base;
+    ret = base_->Open(path, flags, mode, &base);
+    if (ret != 0) {
+      return ret;
+    }
+    f->reset(new FaultInjectingFile(std::move(base), injector_));
+    return 0;
+  }
+
+  int Mkdir(const char *path, mode_t mode) final {
+    return base_->Mkdir(path, mode);
+  }
+
+  int Rmdir(const char *path) final { return base_->Rmdir(path); }
+
+  int Stat(const char *path, struct stat *buf) final {
+    return base_->Stat(path, buf);
+  }
+
+  int Unlink(const char *path) final {
+    int ret = injector_->Inject(FaultInjector::Op::kUnlink);
+    return ret != 0 ? ret : base_->Unlink(path);
+  }
+
+ private:
+  Filesystem *base_;
+  FaultInjector *injector_;
+};
+
 }  // namespace
 
+int FaultInjector::Inject(Op op) {
+  const FaultSpec &spec = specs_[static_cast<int>(op)];
+  bool tail = false;
+  bool error = false;
+  if (spec.tail_probability > 0 || spec.error_probability > 0) {
+    std::uniform_real_distribution<double> dist;
+    std::lock_guard<std::mutex> lock(mu_);
+    tail = dist(rand_) < spec.tail_probability;
+    error = dist(rand_) < spec.error_probability;
+  }
+  const struct timespec &latency = tail ? spec.tail_latency : spec.latency;
+  if (latency.tv_sec > 0 || latency.tv_nsec > 0) {
+    clock_->Sleep(latency);
+  }
+  if (tail) {
+    ++tails_[static_cast<int>(op)];
+  }
+  if (error) {
+    ++errors_[static_cast<int>(op)];
+    return spec.error;
+  }
+  return 0;
+}
+
+std::unique_ptr<Filesystem> NewFaultInjectingFilesystem(
+    Filesystem *base, FaultInjector *injector) {
+  return std::unique_ptr<Filesystem>(
+      new FaultInjectingFilesystem(base, injector));
+}
+
+std::unique_ptr<File> NewFaultInjectingFile(std::unique_ptr<File> base,
+                                            FaultInjector *injector) {
+  return std::unique_ptr<File>(
+      new FaultInjectingFile(std::move(base), injector));
+}
+
 Filesystem *GetRealFilesystem() {
   static Filesystem *real_filesystem = new RealFilesystem;
   return real_filesystem;
 }
 
+std::unique_ptr<Filesystem> NewMemoryFilesystem() {
+  return std::unique_ptr<Filesystem>(new MemoryFilesystem);
+}
+
+int FilesystemSyncer::Sync(File *dir) {
+  std::unique_lock<std::mutex> lock(mu_);
+
+  // One in progress may have started before the caller's writes; wait for
+  // the next.
+  const int64_t needed = started_ + 1;
+  ++waiting_;
+  while (completed_ < needed) {
+    if (syncing_) {
+      cv_.wait(lock);
+      continue;
+    }
+    syncing_ = true;
+    int64_t number = ++started_;
+    waiting_ = 0;
+    lock.unlock();
+    int ret = dir->SyncFilesystem();
+    lock.lock();
+    syncing_ = false;
+    completed_ = number;
+    completed_result_ = ret;
+    cv_.notify_all();
+  }
+  return completed_result_;
+}
+
+int CopyFileRange(int in_fd, off_t in_offset, int out_fd, size_t count) {
+  off_t out_offset = lseek(out_fd, 0, SEEK_CUR);
+  if (out_offset < 0) {
+    return errno;
+  }
+
+  struct stat out_stat;
+  if (fstat(out_fd, &out_stat) < 0) {
+    return errno;
+  }
+  off_t block_size = out_stat.st_blksize;
+  if (block_size > 0 && in_offset % block_size == 0 &&
+      out_offset % block_size == 0 && count % block_size == 0) {
+    struct file_clone_range clone_range;
+    clone_range.src_fd = in_fd;
+    clone_range.src_offset = in_offset;
+    clone_range.src_length = count;
+    clone_range.dest_offset = out_offset;
+    if (ioctl(out_fd, FICLONERANGE, &clone_range) == 0) {
+      return (lseek(out_fd, out_offset + count, SEEK_SET) < 0) ? errno : 0;
+    }
+    VLOG(2) << "FICLONERANGE failed: " << strerror(errno)
+            << "; falling back to copy_file_range.";
+  }
+
+  bool use_copy_file_range = true;
+  std::unique_ptr<char[]> buf;
+  constexpr size_t kBufSize = 1 << 16;
+  while (count > 0) {
+    if (use_copy_file_range) {
+      ssize_t ret =
+          copy_file_range(in_fd, &in_offset, out_fd, nullptr, count, 0);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+            errno != EOPNOTSUPP) {
+          return errno;
+        }
+        VLOG(2) << "copy_file_range failed: " << strerror(errno)
+                << "; falling back to read/write.";
+        use_copy_file_range = false;
+        continue;
+      }
+      if (ret == 0) {
+        return ENODATA;  // |in_fd| is shorter than expected.
+      }
+      count -= ret;
+      continue;
+    }
+
+    if (buf == nullptr) {
+      buf.reset(new char[kBufSize]);
+    }
+    ssize_t bytes_read;
+    while ((bytes_read = pread(in_fd, buf.get(), std::min(count, kBufSize),
+                               in_offset)) == -1 &&
+           errno == EINTR)
+      ;
+    if (bytes_read < 0) {
+      return errno;
+    }
+    if (bytes_read == 0) {
+      return ENODATA;
+    }
+    for (ssize_t written = 0; written < bytes_read;) {
+      ssize_t ret = write(out_fd, buf.get() + written, bytes_read - written);
+      if (ret < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno;
+      }
+      written += ret;
+    }
+    in_offset += bytes_read;
+    count -= bytes_read;
+  }
+  return 0;
+}
+
 }  // namespace moonfire_nvr
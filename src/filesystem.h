@@ -34,12 +34,17 @@
 #define MOONFIRE_NVR_FILESYSTEM_H
 
 #include <dirent.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <functional>
+#include <random>
 #include <string>
 
 #include <event2/buffer.h>
@@ -49,6 +54,7 @@
 #include <re2/stringpiece.h>
 
 #include "common.h"
+#include "time.h"
 
 namespace moonfire_nvr {
 
@@ -58,10 +64,29 @@ class File {
   // Close the file, ignoring the result.
   virtual ~File() {}
 
+  // posix_fallocate(), returning 0 on success or errno>0 on failure.
+  virtual int Allocate(off_t offset, off_t len) = 0;
+
   // Close the file, returning 0 on success or errno>0 on failure.
   // Already closed is considered a success.
   virtual int Close() = 0;
 
+  // Execute |fn| for each directory entry in this directory, stopping early
+  // (successfully) if the callback returns IterationControl::kBreak.
+  //
+  // On success, returns true.
+  // On failure, returns false and updates |error_message|.
+  virtual bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                          std::string *error_message) = 0;
+
+  // mkdirat(), returning 0 on success or errno>0 on failure.
+  virtual int Mkdir(const char *path, mode_t mode) = 0;
+
+  // Note that |bytes| were read through a raw file descriptor opened from
+  // this directory, such as by passing it to EvBuffer::AddFile. This only
+  // informs I/O accounting (see disk-stats.h); most implementations ignore it.
+  virtual void NoteRawRead(int64_t bytes) = 0;
+
   // openat(), returning 0 on success or errno>0 on failure.
   virtual int Open(const char *path, int flags, int *fd) = 0;
   virtual int Open(const char *path, int flags, std::unique_ptr<File> *f) = 0;
@@ -73,12 +98,23 @@ class File {
   // On success, |bytes_read| will be updated.
   virtual int Read(void *buf, size_t count, size_t *bytes_read) = 0;
 
+  // renameat() within this directory, returning 0 on success or errno>0 on
+  // failure.
+  virtual int Rename(const char *oldpath, const char *newpath) = 0;
+
+  // lseek(..., SEEK_SET), returning 0 on success or errno>0 on failure.
+  virtual int Seek(off_t offset) = 0;
+
   // fstat(), returning 0 on success or errno>0 on failure.
   virtual int Stat(struct stat *buf) = 0;
 
   // fsync(), returning 0 on success or errno>0 on failure.
   virtual int Sync() = 0;
 
+  // syncfs(), returning 0 on success or errno>0 on failure. This syncs every
+  // file and directory on the filesystem containing this file at once.
+  virtual int SyncFilesystem() = 0;
+
   // ftruncate(), returning 0 on success or errno>0 on failure.
   virtual int Truncate(off_t length) = 0;
 
@@ -92,7 +128,13 @@ class File {
 
 class MockFile : public File {
  public:
+  MOCK_METHOD2(Allocate, int(off_t, off_t));
   MOCK_METHOD0(Close, int());
+  MOCK_METHOD2(DirForEach,
+               bool(std::function<IterationControl(const dirent *)>,
+                    std::string *));
+  MOCK_METHOD2(Mkdir, int(const char *, mode_t));
+  MOCK_METHOD1(NoteRawRead, void(int64_t));
 
   // The std::unique_ptr<File> variants of Open are wrapped here because gmock's
   // SetArgPointee doesn't work well with std::unique_ptr.
@@ -117,8 +159,11 @@ class MockFile : public File {
   MOCK_METHOD3(OpenRaw, int(const char *, int, File **));
   MOCK_METHOD4(OpenRaw, int(const char *, int, mode_t, File **));
   MOCK_METHOD3(Read, int(void *, size_t, size_t *));
+  MOCK_METHOD2(Rename, int(const char *, const char *));
+  MOCK_METHOD1(Seek, int(off_t));
   MOCK_METHOD1(Stat, int(struct stat *));
   MOCK_METHOD0(Sync, int());
+  MOCK_METHOD0(SyncFilesystem, int());
   MOCK_METHOD1(Truncate, int(off_t));
   MOCK_METHOD1(Unlink, int(const char *));
   MOCK_METHOD2(Write, int(re2::StringPiece, size_t *));
@@ -161,6 +206,126 @@ class Filesystem {
 // Get the (singleton) real filesystem, which is never deleted.
 Filesystem *GetRealFilesystem();
 
+// Create a new, empty in-memory filesystem, for tests and benchmarks which
+// shouldn't depend on (or be slowed by) a real disk. Directories exist only
+// in memory; each regular file is backed by a memfd, so it can be sparse and
+// the raw file descriptors returned by File::Open can be read, mmap()ed, or
+// passed to EvBuffer::AddFile like any other. Directories can't be opened as
+// raw file descriptors. Relative paths are interpreted relative to the root.
+// Files opened from it (such as a directory to use as
+// Environment::sample_file_dir) may outlive the filesystem itself.
+std::unique_ptr<Filesystem> NewMemoryFilesystem();
+
+// The latency and errors to inject into one kind of file operation. Each
+// operation first sleeps for |latency| or, with probability
+// |tail_probability|, for |tail_latency| instead. Then it fails with |error|
+// with probability |error_probability|.
+struct FaultSpec {
+  struct timespec latency = {0, 0};
+  struct timespec tail_latency = {0, 0};
+  double tail_probability = 0;
+  double error_probability = 0;
+  int error = EIO;
+};
+
+// Decides the faults to inject into file operations for
+// NewFaultInjectingFilesystem and NewFaultInjectingFile, for testing and
+// benchmarking under slow or failing disks. Thread-safe.
+class FaultInjector {
+ public:
+  enum class Op { kOpen = 0, kWrite, kSync, kUnlink, kNumOps };
+
+  // |clock| must outlive the FaultInjector. The given |seed| makes the
+  // choices of which operations see tail latency or errors reproducible.
+  explicit FaultInjector(WallClock *clock, uint32_t seed = 0)
+      : clock_(clock), rand_(seed) {}
+  FaultInjector(const FaultInjector &) = delete;
+  void operator=(const FaultInjector &) = delete;
+
+  // Set the faults of an operation: kOpen for all File::Open and
+  // Filesystem::Open variants, kWrite for File::Write, kSync for File::Sync
+  // and File::SyncFilesystem, kUnlink for File::Unlink and
+  // Filesystem::Unlink. Call before any operations.
+  void set_spec(Op op, const FaultSpec &spec) {
+    specs_[static_cast<int>(op)] = spec;
+  }
+
+  // Sleep as specified for |op|, then return 0 or the errno>0 with which it
+  // should fail.
+  int Inject(Op op);
+
+  // The number of operations which have seen tail latency or failed.
+  int64_t tail_count(Op op) const { return tails_[static_cast<int>(op)]; }
+  int64_t error_count(Op op) const { return errors_[static_cast<int>(op)]; }
+
+ private:
+  static constexpr int kNumOps = static_cast<int>(Op::kNumOps);
+
+  WallClock *clock_;
+  FaultSpec specs_[kNumOps];
+  std::atomic<int64_t> tails_[kNumOps] = {};
+  std::atomic<int64_t> errors_[kNumOps] = {};
+
+  std::mutex mu_;
+  std::mt19937 rand_;  // guarded by mu_.
+};
+
+// Wrap |base| so that its operations see the faults chosen by |injector|,
+// which must outlive it (as must |base|). Files opened through it, other
+// than raw file descriptors, are wrapped likewise.
+std::unique_ptr<Filesystem> NewFaultInjectingFilesystem(
+    Filesystem *base, FaultInjector *injector);
+
+// As NewFaultInjectingFilesystem, for a single file or directory.
+std::unique_ptr<File> NewFaultInjectingFile(std::unique_ptr<File> base,
+                                            FaultInjector *injector);
+
+// Coalesces File::SyncFilesystem calls on a single filesystem, such as those
+// of several streams writing to one sample file directory on the same
+// schedule. Each Sync returns the result of a syncfs() which started after it
+// was called, so it covers everything written before the call, but callers
+// which arrive while one is in progress share the next rather than each
+// issuing their own. Thread-safe.
+class FilesystemSyncer {
+ public:
+  FilesystemSyncer() {}
+  FilesystemSyncer(const FilesystemSyncer &) = delete;
+  void operator=(const FilesystemSyncer &) = delete;
+
+  // Sync the filesystem containing |dir|, which must be the same for every
+  // caller. Returns 0 on success or errno>0 on failure.
+  int Sync(File *dir);
+
+  // The number of callers waiting for a syncfs() to start. Exposed for
+  // testing.
+  int waiting() {
+    std::lock_guard<std::mutex> lock(mu_);
+    return waiting_;
+  }
+
+ private:
+  std::mutex mu_;
+  std::condition_variable cv_;  // signalled when a syncfs() completes.
+
+  // All below are protected by mu_. syncfs() calls are numbered from 1.
+  bool syncing_ = false;
+  int64_t started_ = 0;
+  int64_t completed_ = 0;
+  int completed_result_ = 0;
+  int waiting_ = 0;
+};
+
+// Copy |count| bytes from |in_fd|, starting at |in_offset|, to |out_fd| at
+// its current position, which is advanced past the copied bytes. Returns 0 on
+// success or errno>0 on failure.
+//
+// This avoids copying through userspace where possible. When the offsets and
+// length are block-aligned, it first tries sharing the blocks outright via a
+// reflink (FICLONERANGE, supported by btrfs and XFS). Otherwise, or if that
+// fails, it uses copy_file_range(), then falls back to read() and write() if
+// the kernel or filesystem doesn't support that either.
+int CopyFileRange(int in_fd, off_t in_offset, int out_fd, size_t count);
+
 }  // namespace moonfire_nvr
 
 #endif  // MOONFIRE_NVR_FILESYSTEM_H
@@ -0,0 +1,257 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// fsck-test.cc: tests of the fsck.h interface.
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "crypto.h"
+#include "fsck.h"
+#include "recording.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+
+DECLARE_bool(alsologtostderr);
+
+using testing::AllOf;
+using testing::HasSubstr;
+using testing::UnorderedElementsAre;
+
+namespace moonfire_nvr {
+namespace {
+
+class FsckTest : public testing::Test {
+ protected:
+  FsckTest() {
+    tmpdir_ = PrepareTempDirOrDie("fsck-test");
+    std::string error_message;
+    CHECK(db_.Open(StrCat(tmpdir_, "/db").c_str(),
+                   SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &error_message))
+        << error_message;
+    std::string create_sql = ReadFileOrDie("../src/schema.sql");
+    {
+      DatabaseContext ctx(&db_);
+      CHECK(RunStatements(&ctx, create_sql, &error_message)) << error_message;
+      auto run = ctx.UseOnce(
+          R"(
+          insert into camera (uuid,  short_name,  host,  username,  password,
+                              main_rtsp_path,  sub_rtsp_path,  retain_bytes)
+                      values (:uuid, 'test', 'test-camera', 'foo', 'bar',
+                              '/main', '/sub', 42);
+          )");
+      run.BindBlob(":uuid", GetRealUuidGenerator()->Generate().binary_view());
+      CHECK_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+      camera_id_ = ctx.last_insert_rowid();
+    }
+    CHECK(mdb_.Init(&db_, &error_message)) << error_message;
+
+    std::string samples_path = StrCat(tmpdir_, "/samples");
+    CHECK_EQ(0, GetRealFilesystem()->Mkdir(samples_path.c_str(), 0700));
+    std::unique_ptr<File> dir;
+    CHECK_EQ(0, GetRealFilesystem()->Open(samples_path.c_str(),
+                                          O_DIRECTORY | O_RDONLY, &dir));
+    dir_.reset(new ShardedSampleFileDir(std::move(dir), 1));
+    CHECK(dir_->Init(&error_message)) << error_message;
+
+    entry_.sha1.resize(20);
+    entry_.width = 768;
+    entry_.height = 512;
+    entry_.data.resize(100);
+    CHECK(mdb_.InsertVideoSampleEntry(&entry_, &error_message))
+        << error_message;
+  }
+
+  void WriteSampleFile(const Uuid &uuid, re2::StringPiece contents) {
+    std::unique_ptr<File> f;
+    std::string text = uuid.UnparseText();
+    ASSERT_EQ(0, dir_->Open(text.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600,
+                            &f));
+    size_t written;
+    ASSERT_EQ(0, f->Write(contents, &written));
+    ASSERT_EQ(contents.size(), written);
+  }
+
+  // Insert a recording of |bytes| bytes whose hash is that of |contents|.
+  Recording InsertRecording(const Uuid &uuid, int32_t bytes,
+                            re2::StringPiece contents) {
+    Recording recording;
+    recording.camera_id = camera_id_;
+    recording.sample_file_uuid = uuid;
+    auto sha1 = Digest::SHA1();
+    sha1->Update(contents);
+    recording.sample_file_hash = sha1->Finalize();
+    recording.video_sample_entry_id = entry_.id;
+    SampleIndexEncoder encoder;
+    encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
+    encoder.AddSample(kTimeUnitsPerSecond, bytes, true);
+    encoder.Flush();
+    std::string error_message;
+    EXPECT_TRUE(mdb_.InsertRecording(&recording, &error_message))
+        << error_message;
+    return recording;
+  }
+
+  std::string tmpdir_;
+  Database db_;
+  MoonfireDatabase mdb_;
+  int64_t camera_id_ = -1;
+  std::unique_ptr<ShardedSampleFileDir> dir_;
+  VideoSampleEntry entry_;
+};
+
+TEST_F(FsckTest, Empty) {
+  FsckReport report;
+  std::string error_message;
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kHash, 4, &report, &error_message))
+      << error_message;
+  EXPECT_EQ(0, report.recordings);
+  EXPECT_EQ(0, report.files);
+  EXPECT_THAT(report.problems, testing::IsEmpty());
+  EXPECT_GE(report.presence_sec, 0);
+  EXPECT_GE(report.size_sec, 0);
+  EXPECT_GE(report.hash_sec, 0);
+}
+
+TEST_F(FsckTest, Levels) {
+  std::string error_message;
+  std::vector<Uuid> uuids = mdb_.ReserveSampleFiles(5, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(5)) << error_message;
+  Uuid stray = GetRealUuidGenerator()->Generate();
+
+  // uuids[0] is fine; [1] is missing; [2] is too short; [3] has the wrong
+  // contents; [4] is still reserved; |stray| is unreferenced.
+  WriteSampleFile(uuids[0], "abc");
+  InsertRecording(uuids[0], 3, "abc");
+  InsertRecording(uuids[1], 3, "abc");
+  WriteSampleFile(uuids[2], "ab");
+  InsertRecording(uuids[2], 3, "abc");
+  WriteSampleFile(uuids[3], "xyz");
+  InsertRecording(uuids[3], 3, "abc");
+  WriteSampleFile(uuids[4], "abc");
+  WriteSampleFile(stray, "abc");
+
+  FsckReport report;
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kPresence, 4, &report,
+                               &error_message))
+      << error_message;
+  EXPECT_EQ(4, report.recordings);
+  EXPECT_EQ(1, report.reserved);
+  EXPECT_EQ(5, report.files);
+  EXPECT_EQ(-1, report.size_sec);
+  auto missing = AllOf(HasSubstr(uuids[1].UnparseText()),
+                       HasSubstr("missing sample file of recording"));
+  auto reserved = AllOf(HasSubstr(uuids[4].UnparseText()),
+                        HasSubstr("reservation remains"));
+  auto unreferenced =
+      AllOf(HasSubstr(stray.UnparseText()), HasSubstr("not referenced"));
+  EXPECT_THAT(report.problems,
+              UnorderedElementsAre(missing, reserved, unreferenced));
+
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kSize, 4, &report, &error_message))
+      << error_message;
+  auto short_file =
+      AllOf(HasSubstr(uuids[2].UnparseText()), HasSubstr("has 2 bytes"));
+  EXPECT_THAT(report.problems, UnorderedElementsAre(missing, reserved,
+                                                    unreferenced, short_file));
+  EXPECT_EQ(-1, report.hash_sec);
+
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kHash, 4, &report, &error_message))
+      << error_message;
+  auto bad_hash = AllOf(HasSubstr(uuids[3].UnparseText()),
+                        HasSubstr("doesn't match"));
+  EXPECT_THAT(report.problems,
+              UnorderedElementsAre(missing, reserved, unreferenced, short_file,
+                                   bad_hash));
+  EXPECT_EQ(3, report.hashed_bytes);
+}
+
+TEST_F(FsckTest, CameraStats) {
+  std::string error_message;
+  std::vector<Uuid> uuids = mdb_.ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  WriteSampleFile(uuids[0], "abc");
+  InsertRecording(uuids[0], 3, "abc");
+
+  FsckReport report;
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kPresence, 4, &report,
+                               &error_message))
+      << error_message;
+  EXPECT_THAT(report.problems, testing::IsEmpty());
+
+  {
+    DatabaseContext ctx(&db_);
+    auto run = ctx.UseOnce(
+        "update camera_stats set total_sample_file_bytes = 4;");
+    ASSERT_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  }
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kPresence, 4, &report,
+                               &error_message))
+      << error_message;
+  EXPECT_THAT(report.problems,
+              UnorderedElementsAre(AllOf(
+                  HasSubstr("total_sample_file_bytes 4"),
+                  HasSubstr("recordings have 3"))));
+
+  {
+    DatabaseContext ctx(&db_);
+    auto run = ctx.UseOnce("delete from camera_stats;");
+    ASSERT_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  }
+  ASSERT_TRUE(CheckSampleFiles(&mdb_, dir_.get(), nullptr, GetRealClock(),
+                               FsckLevel::kPresence, 4, &report,
+                               &error_message))
+      << error_message;
+  EXPECT_THAT(report.problems,
+              UnorderedElementsAre(HasSubstr("camera_stats row is missing")));
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
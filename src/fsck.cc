@@ -0,0 +1,409 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// fsck.cc: see fsck.h.
+
+#include "fsck.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+
+#include <glog/logging.h>
+
+#include "crypto.h"
+#include "string.h"
+
+namespace moonfire_nvr {
+
+namespace {
+
+const size_t kHashBufferSize = 1 << 20;
+
+// A sample file which the database says should exist.
+struct ExpectedFile {
+  Uuid uuid;
+  SampleFileTier tier = SampleFileTier::kHot;
+
+  // The file's exact size, or its minimum size for a container, which is
+  // preallocated and may have unused space at the end.
+  int64_t bytes = 0;
+  bool is_container = false;
+
+  std::string description;  // "recording 42" or "container 7".
+};
+
+const char *TierName(SampleFileTier tier) {
+  return tier == SampleFileTier::kHot ? "hot" : "cold";
+}
+
+// Call |fn| for each index in [0, n) from up to |concurrency| threads. The
+// calling thread is one of them.
+void ParallelFor(size_t n, int concurrency, std::function<void(size_t)> fn) {
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < n) {
+      fn(i);
+    }
+  };
+  size_t n_threads =
+      std::min(static_cast<size_t>(std::max(concurrency, 1)), n);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+// Compare the sorted listing |files| of a directory to the sorted |expected|
+// files in it, appending those found to |present| and any problems to
+// |problems|.
+void MergeListing(SampleFileTier tier, const std::vector<Uuid> &files,
+                  const std::vector<ExpectedFile> &expected,
+                  const std::vector<Uuid> &reserved,
+                  std::vector<const ExpectedFile *> *present,
+                  std::vector<std::string> *problems) {
+  size_t e = 0;
+  size_t f = 0;
+  while (e < expected.size() || f < files.size()) {
+    if (f == files.size() ||
+        (e < expected.size() && expected[e].uuid < files[f])) {
+      problems->push_back(StrCat(TierName(tier), " ",
+                                 expected[e].uuid.UnparseText(),
+                                 ": missing sample file of ",
+                                 expected[e].description));
+      ++e;
+    } else if (e == expected.size() || files[f] < expected[e].uuid) {
+      if (f > 0 && files[f] == files[f - 1]) {
+        problems->push_back(StrCat(TierName(tier), " ",
+                                   files[f].UnparseText(),
+                                   ": in both the flat and sharded layouts"));
+      } else if (!std::binary_search(reserved.begin(), reserved.end(),
+                                     files[f])) {
+        problems->push_back(
+            StrCat(TierName(tier), " ", files[f].UnparseText(),
+                   ": not referenced by any recording, container, or "
+                   "reservation"));
+      }
+      ++f;
+    } else {
+      present->push_back(&expected[e]);
+      ++e;
+      ++f;
+    }
+  }
+}
+
+// Compare each camera's camera_stats row to aggregates of |recordings|.
+void CheckCameraStats(const std::vector<Recording> &recordings,
+                      const std::vector<CameraStatsRow> &rows,
+                      std::vector<std::string> *problems) {
+  std::map<int64_t, CameraStatsRow> expected;
+  for (const auto &row : rows) {
+    CameraStatsRow &e = expected[row.camera_id];
+    e.total_duration_90k = 0;
+    e.total_sample_file_bytes = 0;
+  }
+  for (const auto &recording : recordings) {
+    CameraStatsRow &e = expected[recording.camera_id];
+    if (e.min_start_time_90k == -1 ||
+        recording.start_time_90k < e.min_start_time_90k) {
+      e.min_start_time_90k = recording.start_time_90k;
+    }
+    e.max_end_time_90k = std::max(e.max_end_time_90k, recording.end_time_90k);
+    e.total_duration_90k += recording.end_time_90k - recording.start_time_90k;
+    e.total_sample_file_bytes += recording.sample_file_bytes;
+  }
+  for (const auto &row : rows) {
+    const CameraStatsRow &e = expected[row.camera_id];
+    std::string prefix = StrCat("camera ", row.camera_id, ": ");
+    if (!row.present) {
+      problems->push_back(StrCat(prefix, "camera_stats row is missing; the ",
+                                 "next startup will compute it"));
+      continue;
+    }
+    auto compare = [&](const char *name, int64_t got, int64_t want) {
+      if (got != want) {
+        problems->push_back(StrCat(prefix, "camera_stats has ", name, " ",
+                                   got, "; recordings have ", want,
+                                   " (delete the row to recompute it)"));
+      }
+    };
+    compare("min_start_time_90k", row.min_start_time_90k,
+            e.min_start_time_90k);
+    compare("max_end_time_90k", row.max_end_time_90k, e.max_end_time_90k);
+    compare("total_duration_90k", row.total_duration_90k,
+            e.total_duration_90k);
+    compare("total_sample_file_bytes", row.total_sample_file_bytes,
+            e.total_sample_file_bytes);
+  }
+}
+
+// Hash |recording|'s sample data within |dir|, returning 0 or an errno>0.
+int HashRecording(File *dir, const Recording &recording, std::string *hash) {
+  std::string text = recording.sample_file_uuid.UnparseText();
+  std::unique_ptr<File> f;
+  int ret = dir->Open(text.c_str(), O_RDONLY, &f);
+  if (ret != 0) {
+    return ret;
+  }
+  if (recording.sample_file_offset != 0 &&
+      (ret = f->Seek(recording.sample_file_offset)) != 0) {
+    return ret;
+  }
+  auto digest = Digest::ForAlgorithm(recording.sample_file_hash_algorithm);
+  std::string buf(
+      std::min(recording.sample_file_bytes,
+               static_cast<int64_t>(kHashBufferSize)),
+      0);
+  int64_t remaining = recording.sample_file_bytes;
+  while (remaining > 0) {
+    size_t bytes_read;
+    ret = f->Read(&buf[0],
+                  std::min(remaining, static_cast<int64_t>(buf.size())),
+                  &bytes_read);
+    if (ret != 0) {
+      return ret;
+    }
+    if (bytes_read == 0) {
+      return ENODATA;
+    }
+    digest->Update(re2::StringPiece(buf.data(), bytes_read));
+    remaining -= bytes_read;
+  }
+  *hash = digest->Finalize();
+  return 0;
+}
+
+}  // namespace
+
+bool ParseFsckLevel(re2::StringPiece name, FsckLevel *level) {
+  if (name == "presence") {
+    *level = FsckLevel::kPresence;
+  } else if (name == "size") {
+    *level = FsckLevel::kSize;
+  } else if (name == "hash") {
+    *level = FsckLevel::kHash;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool CheckSampleFiles(MoonfireDatabase *mdb, ShardedSampleFileDir *hot,
+                      ShardedSampleFileDir *cold, WallClock *clock,
+                      FsckLevel level, int concurrency, FsckReport *report,
+                      std::string *error_message) {
+  *report = FsckReport();
+  auto &problems = report->problems;
+  ShardedSampleFileDir *dirs[] = {hot, cold};
+
+  // Presence: gather what the database expects, list both directories, and
+  // merge.
+  double start = TimespecToSec(clock->Now());
+  std::vector<Recording> recordings;
+  std::vector<ExpectedFile> expected[2];
+  int64_t unchecked_cold = 0;
+  auto row_cb = [&](const Recording &recording) {
+    recordings.push_back(recording);
+    if (recording.container_id != -1) {
+      return IterationControl::kContinue;  // checked via the container.
+    }
+    int tier = static_cast<int>(recording.sample_file_tier);
+    if (dirs[tier] == nullptr) {
+      ++unchecked_cold;
+      return IterationControl::kContinue;
+    }
+    ExpectedFile file;
+    file.uuid = recording.sample_file_uuid;
+    file.tier = recording.sample_file_tier;
+    file.bytes = recording.sample_file_bytes;
+    file.description = StrCat("recording ", recording.id);
+    expected[tier].push_back(file);
+    return IterationControl::kContinue;
+  };
+  if (!mdb->ListAllRecordings(row_cb, error_message)) {
+    return false;
+  }
+  report->recordings = recordings.size();
+  std::vector<CameraStatsRow> camera_stats;
+  if (!mdb->ListCameraStats(&camera_stats, error_message)) {
+    return false;
+  }
+  CheckCameraStats(recordings, camera_stats, &problems);
+  std::vector<ContainerRow> containers;
+  if (!mdb->ListContainers(&containers, error_message)) {
+    return false;
+  }
+  report->containers = containers.size();
+  for (const auto &container : containers) {
+    ExpectedFile file;
+    file.uuid = container.uuid;
+    file.bytes = container.used_bytes;
+    file.is_container = true;
+    file.description = StrCat("container ", container.id);
+    expected[0].push_back(file);
+  }
+  std::vector<ListReservedSampleFilesRow> reserved_rows;
+  if (!mdb->ListReservedSampleFiles(&reserved_rows, error_message)) {
+    return false;
+  }
+  report->reserved = reserved_rows.size();
+  std::vector<Uuid> reserved;
+  for (const auto &row : reserved_rows) {
+    reserved.push_back(row.uuid);
+    problems.push_back(StrCat(row.uuid.UnparseText(),
+                              ": reservation remains in state ",
+                              static_cast<int>(row.state),
+                              "; the next startup will clean it up"));
+  }
+  std::sort(reserved.begin(), reserved.end());
+  if (unchecked_cold > 0) {
+    problems.push_back(StrCat(unchecked_cold, " recordings are in the cold ",
+                              "tier, which wasn't supplied; not checked"));
+  }
+  std::vector<const ExpectedFile *> present;
+  for (int tier = 0; tier < 2; ++tier) {
+    if (dirs[tier] == nullptr) {
+      continue;
+    }
+    std::vector<Uuid> files;
+    if (!dirs[tier]->ListSampleFiles(&files, error_message)) {
+      *error_message =
+          StrCat("list ", TierName(static_cast<SampleFileTier>(tier)),
+                 " sample file directory: ", *error_message);
+      return false;
+    }
+    report->files += files.size();
+    std::sort(files.begin(), files.end());
+    auto by_uuid = [](const ExpectedFile &a, const ExpectedFile &b) {
+      return a.uuid < b.uuid;
+    };
+    std::sort(expected[tier].begin(), expected[tier].end(), by_uuid);
+    MergeListing(static_cast<SampleFileTier>(tier), files, expected[tier],
+                 reserved, &present, &problems);
+  }
+  report->presence_sec = TimespecToSec(clock->Now()) - start;
+  if (level < FsckLevel::kSize) {
+    return true;
+  }
+
+  // Size: stat each file present.
+  start = TimespecToSec(clock->Now());
+  std::vector<std::string> size_problems(present.size());
+  ParallelFor(present.size(), concurrency, [&](size_t i) {
+    const ExpectedFile &file = *present[i];
+    std::string text = file.uuid.UnparseText();
+    std::string prefix = StrCat(TierName(file.tier), " ", text, ": ");
+    std::unique_ptr<File> f;
+    int ret = dirs[static_cast<int>(file.tier)]->Open(text.c_str(), O_RDONLY,
+                                                       &f);
+    struct stat statbuf;
+    if (ret != 0 || (ret = f->Stat(&statbuf)) != 0) {
+      size_problems[i] = StrCat(prefix, "stat: ", strerror(ret));
+    } else if (file.is_container ? statbuf.st_size < file.bytes
+                                 : statbuf.st_size != file.bytes) {
+      size_problems[i] =
+          StrCat(prefix, "has ", statbuf.st_size, " bytes; ",
+                 file.description, " expects ",
+                 file.is_container ? "at least " : "", file.bytes);
+    }
+  });
+  std::set<Uuid> bad;
+  for (size_t i = 0; i < present.size(); ++i) {
+    if (!size_problems[i].empty()) {
+      problems.push_back(size_problems[i]);
+      bad.insert(present[i]->uuid);
+    }
+  }
+  report->size_sec = TimespecToSec(clock->Now()) - start;
+  if (level < FsckLevel::kHash) {
+    return true;
+  }
+
+  // Hash: read each recording whose file is present and of the right size.
+  start = TimespecToSec(clock->Now());
+  std::set<Uuid> found[2];
+  for (const auto *file : present) {
+    found[static_cast<int>(file->tier)].insert(file->uuid);
+  }
+  std::vector<const Recording *> to_hash;
+  for (const auto &recording : recordings) {
+    int tier = static_cast<int>(recording.sample_file_tier);
+    if (found[tier].count(recording.sample_file_uuid) != 0 &&
+        bad.count(recording.sample_file_uuid) == 0) {
+      to_hash.push_back(&recording);
+    }
+  }
+  std::vector<std::string> hash_problems(to_hash.size());
+  std::atomic<int64_t> hashed_bytes{0};
+  ParallelFor(to_hash.size(), concurrency, [&](size_t i) {
+    const Recording &recording = *to_hash[i];
+    std::string hash;
+    int ret = HashRecording(
+        dirs[static_cast<int>(recording.sample_file_tier)], recording, &hash);
+    std::string prefix =
+        StrCat(TierName(recording.sample_file_tier), " ",
+               recording.sample_file_uuid.UnparseText(), ": recording ",
+               recording.id, ": ");
+    if (ret != 0) {
+      hash_problems[i] = StrCat(prefix, "read: ", strerror(ret));
+    } else if (hash != recording.sample_file_hash) {
+      hash_problems[i] =
+          StrCat(prefix, "hash ", ToHex(hash), " doesn't match expected ",
+                 ToHex(recording.sample_file_hash));
+    } else {
+      hashed_bytes += recording.sample_file_bytes;
+    }
+  });
+  for (const auto &problem : hash_problems) {
+    if (!problem.empty()) {
+      problems.push_back(problem);
+    }
+  }
+  report->hashed_bytes = hashed_bytes;
+  report->hash_sec = TimespecToSec(clock->Now()) - start;
+  return true;
+}
+
+}  // namespace moonfire_nvr
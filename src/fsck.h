@@ -0,0 +1,96 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// fsck.h: offline verification of the sample file invariants described in
+// design/schema.md.
+
+#ifndef MOONFIRE_NVR_FSCK_H
+#define MOONFIRE_NVR_FSCK_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <re2/stringpiece.h>
+
+#include "moonfire-db.h"
+#include "sample-file-dir.h"
+#include "time.h"
+
+namespace moonfire_nvr {
+
+// The levels of verification, from cheapest to most expensive. Each level
+// includes the ones before it.
+enum class FsckLevel {
+  kPresence = 0,  // list the sample file directories.
+  kSize = 1,      // also fstat() each sample file.
+  kHash = 2       // also read and hash each recording's sample data.
+};
+
+// Parse "presence", "size", or "hash", returning success.
+bool ParseFsckLevel(re2::StringPiece name, FsckLevel *level);
+
+// The results of CheckSampleFiles.
+struct FsckReport {
+  int64_t recordings = 0;  // recording rows.
+  int64_t containers = 0;  // container rows.
+  int64_t reserved = 0;    // reserved_sample_files rows.
+  int64_t files = 0;       // sample files found in the directories.
+  int64_t hashed_bytes = 0;
+
+  // The wall time taken by each level, or -1 if it wasn't run.
+  double presence_sec = -1;
+  double size_sec = -1;
+  double hash_sec = -1;
+
+  // Each violated invariant, in a human-readable form. Empty if all is well.
+  std::vector<std::string> problems;
+};
+
+// Checks the database against the sample file directories. |cold| is nullptr
+// if there's no cold tier. Each is listed in full, and the listing is
+// compared to the recording, container, and reserved_sample_files tables by
+// a sorted merge; each camera's camera_stats row is also compared to its
+// recordings. Higher levels stat or hash the files with up to
+// |concurrency| calls in flight at once, as on a large directory each is
+// dominated by waiting on the disk.
+//
+// The database and directories must not be in use by a running NVR, or the
+// results will include spurious problems. Returns false only if the check
+// couldn't be completed; problems found are listed in |report|.
+bool CheckSampleFiles(MoonfireDatabase *mdb, ShardedSampleFileDir *hot,
+                      ShardedSampleFileDir *cold, WallClock *clock,
+                      FsckLevel level, int concurrency, FsckReport *report,
+                      std::string *error_message);
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_FSCK_H
@@ -39,7 +39,9 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "filesystem.h"
 #include "http.h"
 #include "string.h"
 #include "testutil.h"
@@ -97,6 +99,50 @@ TEST(EvBufferTest, AddFileTest) {
   EXPECT_EQ("1234oo", buf3_contents);
 }
 
+TEST(FileSliceTest, WriteRange) {
+  std::string dir_path = PrepareTempDirOrDie("http");
+  std::unique_ptr<File> dir;
+  ASSERT_EQ(0, GetRealFilesystem()->Open(dir_path.c_str(),
+                                         O_DIRECTORY | O_RDONLY, &dir));
+
+  // A block-aligned file, which may be reflinked, and a small one, which
+  // can't be.
+  std::string big(8192, 'x');
+  big[4096] = 'y';
+  WriteFileOrDie(StrCat(dir_path, "/big"), big);
+  WriteFileOrDie(StrCat(dir_path, "/small"), "foobar");
+  RealFileSlice big_slice;
+  big_slice.Init(dir.get(), "big", ByteRange(4096, 8192));
+  RealFileSlice small_slice;
+  small_slice.Init(dir.get(), "small", ByteRange(1, 5));
+  StaticStringPieceSlice static_slice("123");
+  FillerFileSlice filler_slice;
+  filler_slice.Init(2, [](std::string *s, std::string *error_message) {
+    s->append("ab");
+    return true;
+  });
+  FileSlices slices;
+  slices.Append(&big_slice);
+  slices.Append(&static_slice);
+  slices.Append(&small_slice);
+  slices.Append(&filler_slice);
+
+  // Write the whole thing, then a range starting and ending mid-slice.
+  std::string expected = StrCat(big.substr(4096), "123", "ooba", "ab");
+  for (ByteRange range : {ByteRange(0, slices.size()),
+                          ByteRange(4097, 4096 + 3 + 3 + 1)}) {
+    std::string out_path = StrCat(dir_path, "/out");
+    int fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    PCHECK(fd >= 0) << "open: " << out_path;
+    std::string error_message;
+    EXPECT_TRUE(slices.WriteRange(range, fd, &error_message)) << error_message;
+    EXPECT_EQ(range.size(), lseek(fd, 0, SEEK_CUR));
+    close(fd);
+    EXPECT_EQ(expected.substr(range.begin, range.size()),
+              ReadFileOrDie(out_path));
+  }
+}
+
 class FileSlicesTest : public testing::Test {
  protected:
   void Init(int flags) {
@@ -38,6 +38,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
 
@@ -55,12 +56,27 @@ namespace {
 
 // An HttpServe call still in progress.
 struct ServeInProgress {
+  ~ServeInProgress() {
+    if (timer != nullptr) {
+      event_free(timer);
+    }
+  }
+
   ByteRange left;
   int64_t sent_bytes = 0;
   std::shared_ptr<VirtualFile> file;
   evhttp_request *req = nullptr;
+  TokenBucket *throttle = nullptr;
+  event *timer = nullptr;  // for waiting on |throttle|; created on demand.
 };
 
+void ServeChunkCallback(evhttp_connection *con, void *arg);
+
+void ServeTimerCallback(evutil_socket_t, short, void *arg) {
+  auto *serve = reinterpret_cast<ServeInProgress *>(arg);
+  ServeChunkCallback(evhttp_request_get_connection(serve->req), serve);
+}
+
 void ServeCloseCallback(evhttp_connection *con, void *arg) {
   std::unique_ptr<ServeInProgress> serve(
       reinterpret_cast<ServeInProgress *>(arg));
@@ -84,6 +100,21 @@ void ServeChunkCallback(evhttp_connection *con, void *arg) {
     return;
   }
 
+  // Wait for the throttle, if necessary. If the client aborts meanwhile,
+  // ServeCloseCallback deletes the pending timer along with |serve|.
+  double delay = serve->throttle == nullptr ? 0 : serve->throttle->Delay();
+  if (delay > 0) {
+    if (serve->timer == nullptr) {
+      serve->timer = evtimer_new(evhttp_connection_get_base(con),
+                                 &ServeTimerCallback, serve.get());
+    }
+    struct timespec ts = SecToTimespec(delay);
+    struct timeval tv = {ts.tv_sec, ts.tv_nsec / 1000};
+    evtimer_add(serve->timer, &tv);
+    serve.release();
+    return;
+  }
+
   // Serve more data.
   EvBuffer buf;
   std::string error_message;
@@ -99,6 +130,9 @@ void ServeChunkCallback(evhttp_connection *con, void *arg) {
     return;
   }
 
+  if (serve->throttle != nullptr) {
+    serve->throttle->Take(added);
+  }
   serve->sent_bytes += added;
   serve->left.begin += added;
   VLOG(1) << serve->req << ": sending " << added << " bytes (more) data; still "
@@ -215,17 +249,52 @@ bool EvBuffer::AddFile(int fd, ev_off_t offset, ev_off_t length,
   return true;
 }
 
-void RealFileSlice::Init(File *dir, re2::StringPiece filename,
-                         ByteRange range) {
+void RealFileSlice::Init(File *dir, File *fallback_dir,
+                         re2::StringPiece filename, ByteRange range) {
   dir_ = dir;
+  fallback_dir_ = fallback_dir;
   filename_ = filename.as_string();
   range_ = range;
 }
 
+bool FileSlice::WriteRange(ByteRange range, int fd,
+                          std::string *error_message) const {
+  EvBuffer buf;
+  while (range.size() > 0) {
+    int64_t added = AddRange(range, &buf, error_message);
+    if (added <= 0) {
+      if (added == 0 && error_message->empty()) {
+        *error_message = StrCat("no progress writing range ", range.DebugString());
+      }
+      return false;
+    }
+    range.begin += added;
+    while (evbuffer_get_length(buf.get()) > 0) {
+      if (evbuffer_write(buf.get(), fd) < 0 && errno != EINTR) {
+        int err = errno;
+        *error_message = StrCat("write: ", strerror(err));
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int RealFileSlice::OpenFile(int *fd, File **dir) const {
+  *dir = dir_;
+  int ret = dir_->Open(filename_.c_str(), O_RDONLY, fd);
+  if (ret == ENOENT && fallback_dir_ != nullptr) {
+    *dir = fallback_dir_;
+    ret = fallback_dir_->Open(filename_.c_str(), O_RDONLY, fd);
+  }
+  return ret;
+}
+
 int64_t RealFileSlice::AddRange(ByteRange range, EvBuffer *buf,
                                 std::string *error_message) const {
   int fd;
-  int ret = dir_->Open(filename_.c_str(), O_RDONLY, &fd);
+  File *dir;
+  int ret = OpenFile(&fd, &dir);
   if (ret != 0) {
     *error_message = StrCat("open ", filename_, ": ", strerror(ret));
     return -1;
@@ -236,9 +305,29 @@ int64_t RealFileSlice::AddRange(ByteRange range, EvBuffer *buf,
     return -1;
   }
   // |buf| now owns |fd|.
+  dir->NoteRawRead(range.size());
   return range.size();
 }
 
+bool RealFileSlice::WriteRange(ByteRange range, int fd,
+                               std::string *error_message) const {
+  int in_fd;
+  File *dir;
+  int ret = OpenFile(&in_fd, &dir);
+  if (ret != 0) {
+    *error_message = StrCat("open ", filename_, ": ", strerror(ret));
+    return false;
+  }
+  ret = CopyFileRange(in_fd, range_.begin + range.begin, fd, range.size());
+  close(in_fd);
+  if (ret != 0) {
+    *error_message = StrCat("copy ", filename_, ": ", strerror(ret));
+    return false;
+  }
+  dir->NoteRawRead(range.size());
+  return true;
+}
+
 int64_t FillerFileSlice::AddRange(ByteRange range, EvBuffer *buf,
                                   std::string *error_message) const {
   std::unique_ptr<std::string> s(new std::string);
@@ -315,13 +404,36 @@ int64_t FileSlices::AddRange(ByteRange range, EvBuffer *buf,
   return total_bytes_added;
 }
 
+bool FileSlices::WriteRange(ByteRange range, int fd,
+                            std::string *error_message) const {
+  if (range.begin < 0 || range.begin > range.end || range.end > size_) {
+    *error_message = StrCat("Range ", range.DebugString(),
+                            " not valid for file of size ", size_);
+    return false;
+  }
+  auto it = std::upper_bound(slices_.begin(), slices_.end(), range.begin,
+                             [](int64_t begin, const SliceInfo &info) {
+                               return begin < info.range.end;
+                             });
+  for (; it != slices_.end() && range.end > it->range.begin; ++it) {
+    ByteRange mapped(
+        std::max(INT64_C(0), range.begin - it->range.begin),
+        std::min(range.end - it->range.begin, it->range.end - it->range.begin));
+    if (!it->slice->WriteRange(mapped, fd, error_message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void HttpSendError(evhttp_request *req, int http_err, const std::string &prefix,
                    int posix_err) {
   evhttp_send_error(req, http_err,
                     EscapeHtml(prefix + strerror(posix_err)).c_str());
 }
 
-void HttpServe(const std::shared_ptr<VirtualFile> &file, evhttp_request *req) {
+void HttpServe(const std::shared_ptr<VirtualFile> &file, evhttp_request *req,
+               TokenBucket *throttle) {
   // We could support HEAD, but there's probably no need.
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return evhttp_send_error(req, HTTP_BADMETHOD, "only GET allowed");
@@ -408,6 +520,7 @@ void HttpServe(const std::shared_ptr<VirtualFile> &file, evhttp_request *req) {
   serve->file = file;
   serve->left = left;
   serve->req = req;
+  serve->throttle = throttle;
   evhttp_connection *con = evhttp_request_get_connection(req);
   evhttp_connection_set_closecb(con, &ServeCloseCallback, serve);
   return ServeChunkCallback(con, serve);
@@ -52,6 +52,7 @@
 #include <re2/stringpiece.h>
 
 #include "filesystem.h"
+#include "io-priority.h"
 #include "string.h"
 
 namespace moonfire_nvr {
@@ -157,6 +158,16 @@ class FileSlice {
   // partial failures later.)
   virtual int64_t AddRange(ByteRange range, EvBuffer *buf,
                            std::string *error_message) const = 0;
+
+  // Write all of the given |range| to |fd|, at its current position.
+  // On success, returns true and advances the position of |fd| by
+  // range.size(). On failure, returns false and populates |error_message|;
+  // |fd| may have been partially written.
+  //
+  // The default implementation goes through AddRange. Slices backed by files
+  // override it to copy within the kernel instead; see CopyFileRange.
+  virtual bool WriteRange(ByteRange range, int fd,
+                          std::string *error_message) const;
 };
 
 class VirtualFile : public FileSlice {
@@ -172,15 +183,31 @@ class VirtualFile : public FileSlice {
 class RealFileSlice : public FileSlice {
  public:
   // |dir| must outlive the RealFileSlice.
-  void Init(File *dir, re2::StringPiece filename, ByteRange range);
+  void Init(File *dir, re2::StringPiece filename, ByteRange range) {
+    Init(dir, nullptr, filename, range);
+  }
+
+  // As above, but if |filename| does not exist in |dir|, it is opened from
+  // |fallback_dir| instead. This is used for sample files which may be moved
+  // between directories while being served; see design/schema.md.
+  // |dir| and |fallback_dir| (if non-null) must outlive the RealFileSlice.
+  void Init(File *dir, File *fallback_dir, re2::StringPiece filename,
+            ByteRange range);
 
   int64_t size() const final { return range_.size(); }
 
   int64_t AddRange(ByteRange range, EvBuffer *buf,
                    std::string *error_message) const final;
+  bool WriteRange(ByteRange range, int fd,
+                  std::string *error_message) const final;
 
  private:
+  // Open the file, trying |fallback_dir_| if necessary. On success, |*dir| is
+  // set to the directory it was opened from.
+  int OpenFile(int *fd, File **dir) const;
+
   File *dir_;
+  File *fallback_dir_;
   std::string filename_;
   ByteRange range_;
 };
@@ -253,6 +280,11 @@ class FileSlices : public FileSlice {
   int64_t AddRange(ByteRange range, EvBuffer *buf,
                    std::string *error_message) const final;
 
+  // Writes each slice in turn. kLazy has no effect here, as only one slice is
+  // in progress at a time anyway.
+  bool WriteRange(ByteRange range, int fd,
+                  std::string *error_message) const final;
+
   enum Flags {
     // kLazy, as an argument to Append, instructs the FileSlices to append
     // this slice in AddRange only if it is the first slice in the requested
@@ -288,7 +320,11 @@ class FileSlices : public FileSlice {
 // problematic, this interface may change to take advantage of
 // evbuffer_add_cb, adding buffers incrementally, and some mechanism will be
 // added to guarantee VirtualFile objects outlive the HTTP requests they serve.
-void HttpServe(const std::shared_ptr<VirtualFile> &file, evhttp_request *req);
+//
+// If |throttle| is non-null, it must outlive the request; each chunk is
+// added only once it's out of debt, and the chunk's bytes are then taken.
+void HttpServe(const std::shared_ptr<VirtualFile> &file, evhttp_request *req,
+               TokenBucket *throttle = nullptr);
 
 namespace internal {
 
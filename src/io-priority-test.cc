@@ -0,0 +1,106 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// io-priority-test.cc: tests of the io-priority.h interface.
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "io-priority.h"
+#include "time.h"
+
+DECLARE_bool(alsologtostderr);
+
+namespace moonfire_nvr {
+namespace {
+
+long GetIoprio() { return syscall(SYS_ioprio_get, 1, 0); }
+
+TEST(IoPriorityTest, ScopedIoClassRestores) {
+  ASSERT_EQ(0, SetThreadIoClass(IoClass::kRecording));
+  long recording = GetIoprio();
+  {
+    ScopedIoClass scoped(IoClass::kScrubbing);
+    EXPECT_NE(recording, GetIoprio());
+  }
+  EXPECT_EQ(recording, GetIoprio());
+}
+
+TEST(TokenBucketTest, Debt) {
+  SimulatedClock clock;
+  TokenBucket bucket(&clock, 100, 50);
+
+  // The bucket starts full, and a single use can exceed it.
+  EXPECT_EQ(0, bucket.Delay());
+  bucket.Take(250);
+  EXPECT_DOUBLE_EQ(2, bucket.Delay());
+  clock.Sleep({1, 0});
+  EXPECT_DOUBLE_EQ(1, bucket.Delay());
+
+  // Acquire waits out the debt, then takes.
+  bucket.Acquire(100);
+  EXPECT_EQ(2, clock.Now().tv_sec);
+  EXPECT_DOUBLE_EQ(1, bucket.Delay());
+
+  // Idle time refills only up to the burst size.
+  clock.Sleep({100, 0});
+  bucket.Take(50);
+  EXPECT_EQ(0, bucket.Delay());
+  bucket.Take(1);
+  EXPECT_DOUBLE_EQ(0.01, bucket.Delay());
+}
+
+TEST(IoThrottleTest, Limits) {
+  SimulatedClock clock;
+  IoThrottle throttle(&clock);
+  throttle.SetLimit(IoClass::kServing, 1000);
+  throttle.SetLimit(IoClass::kMaintenance, 0);
+  EXPECT_EQ(nullptr, throttle.bucket(IoClass::kRecording));
+  EXPECT_EQ(nullptr, throttle.bucket(IoClass::kMaintenance));
+  ASSERT_NE(nullptr, throttle.bucket(IoClass::kServing));
+  throttle.bucket(IoClass::kServing)->Take(3000);
+  EXPECT_DOUBLE_EQ(2, throttle.bucket(IoClass::kServing)->Delay());
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,159 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// io-priority.cc: implementation of io-priority.h interface.
+
+#include "io-priority.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace moonfire_nvr {
+
+namespace {
+
+// From linux/ioprio.h, which older distributions don't install.
+const int kIoprioClassShift = 13;
+const int kIoprioClassBestEffort = 2;
+const int kIoprioClassIdle = 3;
+const int kIoprioWhoProcess = 1;  // with who = 0, the calling thread.
+
+int IoprioValue(IoClass io_class) {
+  switch (io_class) {
+    case IoClass::kRecording:
+      return (kIoprioClassBestEffort << kIoprioClassShift) | 0;
+    case IoClass::kServing:
+      return (kIoprioClassBestEffort << kIoprioClassShift) | 4;
+    case IoClass::kRetention:
+      return (kIoprioClassBestEffort << kIoprioClassShift) | 6;
+    case IoClass::kMaintenance:
+      return (kIoprioClassBestEffort << kIoprioClassShift) | 7;
+    case IoClass::kScrubbing:
+    case IoClass::kNumClasses:
+      break;
+  }
+  return kIoprioClassIdle << kIoprioClassShift;
+}
+
+int SetIoprio(int value) {
+  return syscall(SYS_ioprio_set, kIoprioWhoProcess, 0, value) < 0 ? errno : 0;
+}
+
+}  // namespace
+
+const char *IoClassName(IoClass io_class) {
+  switch (io_class) {
+    case IoClass::kRecording:
+      return "recording";
+    case IoClass::kServing:
+      return "serving";
+    case IoClass::kRetention:
+      return "retention";
+    case IoClass::kMaintenance:
+      return "maintenance";
+    case IoClass::kScrubbing:
+      return "scrubbing";
+    case IoClass::kNumClasses:
+      break;
+  }
+  return "unknown";
+}
+
+int SetThreadIoClass(IoClass io_class) {
+  int ret = SetIoprio(IoprioValue(io_class));
+  if (ret != 0) {
+    LOG(WARNING) << "Unable to set I/O priority for " << IoClassName(io_class)
+                 << ": " << strerror(ret);
+  }
+  return ret;
+}
+
+ScopedIoClass::ScopedIoClass(IoClass io_class) {
+  long saved = syscall(SYS_ioprio_get, kIoprioWhoProcess, 0);
+  if (saved >= 0 && SetThreadIoClass(io_class) == 0) {
+    saved_ = static_cast<int>(saved);
+  }
+}
+
+ScopedIoClass::~ScopedIoClass() {
+  if (saved_ >= 0) {
+    SetIoprio(saved_);
+  }
+}
+
+TokenBucket::TokenBucket(WallClock *clock, double rate, double burst)
+    : clock_(clock),
+      rate_(rate),
+      burst_(burst),
+      tokens_(burst),
+      last_sec_(TimespecToSec(clock->Now())) {
+  CHECK_GT(rate, 0);
+}
+
+void TokenBucket::Refill(double now) {
+  if (now > last_sec_) {
+    tokens_ = std::min(burst_, tokens_ + (now - last_sec_) * rate_);
+    last_sec_ = now;
+  }
+}
+
+double TokenBucket::Delay() {
+  std::lock_guard<std::mutex> lock(mu_);
+  Refill(TimespecToSec(clock_->Now()));
+  return tokens_ < 0 ? -tokens_ / rate_ : 0;
+}
+
+void TokenBucket::Take(double n) {
+  std::lock_guard<std::mutex> lock(mu_);
+  Refill(TimespecToSec(clock_->Now()));
+  tokens_ -= n;
+}
+
+void TokenBucket::Acquire(double n) {
+  double delay;
+  while ((delay = Delay()) > 0) {
+    clock_->Sleep(SecToTimespec(delay));
+  }
+  Take(n);
+}
+
+void IoThrottle::SetLimit(IoClass io_class, double bytes_per_sec) {
+  buckets_[static_cast<int>(io_class)].reset(
+      bytes_per_sec > 0 ? new TokenBucket(clock_, bytes_per_sec, bytes_per_sec)
+                        : nullptr);
+}
+
+}  // namespace moonfire_nvr
@@ -0,0 +1,140 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// io-priority.h: prioritization of sample file I/O by class.
+
+#ifndef MOONFIRE_NVR_IO_PRIORITY_H
+#define MOONFIRE_NVR_IO_PRIORITY_H
+
+#include <memory>
+#include <mutex>
+
+#include "time.h"
+
+namespace moonfire_nvr {
+
+// The classes of sample file I/O, in decreasing order of priority. Recording
+// comes first: video which isn't written as it arrives is lost, while all the
+// others can wait.
+enum class IoClass {
+  kRecording = 0,  // writing recordings as they're captured.
+  kServing,        // reading recordings for playback and export.
+  kRetention,      // unlinking old recordings.
+  kMaintenance,    // moving recordings to the cold tier and thinning them.
+  kScrubbing,      // verifying sample files against their hashes.
+  kNumClasses
+};
+
+const char *IoClassName(IoClass io_class);
+
+// Set the kernel I/O priority of the calling thread to that of |io_class|
+// via ioprio_set(2), returning 0 on success or errno>0 on failure. Recording
+// gets the highest best-effort priority and scrubbing the idle class, which
+// is served only when the disk is otherwise unused. (The real-time class
+// would need CAP_SYS_ADMIN and could starve everything else.) Note that only
+// the BFQ and CFQ I/O schedulers honor these priorities; IoThrottle limits
+// the lower classes regardless of the scheduler.
+int SetThreadIoClass(IoClass io_class);
+
+// Sets the calling thread's I/O class for its lifetime, then restores the
+// previous priority. For work of one class done on a thread which otherwise
+// does another, such as a stream's thread unlinking old recordings.
+class ScopedIoClass {
+ public:
+  explicit ScopedIoClass(IoClass io_class);
+  ScopedIoClass(const ScopedIoClass &) = delete;
+  void operator=(const ScopedIoClass &) = delete;
+  ~ScopedIoClass();
+
+ private:
+  int saved_ = -1;  // the previous raw ioprio value, or -1 if unknown.
+};
+
+// Limits the average rate of some use, such as bytes read, while allowing
+// bursts. A single use may exceed the bucket's balance, putting it into
+// debt; later uses wait until the debt is repaid. Thread-safe.
+class TokenBucket {
+ public:
+  // |clock| must outlive the TokenBucket. Tokens accumulate at |rate| per
+  // second, up to |burst|; the bucket starts full. |rate| must be positive.
+  TokenBucket(WallClock *clock, double rate, double burst);
+  TokenBucket(const TokenBucket &) = delete;
+  void operator=(const TokenBucket &) = delete;
+
+  // Returns the seconds until the bucket is out of debt, or 0 if it isn't.
+  double Delay();
+
+  // Take |n| tokens immediately, going into debt if necessary.
+  void Take(double n);
+
+  // Sleep until the bucket is out of debt, then take |n| tokens.
+  void Acquire(double n);
+
+ private:
+  // Add the tokens accumulated since |last_sec_|. Call with |mu_| held.
+  void Refill(double now);
+
+  WallClock *const clock_;
+  const double rate_;
+  const double burst_;
+
+  std::mutex mu_;
+  double tokens_;    // protected by mu_.
+  double last_sec_;  // protected by mu_.
+};
+
+// Per-class limits on the bytes per second of sample file I/O. Recording
+// should be left unlimited. Thread-safe after setup.
+class IoThrottle {
+ public:
+  // |clock| must outlive the IoThrottle.
+  explicit IoThrottle(WallClock *clock) : clock_(clock) {}
+  IoThrottle(const IoThrottle &) = delete;
+  void operator=(const IoThrottle &) = delete;
+
+  // Limit |io_class| to |bytes_per_sec|, allowing bursts of up to a second's
+  // worth. If |bytes_per_sec| is not positive, the class is unlimited. Call
+  // before any concurrent use.
+  void SetLimit(IoClass io_class, double bytes_per_sec);
+
+  // Returns the bucket limiting |io_class|, or nullptr if it's unlimited.
+  TokenBucket *bucket(IoClass io_class) const {
+    return buckets_[static_cast<int>(io_class)].get();
+  }
+
+ private:
+  WallClock *const clock_;
+  std::unique_ptr<TokenBucket>
+      buckets_[static_cast<int>(IoClass::kNumClasses)];
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_IO_PRIORITY_H
@@ -0,0 +1,170 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// key-frame-cache-test.cc: tests of the key-frame-cache.h interface.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "key-frame-cache.h"
+#include "recording.h"
+
+DECLARE_bool(alsologtostderr);
+
+namespace moonfire_nvr {
+namespace {
+
+// Returns a recording with |key_frames| key frames, each followed by a
+// non-key frame.
+Recording MakeRecording(int64_t id, int key_frames) {
+  Recording recording;
+  recording.id = id;
+  recording.sample_file_uuid = GetRealUuidGenerator()->Generate();
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 0);
+  for (int i = 0; i < key_frames; ++i) {
+    encoder.AddSample(10, 1000, true);
+    encoder.AddSample(10, 10, false);
+  }
+  encoder.Flush();
+  return recording;
+}
+
+size_t TableBytes(const Recording &recording) {
+  KeyFrameTable table;
+  std::string error_message;
+  CHECK(table.Init(recording.video_index, &error_message)) << error_message;
+  return table.bytes();
+}
+
+TEST(KeyFrameCacheTest, HitsAndMisses) {
+  KeyFrameCache cache(1 << 20);
+  Recording recording = MakeRecording(1, 3);
+  std::string error_message;
+  auto table = cache.Get(recording, &error_message);
+  ASSERT_TRUE(table != nullptr) << error_message;
+  ASSERT_EQ(3u, table->entries().size());
+  EXPECT_EQ(20, table->entries()[1].start_90k);
+  EXPECT_EQ(2, table->entries()[1].sample_num);
+  EXPECT_EQ(1010, table->entries()[1].pos);
+  EXPECT_EQ(0, cache.hits());
+  EXPECT_EQ(1, cache.misses());
+
+  EXPECT_EQ(table, cache.Get(recording, &error_message));
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_EQ(TableBytes(recording), cache.bytes());
+
+  cache.Erase(1);
+  EXPECT_EQ(0u, cache.size());
+  EXPECT_EQ(0u, cache.bytes());
+  ASSERT_TRUE(cache.Get(recording, &error_message) != nullptr);
+  EXPECT_EQ(2, cache.misses());
+}
+
+TEST(KeyFrameCacheTest, Insert) {
+  KeyFrameCache cache(1 << 20);
+  Recording recording = MakeRecording(1, 3);
+  std::string error_message;
+  ASSERT_TRUE(cache.Insert(recording, &error_message)) << error_message;
+  ASSERT_TRUE(cache.Get(recording, &error_message) != nullptr);
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(0, cache.misses());
+
+  recording.video_index = std::string("\x00\x00\x01", 3);
+  EXPECT_FALSE(cache.Insert(recording, &error_message));
+  EXPECT_EQ("bad video index header", error_message);
+}
+
+TEST(KeyFrameCacheTest, RebuildsChangedRecording) {
+  KeyFrameCache cache(1 << 20);
+  Recording recording = MakeRecording(1, 3);
+  std::string error_message;
+  ASSERT_TRUE(cache.Insert(recording, &error_message)) << error_message;
+
+  // Thinning rewrites the recording under a new sample file uuid.
+  Recording thinned = MakeRecording(1, 2);
+  auto table = cache.Get(thinned, &error_message);
+  ASSERT_TRUE(table != nullptr) << error_message;
+  EXPECT_EQ(2u, table->entries().size());
+  EXPECT_EQ(1, cache.misses());
+  EXPECT_EQ(1u, cache.size());
+  EXPECT_EQ(TableBytes(thinned), cache.bytes());
+
+  // Truncation keeps the uuid but shortens the index.
+  Recording truncated = MakeRecording(1, 1);
+  truncated.sample_file_uuid = thinned.sample_file_uuid;
+  table = cache.Get(truncated, &error_message);
+  ASSERT_TRUE(table != nullptr) << error_message;
+  EXPECT_EQ(1u, table->entries().size());
+  EXPECT_EQ(2, cache.misses());
+}
+
+TEST(KeyFrameCacheTest, EvictsLeastRecentlyUsed) {
+  Recording recordings[] = {MakeRecording(1, 10), MakeRecording(2, 10),
+                            MakeRecording(3, 10)};
+  size_t table_bytes = TableBytes(recordings[0]);
+  KeyFrameCache cache(2 * table_bytes);
+  std::string error_message;
+  for (const auto &recording : recordings) {
+    ASSERT_TRUE(cache.Insert(recording, &error_message)) << error_message;
+  }
+  EXPECT_EQ(2u, cache.size());
+  EXPECT_EQ(2 * table_bytes, cache.bytes());
+
+  // 1 was evicted. Using 2 makes 3 the least recently used, so re-adding 1
+  // evicts 3.
+  ASSERT_TRUE(cache.Get(recordings[1], &error_message) != nullptr);
+  EXPECT_EQ(1, cache.hits());
+  ASSERT_TRUE(cache.Get(recordings[0], &error_message) != nullptr);
+  EXPECT_EQ(1, cache.misses());
+  ASSERT_TRUE(cache.Get(recordings[1], &error_message) != nullptr);
+  EXPECT_EQ(2, cache.hits());
+  ASSERT_TRUE(cache.Get(recordings[2], &error_message) != nullptr);
+  EXPECT_EQ(2, cache.misses());
+
+  // A table larger than the whole cache isn't kept.
+  KeyFrameCache tiny(table_bytes - 1);
+  ASSERT_TRUE(tiny.Insert(recordings[0], &error_message)) << error_message;
+  EXPECT_EQ(0u, tiny.size());
+  EXPECT_EQ(0u, tiny.bytes());
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,141 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// key-frame-cache.cc: see key-frame-cache.h.
+
+#include "key-frame-cache.h"
+
+namespace moonfire_nvr {
+
+std::shared_ptr<const KeyFrameTable> KeyFrameCache::Get(
+    const Recording &recording, std::string *error_message) {
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = by_id_.find(recording.id);
+    if (it != by_id_.end()) {
+      const Entry &entry = *it->second;
+      if (entry.sample_file_uuid == recording.sample_file_uuid &&
+          entry.video_index_bytes == recording.video_index.size()) {
+        ++hits_;
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return entry.table;
+      }
+      EraseLocked(it);
+    }
+    ++misses_;
+  }
+
+  Entry entry;
+  if (!Build(recording, &entry, error_message)) {
+    return nullptr;
+  }
+  std::shared_ptr<const KeyFrameTable> table = entry.table;
+  std::lock_guard<std::mutex> lock(mu_);
+  PutLocked(std::move(entry));
+  return table;
+}
+
+bool KeyFrameCache::Insert(const Recording &recording,
+                           std::string *error_message) {
+  Entry entry;
+  if (!Build(recording, &entry, error_message)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mu_);
+  PutLocked(std::move(entry));
+  return true;
+}
+
+void KeyFrameCache::Erase(int64_t recording_id) {
+  std::lock_guard<std::mutex> lock(mu_);
+  auto it = by_id_.find(recording_id);
+  if (it != by_id_.end()) {
+    EraseLocked(it);
+  }
+}
+
+size_t KeyFrameCache::bytes() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return bytes_;
+}
+
+size_t KeyFrameCache::size() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return lru_.size();
+}
+
+int64_t KeyFrameCache::hits() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return hits_;
+}
+
+int64_t KeyFrameCache::misses() const {
+  std::lock_guard<std::mutex> lock(mu_);
+  return misses_;
+}
+
+bool KeyFrameCache::Build(const Recording &recording, Entry *entry,
+                          std::string *error_message) {
+  auto table = std::make_shared<KeyFrameTable>();
+  if (!table->Init(recording.video_index, error_message)) {
+    return false;
+  }
+  entry->recording_id = recording.id;
+  entry->sample_file_uuid = recording.sample_file_uuid;
+  entry->video_index_bytes = recording.video_index.size();
+  entry->table = std::move(table);
+  return true;
+}
+
+void KeyFrameCache::PutLocked(Entry entry) {
+  auto it = by_id_.find(entry.recording_id);
+  if (it != by_id_.end()) {
+    EraseLocked(it);
+  }
+  size_t entry_bytes = entry.table->bytes();
+  if (entry_bytes > max_bytes_) {
+    return;
+  }
+  while (bytes_ + entry_bytes > max_bytes_) {
+    EraseLocked(by_id_.find(lru_.back().recording_id));
+  }
+  bytes_ += entry_bytes;
+  lru_.push_front(std::move(entry));
+  by_id_[lru_.front().recording_id] = lru_.begin();
+}
+
+void KeyFrameCache::EraseLocked(
+    std::map<int64_t, std::list<Entry>::iterator>::iterator it) {
+  bytes_ -= it->second->table->bytes();
+  lru_.erase(it->second);
+  by_id_.erase(it);
+}
+
+}  // namespace moonfire_nvr
@@ -0,0 +1,115 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// key-frame-cache.h: in-memory cache of recordings' key frame tables.
+
+#ifndef MOONFIRE_NVR_KEY_FRAME_CACHE_H
+#define MOONFIRE_NVR_KEY_FRAME_CACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "recording.h"
+#include "uuid.h"
+
+namespace moonfire_nvr {
+
+// A least-recently-used cache mapping recording ids to KeyFrameTables,
+// bounded by their total size. Seeking within a recording (as for the start
+// and end of a .mp4 file's range) can then skip parsing its video index's
+// checkpoints or, for a version 1 index, decoding every sample.
+//
+// Recent video is viewed most, so MoonfireDatabase fills the cache as it
+// inserts recordings; others are added on first use.
+//
+// Thread-safe.
+class KeyFrameCache {
+ public:
+  explicit KeyFrameCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+  KeyFrameCache(const KeyFrameCache &) = delete;
+  void operator=(const KeyFrameCache &) = delete;
+
+  // Returns the key frames of |recording|, building the table from its
+  // |video_index| on a miss. A cached table is used only if it was built for
+  // the same sample file and index length, so a recording which has been
+  // thinned or truncated since is rebuilt. On failure, returns nullptr.
+  std::shared_ptr<const KeyFrameTable> Get(const Recording &recording,
+                                           std::string *error_message);
+
+  // Builds and caches the key frames of |recording|, replacing any previous
+  // table.
+  bool Insert(const Recording &recording, std::string *error_message);
+
+  // Removes the table of |recording_id|, if any.
+  void Erase(int64_t recording_id);
+
+  // Statistics, for testing and monitoring.
+  size_t bytes() const;
+  size_t size() const;
+  int64_t hits() const;
+  int64_t misses() const;
+
+ private:
+  struct Entry {
+    int64_t recording_id;
+    Uuid sample_file_uuid;
+    size_t video_index_bytes;
+    std::shared_ptr<const KeyFrameTable> table;
+  };
+
+  // Builds an entry for |recording| without holding |mu_|.
+  static bool Build(const Recording &recording, Entry *entry,
+                    std::string *error_message);
+
+  // Adds |entry| as most recently used, replacing any entry for the same
+  // recording and evicting the least recently used to stay within
+  // |max_bytes_|.
+  void PutLocked(Entry entry);
+
+  void EraseLocked(std::map<int64_t, std::list<Entry>::iterator>::iterator it);
+
+  const size_t max_bytes_;
+
+  mutable std::mutex mu_;  // protects below fields.
+  std::list<Entry> lru_;   // most recently used first.
+  std::map<int64_t, std::list<Entry>::iterator> by_id_;
+  size_t bytes_ = 0;
+  int64_t hits_ = 0;
+  int64_t misses_ = 0;
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_KEY_FRAME_CACHE_H
@@ -28,6 +28,8 @@
 //
 // moonfire-db-test.cc: tests of the moonfire-db.h interface.
 
+#include <chrono>
+#include <future>
 #include <string>
 
 #include <gflags/gflags.h>
@@ -199,8 +201,10 @@ class MoonfireDbTest : public testing::Test {
 
           EXPECT_EQ(recording.id, some_recording.id);
           EXPECT_EQ(recording.camera_id, some_recording.camera_id);
-          EXPECT_EQ(recording.sample_file_sha1,
-                    some_recording.sample_file_sha1);
+          EXPECT_EQ(recording.sample_file_hash,
+                    some_recording.sample_file_hash);
+          EXPECT_TRUE(recording.sample_file_hash_algorithm ==
+                      some_recording.sample_file_hash_algorithm);
           EXPECT_EQ(recording.sample_file_uuid,
                     some_recording.sample_file_uuid);
           EXPECT_EQ(recording.video_sample_entry_id,
@@ -213,6 +217,8 @@ class MoonfireDbTest : public testing::Test {
           EXPECT_EQ(recording.video_sync_samples,
                     some_recording.video_sync_samples);
           EXPECT_EQ(recording.video_index, some_recording.video_index);
+          EXPECT_TRUE(recording.sample_file_tier ==
+                      some_recording.sample_file_tier);
 
           EXPECT_EQ(entry.id, some_entry.id);
           EXPECT_EQ(entry.sha1, some_entry.sha1);
@@ -304,13 +310,17 @@ TEST_F(MoonfireDbTest, FullLifecycle) {
   SampleIndexEncoder encoder;
   encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
   encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
 
   // Inserting a recording should succeed and remove its uuid from the
   // reserved table.
   ASSERT_FALSE(mdb_->InsertRecording(&recording, &error_message));
   EXPECT_THAT(error_message, testing::HasSubstr("not reserved"));
   recording.sample_file_uuid = uuids.back();
-  recording.sample_file_sha1.resize(20);
+  recording.sample_file_hash_algorithm = HashAlgorithm::kXxh3_128;
+  recording.sample_file_hash.resize(20);  // the wrong length for XXH3-128.
+  ASSERT_FALSE(mdb_->InsertRecording(&recording, &error_message));
+  recording.sample_file_hash.resize(16);
   ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
       << error_message;
   ASSERT_GT(recording.id, 0);
@@ -328,17 +338,38 @@ TEST_F(MoonfireDbTest, FullLifecycle) {
   ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
   ExpectSingleRecording(camera_uuid, recording, entry, &oldest);
 
+  // ...even if the camera's aggregates must be recomputed, which should also
+  // restore its camera_stats row.
+  {
+    DatabaseContext ctx(&db_);
+    auto run = ctx.UseOnce("delete from camera_stats;");
+    ASSERT_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  }
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  ExpectSingleRecording(camera_uuid, recording, entry, &oldest);
+  std::vector<CameraStatsRow> stats;
+  ASSERT_TRUE(mdb_->ListCameraStats(&stats, &error_message)) << error_message;
+  ASSERT_EQ(1u, stats.size());
+  EXPECT_TRUE(stats[0].present);
+  EXPECT_EQ(recording.start_time_90k, stats[0].min_start_time_90k);
+  EXPECT_EQ(recording.end_time_90k, stats[0].max_end_time_90k);
+  EXPECT_EQ(recording.sample_file_bytes, stats[0].total_sample_file_bytes);
+
   // Deleting a recording should succeed, update the min/max times, and mark
   // the uuid as reserved.
   std::vector<ListOldestSampleFilesRow> to_delete;
   to_delete.push_back(oldest);
-  ASSERT_TRUE(mdb_->DeleteRecordings(to_delete, &error_message))
+  ASSERT_TRUE(mdb_->DeleteRecordings(&to_delete, &error_message))
       << error_message;
   EXPECT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
       << error_message;
   EXPECT_THAT(reserved, testing::UnorderedElementsAre(uuids[0], uuids[1]));
   LOG(INFO) << "after delete";
   ExpectNoRecordings(camera_uuid);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  ExpectNoRecordings(camera_uuid);
 
   EXPECT_TRUE(mdb_->MarkSampleFilesDeleted(uuids, &error_message))
       << error_message;
@@ -347,6 +378,993 @@ TEST_F(MoonfireDbTest, FullLifecycle) {
   EXPECT_THAT(reserved, testing::IsEmpty());
 }
 
+// Test of moving a recording from the hot tier to the cold tier.
+TEST_F(MoonfireDbTest, MoveToCold) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
+  ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+      << error_message;
+
+  // The recording is only eligible once it ends before the given time.
+  std::vector<ListOldestSampleFilesRow> to_move;
+  auto row_cb = [&](const ListOldestSampleFilesRow &row) {
+    to_move.push_back(row);
+    return IterationControl::kContinue;
+  };
+  ASSERT_TRUE(mdb_->ListOldestHotSampleFiles(recording.end_time_90k, row_cb,
+                                             &error_message))
+      << error_message;
+  EXPECT_THAT(to_move, testing::IsEmpty());
+  ASSERT_TRUE(mdb_->ListOldestHotSampleFiles(recording.end_time_90k + 1,
+                                             row_cb, &error_message))
+      << error_message;
+  ASSERT_THAT(to_move, testing::SizeIs(1));
+  EXPECT_EQ(camera_id, to_move[0].camera_id);
+  EXPECT_EQ(recording.id, to_move[0].recording_id);
+  EXPECT_EQ(recording.sample_file_uuid, to_move[0].sample_file_uuid);
+
+  // While moving, the recording is neither eligible for moving again nor for
+  // deletion, and it's still served from the hot tier.
+  ASSERT_TRUE(mdb_->BeginMoveToCold(to_move, &error_message))
+      << error_message;
+  std::vector<ListReservedSampleFilesRow> reserved;
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  ASSERT_THAT(reserved, testing::SizeIs(1));
+  EXPECT_EQ(recording.sample_file_uuid, reserved[0].uuid);
+  EXPECT_TRUE(ReservationState::kMovingToCold == reserved[0].state);
+  std::vector<ListOldestSampleFilesRow> stale = to_move;
+  ASSERT_TRUE(mdb_->DeleteRecordings(&stale, &error_message))
+      << error_message;
+  EXPECT_THAT(stale, testing::IsEmpty());
+  int rows = 0;
+  ASSERT_TRUE(mdb_->ListOldestHotSampleFiles(
+      std::numeric_limits<int64_t>::max(),
+      [&](const ListOldestSampleFilesRow &row) {
+        ++rows;
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+  ASSERT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        ++rows;
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+  ASSERT_TRUE(mdb_->ListMp4Recordings(
+      camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+      [&](Recording &some_recording, const VideoSampleEntry &some_entry) {
+        ++rows;
+        EXPECT_TRUE(SampleFileTier::kHot == some_recording.sample_file_tier);
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(1, rows);
+
+  ASSERT_TRUE(mdb_->FinishMoveToCold(to_move, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  ASSERT_THAT(reserved, testing::SizeIs(1));
+  EXPECT_TRUE(ReservationState::kMovedToCold == reserved[0].state);
+  EXPECT_FALSE(mdb_->FinishMoveToCold(to_move, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("no hot-tier recording"));
+
+  ASSERT_TRUE(mdb_->MarkSampleFilesDeleted(uuids, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  EXPECT_THAT(reserved, testing::IsEmpty());
+
+  // The recording is now served from the cold tier, including after
+  // reloading from the database.
+  recording.sample_file_tier = SampleFileTier::kCold;
+  ListOldestSampleFilesRow oldest;
+  ExpectSingleRecording(camera_uuid, recording, entry, &oldest);
+  EXPECT_TRUE(SampleFileTier::kCold == oldest.sample_file_tier);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  ExpectSingleRecording(camera_uuid, recording, entry, &oldest);
+}
+
+// Test of storing recordings within a container.
+// Test of thinning a recording to key frames only.
+TEST_F(MoonfireDbTest, Thin) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  KeyFrameCache key_frame_cache(1 << 20);
+  mdb_->SetKeyFrameCache(&key_frame_cache);
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.AddSample(kTimeUnitsPerSecond, 10, false);
+  encoder.Flush();
+  ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+      << error_message;
+
+  // Its key frames are cached as it's inserted.
+  EXPECT_EQ(1u, key_frame_cache.size());
+  ASSERT_TRUE(key_frame_cache.Get(recording, &error_message) != nullptr)
+      << error_message;
+  EXPECT_EQ(1, key_frame_cache.hits());
+
+  // The recording is only eligible once it ends before the given time.
+  std::vector<Recording> to_thin;
+  auto row_cb = [&](Recording &row) {
+    to_thin.push_back(row);
+    return IterationControl::kContinue;
+  };
+  ASSERT_TRUE(mdb_->ListRecordingsToThin(camera_id, recording.end_time_90k,
+                                         row_cb, &error_message))
+      << error_message;
+  EXPECT_THAT(to_thin, testing::IsEmpty());
+  ASSERT_TRUE(mdb_->ListRecordingsToThin(camera_id, recording.end_time_90k + 1,
+                                         row_cb, &error_message))
+      << error_message;
+  ASSERT_THAT(to_thin, testing::SizeIs(1));
+  const Recording &original = to_thin[0];
+  EXPECT_EQ(recording.id, original.id);
+  EXPECT_EQ(recording.sample_file_uuid, original.sample_file_uuid);
+  EXPECT_EQ(recording.video_index, original.video_index);
+  EXPECT_EQ(recording.end_time_90k, original.end_time_90k);
+  EXPECT_EQ(52, original.sample_file_bytes);
+  ListOldestSampleFilesRow oldest;
+  ASSERT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        oldest = row;
+        return IterationControl::kBreak;
+      },
+      &error_message))
+      << error_message;
+
+  // While thinning, the recording is neither eligible for thinning again nor
+  // for deletion.
+  Uuid new_uuid;
+  ASSERT_TRUE(mdb_->BeginThin(original, &new_uuid, &error_message))
+      << error_message;
+  std::vector<ListReservedSampleFilesRow> reserved;
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  ASSERT_THAT(reserved, testing::SizeIs(2));
+  for (const auto &row : reserved) {
+    EXPECT_TRUE(row.uuid == original.sample_file_uuid
+                    ? row.state == ReservationState::kThinning
+                    : (row.uuid == new_uuid &&
+                       row.state == ReservationState::kWritingThinned));
+  }
+  to_thin.clear();
+  ASSERT_TRUE(mdb_->ListRecordingsToThin(camera_id,
+                                         std::numeric_limits<int64_t>::max(),
+                                         row_cb, &error_message))
+      << error_message;
+  EXPECT_THAT(to_thin, testing::IsEmpty());
+  int rows = 0;
+  ASSERT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        ++rows;
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+
+  Recording thinned;
+  thinned.id = recording.id;
+  thinned.camera_id = camera_id;
+  thinned.sample_file_uuid = new_uuid;
+  thinned.sample_file_hash.resize(16);
+  thinned.sample_file_hash_algorithm = HashAlgorithm::kXxh3_128;
+  thinned.video_sample_entry_id = entry.id;
+  encoder.Init(&thinned, recording.start_time_90k);
+  encoder.AddSample(2 * kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
+  ASSERT_TRUE(mdb_->FinishThin(recording, thinned, &error_message))
+      << error_message;
+  EXPECT_EQ(0u, key_frame_cache.size());
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  ASSERT_THAT(reserved, testing::SizeIs(1));
+  EXPECT_EQ(original.sample_file_uuid, reserved[0].uuid);
+  EXPECT_TRUE(ReservationState::kDeleting == reserved[0].state);
+  EXPECT_FALSE(mdb_->FinishThin(recording, thinned, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("has changed"));
+  ASSERT_TRUE(mdb_->MarkSampleFilesDeleted({original.sample_file_uuid},
+                                           &error_message))
+      << error_message;
+
+  // A deletion listed before thinning no longer matches the recording.
+  std::vector<ListOldestSampleFilesRow> stale = {oldest};
+  EXPECT_FALSE(mdb_->DeleteRecordings(&stale, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("no such recording"));
+
+  // The thinned copy is served instead, including after reloading from the
+  // database, and the camera's total size shrinks to match.
+  ExpectSingleRecording(camera_uuid, thinned, entry, &oldest);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  ExpectSingleRecording(camera_uuid, thinned, entry, &oldest);
+}
+
+TEST_F(MoonfireDbTest, Journal) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(2, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(2)) << error_message;
+  const int64_t start_time_90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  Recording prefix = recording;
+  prefix.sample_file_hash.clear();
+  SampleIndexEncoder encoder;
+  encoder.Init(&prefix, start_time_90k);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
+  encoder.Init(&recording, start_time_90k);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.AddSample(kTimeUnitsPerSecond, 10, false);
+  encoder.Flush();
+
+  // A sync while writing journals the durable prefix; completing the
+  // recording without a sync keeps it.
+  ASSERT_TRUE(mdb_->UpdateJournal({}, &prefix, &error_message))
+      << error_message;
+  std::vector<ListJournalRow> journal;
+  ASSERT_TRUE(mdb_->ListJournal(&journal, &error_message)) << error_message;
+  ASSERT_THAT(journal, testing::SizeIs(1));
+  EXPECT_EQ(-1, journal[0].prefix.id);
+  EXPECT_EQ(42, journal[0].prefix.sample_file_bytes);
+  ASSERT_TRUE(mdb_->InsertUnsyncedRecording(&recording, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListJournal(&journal, &error_message)) << error_message;
+  ASSERT_THAT(journal, testing::SizeIs(1));
+  EXPECT_EQ(recording.id, journal[0].prefix.id);
+  EXPECT_EQ(recording.sample_file_uuid, journal[0].prefix.sample_file_uuid);
+  EXPECT_EQ(prefix.end_time_90k, journal[0].prefix.end_time_90k);
+  EXPECT_EQ(prefix.video_index, journal[0].prefix.video_index);
+  EXPECT_EQ(52, journal[0].recording_bytes);
+  EXPECT_EQ(2 * kTimeUnitsPerSecond, journal[0].recording_duration_90k);
+  EXPECT_EQ(recording.sample_file_hash, journal[0].recording_hash);
+
+  // Unsynced recordings can't be moved to the cold tier or thinned.
+  int rows = 0;
+  ASSERT_TRUE(mdb_->ListOldestHotSampleFiles(
+      std::numeric_limits<int64_t>::max(),
+      [&](const ListOldestSampleFilesRow &row) {
+        ++rows;
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+  ASSERT_TRUE(mdb_->ListRecordingsToThin(
+      camera_id, std::numeric_limits<int64_t>::max(),
+      [&](Recording &row) {
+        ++rows;
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+
+  // Recovery shrinks the recording to its prefix.
+  ListJournalRow &row = journal[0];
+  row.prefix.sample_file_hash.assign(20, 'x');
+  ASSERT_TRUE(mdb_->RecoverJournaledRecording(&row, &error_message))
+      << error_message;
+  Recording expected = recording;
+  expected.sample_file_hash = row.prefix.sample_file_hash;
+  expected.end_time_90k = prefix.end_time_90k;
+  expected.sample_file_bytes = prefix.sample_file_bytes;
+  expected.video_samples = prefix.video_samples;
+  expected.video_sync_samples = prefix.video_sync_samples;
+  expected.video_index = prefix.video_index;
+  ListOldestSampleFilesRow oldest;
+  ExpectSingleRecording(camera_uuid, expected, entry, &oldest);
+  ASSERT_TRUE(mdb_->ListJournal(&journal, &error_message)) << error_message;
+  EXPECT_THAT(journal, testing::IsEmpty());
+
+  // An in-progress sample file's prefix is inserted on recovery; a synced
+  // one is simply unjournaled.
+  prefix.sample_file_uuid = uuids[1];
+  prefix.start_time_90k += 10 * kTimeUnitsPerSecond;
+  prefix.end_time_90k += 10 * kTimeUnitsPerSecond;
+  ASSERT_TRUE(mdb_->UpdateJournal({}, &prefix, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListJournal(&journal, &error_message)) << error_message;
+  ASSERT_THAT(journal, testing::SizeIs(1));
+  journal[0].prefix.sample_file_hash.assign(20, 'y');
+  ASSERT_TRUE(mdb_->RecoverJournaledRecording(&journal[0], &error_message))
+      << error_message;
+  EXPECT_NE(-1, journal[0].prefix.id);
+  std::vector<ListReservedSampleFilesRow> reserved;
+  ASSERT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  EXPECT_THAT(reserved, testing::IsEmpty());
+  ASSERT_TRUE(mdb_->UpdateJournal({uuids[1]}, nullptr, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListJournal(&journal, &error_message)) << error_message;
+  EXPECT_THAT(journal, testing::IsEmpty());
+}
+
+TEST_F(MoonfireDbTest, Containers) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  ContainerRow container;
+  bool found = true;
+  ASSERT_TRUE(mdb_->GetNewestContainer(camera_uuid, &container, &found,
+                                       &error_message))
+      << error_message;
+  EXPECT_FALSE(found);
+
+  // Inserting a container should remove its uuid from the reserved table.
+  container.uuid = GetRealUuidGenerator()->Generate();
+  container.size_bytes = 1 << 20;
+  ASSERT_FALSE(mdb_->InsertContainer(camera_id, &container, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("not reserved"));
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  container.uuid = uuids[0];
+  ASSERT_TRUE(mdb_->InsertContainer(camera_id, &container, &error_message))
+      << error_message;
+  ASSERT_GT(container.id, 0);
+  std::vector<Uuid> reserved;
+  EXPECT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  EXPECT_THAT(reserved, testing::IsEmpty());
+
+  // Append two recordings, which aren't individually reserved.
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = container.uuid;
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  recording.container_id = container.id;
+  SampleIndexEncoder encoder;
+  int64_t start_time_90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  for (int i = 0; i < 2; ++i) {
+    recording.id = -1;
+    recording.sample_file_offset = 42 * i;
+    encoder.Init(&recording, start_time_90k + i * kTimeUnitsPerSecond);
+    encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+    encoder.Flush();
+    ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+        << error_message;
+  }
+
+  ASSERT_TRUE(mdb_->GetNewestContainer(camera_uuid, &container, &found,
+                                       &error_message))
+      << error_message;
+  EXPECT_TRUE(found);
+  EXPECT_EQ(uuids[0], container.uuid);
+  EXPECT_EQ(1 << 20, container.size_bytes);
+  EXPECT_EQ(84, container.used_bytes);
+  std::vector<ContainerRow> containers;
+  ASSERT_TRUE(mdb_->ListContainers(&containers, &error_message))
+      << error_message;
+  ASSERT_EQ(1, containers.size());
+  EXPECT_EQ(container.id, containers[0].id);
+  EXPECT_EQ(container.uuid, containers[0].uuid);
+  EXPECT_EQ(84, containers[0].used_bytes);
+
+  std::vector<int64_t> offsets;
+  ASSERT_TRUE(mdb_->ListMp4Recordings(
+      camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+      [&](Recording &some_recording, const VideoSampleEntry &some_entry) {
+        EXPECT_EQ(container.id, some_recording.container_id);
+        EXPECT_EQ(container.uuid, some_recording.sample_file_uuid);
+        offsets.push_back(some_recording.sample_file_offset);
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_THAT(offsets, testing::ElementsAre(0, 42));
+
+  // Recordings within containers aren't deleted or moved individually.
+  int rows = 0;
+  auto count_cb = [&](const ListOldestSampleFilesRow &row) {
+    ++rows;
+    return IterationControl::kContinue;
+  };
+  ASSERT_TRUE(
+      mdb_->ListOldestSampleFiles(camera_uuid, count_cb, &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->ListOldestHotSampleFiles(
+      std::numeric_limits<int64_t>::max(), count_cb, &error_message))
+      << error_message;
+  EXPECT_EQ(0, rows);
+
+  // The container being written can be excluded from deletion.
+  std::vector<ListOldestContainersRow> to_delete;
+  auto container_cb = [&](const ListOldestContainersRow &row) {
+    to_delete.push_back(row);
+    return IterationControl::kContinue;
+  };
+  ASSERT_TRUE(mdb_->ListOldestContainers(camera_uuid, container.id,
+                                         container_cb, &error_message))
+      << error_message;
+  EXPECT_THAT(to_delete, testing::IsEmpty());
+  ASSERT_TRUE(mdb_->ListOldestContainers(camera_uuid, -1, container_cb,
+                                         &error_message))
+      << error_message;
+  ASSERT_THAT(to_delete, testing::SizeIs(1));
+  EXPECT_EQ(camera_id, to_delete[0].camera_id);
+  EXPECT_EQ(container.id, to_delete[0].container_id);
+  EXPECT_EQ(container.uuid, to_delete[0].uuid);
+  EXPECT_EQ(2 * kTimeUnitsPerSecond, to_delete[0].duration_90k);
+  EXPECT_EQ(84, to_delete[0].sample_file_bytes);
+
+  // Deleting the container deletes its recordings and reserves its uuid.
+  ASSERT_TRUE(mdb_->DeleteContainers(to_delete, &error_message))
+      << error_message;
+  EXPECT_TRUE(mdb_->ListReservedSampleFiles(&reserved, &error_message))
+      << error_message;
+  EXPECT_THAT(reserved, testing::ElementsAre(container.uuid));
+  ExpectNoRecordings(camera_uuid);
+  ASSERT_TRUE(mdb_->GetNewestContainer(camera_uuid, &container, &found,
+                                       &error_message))
+      << error_message;
+  EXPECT_FALSE(found);
+  EXPECT_FALSE(mdb_->DeleteContainers(to_delete, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("no such container"));
+
+  ASSERT_TRUE(mdb_->MarkSampleFilesDeleted(reserved, &error_message))
+      << error_message;
+}
+
+TEST_F(MoonfireDbTest, Scrub) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  // A fresh database has no scrub state.
+  ScrubState state;
+  ASSERT_TRUE(mdb_->GetScrubState(&state, &error_message)) << error_message;
+  EXPECT_EQ(0, state.cursor_recording_id);
+  EXPECT_EQ(-1, state.pass_start_time_90k);
+  EXPECT_EQ(-1, state.last_pass_end_time_90k);
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
+  ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+      << error_message;
+
+  std::vector<Recording> to_scrub;
+  ASSERT_TRUE(mdb_->ListRecordingsToScrub(0, 10, &to_scrub, &error_message))
+      << error_message;
+  ASSERT_EQ(1, to_scrub.size());
+  EXPECT_EQ(recording.id, to_scrub[0].id);
+  EXPECT_EQ(recording.sample_file_uuid, to_scrub[0].sample_file_uuid);
+  EXPECT_EQ(recording.sample_file_hash, to_scrub[0].sample_file_hash);
+  EXPECT_EQ(42, to_scrub[0].sample_file_bytes);
+  ASSERT_TRUE(mdb_->ListRecordingsToScrub(recording.id, 10, &to_scrub,
+                                          &error_message))
+      << error_message;
+  EXPECT_THAT(to_scrub, testing::IsEmpty());
+  int64_t remaining_recordings;
+  int64_t remaining_bytes;
+  ASSERT_TRUE(mdb_->CountRecordingsAfter(0, &remaining_recordings,
+                                         &remaining_bytes, &error_message))
+      << error_message;
+  EXPECT_EQ(1, remaining_recordings);
+  EXPECT_EQ(42, remaining_bytes);
+
+  // A recording is current only if its sample file is unchanged.
+  bool current = false;
+  ASSERT_TRUE(mdb_->IsRecordingCurrent(recording, &current, &error_message))
+      << error_message;
+  EXPECT_TRUE(current);
+  Recording changed = recording;
+  changed.sample_file_hash[0] = 1;
+  ASSERT_TRUE(mdb_->IsRecordingCurrent(changed, &current, &error_message))
+      << error_message;
+  EXPECT_FALSE(current);
+
+  state.cursor_recording_id = recording.id;
+  state.pass_start_time_90k = 1;
+  state.pass_recordings = 1;
+  state.pass_bytes = 42;
+  ScrubMismatchRow mismatch;
+  mismatch.recording_id = recording.id;
+  mismatch.camera_id = camera_id;
+  mismatch.sample_file_uuid = recording.sample_file_uuid;
+  mismatch.start_time_90k = recording.start_time_90k;
+  mismatch.detected_time_90k = 2;
+  mismatch.error = "hash mismatch";
+  ASSERT_TRUE(mdb_->UpdateScrubState(state, {mismatch}, &error_message))
+      << error_message;
+  ScrubState got;
+  ASSERT_TRUE(mdb_->GetScrubState(&got, &error_message)) << error_message;
+  EXPECT_EQ(recording.id, got.cursor_recording_id);
+  EXPECT_EQ(1, got.pass_start_time_90k);
+  EXPECT_EQ(1, got.pass_recordings);
+  EXPECT_EQ(42, got.pass_bytes);
+  EXPECT_EQ(0, got.completed_passes);
+  EXPECT_EQ(-1, got.last_pass_end_time_90k);
+  std::vector<ScrubMismatchRow> mismatches;
+  ASSERT_TRUE(mdb_->ListScrubMismatches(
+      [&](const ScrubMismatchRow &row) {
+        mismatches.push_back(row);
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  ASSERT_EQ(1, mismatches.size());
+  EXPECT_EQ(recording.id, mismatches[0].recording_id);
+  EXPECT_EQ(camera_id, mismatches[0].camera_id);
+  EXPECT_EQ(recording.sample_file_uuid, mismatches[0].sample_file_uuid);
+  EXPECT_EQ(2, mismatches[0].detected_time_90k);
+  EXPECT_EQ("hash mismatch", mismatches[0].error);
+}
+
+TEST_F(MoonfireDbTest, Activity) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  // Insert two adjacent recordings, of 3 and 2 seconds.
+  const int64_t kStart90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  const int64_t kSec = kTimeUnitsPerSecond;
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(2, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(2)) << error_message;
+  const char *kActivity[] = {"\x00\x50\x60", "\x70\x00"};
+  int64_t start_90k = kStart90k;
+  for (int i = 0; i < 2; ++i) {
+    Recording recording;
+    recording.camera_id = camera_id;
+    recording.sample_file_uuid = uuids[i];
+    recording.sample_file_hash.resize(20);
+    recording.video_sample_entry_id = entry.id;
+    SampleIndexEncoder encoder;
+    encoder.Init(&recording, start_90k);
+    for (int j = 0; j < 3 - i; ++j) {
+      encoder.AddSample(kSec, 42, true);
+    }
+    encoder.Flush();
+    recording.activity.assign(kActivity[i], 3 - i);
+    ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+        << error_message;
+    start_90k = recording.end_time_90k;
+  }
+
+  auto list = [&](int64_t start_time_90k, int64_t end_time_90k,
+                  int min_activity) {
+    std::vector<std::string> intervals;
+    EXPECT_TRUE(mdb_->ListActivityIntervals(
+        start_time_90k, end_time_90k, min_activity,
+        [&](const ActivityIntervalRow &row) {
+          EXPECT_EQ(camera_uuid, row.camera_uuid);
+          EXPECT_EQ(camera_id, row.camera_id);
+          intervals.push_back(StrCat(row.start_time_90k - kStart90k, "-",
+                                     row.end_time_90k - kStart90k, ":",
+                                     row.max_activity));
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    return intervals;
+  };
+
+  // Seconds 1 and 2 of the first recording and 0 of the second merge.
+  EXPECT_THAT(list(0, kStart90k + 10 * kSec, 64),
+              testing::ElementsAre(StrCat(kSec, "-", 4 * kSec, ":", 0x70)));
+  EXPECT_THAT(list(kStart90k + 3 * kSec / 2, kStart90k + 10 * kSec, 64),
+              testing::ElementsAre(
+                  StrCat(3 * kSec / 2, "-", 4 * kSec, ":", 0x70)));
+  EXPECT_THAT(list(0, kStart90k + 10 * kSec, 0x61),
+              testing::ElementsAre(StrCat(3 * kSec, "-", 4 * kSec, ":", 0x70)));
+  EXPECT_THAT(list(kStart90k + 5 * kSec, kStart90k + 10 * kSec, 0),
+              testing::IsEmpty());
+
+  // Activity is deleted along with its recording.
+  std::vector<ListOldestSampleFilesRow> to_delete;
+  ASSERT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        to_delete.push_back(row);
+        return IterationControl::kBreak;
+      },
+      &error_message))
+      << error_message;
+  ASSERT_TRUE(mdb_->DeleteRecordings(&to_delete, &error_message))
+      << error_message;
+  EXPECT_THAT(list(0, kStart90k + 10 * kSec, 64),
+              testing::ElementsAre(StrCat(3 * kSec, "-", 4 * kSec, ":", 0x70)));
+}
+
+TEST_F(MoonfireDbTest, Rollups) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+
+  // Insert recordings of one-second samples starting at the given minutes
+  // past midnight UTC: 61 (1 minute, then adjacent to) 59 (2 minutes,
+  // spanning the hour), then 70 (1 minute, after a gap).
+  const int64_t kDay90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  const int64_t kMin = 60 * kTimeUnitsPerSecond;
+  const int64_t kHour = 60 * kMin;
+  struct {
+    int64_t start_min;
+    int samples;
+    int32_t bytes_per_sample;
+  } kRecordings[] = {{61, 60, 1}, {59, 120, 10}, {70, 60, 1}};
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(3, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(3)) << error_message;
+  std::vector<Recording> recordings;
+  for (int i = 0; i < 3; ++i) {
+    Recording recording;
+    recording.camera_id = camera_id;
+    recording.sample_file_uuid = uuids[i];
+    recording.sample_file_hash.resize(20);
+    recording.video_sample_entry_id = entry.id;
+    SampleIndexEncoder encoder;
+    encoder.Init(&recording, kDay90k + kRecordings[i].start_min * kMin);
+    for (int j = 0; j < kRecordings[i].samples; ++j) {
+      encoder.AddSample(kTimeUnitsPerSecond, kRecordings[i].bytes_per_sample,
+                        true);
+    }
+    encoder.Flush();
+    ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+        << error_message;
+    recordings.push_back(recording);
+  }
+
+  // Each row as "start_min duration_sec bytes samples gaps".
+  auto list = [&](RollupPeriod period) {
+    std::vector<std::string> rows;
+    EXPECT_TRUE(mdb_->ListCameraRollups(
+        camera_uuid, period, 0, std::numeric_limits<int64_t>::max(),
+        [&](const CameraRollupRow &row) {
+          rows.push_back(StrCat((row.start_time_90k - kDay90k) / kMin, " ",
+                                row.duration_90k / kTimeUnitsPerSecond, " ",
+                                row.sample_file_bytes, " ", row.video_samples,
+                                " ", row.gaps));
+          return IterationControl::kContinue;
+        },
+        &error_message))
+        << error_message;
+    return rows;
+  };
+  EXPECT_THAT(list(RollupPeriod::kHour),
+              testing::ElementsAre("60 180 720 180 1", "0 60 600 60 1"));
+  EXPECT_THAT(list(RollupPeriod::kDay),
+              testing::ElementsAre("0 240 1320 240 2"));
+  std::vector<std::string> hours;
+  EXPECT_TRUE(mdb_->ListCameraRollups(
+      camera_uuid, RollupPeriod::kHour, kDay90k + kHour, kDay90k + 2 * kHour,
+      [&](const CameraRollupRow &row) {
+        hours.push_back(StrCat(row.start_time_90k == kDay90k + kHour));
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_THAT(hours, testing::ElementsAre("1"));
+
+  // Deleting the spanning recording should remove the first hour's row and
+  // split the minute-61 recording into a run of its own.
+  ListOldestSampleFilesRow to_delete;
+  to_delete.camera_id = camera_id;
+  to_delete.recording_id = recordings[1].id;
+  to_delete.sample_file_uuid = recordings[1].sample_file_uuid;
+  to_delete.duration_90k =
+      recordings[1].end_time_90k - recordings[1].start_time_90k;
+  to_delete.sample_file_bytes = recordings[1].sample_file_bytes;
+  std::vector<ListOldestSampleFilesRow> to_delete_rows = {to_delete};
+  ASSERT_TRUE(mdb_->DeleteRecordings(&to_delete_rows, &error_message))
+      << error_message;
+  EXPECT_THAT(list(RollupPeriod::kHour),
+              testing::ElementsAre("60 120 120 120 2"));
+  EXPECT_THAT(list(RollupPeriod::kDay),
+              testing::ElementsAre("0 120 120 120 2"));
+
+  // Rebuilding from the recordings should produce the same rollups.
+  {
+    DatabaseContext ctx(&db_);
+    auto del = ctx.UseOnce("delete from camera_stats;");
+    ASSERT_EQ(SQLITE_DONE, del.Step()) << del.error_message();
+    auto corrupt = ctx.UseOnce("update recording_rollup set gaps = 5;");
+    ASSERT_EQ(SQLITE_DONE, corrupt.Step()) << corrupt.error_message();
+  }
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+  EXPECT_THAT(list(RollupPeriod::kHour),
+              testing::ElementsAre("60 120 120 120 2"));
+  EXPECT_THAT(list(RollupPeriod::kDay),
+              testing::ElementsAre("0 120 120 120 2"));
+}
+
+TEST_F(MoonfireDbTest, ListingsDoNotWaitForDatabaseLock) {
+  std::string error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  // The camera's first listing indexes its recordings under the lock; after
+  // that, listings read the snapshot alone.
+  EXPECT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+  std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+  ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+  Recording recording;
+  recording.camera_id = camera_id;
+  recording.sample_file_uuid = uuids[0];
+  recording.sample_file_hash.resize(20);
+  recording.video_sample_entry_id = entry.id;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, UINT64_C(1430006400) * kTimeUnitsPerSecond);
+  encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+  encoder.Flush();
+  ASSERT_TRUE(mdb_->InsertRecording(&recording, &error_message))
+      << error_message;
+
+  // Hold the database lock as a writer would while the listings run on
+  // another thread; they read the snapshot published by the insert instead.
+  DatabaseContext ctx(&db_);
+  auto listings = std::async(std::launch::async, [&]() {
+    std::string listing_error_message;
+    GetCameraRow camera_row;
+    EXPECT_TRUE(mdb_->GetCamera(camera_uuid, &camera_row));
+    EXPECT_EQ(42, camera_row.total_sample_file_bytes);
+    int rows = 0;
+    mdb_->ListCameras([&](const ListCamerasRow &row) {
+      ++rows;
+      EXPECT_EQ(recording.start_time_90k, row.min_start_time_90k);
+      return IterationControl::kContinue;
+    });
+    EXPECT_EQ(1, rows);
+    EXPECT_TRUE(mdb_->ListCameraRecordings(
+        camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+        [&](const ListCameraRecordingsRow &row) {
+          ++rows;
+          EXPECT_EQ(recording.end_time_90k, row.end_time_90k);
+          EXPECT_EQ(768, row.width);
+          return IterationControl::kContinue;
+        },
+        &listing_error_message))
+        << listing_error_message;
+    EXPECT_EQ(2, rows);
+    EXPECT_TRUE(mdb_->ListOldestSampleFiles(
+        camera_uuid,
+        [&](const ListOldestSampleFilesRow &row) {
+          ++rows;
+          EXPECT_EQ(recording.id, row.recording_id);
+          return IterationControl::kContinue;
+        },
+        &listing_error_message))
+        << listing_error_message;
+    EXPECT_EQ(3, rows);
+  });
+  EXPECT_EQ(std::future_status::ready,
+            listings.wait_for(std::chrono::seconds(10)));
+}
+
+// A camera's recordings are read on a reader connection without the
+// database lock. Commits meanwhile aren't in the rows read, so they must be
+// replayed onto the index before it's published.
+TEST_F(MoonfireDbTest, IndexingReplaysConcurrentCommits) {
+  std::string error_message;
+  {
+    DatabaseContext ctx(&db_);
+    ASSERT_TRUE(RunStatements(&ctx, "pragma journal_mode = wal;",
+                              &error_message))
+        << error_message;
+  }
+  ASSERT_TRUE(db_.OpenReaders(1, DatabaseOptions(), &error_message))
+      << error_message;
+  Uuid camera_uuid = GetRealUuidGenerator()->Generate();
+  int64_t camera_id = AddCamera(camera_uuid, "testcam");
+  ASSERT_GT(camera_id, 0);
+  mdb_.reset(new MoonfireDatabase);
+  ASSERT_TRUE(mdb_->Init(&db_, &error_message)) << error_message;
+
+  VideoSampleEntry entry;
+  entry.sha1.resize(20);
+  entry.width = 768;
+  entry.height = 512;
+  entry.data.resize(100);
+  ASSERT_TRUE(mdb_->InsertVideoSampleEntry(&entry, &error_message))
+      << error_message;
+  auto insert = [&](int64_t start_time_90k, Recording *recording) {
+    std::vector<Uuid> uuids = mdb_->ReserveSampleFiles(1, &error_message);
+    ASSERT_THAT(uuids, testing::SizeIs(1)) << error_message;
+    recording->camera_id = camera_id;
+    recording->sample_file_uuid = uuids[0];
+    recording->sample_file_hash.resize(20);
+    recording->video_sample_entry_id = entry.id;
+    SampleIndexEncoder encoder;
+    encoder.Init(recording, start_time_90k);
+    encoder.AddSample(kTimeUnitsPerSecond, 42, true);
+    encoder.Flush();
+    ASSERT_TRUE(mdb_->InsertRecording(recording, &error_message))
+        << error_message;
+  };
+  int64_t start_time_90k = UINT64_C(1430006400) * kTimeUnitsPerSecond;
+  Recording first;
+  insert(start_time_90k, &first);
+
+  // While the first listing reads the camera's recordings, insert a second
+  // and delete the first.
+  Recording second;
+  int hook_calls = 0;
+  mdb_->SetIndexingHookForTesting([&]() {
+    ++hook_calls;
+    insert(start_time_90k + kTimeUnitsPerSecond, &second);
+    std::vector<ListOldestSampleFilesRow> rows(1);
+    rows[0].camera_id = camera_id;
+    rows[0].recording_id = first.id;
+    rows[0].sample_file_uuid = first.sample_file_uuid;
+    rows[0].duration_90k = first.end_time_90k - first.start_time_90k;
+    rows[0].sample_file_bytes = first.sample_file_bytes;
+    ASSERT_TRUE(mdb_->DeleteRecordings(&rows, &error_message))
+        << error_message;
+    ASSERT_THAT(rows, testing::SizeIs(1));
+  });
+
+  std::vector<int64_t> ids;
+  EXPECT_TRUE(mdb_->ListOldestSampleFiles(
+      camera_uuid,
+      [&](const ListOldestSampleFilesRow &row) {
+        ids.push_back(row.recording_id);
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_EQ(1, hook_calls);
+  EXPECT_THAT(ids, testing::ElementsAre(second.id));
+
+  // Later commits apply to the published index directly.
+  Recording third;
+  insert(start_time_90k + 2 * kTimeUnitsPerSecond, &third);
+  ids.clear();
+  EXPECT_TRUE(mdb_->ListCameraRecordings(
+      camera_uuid, 0, std::numeric_limits<int64_t>::max(),
+      [&](const ListCameraRecordingsRow &row) {
+        ids.push_back(row.start_time_90k);
+        return IterationControl::kContinue;
+      },
+      &error_message))
+      << error_message;
+  EXPECT_THAT(ids, testing::ElementsAre(third.start_time_90k,
+                                        second.start_time_90k));
+  EXPECT_EQ(1, hook_calls);
+}
+
 }  // namespace
 }  // namespace moonfire_nvr
 
@@ -33,6 +33,9 @@
 
 #include "moonfire-db.h"
 
+#include <algorithm>
+#include <limits>
+#include <set>
 #include <string>
 
 #include <glog/logging.h>
@@ -40,18 +43,156 @@
 #include "http.h"
 #include "mp4.h"
 #include "recording.h"
+#include "upgrade.h"
 
 namespace moonfire_nvr {
 
+namespace {
+
+// The recording.sample_file_sha1 column predates sample_file_hash_algorithm
+// and is fixed at 20 bytes, so shorter hashes are stored zero-padded.
+const size_t kSampleFileSha1Bytes = 20;
+
+size_t HashBytes(HashAlgorithm algorithm) {
+  return algorithm == HashAlgorithm::kXxh3_128 ? 16 : kSampleFileSha1Bytes;
+}
+
+// Returns |hash| as stored in sample_file_sha1, or an empty string (which
+// the column's length check rejects) if it's the wrong length for |algorithm|.
+std::string HashToColumn(const std::string &hash, HashAlgorithm algorithm) {
+  if (hash.size() != HashBytes(algorithm)) {
+    return std::string();
+  }
+  std::string column = hash;
+  column.resize(kSampleFileSha1Bytes, '\0');
+  return column;
+}
+
+std::string HashFromColumn(re2::StringPiece column, HashAlgorithm algorithm) {
+  return column.substr(0, HashBytes(algorithm)).as_string();
+}
+
+// The recording columns read by FillSampleFileRecording, in order.
+const char kSampleFileRecordingColumns[] = R"(
+        id,
+        camera_id,
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        sample_file_uuid,
+        sample_file_sha1,
+        sample_file_hash_algorithm,
+        sample_file_tier,
+        ifnull(container_id, -1),
+        sample_file_offset)";
+
+// Fill |recording| from the current row of a query selecting
+// kSampleFileRecordingColumns.
+bool FillSampleFileRecording(RunningStatement *run, Recording *recording,
+                             std::string *error_message) {
+  recording->id = run->ColumnInt64(0);
+  recording->camera_id = run->ColumnInt64(1);
+  recording->start_time_90k = run->ColumnInt64(2);
+  recording->end_time_90k = recording->start_time_90k + run->ColumnInt64(3);
+  recording->sample_file_bytes = run->ColumnInt64(4);
+  if (!recording->sample_file_uuid.ParseBinary(run->ColumnBlob(5))) {
+    *error_message = StrCat("recording ", recording->id,
+                            " has unparseable uuid ", ToHex(run->ColumnBlob(5)));
+    return false;
+  }
+  recording->sample_file_hash_algorithm =
+      static_cast<HashAlgorithm>(run->ColumnInt64(7));
+  recording->sample_file_hash =
+      HashFromColumn(run->ColumnBlob(6), recording->sample_file_hash_algorithm);
+  recording->sample_file_tier =
+      static_cast<SampleFileTier>(run->ColumnInt64(8));
+  recording->container_id = run->ColumnInt64(9);
+  recording->sample_file_offset = run->ColumnInt64(10);
+  return true;
+}
+
+// Split [start_time_90k, end_time_90k) into |period|-long slices, dividing
+// |bytes| and |samples| among them in proportion to duration. The shares
+// always sum to the totals, so removing a recording exactly undoes adding it.
+// A recording of zero duration is a single slice.
+std::vector<CameraRollupRow> RollupSlices(RollupPeriod period,
+                                          int64_t start_time_90k,
+                                          int64_t end_time_90k, int64_t bytes,
+                                          int64_t samples) {
+  const int64_t period_90k = RollupPeriodDuration90k(period);
+  const int64_t duration_90k = end_time_90k - start_time_90k;
+  std::vector<CameraRollupRow> slices;
+  int64_t slice_start_90k = start_time_90k;
+  int64_t prev_bytes = 0;
+  int64_t prev_samples = 0;
+  do {
+    CameraRollupRow slice;
+    slice.start_time_90k = slice_start_90k - slice_start_90k % period_90k;
+    int64_t slice_end_90k =
+        std::min(end_time_90k, slice.start_time_90k + period_90k);
+    int64_t offset_90k = slice_end_90k - start_time_90k;
+    int64_t cum_bytes =
+        duration_90k == 0 ? bytes : bytes * offset_90k / duration_90k;
+    int64_t cum_samples =
+        duration_90k == 0 ? samples : samples * offset_90k / duration_90k;
+    slice.duration_90k = slice_end_90k - slice_start_90k;
+    slice.sample_file_bytes = cum_bytes - prev_bytes;
+    slice.video_samples = cum_samples - prev_samples;
+    slices.push_back(slice);
+    prev_bytes = cum_bytes;
+    prev_samples = cum_samples;
+    slice_start_90k = slice_end_90k;
+  } while (slice_start_90k < end_time_90k);
+  return slices;
+}
+
+// The snapshot's view of a newly inserted recording.
+IndexedRecording ToIndexedRecording(const Recording &recording, int64_t id) {
+  IndexedRecording indexed;
+  indexed.id = id;
+  indexed.start_time_90k = recording.start_time_90k;
+  indexed.end_time_90k = recording.end_time_90k;
+  indexed.sample_file_bytes = recording.sample_file_bytes;
+  indexed.video_samples = recording.video_samples;
+  indexed.video_sample_entry_id = recording.video_sample_entry_id;
+  indexed.sample_file_uuid = recording.sample_file_uuid;
+  indexed.sample_file_tier = SampleFileTier::kHot;
+  indexed.in_container = recording.container_id != -1;
+  return indexed;
+}
+
+}  // namespace
+
+int64_t RollupPeriodDuration90k(RollupPeriod period) {
+  return (period == RollupPeriod::kHour ? 60 * 60 : 24 * 60 * 60) *
+         kTimeUnitsPerSecond;
+}
+
 bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
   CHECK(db_ == nullptr);
   db_ = db;
 
+  // Cameras without a camera_stats row, as when the camera was just added.
+  std::vector<int64_t> missing_stats;
+
+  // For the first snapshot.
+  std::set<Uuid> reserved_uuids;
   {
     DatabaseContext ctx(db_);
 
-    // This query scans the entirety of the recording table's index.
-    // It is quite slow, so the results are cached.
+    int version;
+    if (!GetSchemaVersion(&ctx, &version, error_message)) {
+      return false;
+    }
+    if (version != kSchemaVersion) {
+      *error_message = StrCat("Database schema version is ", version,
+                              ", not the expected ", kSchemaVersion);
+      *error_message += version < kSchemaVersion
+                            ? "; run \"moonfire-nvr upgrade\" to upgrade it"
+                            : "; it was written by a newer Moonfire NVR";
+      return false;
+    }
+
     auto list_cameras_run = ctx.UseOnce(
         R"(
         select
@@ -65,19 +206,15 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
           camera.main_rtsp_path,
           camera.sub_rtsp_path,
           camera.retain_bytes,
-          min(recording.start_time_90k),
-          max(recording.start_time_90k + recording.duration_90k),
-          sum(recording.duration_90k),
-          sum(recording.sample_file_bytes)
+          camera.thin_age_sec,
+          camera_stats.camera_id,
+          camera_stats.min_start_time_90k,
+          camera_stats.max_end_time_90k,
+          camera_stats.total_duration_90k,
+          camera_stats.total_sample_file_bytes
         from
           camera
-          left join recording on (camera.id = recording.camera_id)
-        group by
-          camera.id,
-          camera.uuid,
-          camera.short_name,
-          camera.description,
-          camera.retain_bytes;
+          left join camera_stats on (camera.id = camera_stats.camera_id);
         )");
     while (list_cameras_run.Step() == SQLITE_ROW) {
       CameraData data;
@@ -97,14 +234,23 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
       data.main_rtsp_path = list_cameras_run.ColumnText(7).as_string();
       data.sub_rtsp_path = list_cameras_run.ColumnText(8).as_string();
       data.retain_bytes = list_cameras_run.ColumnInt64(9);
-      data.min_start_time_90k = list_cameras_run.ColumnType(10) == SQLITE_NULL
-                                    ? -1
-                                    : list_cameras_run.ColumnInt64(10);
-      data.max_end_time_90k = list_cameras_run.ColumnType(11) == SQLITE_NULL
-                                  ? -1
-                                  : list_cameras_run.ColumnInt64(11);
-      data.total_duration_90k = list_cameras_run.ColumnInt64(12);
-      data.total_sample_file_bytes = list_cameras_run.ColumnInt64(13);
+      data.thin_age_sec = list_cameras_run.ColumnType(10) == SQLITE_NULL
+                              ? -1
+                              : list_cameras_run.ColumnInt64(10);
+      if (list_cameras_run.ColumnType(11) == SQLITE_NULL) {
+        missing_stats.push_back(data.id);
+      } else {
+        data.stats.min_start_time_90k =
+            list_cameras_run.ColumnType(12) == SQLITE_NULL
+                ? -1
+                : list_cameras_run.ColumnInt64(12);
+        data.stats.max_end_time_90k =
+            list_cameras_run.ColumnType(13) == SQLITE_NULL
+                ? -1
+                : list_cameras_run.ColumnInt64(13);
+        data.stats.total_duration_90k = list_cameras_run.ColumnInt64(14);
+        data.stats.total_sample_file_bytes = list_cameras_run.ColumnInt64(15);
+      }
 
       auto ret = cameras_by_uuid_.insert(std::make_pair(uuid, data));
       if (!ret.second) {
@@ -120,6 +266,7 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
     if (list_cameras_run.status() != SQLITE_DONE) {
       *error_message = StrCat("Camera list query failed: ",
                               list_cameras_run.error_message());
+      return false;
     }
 
     // It's simplest to just keep the video sample entries in RAM.
@@ -155,18 +302,46 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
           video_sample_entries_.insert(std::make_pair(entry.id, entry)).second)
           << "duplicate: " << entry.id;
     }
+
+    auto reserved_run =
+        ctx.UseOnce("select uuid from reserved_sample_files;");
+    while (reserved_run.Step() == SQLITE_ROW) {
+      Uuid uuid;
+      if (!uuid.ParseBinary(reserved_run.ColumnBlob(0))) {
+        *error_message = StrCat("reserved_sample_files has unparseable uuid ",
+                                ToHex(reserved_run.ColumnBlob(0)));
+        return false;
+      }
+      reserved_uuids.insert(uuid);
+    }
+    if (reserved_run.status() != SQLITE_DONE) {
+      *error_message = StrCat("Reservation list query failed: ",
+                              reserved_run.error_message());
+      return false;
+    }
   }
 
-  std::string list_camera_recordings_sql = StrCat(
+  std::string build_mp4_sql = StrCat(
       R"(
       select
+        recording.id,
         recording.start_time_90k,
         recording.duration_90k,
-        recording.video_samples,
         recording.sample_file_bytes,
-        recording.video_sample_entry_id
+        recording.sample_file_uuid,
+        recording.sample_file_sha1,
+        recording_playback.video_index,
+        recording.video_samples,
+        recording.video_sync_samples,
+        recording.video_sample_entry_id,
+        recording.sample_file_tier,
+        recording.container_id,
+        recording.sample_file_offset,
+        recording.sample_file_hash_algorithm
       from
         recording
+        join recording_playback
+            on (recording.id = recording_playback.recording_id)
       where
         camera_id = :camera_id and
         recording.start_time_90k > :start_time_90k - )",
@@ -175,41 +350,61 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
         recording.start_time_90k < :end_time_90k and
         recording.start_time_90k + recording.duration_90k > :start_time_90k
       order by
-        recording.start_time_90k desc;)");
-  list_camera_recordings_stmt_ =
-      db_->Prepare(list_camera_recordings_sql, nullptr, error_message);
-  if (!list_camera_recordings_stmt_.valid()) {
+        recording.start_time_90k;)");
+  if (!db_->Prepare(build_mp4_sql, nullptr, error_message).valid()) {
     return false;
   }
+  build_mp4_sql_ = build_mp4_sql;
 
-  std::string build_mp4_sql = StrCat(
+  std::string list_camera_rollups_sql =
+      R"(
+      select
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        video_samples,
+        gaps
+      from
+        recording_rollup
+      where
+        camera_id = :camera_id and
+        period = :period and
+        start_time_90k >= :start_time_90k and
+        start_time_90k < :end_time_90k
+      order by
+        start_time_90k desc;
+      )";
+  if (!db_->Prepare(list_camera_rollups_sql, nullptr, error_message).valid()) {
+    return false;
+  }
+  list_camera_rollups_sql_ = list_camera_rollups_sql;
+
+  // As in build_mp4_sql, the lower bound on start_time_90k lets this use the
+  // recording_cover index.
+  std::string list_activity_intervals_sql = StrCat(
       R"(
       select
-        recording.id,
         recording.start_time_90k,
         recording.duration_90k,
-        recording.sample_file_bytes,
-        recording.sample_file_uuid,
-        recording.sample_file_sha1,
-        recording.video_index,
-        recording.video_samples,
-        recording.video_sync_samples,
-        recording.video_sample_entry_id
+        recording_activity.activity
       from
         recording
+        join recording_activity
+            on (recording.id = recording_activity.recording_id)
       where
-        camera_id = :camera_id and
+        recording.camera_id = :camera_id and
         recording.start_time_90k > :start_time_90k - )",
       kMaxRecordingDuration, " and\n",
       R"(
         recording.start_time_90k < :end_time_90k and
-        recording.start_time_90k + recording.duration_90k > :start_time_90k
+        recording_activity.max_activity >= :min_activity
       order by
         recording.start_time_90k;)");
-  build_mp4_stmt_ = db_->Prepare(build_mp4_sql, nullptr, error_message);
-  if (!build_mp4_stmt_.valid()) {
+  if (!db_->Prepare(list_activity_intervals_sql, nullptr, error_message)
+           .valid()) {
     return false;
   }
+  list_activity_intervals_sql_ = list_activity_intervals_sql;
 
   insert_reservation_stmt_ = db_->Prepare(
       "insert into reserved_sample_files (uuid,  state)\n"
@@ -226,6 +421,13 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
     return false;
   }
 
+  is_reserved_stmt_ = db_->Prepare(
+      "select 1 from reserved_sample_files where uuid = :uuid;", nullptr,
+      error_message);
+  if (!is_reserved_stmt_.valid()) {
+    return false;
+  }
+
   insert_video_sample_entry_stmt_ = db_->Prepare(
       R"(
       insert into video_sample_entry (sha1,  width,  height,  data)
@@ -241,21 +443,74 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
       insert into recording (camera_id, sample_file_bytes, start_time_90k,
                              duration_90k, local_time_delta_90k, video_samples,
                              video_sync_samples, video_sample_entry_id,
-                             sample_file_uuid, sample_file_sha1, video_index)
+                             sample_file_uuid, sample_file_sha1, container_id,
+                             sample_file_offset, sample_file_hash_algorithm)
                      values (:camera_id, :sample_file_bytes, :start_time_90k,
                              :duration_90k, :local_time_delta_90k,
                              :video_samples, :video_sync_samples,
                              :video_sample_entry_id, :sample_file_uuid,
-                             :sample_file_sha1, :video_index);
+                             :sample_file_hash, :container_id,
+                             :sample_file_offset,
+                             :sample_file_hash_algorithm);
       )",
       nullptr, error_message);
   if (!insert_recording_stmt_.valid()) {
     return false;
   }
 
-  list_oldest_sample_files_stmt_ = db_->Prepare(
+  insert_recording_playback_stmt_ = db_->Prepare(
+      R"(
+      insert into recording_playback (recording_id,  video_index)
+                              values (:recording_id, :video_index);
+      )",
+      nullptr, error_message);
+  if (!insert_recording_playback_stmt_.valid()) {
+    return false;
+  }
+
+  update_recording_playback_stmt_ = db_->Prepare(
+      R"(
+      update recording_playback
+      set
+        video_index = :video_index
+      where
+        recording_id = :recording_id;
+      )",
+      nullptr, error_message);
+  if (!update_recording_playback_stmt_.valid()) {
+    return false;
+  }
+
+  // See GetRecordingIndex, which sorts the rows itself.
+  std::string index_camera_recordings_sql =
+      R"(
+      select
+        id,
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        video_samples,
+        video_sample_entry_id,
+        sample_file_uuid,
+        sample_file_tier,
+        container_id is not null
+      from
+        recording
+      where
+        camera_id = :camera_id;
+      )";
+  if (!db_->Prepare(index_camera_recordings_sql, nullptr, error_message)
+           .valid()) {
+    return false;
+  }
+  index_camera_recordings_sql_ = index_camera_recordings_sql;
+
+  // The recording_hot index is partial, so the query must repeat its
+  // "sample_file_tier = 0" condition exactly for SQLite to use it.
+  list_oldest_hot_sample_files_stmt_ = db_->Prepare(
       R"(
       select
+        camera_id,
         id,
         sample_file_uuid,
         duration_90k,
@@ -263,22 +518,183 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
       from
         recording
       where
-        camera_id = :camera_id
+        sample_file_tier = 0 and
+        start_time_90k + duration_90k < :end_time_90k and
+        container_id is null and
+        sample_file_uuid not in (select uuid from reserved_sample_files) and
+        sample_file_uuid not in
+            (select sample_file_uuid from recording_journal)
       order by
         start_time_90k
       )",
       nullptr, error_message);
-  if (!list_oldest_sample_files_stmt_.valid()) {
+  if (!list_oldest_hot_sample_files_stmt_.valid()) {
     return false;
   }
 
-  delete_recording_stmt_ =
-      db_->Prepare("delete from recording where id = :recording_id;", nullptr,
-                   error_message);
+  update_recording_tier_stmt_ = db_->Prepare(
+      R"(
+      update recording set sample_file_tier = :new_tier
+      where id = :recording_id and sample_file_tier = :old_tier;
+      )",
+      nullptr, error_message);
+  if (!update_recording_tier_stmt_.valid()) {
+    return false;
+  }
+
+  update_reservation_state_stmt_ = db_->Prepare(
+      R"(
+      update reserved_sample_files set state = :new_state
+      where uuid = :uuid and state = :old_state;
+      )",
+      nullptr, error_message);
+  if (!update_reservation_state_stmt_.valid()) {
+    return false;
+  }
+
+  // Matching the uuid, too, guards against deleting a recording whose sample
+  // file was replaced by thinning since it was listed.
+  delete_recording_stmt_ = db_->Prepare(
+      R"(
+      delete from recording
+      where id = :recording_id and sample_file_uuid = :sample_file_uuid;
+      )",
+      nullptr, error_message);
   if (!delete_recording_stmt_.valid()) {
     return false;
   }
 
+  insert_container_stmt_ = db_->Prepare(
+      R"(
+      insert into container (camera_id,  uuid,  size_bytes)
+                     values (:camera_id, :uuid, :size_bytes);
+      )",
+      nullptr, error_message);
+  if (!insert_container_stmt_.valid()) {
+    return false;
+  }
+
+  // The container table is small (one row per gigabytes of recordings), so
+  // the aggregation here is cheap.
+  list_oldest_containers_stmt_ = db_->Prepare(
+      R"(
+      select
+        container.id,
+        container.uuid,
+        coalesce(sum(recording.duration_90k), 0),
+        coalesce(sum(recording.sample_file_bytes), 0)
+      from
+        container
+        left join recording on (container.id = recording.container_id)
+      where
+        container.camera_id = :camera_id and
+        container.id != :exclude_container_id
+      group by
+        container.id,
+        container.uuid
+      order by
+        container.id
+      )",
+      nullptr, error_message);
+  if (!list_oldest_containers_stmt_.valid()) {
+    return false;
+  }
+
+  list_container_recordings_stmt_ = db_->Prepare(
+      "select id from recording where container_id = :container_id;", nullptr,
+      error_message);
+  if (!list_container_recordings_stmt_.valid()) {
+    return false;
+  }
+
+  delete_container_recordings_stmt_ = db_->Prepare(
+      R"(
+      delete from recording
+      where id = :recording_id and container_id = :container_id;
+      )",
+      nullptr, error_message);
+  if (!delete_container_recordings_stmt_.valid()) {
+    return false;
+  }
+
+  delete_container_stmt_ =
+      db_->Prepare("delete from container where id = :container_id;", nullptr,
+                   error_message);
+  if (!delete_container_stmt_.valid()) {
+    return false;
+  }
+
+  update_recording_thinned_stmt_ = db_->Prepare(
+      R"(
+      update recording
+      set
+        sample_file_uuid = :new_uuid,
+        sample_file_sha1 = :sample_file_hash,
+        sample_file_hash_algorithm = :sample_file_hash_algorithm,
+        sample_file_bytes = :sample_file_bytes,
+        video_samples = :video_samples,
+        video_sync_samples = :video_sync_samples
+      where
+        id = :recording_id and
+        sample_file_uuid = :old_uuid and
+        sample_file_tier = :sample_file_tier;
+      )",
+      nullptr, error_message);
+  if (!update_recording_thinned_stmt_.valid()) {
+    return false;
+  }
+
+  // A journal row is created (empty) when an unsynced recording is inserted
+  // and replaced with the durable prefix of a file still being written.
+  static const char kJournalColumns[] = R"(
+      recording_journal (sample_file_uuid,  camera_id,  start_time_90k,
+                         local_time_delta_90k,  video_sample_entry_id,
+                         sample_file_hash_algorithm,  sample_file_bytes,
+                         duration_90k,  video_samples,  video_sync_samples,
+                         video_index)
+                 values (:sample_file_uuid, :camera_id, :start_time_90k,
+                         :local_time_delta_90k, :video_sample_entry_id,
+                         :sample_file_hash_algorithm, :sample_file_bytes,
+                         :duration_90k, :video_samples, :video_sync_samples,
+                         :video_index);
+      )";
+  insert_journal_stmt_ = db_->Prepare(
+      StrCat("insert or ignore into", kJournalColumns), nullptr, error_message);
+  if (!insert_journal_stmt_.valid()) {
+    return false;
+  }
+  replace_journal_stmt_ = db_->Prepare(
+      StrCat("insert or replace into", kJournalColumns), nullptr,
+      error_message);
+  if (!replace_journal_stmt_.valid()) {
+    return false;
+  }
+
+  delete_journal_stmt_ = db_->Prepare(
+      "delete from recording_journal where sample_file_uuid = :uuid;",
+      nullptr, error_message);
+  if (!delete_journal_stmt_.valid()) {
+    return false;
+  }
+
+  update_recording_prefix_stmt_ = db_->Prepare(
+      R"(
+      update recording
+      set
+        sample_file_bytes = :sample_file_bytes,
+        duration_90k = :duration_90k,
+        video_samples = :video_samples,
+        video_sync_samples = :video_sync_samples,
+        sample_file_sha1 = :sample_file_hash
+      where
+        id = :recording_id and
+        sample_file_uuid = :sample_file_uuid;
+      )",
+      nullptr, error_message);
+  if (!update_recording_prefix_stmt_.valid()) {
+    return false;
+  }
+
   camera_min_start_stmt_ = db_->Prepare(
       R"(
       select
@@ -310,14 +726,157 @@ bool MoonfireDatabase::Init(Database *db, std::string *error_message) {
     return false;
   }
 
+  replace_camera_stats_stmt_ = db_->Prepare(
+      R"(
+      insert or replace into camera_stats
+          (camera_id,  min_start_time_90k,  max_end_time_90k,
+           total_duration_90k,  total_sample_file_bytes)
+          values
+          (:camera_id, :min_start_time_90k, :max_end_time_90k,
+           :total_duration_90k, :total_sample_file_bytes);
+      )",
+      nullptr, error_message);
+  if (!replace_camera_stats_stmt_.valid()) {
+    return false;
+  }
+
+  insert_rollup_stmt_ = db_->Prepare(
+      R"(
+      insert or ignore into recording_rollup
+          (camera_id,  period,  start_time_90k,  duration_90k,
+           sample_file_bytes,  video_samples,  gaps)
+          values
+          (:camera_id, :period, :start_time_90k, 0, 0, 0, 0);
+      )",
+      nullptr, error_message);
+  if (!insert_rollup_stmt_.valid()) {
+    return false;
+  }
+
+  update_rollup_stmt_ = db_->Prepare(
+      R"(
+      update recording_rollup
+      set
+        duration_90k = duration_90k + :duration_90k,
+        sample_file_bytes = sample_file_bytes + :sample_file_bytes,
+        video_samples = video_samples + :video_samples,
+        gaps = gaps + :gaps
+      where
+        camera_id = :camera_id and
+        period = :period and
+        start_time_90k = :start_time_90k;
+      )",
+      nullptr, error_message);
+  if (!update_rollup_stmt_.valid()) {
+    return false;
+  }
+
+  delete_empty_rollup_stmt_ = db_->Prepare(
+      R"(
+      delete from recording_rollup
+      where
+        camera_id = :camera_id and
+        period = :period and
+        start_time_90k = :start_time_90k and
+        duration_90k = 0 and
+        sample_file_bytes = 0 and
+        video_samples = 0 and
+        gaps = 0;
+      )",
+      nullptr, error_message);
+  if (!delete_empty_rollup_stmt_.valid()) {
+    return false;
+  }
+
+  count_predecessors_stmt_ = db_->Prepare(
+      StrCat(R"(
+      select
+        count(*)
+      from
+        recording
+      where
+        camera_id = :camera_id and
+        start_time_90k >= :time_90k - )",
+             kMaxRecordingDuration, R"( and
+        start_time_90k <= :time_90k and
+        start_time_90k + duration_90k = :time_90k and
+        id != :exclude_id;
+      )"),
+      nullptr, error_message);
+  if (!count_predecessors_stmt_.valid()) {
+    return false;
+  }
+
+  count_successors_stmt_ = db_->Prepare(
+      R"(
+      select
+        count(*)
+      from
+        recording
+      where
+        camera_id = :camera_id and
+        start_time_90k = :time_90k and
+        id != :exclude_id;
+      )",
+      nullptr, error_message);
+  if (!count_successors_stmt_.valid()) {
+    return false;
+  }
+
+  // Compute missing aggregates the slow way, rebuilding the camera's rollups
+  // as well. Failing to save them is only a warning (the database may be
+  // opened read-only, as by fsck); the next startup will try again.
+  if (!missing_stats.empty()) {
+    DatabaseContext ctx(db_);
+    for (int64_t camera_id : missing_stats) {
+      LOG(INFO) << "Computing aggregates of camera " << camera_id
+                << "'s recordings.";
+      if (!ComputeCameraStats(&ctx, camera_id,
+                              &cameras_by_id_[camera_id]->stats,
+                              error_message)) {
+        return false;
+      }
+    }
+    std::string save_error_message;
+    if (ctx.BeginTransaction(&save_error_message)) {
+      bool saved = true;
+      for (int64_t camera_id : missing_stats) {
+        saved = saved &&
+                WriteCameraStats(&ctx, camera_id,
+                                 cameras_by_id_[camera_id]->stats,
+                                 &save_error_message) &&
+                RebuildRollups(&ctx, camera_id, &save_error_message);
+      }
+      if (!saved || !ctx.CommitTransaction(&save_error_message)) {
+        ctx.RollbackTransaction();
+        LOG(WARNING) << "Unable to save camera aggregates: "
+                     << save_error_message;
+      }
+    } else {
+      LOG(WARNING) << "Unable to save camera aggregates: "
+                   << save_error_message;
+    }
+  }
+
+  std::shared_ptr<Snapshot> snapshot(new Snapshot);
+  for (const auto &entry : cameras_by_id_) {
+    std::shared_ptr<CameraSnapshot> camera(new CameraSnapshot);
+    camera->stats = entry.second->stats;
+    snapshot->cameras_by_id[entry.first] = camera;
+  }
+  snapshot->reserved_uuids =
+      std::make_shared<std::set<Uuid>>(std::move(reserved_uuids));
+  std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(snapshot));
   return true;
 }
 
 void MoonfireDatabase::ListCameras(
     std::function<IterationControl(const ListCamerasRow &)> cb) {
-  DatabaseContext ctx(db_);
+  std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
   ListCamerasRow row;
   for (const auto &entry : cameras_by_uuid_) {
+    const CameraStats &stats =
+        snapshot->cameras_by_id.at(entry.second.id)->stats;
     row.id = entry.second.id;
     row.uuid = entry.first;
     row.short_name = entry.second.short_name;
@@ -328,10 +887,11 @@ void MoonfireDatabase::ListCameras(
     row.main_rtsp_path = entry.second.main_rtsp_path;
     row.sub_rtsp_path = entry.second.sub_rtsp_path;
     row.retain_bytes = entry.second.retain_bytes;
-    row.min_start_time_90k = entry.second.min_start_time_90k;
-    row.max_end_time_90k = entry.second.max_end_time_90k;
-    row.total_duration_90k = entry.second.total_duration_90k;
-    row.total_sample_file_bytes = entry.second.total_sample_file_bytes;
+    row.thin_age_sec = entry.second.thin_age_sec;
+    row.min_start_time_90k = stats.min_start_time_90k;
+    row.max_end_time_90k = stats.max_end_time_90k;
+    row.total_duration_90k = stats.total_duration_90k;
+    row.total_sample_file_bytes = stats.total_sample_file_bytes;
     if (cb(row) == IterationControl::kBreak) {
       return;
     }
@@ -340,19 +900,20 @@ void MoonfireDatabase::ListCameras(
 }
 
 bool MoonfireDatabase::GetCamera(Uuid camera_uuid, GetCameraRow *row) {
-  DatabaseContext ctx(db_);
   const auto it = cameras_by_uuid_.find(camera_uuid);
   if (it == cameras_by_uuid_.end()) {
     return false;
   }
   const CameraData &data = it->second;
+  std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+  const CameraStats &stats = snapshot->cameras_by_id.at(data.id)->stats;
   row->short_name = data.short_name;
   row->description = data.description;
   row->retain_bytes = data.retain_bytes;
-  row->min_start_time_90k = data.min_start_time_90k;
-  row->max_end_time_90k = data.max_end_time_90k;
-  row->total_duration_90k = data.total_duration_90k;
-  row->total_sample_file_bytes = data.total_sample_file_bytes;
+  row->min_start_time_90k = stats.min_start_time_90k;
+  row->max_end_time_90k = stats.max_end_time_90k;
+  row->total_duration_90k = stats.total_duration_90k;
+  row->total_sample_file_bytes = stats.total_sample_file_bytes;
   return true;
 }
 
@@ -360,43 +921,43 @@ bool MoonfireDatabase::ListCameraRecordings(
     Uuid camera_uuid, int64_t start_time_90k, int64_t end_time_90k,
     std::function<IterationControl(const ListCameraRecordingsRow &)> cb,
     std::string *error_message) {
-  DatabaseContext ctx(db_);
   const auto camera_it = cameras_by_uuid_.find(camera_uuid);
   if (camera_it == cameras_by_uuid_.end()) {
     *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
     return false;
   }
-  auto run = ctx.Borrow(&list_camera_recordings_stmt_);
-  run.BindInt64(":camera_id", camera_it->second.id);
-  run.BindInt64(":start_time_90k", start_time_90k);
-  run.BindInt64(":end_time_90k", end_time_90k);
-  ListCameraRecordingsRow row;
-  while (run.Step() == SQLITE_ROW) {
-    row.start_time_90k = run.ColumnInt64(0);
-    row.end_time_90k = row.start_time_90k + run.ColumnInt64(1);
-    row.video_samples = run.ColumnInt64(2);
-    row.sample_file_bytes = run.ColumnInt64(3);
-    int64_t video_sample_entry_id = run.ColumnInt64(4);
-    const auto it = video_sample_entries_.find(video_sample_entry_id);
-    if (it == video_sample_entries_.end()) {
-      *error_message =
-          StrCat("recording references invalid video sample entry ",
-                 video_sample_entry_id);
-      return false;
-    }
-    const VideoSampleEntry &entry = it->second;
-    row.video_sample_entry_sha1 = entry.sha1;
-    row.width = entry.width;
-    row.height = entry.height;
-    if (cb(row) == IterationControl::kBreak) {
-      return true;
-    }
-  }
-  if (run.status() != SQLITE_DONE) {
-    *error_message = StrCat("sqlite query failed: ", run.error_message());
+  std::shared_ptr<const RecordingIndex> recordings =
+      GetRecordingIndex(camera_it->second.id, error_message);
+  if (recordings == nullptr) {
     return false;
   }
-  return true;
+  ListCameraRecordingsRow row;
+  VideoSampleEntry entry;
+  bool ok = true;
+  recordings->ForEach(
+      start_time_90k - kMaxRecordingDuration + 1, end_time_90k,
+      /* newest_first= */ true, [&](const IndexedRecording &recording) {
+        if (recording.end_time_90k <= start_time_90k) {
+          return IterationControl::kContinue;
+        }
+        row.start_time_90k = recording.start_time_90k;
+        row.end_time_90k = recording.end_time_90k;
+        row.video_samples = recording.video_samples;
+        row.sample_file_bytes = recording.sample_file_bytes;
+        if (entry.id != recording.video_sample_entry_id &&
+            !GetVideoSampleEntry(recording.video_sample_entry_id, &entry)) {
+          *error_message =
+              StrCat("recording references invalid video sample entry ",
+                     recording.video_sample_entry_id);
+          ok = false;
+          return IterationControl::kBreak;
+        }
+        row.video_sample_entry_sha1 = entry.sha1;
+        row.width = entry.width;
+        row.height = entry.height;
+        return cb(row);
+      });
+  return ok;
 }
 
 bool MoonfireDatabase::ListMp4Recordings(
@@ -404,16 +965,16 @@ bool MoonfireDatabase::ListMp4Recordings(
     std::function<IterationControl(Recording &, const VideoSampleEntry &)>
         row_cb,
     std::string *error_message) {
-  VLOG(1) << "...(1/4): Waiting for database lock";
-  DatabaseContext ctx(db_);
   const auto it = cameras_by_uuid_.find(camera_uuid);
   if (it == cameras_by_uuid_.end()) {
     *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
     return false;
   }
   const CameraData &data = it->second;
+  VLOG(1) << "...(1/4): Waiting for a database reader";
+  DatabaseContext ctx(db_, DatabaseAccess::kReadOnly);
   VLOG(1) << "...(2/4): Querying database";
-  auto run = ctx.Borrow(&build_mp4_stmt_);
+  auto run = ctx.UsePrepared(build_mp4_sql_);
   run.BindInt64(":camera_id", data.id);
   run.BindInt64(":end_time_90k", end_time_90k);
   run.BindInt64(":start_time_90k", start_time_90k);
@@ -431,22 +992,30 @@ bool MoonfireDatabase::ListMp4Recordings(
                  ToHex(run.ColumnBlob(4)));
       return false;
     }
-    recording.sample_file_sha1 = run.ColumnBlob(5).as_string();
     recording.video_index = run.ColumnBlob(6).as_string();
     recording.video_samples = run.ColumnInt64(7);
     recording.video_sync_samples = run.ColumnInt64(8);
     recording.video_sample_entry_id = run.ColumnInt64(9);
+    recording.sample_file_tier =
+        static_cast<SampleFileTier>(run.ColumnInt64(10));
+    recording.container_id =
+        run.ColumnType(11) == SQLITE_NULL ? -1 : run.ColumnInt64(11);
+    recording.sample_file_offset = run.ColumnInt64(12);
+    recording.sample_file_hash_algorithm =
+        static_cast<HashAlgorithm>(run.ColumnInt64(13));
+    recording.sample_file_hash = HashFromColumn(
+        run.ColumnBlob(5), recording.sample_file_hash_algorithm);
 
-    auto it = video_sample_entries_.find(recording.video_sample_entry_id);
-    if (it == video_sample_entries_.end()) {
+    if (sample_entry.id != recording.video_sample_entry_id &&
+        !GetVideoSampleEntry(recording.video_sample_entry_id,
+                             &sample_entry)) {
       *error_message = StrCat("recording ", recording.id,
                               " references unknown video sample entry ",
                               recording.video_sample_entry_id);
       return false;
     }
-    const VideoSampleEntry &entry = it->second;
 
-    if (row_cb(recording, entry) == IterationControl::kBreak) {
+    if (row_cb(recording, sample_entry) == IterationControl::kBreak) {
       return true;
     }
   }
@@ -457,18 +1026,74 @@ bool MoonfireDatabase::ListMp4Recordings(
   return true;
 }
 
-bool MoonfireDatabase::ListReservedSampleFiles(std::vector<Uuid> *reserved,
-                                               std::string *error_message) {
-  reserved->clear();
-  DatabaseContext ctx(db_);
-  auto run = ctx.UseOnce("select uuid from reserved_sample_files;");
-  while (run.Step() == SQLITE_ROW) {
-    Uuid uuid;
-    if (!uuid.ParseBinary(run.ColumnBlob(0))) {
-      *error_message = StrCat("unparseable uuid ", ToHex(run.ColumnBlob(0)));
+bool MoonfireDatabase::ListCameraRollups(
+    Uuid camera_uuid, RollupPeriod period, int64_t start_time_90k,
+    int64_t end_time_90k,
+    std::function<IterationControl(const CameraRollupRow &)> row_cb,
+    std::string *error_message) {
+  const auto it = cameras_by_uuid_.find(camera_uuid);
+  if (it == cameras_by_uuid_.end()) {
+    *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
+    return false;
+  }
+  DatabaseContext ctx(db_, DatabaseAccess::kReadOnly);
+  auto run = ctx.UsePrepared(list_camera_rollups_sql_);
+  run.BindInt64(":camera_id", it->second.id);
+  run.BindInt64(":period", static_cast<int64_t>(period));
+  run.BindInt64(":start_time_90k", start_time_90k);
+  run.BindInt64(":end_time_90k", end_time_90k);
+  while (run.Step() == SQLITE_ROW) {
+    CameraRollupRow row;
+    row.start_time_90k = run.ColumnInt64(0);
+    row.duration_90k = run.ColumnInt64(1);
+    row.sample_file_bytes = run.ColumnInt64(2);
+    row.video_samples = run.ColumnInt64(3);
+    row.gaps = run.ColumnInt64(4);
+    if (row_cb(row) == IterationControl::kBreak) {
+      return true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListReservedSampleFiles(std::vector<Uuid> *reserved,
+                                               std::string *error_message) {
+  reserved->clear();
+  std::vector<ListReservedSampleFilesRow> rows;
+  if (!ListReservedSampleFiles(&rows, error_message)) {
+    return false;
+  }
+  for (const auto &row : rows) {
+    reserved->push_back(row.uuid);
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListReservedSampleFiles(
+    std::vector<ListReservedSampleFilesRow> *reserved,
+    std::string *error_message) {
+  reserved->clear();
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce("select uuid, state from reserved_sample_files;");
+  ListReservedSampleFilesRow row;
+  while (run.Step() == SQLITE_ROW) {
+    if (!row.uuid.ParseBinary(run.ColumnBlob(0))) {
+      *error_message = StrCat("unparseable uuid ", ToHex(run.ColumnBlob(0)));
+      return false;
+    }
+    int64_t state = run.ColumnInt64(1);
+    if (state < static_cast<int64_t>(ReservationState::kWriting) ||
+        state > static_cast<int64_t>(ReservationState::kWritingThinned)) {
+      *error_message = StrCat("uuid ", row.uuid.UnparseText(),
+                              " has unknown reservation state ", state);
       return false;
     }
-    reserved->push_back(uuid);
+    row.state = static_cast<ReservationState>(state);
+    reserved->push_back(row);
   }
   if (run.status() != SQLITE_DONE) {
     *error_message = run.error_message();
@@ -504,6 +1129,9 @@ std::vector<Uuid> MoonfireDatabase::ReserveSampleFiles(
   if (!ctx.CommitTransaction(error_message)) {
     return std::vector<Uuid>();
   }
+  SnapshotChanges changes;
+  changes.reserved = uuids;
+  PublishSnapshot(changes);
   return uuids;
 }
 
@@ -542,13 +1170,42 @@ bool MoonfireDatabase::InsertVideoSampleEntry(VideoSampleEntry *entry,
     return false;
   }
   entry->id = ctx.last_insert_rowid();
+  std::lock_guard<std::mutex> lock(video_sample_entries_mu_);
   CHECK(video_sample_entries_.insert(std::make_pair(entry->id, *entry)).second)
       << "duplicate: " << entry->id;
   return true;
 }
 
+bool MoonfireDatabase::GetVideoSampleEntry(int64_t id,
+                                           VideoSampleEntry *entry) {
+  std::lock_guard<std::mutex> lock(video_sample_entries_mu_);
+  auto it = video_sample_entries_.find(id);
+  if (it == video_sample_entries_.end()) {
+    return false;
+  }
+  *entry = it->second;
+  return true;
+}
+
 bool MoonfireDatabase::InsertRecording(Recording *recording,
                                        std::string *error_message) {
+  return InsertRecordingInternal(recording, JournalAction::kNone,
+                                 error_message);
+}
+
+bool MoonfireDatabase::InsertUnsyncedRecording(Recording *recording,
+                                               std::string *error_message) {
+  if (recording->container_id != -1) {
+    *error_message = "recordings within containers can't be journaled";
+    return false;
+  }
+  return InsertRecordingInternal(recording, JournalAction::kCreate,
+                                 error_message);
+}
+
+bool MoonfireDatabase::InsertRecordingInternal(Recording *recording,
+                                               JournalAction action,
+                                               std::string *error_message) {
   if (recording->id != -1) {
     *error_message = StrCat("recording already has id ", recording->id);
     return false;
@@ -569,18 +1226,22 @@ bool MoonfireDatabase::InsertRecording(Recording *recording,
   if (!ctx.BeginTransaction(error_message)) {
     return false;
   }
-  auto delete_run = ctx.Borrow(&delete_reservation_stmt_);
-  delete_run.BindBlob(":uuid", recording->sample_file_uuid.binary_view());
-  if (delete_run.Step() != SQLITE_DONE) {
-    *error_message = delete_run.error_message();
-    ctx.RollbackTransaction();
-    return false;
-  }
-  if (ctx.changes() != 1) {
-    *error_message = StrCat("uuid ", recording->sample_file_uuid.UnparseText(),
-                            " is not reserved");
-    ctx.RollbackTransaction();
-    return false;
+  // A container's reservation was already removed by InsertContainer.
+  if (recording->container_id == -1) {
+    auto delete_run = ctx.Borrow(&delete_reservation_stmt_);
+    delete_run.BindBlob(":uuid", recording->sample_file_uuid.binary_view());
+    if (delete_run.Step() != SQLITE_DONE) {
+      *error_message = delete_run.error_message();
+      ctx.RollbackTransaction();
+      return false;
+    }
+    if (ctx.changes() != 1) {
+      *error_message =
+          StrCat("uuid ", recording->sample_file_uuid.UnparseText(),
+                 " is not reserved");
+      ctx.RollbackTransaction();
+      return false;
+    }
   }
   auto insert_run = ctx.Borrow(&insert_recording_stmt_);
   insert_run.BindInt64(":camera_id", recording->camera_id);
@@ -596,8 +1257,16 @@ bool MoonfireDatabase::InsertRecording(Recording *recording,
                        recording->video_sample_entry_id);
   insert_run.BindBlob(":sample_file_uuid",
                       recording->sample_file_uuid.binary_view());
-  insert_run.BindBlob(":sample_file_sha1", recording->sample_file_sha1);
-  insert_run.BindBlob(":video_index", recording->video_index);
+  insert_run.BindBlob(":sample_file_hash",
+                      HashToColumn(recording->sample_file_hash,
+                                   recording->sample_file_hash_algorithm));
+  if (recording->container_id != -1) {
+    insert_run.BindInt64(":container_id", recording->container_id);
+  }
+  insert_run.BindInt64(":sample_file_offset", recording->sample_file_offset);
+  insert_run.BindInt64(
+      ":sample_file_hash_algorithm",
+      static_cast<int64_t>(recording->sample_file_hash_algorithm));
   if (insert_run.Step() != SQLITE_DONE) {
     *error_message =
         StrCat("insert failed: ", insert_run.error_message(), ", camera_id=",
@@ -611,27 +1280,123 @@ bool MoonfireDatabase::InsertRecording(Recording *recording,
                ", video_sync_samples=", recording->video_sync_samples,
                ", video_sample_entry_id=", recording->video_sample_entry_id,
                ", sample_file_uuid=", recording->sample_file_uuid.UnparseText(),
-               ", sample_file_sha1=", ToHex(recording->sample_file_sha1),
-               ", video_index length ", recording->video_index.size());
+               ", sample_file_hash=", ToHex(recording->sample_file_hash),
+               ", container_id=", recording->container_id,
+               ", sample_file_offset=", recording->sample_file_offset,
+               ", sample_file_hash_algorithm=",
+               static_cast<int>(recording->sample_file_hash_algorithm));
+    ctx.RollbackTransaction();
+    return false;
+  }
+  int64_t id = ctx.last_insert_rowid();
+  auto playback_run = ctx.Borrow(&insert_recording_playback_stmt_);
+  playback_run.BindInt64(":recording_id", id);
+  playback_run.BindBlob(":video_index", recording->video_index);
+  if (playback_run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("insert playback: ", playback_run.error_message(),
+                            ", video_index length ",
+                            recording->video_index.size());
+    ctx.RollbackTransaction();
+    return false;
+  }
+  RollupRecording rollup;
+  rollup.id = id;
+  rollup.camera_id = recording->camera_id;
+  rollup.start_time_90k = recording->start_time_90k;
+  rollup.end_time_90k = recording->end_time_90k;
+  rollup.sample_file_bytes = recording->sample_file_bytes;
+  rollup.video_samples = recording->video_samples;
+  if (!UpdateRollups(&ctx, rollup, 1, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  if (!recording->activity.empty()) {
+    auto activity_run = ctx.UseOnce(R"(
+        insert into recording_activity (recording_id,  max_activity,  activity)
+                                values (:recording_id, :max_activity, :activity);
+        )");
+    activity_run.BindInt64(":recording_id", id);
+    activity_run.BindInt64(
+        ":max_activity",
+        static_cast<uint8_t>(*std::max_element(
+            recording->activity.begin(), recording->activity.end(),
+            [](char a, char b) {
+              return static_cast<uint8_t>(a) < static_cast<uint8_t>(b);
+            })));
+    activity_run.BindBlob(":activity", recording->activity);
+    if (activity_run.Step() != SQLITE_DONE) {
+      *error_message =
+          StrCat("insert activity: ", activity_run.error_message());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  }
+  CameraStats stats = camera_data->stats;
+  if (stats.min_start_time_90k == -1 ||
+      stats.min_start_time_90k > recording->start_time_90k) {
+    stats.min_start_time_90k = recording->start_time_90k;
+  }
+  if (stats.max_end_time_90k == -1 ||
+      stats.max_end_time_90k < recording->end_time_90k) {
+    stats.max_end_time_90k = recording->end_time_90k;
+  }
+  stats.total_duration_90k +=
+      recording->end_time_90k - recording->start_time_90k;
+  stats.total_sample_file_bytes += recording->sample_file_bytes;
+  if (!WriteCameraStats(&ctx, recording->camera_id, stats, error_message)) {
     ctx.RollbackTransaction();
     return false;
   }
+  if (action == JournalAction::kCreate) {
+    // An empty prefix: nothing is known to be durable yet.
+    Recording empty;
+    empty.camera_id = recording->camera_id;
+    empty.sample_file_uuid = recording->sample_file_uuid;
+    empty.start_time_90k = recording->start_time_90k;
+    empty.end_time_90k = recording->start_time_90k;
+    empty.local_time_90k = recording->local_time_90k;
+    empty.video_sample_entry_id = recording->video_sample_entry_id;
+    empty.sample_file_hash_algorithm = recording->sample_file_hash_algorithm;
+    empty.sample_file_bytes = 0;
+    empty.video_samples = 0;
+    empty.video_sync_samples = 0;
+    auto journal_run = ctx.Borrow(&insert_journal_stmt_);
+    BindJournal(empty, &journal_run);
+    if (journal_run.Step() != SQLITE_DONE) {
+      *error_message =
+          StrCat("insert journal: ", journal_run.error_message());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  } else if (action == JournalAction::kDelete) {
+    auto journal_run = ctx.Borrow(&delete_journal_stmt_);
+    journal_run.BindBlob(":uuid", recording->sample_file_uuid.binary_view());
+    if (journal_run.Step() != SQLITE_DONE) {
+      *error_message =
+          StrCat("delete journal: ", journal_run.error_message());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  }
   if (!ctx.CommitTransaction(error_message)) {
     LOG(ERROR) << "commit failed";
     return false;
   }
-  recording->id = ctx.last_insert_rowid();
-  if (camera_data->min_start_time_90k == -1 ||
-      camera_data->min_start_time_90k > recording->start_time_90k) {
-    camera_data->min_start_time_90k = recording->start_time_90k;
+  recording->id = id;
+  std::string cache_error_message;
+  if (key_frame_cache_ != nullptr &&
+      !key_frame_cache_->Insert(*recording, &cache_error_message)) {
+    LOG(WARNING) << "Unable to cache key frames of recording " << id << ": "
+                 << cache_error_message;
   }
-  if (camera_data->max_end_time_90k == -1 ||
-      camera_data->max_end_time_90k < recording->end_time_90k) {
-    camera_data->max_end_time_90k = recording->end_time_90k;
+  camera_data->stats = stats;
+  SnapshotChanges changes;
+  changes.upserted[recording->camera_id].push_back(
+      ToIndexedRecording(*recording, id));
+  if (recording->container_id == -1) {
+    changes.unreserved.push_back(recording->sample_file_uuid);
   }
-  camera_data->total_duration_90k +=
-      recording->end_time_90k - recording->start_time_90k;
-  camera_data->total_sample_file_bytes += recording->sample_file_bytes;
+  PublishSnapshot(changes);
   return true;
 }
 
@@ -639,27 +1404,60 @@ bool MoonfireDatabase::ListOldestSampleFiles(
     Uuid camera_uuid,
     std::function<IterationControl(const ListOldestSampleFilesRow &)> row_cb,
     std::string *error_message) {
-  DatabaseContext ctx(db_);
   auto it = cameras_by_uuid_.find(camera_uuid);
   if (it == cameras_by_uuid_.end()) {
     *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
     return false;
   }
-  const CameraData &camera_data = it->second;
-  auto run = ctx.Borrow(&list_oldest_sample_files_stmt_);
-  run.BindInt64(":camera_id", camera_data.id);
+  const int64_t camera_id = it->second.id;
+  if (GetRecordingIndex(camera_id, error_message) == nullptr) {
+    return false;
+  }
+  // Once indexed, a camera stays indexed in later snapshots.
+  std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+  const std::set<Uuid> &reserved = *snapshot->reserved_uuids;
+
+  // Recordings which are being moved between tiers are also reserved; they
+  // are skipped rather than causing DeleteRecordings to fail.
+  ListOldestSampleFilesRow row;
+  snapshot->cameras_by_id.at(camera_id)->recordings->ForEach(
+      std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max(),
+      /* newest_first= */ false, [&](const IndexedRecording &recording) {
+        if (recording.in_container ||
+            reserved.count(recording.sample_file_uuid) != 0) {
+          return IterationControl::kContinue;
+        }
+        row.camera_id = camera_id;
+        row.recording_id = recording.id;
+        row.sample_file_uuid = recording.sample_file_uuid;
+        row.duration_90k = recording.end_time_90k - recording.start_time_90k;
+        row.sample_file_bytes = recording.sample_file_bytes;
+        row.sample_file_tier = recording.sample_file_tier;
+        return row_cb(row);
+      });
+  return true;
+}
+
+bool MoonfireDatabase::ListOldestHotSampleFiles(
+    int64_t end_time_90k,
+    std::function<IterationControl(const ListOldestSampleFilesRow &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto run = ctx.Borrow(&list_oldest_hot_sample_files_stmt_);
+  run.BindInt64(":end_time_90k", end_time_90k);
   ListOldestSampleFilesRow row;
   while (run.Step() == SQLITE_ROW) {
-    row.camera_id = camera_data.id;
-    row.recording_id = run.ColumnInt64(0);
-    if (!row.sample_file_uuid.ParseBinary(run.ColumnBlob(1))) {
+    row.camera_id = run.ColumnInt64(0);
+    row.recording_id = run.ColumnInt64(1);
+    if (!row.sample_file_uuid.ParseBinary(run.ColumnBlob(2))) {
       *error_message =
           StrCat("recording ", row.recording_id, " has unparseable uuid ",
-                 ToHex(run.ColumnBlob(1)));
+                 ToHex(run.ColumnBlob(2)));
       return false;
     }
-    row.duration_90k = run.ColumnInt64(2);
-    row.sample_file_bytes = run.ColumnInt64(3);
+    row.duration_90k = run.ColumnInt64(3);
+    row.sample_file_bytes = run.ColumnInt64(4);
+    row.sample_file_tier = SampleFileTier::kHot;
     if (row_cb(row) == IterationControl::kBreak) {
       return true;
     }
@@ -671,150 +1469,1797 @@ bool MoonfireDatabase::ListOldestSampleFiles(
   return true;
 }
 
-bool MoonfireDatabase::DeleteRecordings(
-    const std::vector<ListOldestSampleFilesRow> &recordings,
+bool MoonfireDatabase::BeginMoveToCold(
+    const std::vector<ListOldestSampleFilesRow> &rows,
     std::string *error_message) {
-  if (recordings.empty()) {
+  if (rows.empty()) {
     return true;
   }
-
   DatabaseContext ctx(db_);
   if (!ctx.BeginTransaction(error_message)) {
     return false;
   }
-  struct State {
-    int64_t deleted_duration_90k = 0;
-    int64_t deleted_sample_file_bytes = 0;
-    int64_t min_start_time_90k = -1;
-    int64_t max_end_time_90k = -1;
-    CameraData *camera_data = nullptr;
-  };
-  std::map<int64_t, State> state_by_camera_id;
-  for (const auto &recording : recordings) {
-    State &state = state_by_camera_id[recording.camera_id];
-    state.deleted_duration_90k += recording.duration_90k;
-    state.deleted_sample_file_bytes += recording.sample_file_bytes;
-
-    auto delete_run = ctx.Borrow(&delete_recording_stmt_);
-    delete_run.BindInt64(":recording_id", recording.recording_id);
-    if (delete_run.Step() != SQLITE_DONE) {
+  for (const auto &row : rows) {
+    if (row.sample_file_tier != SampleFileTier::kHot) {
       ctx.RollbackTransaction();
-      *error_message = StrCat("delete: ", delete_run.error_message());
+      *error_message =
+          StrCat("recording ", row.recording_id, " is not in the hot tier");
       return false;
     }
-    if (ctx.changes() != 1) {
+    auto run = ctx.Borrow(&insert_reservation_stmt_);
+    run.BindBlob(":uuid", row.sample_file_uuid.binary_view());
+    run.BindInt64(":state",
+                  static_cast<int64_t>(ReservationState::kMovingToCold));
+    if (run.Step() != SQLITE_DONE) {
       ctx.RollbackTransaction();
-      *error_message = StrCat("no such recording ", recording.recording_id);
+      *error_message = StrCat("reserve ", row.sample_file_uuid.UnparseText(),
+                              ": ", run.error_message());
       return false;
     }
+  }
+  if (!ctx.CommitTransaction(error_message)) {
+    *error_message = StrCat("commit: ", *error_message);
+    return false;
+  }
+  SnapshotChanges changes;
+  for (const auto &row : rows) {
+    changes.reserved.push_back(row.sample_file_uuid);
+  }
+  PublishSnapshot(changes);
+  return true;
+}
 
-    auto insert_run = ctx.Borrow(&insert_reservation_stmt_);
-    insert_run.BindBlob(":uuid", recording.sample_file_uuid.binary_view());
-    insert_run.BindInt64(":state",
-                         static_cast<int64_t>(ReservationState::kDeleting));
-    if (insert_run.Step() != SQLITE_DONE) {
+bool MoonfireDatabase::FinishMoveToCold(
+    const std::vector<ListOldestSampleFilesRow> &rows,
+    std::string *error_message) {
+  if (rows.empty()) {
+    return true;
+  }
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  SnapshotChanges changes;
+  for (const auto &row : rows) {
+    RollupRecording rollup;
+    IndexedRecording indexed;
+    if (!GetRollupRecording(&ctx, row.recording_id, &rollup, error_message) ||
+        !FindIndexedRecording(rollup.camera_id, rollup.start_time_90k,
+                              row.recording_id, &indexed, error_message)) {
       ctx.RollbackTransaction();
-      *error_message = StrCat("insert: ", insert_run.error_message());
       return false;
     }
-  }
+    indexed.sample_file_tier = SampleFileTier::kCold;
+    changes.upserted[rollup.camera_id].push_back(indexed);
 
-  // Recompute start and end times for each camera.
-  for (auto &state_entry : state_by_camera_id) {
-    int64_t camera_id = state_entry.first;
-    State &state = state_entry.second;
-    auto it = cameras_by_id_.find(camera_id);
-    if (it == cameras_by_id_.end()) {
+    auto recording_run = ctx.Borrow(&update_recording_tier_stmt_);
+    recording_run.BindInt64(":recording_id", row.recording_id);
+    recording_run.BindInt64(":old_tier",
+                            static_cast<int64_t>(SampleFileTier::kHot));
+    recording_run.BindInt64(":new_tier",
+                            static_cast<int64_t>(SampleFileTier::kCold));
+    if (recording_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
       *error_message =
-          StrCat("internal error; can't find camera id ", camera_id);
+          StrCat("update recording: ", recording_run.error_message());
       return false;
     }
-    state.camera_data = it->second;
-
-    // The minimum is straightforward, taking advantage of the start_time_90k
-    // index for speed.
-    auto min_run = ctx.Borrow(&camera_min_start_stmt_);
-    min_run.BindInt64(":camera_id", camera_id);
-    if (min_run.Step() == SQLITE_ROW) {
-      state.min_start_time_90k = min_run.ColumnInt64(0);
-    } else if (min_run.Step() == SQLITE_DONE) {
-      // There are no recordings left.
-      state.min_start_time_90k = -1;
-      state.max_end_time_90k = -1;
-      continue;  // skip additional query below to calculate max.
-    } else {
+    if (ctx.changes() != 1) {
       ctx.RollbackTransaction();
-      *error_message = StrCat("min: ", min_run.error_message());
+      *error_message = StrCat("no hot-tier recording ", row.recording_id);
       return false;
     }
 
-    // The maximum is less straightforward in the case of overlap - all
-    // recordings starting in the last kMaxRecordingDuration must be examined
-    // to take advantage of the start_time_90k index.
-    auto max_run = ctx.Borrow(&camera_max_start_stmt_);
-    max_run.BindInt64(":camera_id", camera_id);
-    if (max_run.Step() != SQLITE_ROW) {
-      // If there was a min row, there should be a max row too, so this is an
-      // error even in the SQLITE_DONE case.
+    auto reservation_run = ctx.Borrow(&update_reservation_state_stmt_);
+    reservation_run.BindBlob(":uuid", row.sample_file_uuid.binary_view());
+    reservation_run.BindInt64(
+        ":old_state", static_cast<int64_t>(ReservationState::kMovingToCold));
+    reservation_run.BindInt64(
+        ":new_state", static_cast<int64_t>(ReservationState::kMovedToCold));
+    if (reservation_run.Step() != SQLITE_DONE) {
       ctx.RollbackTransaction();
-      *error_message = StrCat("max[0]: ", max_run.error_message());
+      *error_message =
+          StrCat("update reservation: ", reservation_run.error_message());
       return false;
     }
-    int64_t max_start_90k = max_run.ColumnInt64(0);
-    do {
-      auto end_time_90k = max_run.ColumnInt64(0) + max_run.ColumnInt64(1);
-      state.max_end_time_90k = std::max(state.max_end_time_90k, end_time_90k);
-    } while (max_run.Step() == SQLITE_ROW &&
-             max_run.ColumnInt64(0) > max_start_90k - kMaxRecordingDuration);
-    if (max_run.status() != SQLITE_DONE && max_run.status() != SQLITE_ROW) {
-      *error_message = StrCat("max[1]: ", max_run.error_message());
+    if (ctx.changes() != 1) {
       ctx.RollbackTransaction();
+      *error_message = StrCat("uuid ", row.sample_file_uuid.UnparseText(),
+                              " is not reserved for moving");
       return false;
     }
   }
-
   if (!ctx.CommitTransaction(error_message)) {
     *error_message = StrCat("commit: ", *error_message);
     return false;
   }
+  PublishSnapshot(changes);
+  return true;
+}
 
-  for (auto &state_entry : state_by_camera_id) {
-    State &state = state_entry.second;
-    state.camera_data->total_duration_90k -= state.deleted_duration_90k;
-    state.camera_data->total_sample_file_bytes -=
-        state.deleted_sample_file_bytes;
-    state.camera_data->min_start_time_90k = state.min_start_time_90k;
-    state.camera_data->max_end_time_90k = state.max_end_time_90k;
+bool MoonfireDatabase::ListRecordingsToThin(
+    int64_t camera_id, int64_t end_time_90k,
+    std::function<IterationControl(Recording &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+
+  // This runs only occasionally, in the background, so it isn't worth
+  // preparing.
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        id,
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        sample_file_uuid,
+        sample_file_sha1,
+        sample_file_hash_algorithm,
+        video_index,
+        video_samples,
+        video_sync_samples,
+        video_sample_entry_id,
+        sample_file_tier
+      from
+        recording
+        join recording_playback
+            on (recording.id = recording_playback.recording_id)
+      where
+        camera_id = :camera_id and
+        start_time_90k + duration_90k < :end_time_90k and
+        video_sync_samples > 0 and
+        video_sync_samples < video_samples and
+        container_id is null and
+        sample_file_uuid not in (select uuid from reserved_sample_files) and
+        sample_file_uuid not in
+            (select sample_file_uuid from recording_journal)
+      order by
+        start_time_90k;
+      )");
+  run.BindInt64(":camera_id", camera_id);
+  run.BindInt64(":end_time_90k", end_time_90k);
+  Recording recording;
+  while (run.Step() == SQLITE_ROW) {
+    recording.id = run.ColumnInt64(0);
+    recording.camera_id = camera_id;
+    recording.start_time_90k = run.ColumnInt64(1);
+    recording.end_time_90k = recording.start_time_90k + run.ColumnInt64(2);
+    recording.sample_file_bytes = run.ColumnInt64(3);
+    if (!recording.sample_file_uuid.ParseBinary(run.ColumnBlob(4))) {
+      *error_message =
+          StrCat("recording ", recording.id, " has unparseable uuid ",
+                 ToHex(run.ColumnBlob(4)));
+      return false;
+    }
+    recording.sample_file_hash_algorithm =
+        static_cast<HashAlgorithm>(run.ColumnInt64(6));
+    recording.sample_file_hash = HashFromColumn(
+        run.ColumnBlob(5), recording.sample_file_hash_algorithm);
+    recording.video_index = run.ColumnBlob(7).as_string();
+    recording.video_samples = run.ColumnInt64(8);
+    recording.video_sync_samples = run.ColumnInt64(9);
+    recording.video_sample_entry_id = run.ColumnInt64(10);
+    recording.sample_file_tier =
+        static_cast<SampleFileTier>(run.ColumnInt64(11));
+    if (row_cb(recording) == IterationControl::kBreak) {
+      return true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
   }
   return true;
 }
 
-bool MoonfireDatabase::MarkSampleFilesDeleted(const std::vector<Uuid> &uuids,
-                                              std::string *error_message) {
-  if (uuids.empty()) {
-    return true;
-  }
+bool MoonfireDatabase::BeginThin(const Recording &recording, Uuid *new_uuid,
+                                 std::string *error_message) {
+  *new_uuid = uuidgen_->Generate();
   DatabaseContext ctx(db_);
   if (!ctx.BeginTransaction(error_message)) {
     return false;
   }
-  for (const auto &uuid : uuids) {
-    auto run = ctx.Borrow(&delete_reservation_stmt_);
-    run.BindBlob(":uuid", uuid.binary_view());
+  const std::pair<Uuid, ReservationState> reservations[] = {
+      {recording.sample_file_uuid, ReservationState::kThinning},
+      {*new_uuid, ReservationState::kWritingThinned}};
+  for (const auto &reservation : reservations) {
+    auto run = ctx.Borrow(&insert_reservation_stmt_);
+    run.BindBlob(":uuid", reservation.first.binary_view());
+    run.BindInt64(":state", static_cast<int64_t>(reservation.second));
     if (run.Step() != SQLITE_DONE) {
-      *error_message = run.error_message();
-      ctx.RollbackTransaction();
-      return false;
-    }
-    if (ctx.changes() != 1) {
-      *error_message = StrCat("no reservation for uuid ", uuid.UnparseText());
       ctx.RollbackTransaction();
+      *error_message = StrCat("reserve ", reservation.first.UnparseText(),
+                              ": ", run.error_message());
       return false;
     }
   }
   if (!ctx.CommitTransaction(error_message)) {
+    *error_message = StrCat("commit: ", *error_message);
+    return false;
+  }
+  SnapshotChanges changes;
+  changes.reserved.push_back(recording.sample_file_uuid);
+  changes.reserved.push_back(*new_uuid);
+  PublishSnapshot(changes);
+  return true;
+}
+
+bool MoonfireDatabase::FinishThin(const Recording &original,
+                                  const Recording &thinned,
+                                  std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto it = cameras_by_id_.find(original.camera_id);
+  if (it == cameras_by_id_.end()) {
+    *error_message = StrCat("no camera with id ", original.camera_id);
+    return false;
+  }
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  IndexedRecording indexed;
+  if (!FindIndexedRecording(original.camera_id, original.start_time_90k,
+                            original.id, &indexed, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  auto recording_run = ctx.Borrow(&update_recording_thinned_stmt_);
+  recording_run.BindBlob(":new_uuid", thinned.sample_file_uuid.binary_view());
+  recording_run.BindBlob(
+      ":sample_file_hash",
+      HashToColumn(thinned.sample_file_hash,
+                   thinned.sample_file_hash_algorithm));
+  recording_run.BindInt64(
+      ":sample_file_hash_algorithm",
+      static_cast<int64_t>(thinned.sample_file_hash_algorithm));
+  recording_run.BindInt64(":sample_file_bytes", thinned.sample_file_bytes);
+  recording_run.BindInt64(":video_samples", thinned.video_samples);
+  recording_run.BindInt64(":video_sync_samples", thinned.video_sync_samples);
+  recording_run.BindInt64(":recording_id", original.id);
+  recording_run.BindBlob(":old_uuid", original.sample_file_uuid.binary_view());
+  recording_run.BindInt64(":sample_file_tier",
+                          static_cast<int64_t>(original.sample_file_tier));
+  if (recording_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message =
+        StrCat("update recording: ", recording_run.error_message());
+    return false;
+  }
+  if (ctx.changes() != 1) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("recording ", original.id, " has changed");
+    return false;
+  }
+  if (!UpdateRecordingPlayback(&ctx, original.id, thinned.video_index,
+                               error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+
+  auto delete_run = ctx.Borrow(&delete_reservation_stmt_);
+  delete_run.BindBlob(":uuid", thinned.sample_file_uuid.binary_view());
+  if (delete_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message =
+        StrCat("delete reservation: ", delete_run.error_message());
+    return false;
+  }
+  if (ctx.changes() != 1) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("uuid ", thinned.sample_file_uuid.UnparseText(),
+                            " is not reserved");
+    return false;
+  }
+
+  auto reservation_run = ctx.Borrow(&update_reservation_state_stmt_);
+  reservation_run.BindBlob(":uuid", original.sample_file_uuid.binary_view());
+  reservation_run.BindInt64(":old_state",
+                            static_cast<int64_t>(ReservationState::kThinning));
+  reservation_run.BindInt64(":new_state",
+                            static_cast<int64_t>(ReservationState::kDeleting));
+  if (reservation_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message =
+        StrCat("update reservation: ", reservation_run.error_message());
     return false;
   }
+  if (ctx.changes() != 1) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("uuid ", original.sample_file_uuid.UnparseText(),
+                            " is not reserved for thinning");
+    return false;
+  }
+  RollupRecording rollup;
+  rollup.id = original.id;
+  rollup.camera_id = original.camera_id;
+  rollup.start_time_90k = original.start_time_90k;
+  rollup.end_time_90k = original.end_time_90k;
+  rollup.sample_file_bytes = original.sample_file_bytes;
+  rollup.video_samples = original.video_samples;
+  if (!UpdateRollups(&ctx, rollup, -1, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  rollup.sample_file_bytes = thinned.sample_file_bytes;
+  rollup.video_samples = thinned.video_samples;
+  if (!UpdateRollups(&ctx, rollup, 1, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  CameraStats stats = it->second->stats;
+  stats.total_sample_file_bytes -=
+      original.sample_file_bytes - thinned.sample_file_bytes;
+  if (!WriteCameraStats(&ctx, original.camera_id, stats, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  if (!ctx.CommitTransaction(error_message)) {
+    *error_message = StrCat("commit: ", *error_message);
+    return false;
+  }
+  it->second->stats = stats;
+  SnapshotChanges changes;
+  indexed.sample_file_uuid = thinned.sample_file_uuid;
+  indexed.sample_file_bytes = thinned.sample_file_bytes;
+  indexed.video_samples = thinned.video_samples;
+  changes.upserted[original.camera_id].push_back(indexed);
+  changes.unreserved.push_back(thinned.sample_file_uuid);
+  PublishSnapshot(changes);
+  if (key_frame_cache_ != nullptr) {
+    key_frame_cache_->Erase(original.id);
+  }
+  return true;
+}
+
+bool MoonfireDatabase::DeleteRecordings(
+    std::vector<ListOldestSampleFilesRow> *recordings,
+    std::string *error_message) {
+  if (recordings->empty()) {
+    return true;
+  }
+
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  std::map<int64_t, DeletedRecordings> deleted_by_camera_id;
+  SnapshotChanges changes;
+  std::vector<ListOldestSampleFilesRow> to_delete;
+  for (const auto &recording : *recordings) {
+    // The caller listed the recordings without the lock; since then, the
+    // cold tier mover or thinner may have reserved some of them.
+    auto reserved_run = ctx.Borrow(&is_reserved_stmt_);
+    reserved_run.BindBlob(":uuid", recording.sample_file_uuid.binary_view());
+    int ret = reserved_run.Step();
+    if (ret == SQLITE_ROW) {
+      VLOG(1) << "Skipping deletion of reserved recording "
+              << recording.recording_id;
+      continue;
+    } else if (ret != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message =
+          StrCat("check reservation: ", reserved_run.error_message());
+      return false;
+    }
+    to_delete.push_back(recording);
+
+    DeletedRecordings &deleted = deleted_by_camera_id[recording.camera_id];
+    deleted.duration_90k += recording.duration_90k;
+    deleted.sample_file_bytes += recording.sample_file_bytes;
+
+    RollupRecording rollup;
+    if (!GetRollupRecording(&ctx, recording.recording_id, &rollup,
+                            error_message) ||
+        !UpdateRollups(&ctx, rollup, -1, error_message)) {
+      ctx.RollbackTransaction();
+      return false;
+    }
+    IndexedRecording erased;
+    erased.id = recording.recording_id;
+    erased.start_time_90k = rollup.start_time_90k;
+    changes.erased[recording.camera_id].push_back(erased);
+    changes.reserved.push_back(recording.sample_file_uuid);
+    auto delete_run = ctx.Borrow(&delete_recording_stmt_);
+    delete_run.BindInt64(":recording_id", recording.recording_id);
+    delete_run.BindBlob(":sample_file_uuid",
+                        recording.sample_file_uuid.binary_view());
+    if (delete_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("delete: ", delete_run.error_message());
+      return false;
+    }
+    if (ctx.changes() != 1) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("no such recording ", recording.recording_id);
+      return false;
+    }
+
+    auto insert_run = ctx.Borrow(&insert_reservation_stmt_);
+    insert_run.BindBlob(":uuid", recording.sample_file_uuid.binary_view());
+    insert_run.BindInt64(":state",
+                         static_cast<int64_t>(ReservationState::kDeleting));
+    if (insert_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("insert: ", insert_run.error_message());
+      return false;
+    }
+
+    auto journal_run = ctx.Borrow(&delete_journal_stmt_);
+    journal_run.BindBlob(":uuid", recording.sample_file_uuid.binary_view());
+    if (journal_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("delete journal: ", journal_run.error_message());
+      return false;
+    }
+  }
+  if (to_delete.empty()) {
+    ctx.RollbackTransaction();
+    recordings->clear();
+    return true;
+  }
+  if (!CommitDeletion(&ctx, deleted_by_camera_id, changes, error_message)) {
+    return false;
+  }
+  recordings->swap(to_delete);
+  if (key_frame_cache_ != nullptr) {
+    for (const auto &recording : *recordings) {
+      key_frame_cache_->Erase(recording.recording_id);
+    }
+  }
+  return true;
+}
+
+bool MoonfireDatabase::UpdateRecordingPlayback(DatabaseContext *ctx,
+                                               int64_t recording_id,
+                                               re2::StringPiece video_index,
+                                               std::string *error_message) {
+  auto run = ctx->Borrow(&update_recording_playback_stmt_);
+  run.BindBlob(":video_index", video_index);
+  run.BindInt64(":recording_id", recording_id);
+  if (run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("update playback: ", run.error_message());
+    return false;
+  }
+  if (ctx->changes() != 1) {
+    *error_message = StrCat("recording ", recording_id, " has no playback row");
+    return false;
+  }
+  return true;
+}
+
+void MoonfireDatabase::PublishSnapshot(const SnapshotChanges &changes) {
+  std::shared_ptr<const Snapshot> old = std::atomic_load(&snapshot_);
+  std::shared_ptr<Snapshot> snapshot(new Snapshot(*old));
+  std::set<int64_t> camera_ids;
+  for (const auto &entry : changes.upserted) {
+    camera_ids.insert(entry.first);
+  }
+  for (const auto &entry : changes.erased) {
+    camera_ids.insert(entry.first);
+  }
+  static const std::vector<IndexedRecording> kNone;
+  for (int64_t camera_id : camera_ids) {
+    const CameraSnapshot &old_camera = *old->cameras_by_id.at(camera_id);
+    std::shared_ptr<CameraSnapshot> camera(new CameraSnapshot);
+    camera->stats = cameras_by_id_.at(camera_id)->stats;
+    auto upserted = changes.upserted.find(camera_id);
+    auto erased = changes.erased.find(camera_id);
+    const auto &camera_upserted =
+        upserted == changes.upserted.end() ? kNone : upserted->second;
+    const auto &camera_erased =
+        erased == changes.erased.end() ? kNone : erased->second;
+    if (old_camera.recordings != nullptr) {
+      camera->recordings =
+          old_camera.recordings->Apply(camera_upserted, camera_erased);
+    } else {
+      auto indexing = indexing_.find(camera_id);
+      if (indexing != indexing_.end()) {
+        indexing->second.push_back(
+            CameraChanges{camera_upserted, camera_erased});
+      }
+    }
+    snapshot->cameras_by_id[camera_id] = camera;
+  }
+  if (!changes.reserved.empty() || !changes.unreserved.empty()) {
+    std::shared_ptr<std::set<Uuid>> reserved(
+        new std::set<Uuid>(*old->reserved_uuids));
+    for (const auto &uuid : changes.unreserved) {
+      reserved->erase(uuid);
+    }
+    reserved->insert(changes.reserved.begin(), changes.reserved.end());
+    snapshot->reserved_uuids = reserved;
+  }
+  std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(snapshot));
+}
+
+std::shared_ptr<const RecordingIndex> MoonfireDatabase::GetRecordingIndex(
+    int64_t camera_id, std::string *error_message) {
+  std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+  std::shared_ptr<const RecordingIndex> recordings =
+      snapshot->cameras_by_id.at(camera_id)->recordings;
+  if (recordings != nullptr) {
+    return recordings;
+  }
+
+  std::lock_guard<std::mutex> index_lock(index_mu_);
+  snapshot = std::atomic_load(&snapshot_);
+  recordings = snapshot->cameras_by_id.at(camera_id)->recordings;
+  if (recordings != nullptr) {
+    return recordings;  // another thread got here first.
+  }
+  LOG(INFO) << "Indexing camera " << camera_id << "'s recordings.";
+  std::vector<IndexedRecording> rows;
+  bool ok = true;
+  {
+    DatabaseContext reader(db_, DatabaseAccess::kReadOnly);
+    auto run = reader.UsePrepared(index_camera_recordings_sql_);
+    run.BindInt64(":camera_id", camera_id);
+    int status;
+    {
+      // The first step begins the read transaction. Under the database lock,
+      // it sees every commit so far, and every later one is logged. Without
+      // reader connections, |reader| holds the lock itself throughout.
+      std::unique_ptr<DatabaseContext> ctx;
+      if (reader.db() != db_) {
+        ctx.reset(new DatabaseContext(db_));
+      }
+      status = run.Step();
+      indexing_[camera_id];
+    }
+    if (indexing_hook_ != nullptr) {
+      indexing_hook_();
+    }
+    for (; status == SQLITE_ROW; status = run.Step()) {
+      IndexedRecording recording;
+      recording.id = run.ColumnInt64(0);
+      recording.start_time_90k = run.ColumnInt64(1);
+      recording.end_time_90k = recording.start_time_90k + run.ColumnInt64(2);
+      recording.sample_file_bytes = run.ColumnInt64(3);
+      recording.video_samples = run.ColumnInt64(4);
+      recording.video_sample_entry_id = run.ColumnInt64(5);
+      if (!recording.sample_file_uuid.ParseBinary(run.ColumnBlob(6))) {
+        *error_message = StrCat("recording ", recording.id,
+                                " has unparseable uuid ",
+                                ToHex(run.ColumnBlob(6)));
+        ok = false;
+        break;
+      }
+      recording.sample_file_tier =
+          static_cast<SampleFileTier>(run.ColumnInt64(7));
+      recording.in_container = run.ColumnInt64(8) != 0;
+      rows.push_back(recording);
+    }
+    if (ok && status != SQLITE_DONE) {
+      *error_message =
+          StrCat("Recording list query failed: ", run.error_message());
+      ok = false;
+    }
+  }
+
+  // Apply the commits since the read began, then publish under the lock so
+  // that later commits apply their changes to the new index.
+  DatabaseContext ctx(db_);
+  std::vector<CameraChanges> changes = std::move(indexing_[camera_id]);
+  indexing_.erase(camera_id);
+  if (!ok) {
+    return nullptr;
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const IndexedRecording &a, const IndexedRecording &b) {
+              return std::make_pair(a.start_time_90k, a.id) <
+                     std::make_pair(b.start_time_90k, b.id);
+            });
+  recordings = std::make_shared<RecordingIndex>(rows);
+  for (const auto &commit : changes) {
+    recordings = recordings->Apply(commit.upserted, commit.erased);
+  }
+
+  snapshot = std::atomic_load(&snapshot_);
+  std::shared_ptr<Snapshot> next(new Snapshot(*snapshot));
+  std::shared_ptr<CameraSnapshot> camera(
+      new CameraSnapshot(*snapshot->cameras_by_id.at(camera_id)));
+  camera->recordings = recordings;
+  next->cameras_by_id[camera_id] = camera;
+  std::atomic_store(&snapshot_, std::shared_ptr<const Snapshot>(next));
+  return recordings;
+}
+
+bool MoonfireDatabase::FindIndexedRecording(int64_t camera_id,
+                                            int64_t start_time_90k, int64_t id,
+                                            IndexedRecording *recording,
+                                            std::string *error_message) {
+  std::shared_ptr<const Snapshot> snapshot = std::atomic_load(&snapshot_);
+  auto it = snapshot->cameras_by_id.find(camera_id);
+  if (it != snapshot->cameras_by_id.end() &&
+      it->second->recordings == nullptr) {
+    return true;  // not indexed yet; PublishSnapshot will skip the camera.
+  }
+  if (it == snapshot->cameras_by_id.end() ||
+      !it->second->recordings->Find(start_time_90k, id, recording)) {
+    *error_message = StrCat("recording ", id, " of camera ", camera_id,
+                            " is missing from the snapshot");
+    return false;
+  }
+  return true;
+}
+
+void MoonfireDatabase::BindJournal(const Recording &recording,
+                                   RunningStatement *run) {
+  run->BindBlob(":sample_file_uuid", recording.sample_file_uuid.binary_view());
+  run->BindInt64(":camera_id", recording.camera_id);
+  run->BindInt64(":start_time_90k", recording.start_time_90k);
+  run->BindInt64(":local_time_delta_90k",
+                 recording.local_time_90k - recording.start_time_90k);
+  run->BindInt64(":video_sample_entry_id", recording.video_sample_entry_id);
+  run->BindInt64(":sample_file_hash_algorithm",
+                 static_cast<int64_t>(recording.sample_file_hash_algorithm));
+  run->BindInt64(":sample_file_bytes", recording.sample_file_bytes);
+  run->BindInt64(":duration_90k",
+                 recording.end_time_90k - recording.start_time_90k);
+  run->BindInt64(":video_samples", recording.video_samples);
+  run->BindInt64(":video_sync_samples", recording.video_sync_samples);
+  run->BindBlob(":video_index", recording.video_index);
+}
+
+bool MoonfireDatabase::UpdateJournal(const std::vector<Uuid> &synced,
+                                     const Recording *in_progress,
+                                     std::string *error_message) {
+  bool journal_in_progress =
+      in_progress != nullptr && in_progress->video_samples > 0;
+  if (synced.empty() && !journal_in_progress) {
+    return true;
+  }
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  for (const auto &uuid : synced) {
+    auto delete_run = ctx.Borrow(&delete_journal_stmt_);
+    delete_run.BindBlob(":uuid", uuid.binary_view());
+    if (delete_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("delete journal: ", delete_run.error_message());
+      return false;
+    }
+  }
+  if (journal_in_progress) {
+    auto replace_run = ctx.Borrow(&replace_journal_stmt_);
+    BindJournal(*in_progress, &replace_run);
+    if (replace_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("journal: ", replace_run.error_message());
+      return false;
+    }
+  }
+  if (!ctx.CommitTransaction(error_message)) {
+    *error_message = StrCat("commit: ", *error_message);
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListJournal(std::vector<ListJournalRow> *rows,
+                                   std::string *error_message) {
+  rows->clear();
+  DatabaseContext ctx(db_);
+
+  // This runs only on startup, so it isn't worth preparing.
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        j.sample_file_uuid,
+        j.camera_id,
+        j.start_time_90k,
+        j.local_time_delta_90k,
+        j.video_sample_entry_id,
+        j.sample_file_hash_algorithm,
+        j.sample_file_bytes,
+        j.duration_90k,
+        j.video_samples,
+        j.video_sync_samples,
+        j.video_index,
+        r.id,
+        r.sample_file_bytes,
+        r.duration_90k,
+        r.sample_file_sha1
+      from
+        recording_journal j
+        left join recording r on (j.sample_file_uuid = r.sample_file_uuid);
+      )");
+  while (run.Step() == SQLITE_ROW) {
+    ListJournalRow row;
+    Recording &prefix = row.prefix;
+    if (!prefix.sample_file_uuid.ParseBinary(run.ColumnBlob(0))) {
+      *error_message = StrCat("unparseable uuid ", ToHex(run.ColumnBlob(0)));
+      return false;
+    }
+    prefix.camera_id = run.ColumnInt64(1);
+    prefix.start_time_90k = run.ColumnInt64(2);
+    prefix.local_time_90k = prefix.start_time_90k + run.ColumnInt64(3);
+    prefix.video_sample_entry_id = run.ColumnInt64(4);
+    prefix.sample_file_hash_algorithm =
+        static_cast<HashAlgorithm>(run.ColumnInt64(5));
+    prefix.sample_file_bytes = run.ColumnInt64(6);
+    prefix.end_time_90k = prefix.start_time_90k + run.ColumnInt64(7);
+    prefix.video_samples = run.ColumnInt64(8);
+    prefix.video_sync_samples = run.ColumnInt64(9);
+    prefix.video_index = run.ColumnBlob(10).as_string();
+    if (run.ColumnType(11) != SQLITE_NULL) {
+      prefix.id = run.ColumnInt64(11);
+      row.recording_bytes = run.ColumnInt64(12);
+      row.recording_duration_90k = run.ColumnInt64(13);
+      row.recording_hash = HashFromColumn(run.ColumnBlob(14),
+                                          prefix.sample_file_hash_algorithm);
+    }
+    rows->push_back(std::move(row));
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("list journal: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::RecoverJournaledRecording(ListJournalRow *row,
+                                                 std::string *error_message) {
+  Recording &prefix = row->prefix;
+  if (prefix.video_samples <= 0) {
+    *error_message = StrCat("no durable prefix of ",
+                            prefix.sample_file_uuid.UnparseText());
+    return false;
+  }
+  if (prefix.id == -1) {
+    return InsertRecordingInternal(&prefix, JournalAction::kDelete,
+                                   error_message);
+  }
+
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  RollupRecording rollup;
+  IndexedRecording indexed;
+  if (!GetRollupRecording(&ctx, prefix.id, &rollup, error_message) ||
+      !FindIndexedRecording(rollup.camera_id, rollup.start_time_90k,
+                            prefix.id, &indexed, error_message) ||
+      !UpdateRollups(&ctx, rollup, -1, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  auto update_run = ctx.Borrow(&update_recording_prefix_stmt_);
+  update_run.BindInt64(":sample_file_bytes", prefix.sample_file_bytes);
+  update_run.BindInt64(":duration_90k",
+                       prefix.end_time_90k - prefix.start_time_90k);
+  update_run.BindInt64(":video_samples", prefix.video_samples);
+  update_run.BindInt64(":video_sync_samples", prefix.video_sync_samples);
+  update_run.BindBlob(":sample_file_hash",
+                      HashToColumn(prefix.sample_file_hash,
+                                   prefix.sample_file_hash_algorithm));
+  update_run.BindInt64(":recording_id", prefix.id);
+  update_run.BindBlob(":sample_file_uuid", prefix.sample_file_uuid.binary_view());
+  if (update_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("update recording: ", update_run.error_message());
+    return false;
+  }
+  if (ctx.changes() != 1) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("no such recording ", prefix.id);
+    return false;
+  }
+  if (!UpdateRecordingPlayback(&ctx, prefix.id, prefix.video_index,
+                               error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  rollup.end_time_90k = prefix.end_time_90k;
+  rollup.sample_file_bytes = prefix.sample_file_bytes;
+  rollup.video_samples = prefix.video_samples;
+  if (!UpdateRollups(&ctx, rollup, 1, error_message)) {
+    ctx.RollbackTransaction();
+    return false;
+  }
+  auto delete_run = ctx.Borrow(&delete_journal_stmt_);
+  delete_run.BindBlob(":uuid", prefix.sample_file_uuid.binary_view());
+  if (delete_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("delete journal: ", delete_run.error_message());
+    return false;
+  }
+
+  // The journal doesn't hold activity, so the prefix has none.
+  auto activity_run = ctx.UseOnce(
+      "delete from recording_activity where recording_id = :recording_id;");
+  activity_run.BindInt64(":recording_id", prefix.id);
+  if (activity_run.Step() != SQLITE_DONE) {
+    ctx.RollbackTransaction();
+    *error_message = StrCat("delete activity: ", activity_run.error_message());
+    return false;
+  }
+
+  // The recording has shrunk, which is accounted for as a partial deletion.
+  std::map<int64_t, DeletedRecordings> deleted_by_camera_id;
+  DeletedRecordings &deleted = deleted_by_camera_id[prefix.camera_id];
+  deleted.duration_90k = row->recording_duration_90k -
+                         (prefix.end_time_90k - prefix.start_time_90k);
+  deleted.sample_file_bytes = row->recording_bytes - prefix.sample_file_bytes;
+  SnapshotChanges changes;
+  indexed.end_time_90k = prefix.end_time_90k;
+  indexed.sample_file_bytes = prefix.sample_file_bytes;
+  indexed.video_samples = prefix.video_samples;
+  changes.upserted[rollup.camera_id].push_back(indexed);
+  if (!CommitDeletion(&ctx, deleted_by_camera_id, changes, error_message)) {
+    return false;
+  }
+  if (key_frame_cache_ != nullptr) {
+    key_frame_cache_->Erase(prefix.id);
+  }
+  return true;
+}
+
+bool MoonfireDatabase::InsertContainer(int64_t camera_id, ContainerRow *row,
+                                       std::string *error_message) {
+  if (row->id != -1) {
+    *error_message = StrCat("container already has id ", row->id);
+    return false;
+  }
+  DatabaseContext ctx(db_);
+  if (cameras_by_id_.find(camera_id) == cameras_by_id_.end()) {
+    *error_message = StrCat("no camera with id ", camera_id);
+    return false;
+  }
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  auto delete_run = ctx.Borrow(&delete_reservation_stmt_);
+  delete_run.BindBlob(":uuid", row->uuid.binary_view());
+  if (delete_run.Step() != SQLITE_DONE) {
+    *error_message = delete_run.error_message();
+    ctx.RollbackTransaction();
+    return false;
+  }
+  if (ctx.changes() != 1) {
+    *error_message =
+        StrCat("uuid ", row->uuid.UnparseText(), " is not reserved");
+    ctx.RollbackTransaction();
+    return false;
+  }
+  auto insert_run = ctx.Borrow(&insert_container_stmt_);
+  insert_run.BindInt64(":camera_id", camera_id);
+  insert_run.BindBlob(":uuid", row->uuid.binary_view());
+  insert_run.BindInt64(":size_bytes", row->size_bytes);
+  if (insert_run.Step() != SQLITE_DONE) {
+    *error_message =
+        StrCat("insert failed: ", insert_run.error_message(), ", camera_id=",
+               camera_id, ", uuid=", row->uuid.UnparseText(),
+               ", size_bytes=", row->size_bytes);
+    ctx.RollbackTransaction();
+    return false;
+  }
+  if (!ctx.CommitTransaction(error_message)) {
+    return false;
+  }
+  row->id = ctx.last_insert_rowid();
+  SnapshotChanges changes;
+  changes.unreserved.push_back(row->uuid);
+  PublishSnapshot(changes);
+  return true;
+}
+
+bool MoonfireDatabase::GetNewestContainer(Uuid camera_uuid, ContainerRow *row,
+                                          bool *found,
+                                          std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto it = cameras_by_uuid_.find(camera_uuid);
+  if (it == cameras_by_uuid_.end()) {
+    *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
+    return false;
+  }
+  // This is called only when a stream starts, so it isn't worth preparing.
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        id,
+        uuid,
+        size_bytes,
+        (select
+           coalesce(max(sample_file_offset + sample_file_bytes), 0)
+         from
+           recording
+         where
+           container_id = container.id)
+      from
+        container
+      where
+        camera_id = :camera_id
+      order by
+        id desc
+      limit 1;
+      )");
+  run.BindInt64(":camera_id", it->second.id);
+  if (run.Step() == SQLITE_DONE) {
+    *found = false;
+    return true;
+  } else if (run.status() != SQLITE_ROW) {
+    *error_message = run.error_message();
+    return false;
+  }
+  row->id = run.ColumnInt64(0);
+  if (!row->uuid.ParseBinary(run.ColumnBlob(1))) {
+    *error_message = StrCat("container ", row->id, " has unparseable uuid ",
+                            ToHex(run.ColumnBlob(1)));
+    return false;
+  }
+  row->size_bytes = run.ColumnInt64(2);
+  row->used_bytes = run.ColumnInt64(3);
+  *found = true;
+  return true;
+}
+
+bool MoonfireDatabase::ListOldestContainers(
+    Uuid camera_uuid, int64_t exclude_container_id,
+    std::function<IterationControl(const ListOldestContainersRow &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto it = cameras_by_uuid_.find(camera_uuid);
+  if (it == cameras_by_uuid_.end()) {
+    *error_message = StrCat("no such camera ", camera_uuid.UnparseText());
+    return false;
+  }
+  const CameraData &camera_data = it->second;
+  auto run = ctx.Borrow(&list_oldest_containers_stmt_);
+  run.BindInt64(":camera_id", camera_data.id);
+  run.BindInt64(":exclude_container_id", exclude_container_id);
+  ListOldestContainersRow row;
+  while (run.Step() == SQLITE_ROW) {
+    row.camera_id = camera_data.id;
+    row.container_id = run.ColumnInt64(0);
+    if (!row.uuid.ParseBinary(run.ColumnBlob(1))) {
+      *error_message =
+          StrCat("container ", row.container_id, " has unparseable uuid ",
+                 ToHex(run.ColumnBlob(1)));
+      return false;
+    }
+    row.duration_90k = run.ColumnInt64(2);
+    row.sample_file_bytes = run.ColumnInt64(3);
+    if (row_cb(row) == IterationControl::kBreak) {
+      return true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = run.error_message();
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::DeleteContainers(
+    const std::vector<ListOldestContainersRow> &rows,
+    std::string *error_message) {
+  if (rows.empty()) {
+    return true;
+  }
+
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  std::map<int64_t, DeletedRecordings> deleted_by_camera_id;
+  SnapshotChanges changes;
+  for (const auto &row : rows) {
+    DeletedRecordings &deleted = deleted_by_camera_id[row.camera_id];
+    deleted.duration_90k += row.duration_90k;
+    deleted.sample_file_bytes += row.sample_file_bytes;
+    changes.reserved.push_back(row.uuid);
+
+    std::vector<int64_t> recording_ids;
+    auto list_run = ctx.Borrow(&list_container_recordings_stmt_);
+    list_run.BindInt64(":container_id", row.container_id);
+    while (list_run.Step() == SQLITE_ROW) {
+      recording_ids.push_back(list_run.ColumnInt64(0));
+    }
+    if (list_run.status() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("list recordings: ", list_run.error_message());
+      return false;
+    }
+    for (int64_t recording_id : recording_ids) {
+      RollupRecording rollup;
+      if (!GetRollupRecording(&ctx, recording_id, &rollup, error_message) ||
+          !UpdateRollups(&ctx, rollup, -1, error_message)) {
+        ctx.RollbackTransaction();
+        return false;
+      }
+      IndexedRecording erased;
+      erased.id = recording_id;
+      erased.start_time_90k = rollup.start_time_90k;
+      changes.erased[rollup.camera_id].push_back(erased);
+      auto recordings_run = ctx.Borrow(&delete_container_recordings_stmt_);
+      recordings_run.BindInt64(":recording_id", recording_id);
+      recordings_run.BindInt64(":container_id", row.container_id);
+      if (recordings_run.Step() != SQLITE_DONE) {
+        ctx.RollbackTransaction();
+        *error_message =
+            StrCat("delete recordings: ", recordings_run.error_message());
+        return false;
+      }
+    }
+
+    auto container_run = ctx.Borrow(&delete_container_stmt_);
+    container_run.BindInt64(":container_id", row.container_id);
+    if (container_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message =
+          StrCat("delete container: ", container_run.error_message());
+      return false;
+    }
+    if (ctx.changes() != 1) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("no such container ", row.container_id);
+      return false;
+    }
+
+    auto insert_run = ctx.Borrow(&insert_reservation_stmt_);
+    insert_run.BindBlob(":uuid", row.uuid.binary_view());
+    insert_run.BindInt64(":state",
+                         static_cast<int64_t>(ReservationState::kDeleting));
+    if (insert_run.Step() != SQLITE_DONE) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("insert: ", insert_run.error_message());
+      return false;
+    }
+  }
+  return CommitDeletion(&ctx, deleted_by_camera_id, changes, error_message);
+}
+
+bool MoonfireDatabase::ComputeCameraRecordingBounds(
+    DatabaseContext *ctx, int64_t camera_id, int64_t *min_start_time_90k,
+    int64_t *max_end_time_90k, std::string *error_message) {
+  *min_start_time_90k = -1;
+  *max_end_time_90k = -1;
+
+  // The minimum is straightforward, taking advantage of the start_time_90k
+  // index for speed.
+  auto min_run = ctx->Borrow(&camera_min_start_stmt_);
+  min_run.BindInt64(":camera_id", camera_id);
+  if (min_run.Step() == SQLITE_ROW) {
+    *min_start_time_90k = min_run.ColumnInt64(0);
+  } else if (min_run.status() == SQLITE_DONE) {
+    return true;  // There are no recordings left.
+  } else {
+    *error_message = StrCat("min: ", min_run.error_message());
+    return false;
+  }
+
+  // The maximum is less straightforward in the case of overlap - all
+  // recordings starting in the last kMaxRecordingDuration must be examined
+  // to take advantage of the start_time_90k index.
+  auto max_run = ctx->Borrow(&camera_max_start_stmt_);
+  max_run.BindInt64(":camera_id", camera_id);
+  if (max_run.Step() != SQLITE_ROW) {
+    // If there was a min row, there should be a max row too, so this is an
+    // error even in the SQLITE_DONE case.
+    *error_message = StrCat("max[0]: ", max_run.error_message());
+    return false;
+  }
+  int64_t max_start_90k = max_run.ColumnInt64(0);
+  do {
+    auto end_time_90k = max_run.ColumnInt64(0) + max_run.ColumnInt64(1);
+    *max_end_time_90k = std::max(*max_end_time_90k, end_time_90k);
+  } while (max_run.Step() == SQLITE_ROW &&
+           max_run.ColumnInt64(0) > max_start_90k - kMaxRecordingDuration);
+  if (max_run.status() != SQLITE_DONE && max_run.status() != SQLITE_ROW) {
+    *error_message = StrCat("max[1]: ", max_run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::GetRollupRecording(DatabaseContext *ctx, int64_t id,
+                                          RollupRecording *recording,
+                                          std::string *error_message) {
+  auto run = ctx->UseOnce(
+      R"(
+      select
+        camera_id,
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        video_samples
+      from
+        recording
+      where
+        id = :recording_id;
+      )");
+  run.BindInt64(":recording_id", id);
+  if (run.Step() != SQLITE_ROW) {
+    *error_message = run.status() == SQLITE_DONE
+                         ? StrCat("no such recording ", id)
+                         : StrCat("get recording ", id, ": ",
+                                  run.error_message());
+    return false;
+  }
+  recording->id = id;
+  recording->camera_id = run.ColumnInt64(0);
+  recording->start_time_90k = run.ColumnInt64(1);
+  recording->end_time_90k = recording->start_time_90k + run.ColumnInt64(2);
+  recording->sample_file_bytes = run.ColumnInt64(3);
+  recording->video_samples = run.ColumnInt64(4);
+  return true;
+}
+
+bool MoonfireDatabase::UpdateRollups(DatabaseContext *ctx,
+                                     const RollupRecording &recording,
+                                     int sign, std::string *error_message) {
+  // Count the other recordings ending at |time_90k| (predecessors) or
+  // starting there (successors).
+  auto count = [&](Statement *stmt, int64_t time_90k, int64_t *n) {
+    auto run = ctx->Borrow(stmt);
+    run.BindInt64(":camera_id", recording.camera_id);
+    run.BindInt64(":time_90k", time_90k);
+    run.BindInt64(":exclude_id", recording.id);
+    if (run.Step() != SQLITE_ROW) {
+      *error_message =
+          StrCat("count adjacent recordings: ", run.error_message());
+      return false;
+    }
+    *n = run.ColumnInt64(0);
+    return true;
+  };
+
+  // The recording starts a run unless another ends where it starts. It also
+  // ends the runs started by any successors which have no other predecessor:
+  // adding it joins them to its run, and removing it splits them off again.
+  int64_t predecessors;
+  int64_t successors;
+  int64_t successor_predecessors = 0;
+  if (!count(&count_predecessors_stmt_, recording.start_time_90k,
+             &predecessors) ||
+      !count(&count_successors_stmt_, recording.end_time_90k, &successors) ||
+      (successors > 0 &&
+       !count(&count_predecessors_stmt_, recording.end_time_90k,
+              &successor_predecessors))) {
+    return false;
+  }
+
+  for (RollupPeriod period : {RollupPeriod::kHour, RollupPeriod::kDay}) {
+    auto slices =
+        RollupSlices(period, recording.start_time_90k, recording.end_time_90k,
+                     recording.sample_file_bytes, recording.video_samples);
+    if (predecessors == 0) {
+      slices[0].gaps = 1;
+    }
+    for (auto &slice : slices) {
+      slice.duration_90k *= sign;
+      slice.sample_file_bytes *= sign;
+      slice.video_samples *= sign;
+      slice.gaps *= sign;
+      if (!AddToRollup(ctx, recording.camera_id, period, slice,
+                       error_message)) {
+        return false;
+      }
+    }
+    if (successors > 0 && successor_predecessors == 0) {
+      CameraRollupRow joined;
+      int64_t period_90k = RollupPeriodDuration90k(period);
+      joined.start_time_90k =
+          recording.end_time_90k - recording.end_time_90k % period_90k;
+      joined.gaps = -sign * successors;
+      if (!AddToRollup(ctx, recording.camera_id, period, joined,
+                       error_message)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool MoonfireDatabase::AddToRollup(DatabaseContext *ctx, int64_t camera_id,
+                                   RollupPeriod period,
+                                   const CameraRollupRow &delta,
+                                   std::string *error_message) {
+  auto bind_key = [&](RunningStatement *run) {
+    run->BindInt64(":camera_id", camera_id);
+    run->BindInt64(":period", static_cast<int64_t>(period));
+    run->BindInt64(":start_time_90k", delta.start_time_90k);
+  };
+  auto insert_run = ctx->Borrow(&insert_rollup_stmt_);
+  bind_key(&insert_run);
+  if (insert_run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("insert rollup: ", insert_run.error_message());
+    return false;
+  }
+  auto update_run = ctx->Borrow(&update_rollup_stmt_);
+  bind_key(&update_run);
+  update_run.BindInt64(":duration_90k", delta.duration_90k);
+  update_run.BindInt64(":sample_file_bytes", delta.sample_file_bytes);
+  update_run.BindInt64(":video_samples", delta.video_samples);
+  update_run.BindInt64(":gaps", delta.gaps);
+  if (update_run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("update rollup: ", update_run.error_message());
+    return false;
+  }
+  if (delta.duration_90k < 0 || delta.sample_file_bytes < 0 ||
+      delta.video_samples < 0 || delta.gaps < 0) {
+    auto delete_run = ctx->Borrow(&delete_empty_rollup_stmt_);
+    bind_key(&delete_run);
+    if (delete_run.Step() != SQLITE_DONE) {
+      *error_message = StrCat("delete rollup: ", delete_run.error_message());
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MoonfireDatabase::RebuildRollups(DatabaseContext *ctx, int64_t camera_id,
+                                      std::string *error_message) {
+  auto delete_run = ctx->UseOnce(
+      "delete from recording_rollup where camera_id = :camera_id;");
+  delete_run.BindInt64(":camera_id", camera_id);
+  if (delete_run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("delete rollups: ", delete_run.error_message());
+    return false;
+  }
+
+  // In start time order, a recording's predecessors have all been seen, and
+  // end times before its start can't match any later recording's start.
+  std::map<std::pair<RollupPeriod, int64_t>, CameraRollupRow> rollups;
+  std::multiset<int64_t> end_times_90k;
+  auto run = ctx->UseOnce(
+      R"(
+      select
+        start_time_90k,
+        duration_90k,
+        sample_file_bytes,
+        video_samples
+      from
+        recording
+      where
+        camera_id = :camera_id
+      order by
+        start_time_90k;
+      )");
+  run.BindInt64(":camera_id", camera_id);
+  while (run.Step() == SQLITE_ROW) {
+    int64_t start_time_90k = run.ColumnInt64(0);
+    int64_t end_time_90k = start_time_90k + run.ColumnInt64(1);
+    end_times_90k.erase(end_times_90k.begin(),
+                        end_times_90k.lower_bound(start_time_90k));
+    bool starts_run = end_times_90k.count(start_time_90k) == 0;
+    for (RollupPeriod period : {RollupPeriod::kHour, RollupPeriod::kDay}) {
+      auto slices = RollupSlices(period, start_time_90k, end_time_90k,
+                                 run.ColumnInt64(2), run.ColumnInt64(3));
+      if (starts_run) {
+        slices[0].gaps = 1;
+      }
+      for (const auto &slice : slices) {
+        CameraRollupRow &rollup =
+            rollups[std::make_pair(period, slice.start_time_90k)];
+        rollup.start_time_90k = slice.start_time_90k;
+        rollup.duration_90k += slice.duration_90k;
+        rollup.sample_file_bytes += slice.sample_file_bytes;
+        rollup.video_samples += slice.video_samples;
+        rollup.gaps += slice.gaps;
+      }
+    }
+    end_times_90k.insert(end_time_90k);
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("list recordings: ", run.error_message());
+    return false;
+  }
+  for (const auto &entry : rollups) {
+    if (!AddToRollup(ctx, camera_id, entry.first.first, entry.second,
+                     error_message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ComputeCameraStats(DatabaseContext *ctx,
+                                          int64_t camera_id, CameraStats *stats,
+                                          std::string *error_message) {
+  auto run = ctx->UseOnce(
+      R"(
+      select
+        min(start_time_90k),
+        max(start_time_90k + duration_90k),
+        ifnull(sum(duration_90k), 0),
+        ifnull(sum(sample_file_bytes), 0)
+      from
+        recording
+      where
+        camera_id = :camera_id;
+      )");
+  run.BindInt64(":camera_id", camera_id);
+  if (run.Step() != SQLITE_ROW) {
+    *error_message = StrCat("camera ", camera_id,
+                            " aggregates: ", run.error_message());
+    return false;
+  }
+  stats->min_start_time_90k =
+      run.ColumnType(0) == SQLITE_NULL ? -1 : run.ColumnInt64(0);
+  stats->max_end_time_90k =
+      run.ColumnType(1) == SQLITE_NULL ? -1 : run.ColumnInt64(1);
+  stats->total_duration_90k = run.ColumnInt64(2);
+  stats->total_sample_file_bytes = run.ColumnInt64(3);
+  return true;
+}
+
+bool MoonfireDatabase::WriteCameraStats(DatabaseContext *ctx,
+                                        int64_t camera_id,
+                                        const CameraStats &stats,
+                                        std::string *error_message) {
+  auto run = ctx->Borrow(&replace_camera_stats_stmt_);
+  run.BindInt64(":camera_id", camera_id);
+  if (stats.min_start_time_90k != -1) {
+    run.BindInt64(":min_start_time_90k", stats.min_start_time_90k);
+    run.BindInt64(":max_end_time_90k", stats.max_end_time_90k);
+  }
+  run.BindInt64(":total_duration_90k", stats.total_duration_90k);
+  run.BindInt64(":total_sample_file_bytes", stats.total_sample_file_bytes);
+  if (run.Step() != SQLITE_DONE) {
+    *error_message = StrCat("replace camera_stats of camera ", camera_id, ": ",
+                            run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::CommitDeletion(
+    DatabaseContext *ctx,
+    const std::map<int64_t, DeletedRecordings> &by_camera_id,
+    const SnapshotChanges &changes, std::string *error_message) {
+  std::map<CameraData *, CameraStats> stats_by_camera;
+  for (const auto &entry : by_camera_id) {
+    int64_t camera_id = entry.first;
+    const DeletedRecordings &deleted = entry.second;
+    auto it = cameras_by_id_.find(camera_id);
+    if (it == cameras_by_id_.end()) {
+      ctx->RollbackTransaction();
+      *error_message =
+          StrCat("internal error; can't find camera id ", camera_id);
+      return false;
+    }
+    CameraStats &stats = stats_by_camera[it->second];
+    stats = it->second->stats;
+    stats.total_duration_90k -= deleted.duration_90k;
+    stats.total_sample_file_bytes -= deleted.sample_file_bytes;
+    if (!ComputeCameraRecordingBounds(ctx, camera_id,
+                                      &stats.min_start_time_90k,
+                                      &stats.max_end_time_90k,
+                                      error_message) ||
+        !WriteCameraStats(ctx, camera_id, stats, error_message)) {
+      ctx->RollbackTransaction();
+      return false;
+    }
+  }
+
+  if (!ctx->CommitTransaction(error_message)) {
+    *error_message = StrCat("commit: ", *error_message);
+    return false;
+  }
+
+  for (const auto &entry : stats_by_camera) {
+    entry.first->stats = entry.second;
+  }
+  PublishSnapshot(changes);
+  return true;
+}
+
+bool MoonfireDatabase::MarkSampleFilesDeleted(const std::vector<Uuid> &uuids,
+                                              std::string *error_message) {
+  if (uuids.empty()) {
+    return true;
+  }
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  for (const auto &uuid : uuids) {
+    auto run = ctx.Borrow(&delete_reservation_stmt_);
+    run.BindBlob(":uuid", uuid.binary_view());
+    if (run.Step() != SQLITE_DONE) {
+      *error_message = run.error_message();
+      ctx.RollbackTransaction();
+      return false;
+    }
+    if (ctx.changes() != 1) {
+      *error_message = StrCat("no reservation for uuid ", uuid.UnparseText());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  }
+  if (!ctx.CommitTransaction(error_message)) {
+    return false;
+  }
+  SnapshotChanges changes;
+  changes.unreserved = uuids;
+  PublishSnapshot(changes);
+  return true;
+}
+
+bool MoonfireDatabase::ListRecordingsToScrub(int64_t after_id, int limit,
+                                             std::vector<Recording> *recordings,
+                                             std::string *error_message) {
+  recordings->clear();
+  DatabaseContext ctx(db_);
+
+  // This runs only occasionally, in the background, so it isn't worth
+  // preparing.
+  auto run = ctx.UseOnce(StrCat("select", kSampleFileRecordingColumns, R"(
+      from
+        recording
+      where
+        id > :after_id and
+        sample_file_uuid not in (select uuid from reserved_sample_files) and
+        sample_file_uuid not in
+            (select sample_file_uuid from recording_journal)
+      order by
+        id
+      limit :limit;
+      )"));
+  run.BindInt64(":after_id", after_id);
+  run.BindInt64(":limit", limit);
+  while (run.Step() == SQLITE_ROW) {
+    Recording recording;
+    if (!FillSampleFileRecording(&run, &recording, error_message)) {
+      return false;
+    }
+    recordings->push_back(std::move(recording));
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::IsRecordingCurrent(const Recording &recording,
+                                          bool *current,
+                                          std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        count(*)
+      from
+        recording
+      where
+        id = :id and
+        sample_file_uuid = :sample_file_uuid and
+        sample_file_sha1 = :sample_file_hash and
+        sample_file_tier = :sample_file_tier and
+        sample_file_uuid not in (select uuid from reserved_sample_files);
+      )");
+  run.BindInt64(":id", recording.id);
+  run.BindBlob(":sample_file_uuid", recording.sample_file_uuid.binary_view());
+  run.BindBlob(":sample_file_hash",
+               HashToColumn(recording.sample_file_hash,
+                            recording.sample_file_hash_algorithm));
+  run.BindInt64(":sample_file_tier",
+                static_cast<int64_t>(recording.sample_file_tier));
+  if (run.Step() != SQLITE_ROW) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  *current = run.ColumnInt64(0) > 0;
+  return true;
+}
+
+bool MoonfireDatabase::GetScrubState(ScrubState *state,
+                                     std::string *error_message) {
+  *state = ScrubState();
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        cursor_recording_id,
+        ifnull(pass_start_time_90k, -1),
+        pass_recordings,
+        pass_bytes,
+        completed_passes,
+        ifnull(last_pass_end_time_90k, -1)
+      from
+        scrub_state;
+      )");
+  if (run.Step() == SQLITE_ROW) {
+    state->cursor_recording_id = run.ColumnInt64(0);
+    state->pass_start_time_90k = run.ColumnInt64(1);
+    state->pass_recordings = run.ColumnInt64(2);
+    state->pass_bytes = run.ColumnInt64(3);
+    state->completed_passes = run.ColumnInt64(4);
+    state->last_pass_end_time_90k = run.ColumnInt64(5);
+    run.Step();
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::UpdateScrubState(
+    const ScrubState &state, const std::vector<ScrubMismatchRow> &mismatches,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+  if (!ctx.BeginTransaction(error_message)) {
+    return false;
+  }
+  {
+    auto run = ctx.UseOnce(
+        R"(
+        insert or replace into scrub_state (id,  cursor_recording_id,
+                                            pass_start_time_90k,
+                                            pass_recordings,  pass_bytes,
+                                            completed_passes,
+                                            last_pass_end_time_90k)
+                                    values (1,   :cursor_recording_id,
+                                            nullif(:pass_start_time_90k, -1),
+                                            :pass_recordings, :pass_bytes,
+                                            :completed_passes,
+                                            nullif(:last_pass_end_time_90k, -1));
+        )");
+    run.BindInt64(":cursor_recording_id", state.cursor_recording_id);
+    run.BindInt64(":pass_start_time_90k", state.pass_start_time_90k);
+    run.BindInt64(":pass_recordings", state.pass_recordings);
+    run.BindInt64(":pass_bytes", state.pass_bytes);
+    run.BindInt64(":completed_passes", state.completed_passes);
+    run.BindInt64(":last_pass_end_time_90k", state.last_pass_end_time_90k);
+    if (run.Step() != SQLITE_DONE) {
+      *error_message = StrCat("update scrub state: ", run.error_message());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  }
+  for (const auto &mismatch : mismatches) {
+    auto run = ctx.UseOnce(
+        R"(
+        insert into scrub_mismatch (recording_id,  camera_id,
+                                    sample_file_uuid,  start_time_90k,
+                                    detected_time_90k,  error)
+                            values (:recording_id, :camera_id,
+                                    :sample_file_uuid, :start_time_90k,
+                                    :detected_time_90k, :error);
+        )");
+    run.BindInt64(":recording_id", mismatch.recording_id);
+    run.BindInt64(":camera_id", mismatch.camera_id);
+    run.BindBlob(":sample_file_uuid", mismatch.sample_file_uuid.binary_view());
+    run.BindInt64(":start_time_90k", mismatch.start_time_90k);
+    run.BindInt64(":detected_time_90k", mismatch.detected_time_90k);
+    run.BindText(":error", mismatch.error);
+    if (run.Step() != SQLITE_DONE) {
+      *error_message = StrCat("insert scrub mismatch: ", run.error_message());
+      ctx.RollbackTransaction();
+      return false;
+    }
+  }
+  return ctx.CommitTransaction(error_message);
+}
+
+bool MoonfireDatabase::ListScrubMismatches(
+    std::function<IterationControl(const ScrubMismatchRow &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        recording_id,
+        camera_id,
+        sample_file_uuid,
+        start_time_90k,
+        detected_time_90k,
+        error
+      from
+        scrub_mismatch
+      order by
+        detected_time_90k desc, id desc;
+      )");
+  ScrubMismatchRow row;
+  while (run.Step() == SQLITE_ROW) {
+    row.recording_id = run.ColumnInt64(0);
+    row.camera_id = run.ColumnInt64(1);
+    if (!row.sample_file_uuid.ParseBinary(run.ColumnBlob(2))) {
+      *error_message = StrCat("unparseable uuid ", ToHex(run.ColumnBlob(2)));
+      return false;
+    }
+    row.start_time_90k = run.ColumnInt64(3);
+    row.detected_time_90k = run.ColumnInt64(4);
+    row.error = run.ColumnText(5).as_string();
+    if (row_cb(row) == IterationControl::kBreak) {
+      return true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::CountRecordingsAfter(int64_t after_id,
+                                            int64_t *recordings,
+                                            int64_t *bytes,
+                                            std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        count(*),
+        ifnull(sum(sample_file_bytes), 0)
+      from
+        recording
+      where
+        id > :after_id;
+      )");
+  run.BindInt64(":after_id", after_id);
+  if (run.Step() != SQLITE_ROW) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  *recordings = run.ColumnInt64(0);
+  *bytes = run.ColumnInt64(1);
+  return true;
+}
+
+bool MoonfireDatabase::ListAllRecordings(
+    std::function<IterationControl(const Recording &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(StrCat("select", kSampleFileRecordingColumns, R"(
+      from
+        recording
+      order by
+        id;
+      )"));
+  while (run.Step() == SQLITE_ROW) {
+    Recording recording;
+    if (!FillSampleFileRecording(&run, &recording, error_message)) {
+      return false;
+    }
+    if (row_cb(recording) == IterationControl::kBreak) {
+      return true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListContainers(std::vector<ContainerRow> *rows,
+                                      std::string *error_message) {
+  rows->clear();
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        container.id,
+        container.uuid,
+        container.size_bytes,
+        ifnull(max(recording.sample_file_offset +
+                   recording.sample_file_bytes), 0)
+      from
+        container
+        left join recording on (container.id = recording.container_id)
+      group by
+        container.id
+      order by
+        container.id;
+      )");
+  while (run.Step() == SQLITE_ROW) {
+    ContainerRow row;
+    row.id = run.ColumnInt64(0);
+    if (!row.uuid.ParseBinary(run.ColumnBlob(1))) {
+      *error_message = StrCat("container ", row.id, " has unparseable uuid ",
+                              ToHex(run.ColumnBlob(1)));
+      return false;
+    }
+    row.size_bytes = run.ColumnInt64(2);
+    row.used_bytes = run.ColumnInt64(3);
+    rows->push_back(row);
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListCameraStats(std::vector<CameraStatsRow> *rows,
+                                       std::string *error_message) {
+  rows->clear();
+  DatabaseContext ctx(db_);
+  auto run = ctx.UseOnce(
+      R"(
+      select
+        camera.id,
+        camera_stats.camera_id,
+        camera_stats.min_start_time_90k,
+        camera_stats.max_end_time_90k,
+        camera_stats.total_duration_90k,
+        camera_stats.total_sample_file_bytes
+      from
+        camera
+        left join camera_stats on (camera.id = camera_stats.camera_id)
+      order by
+        camera.id;
+      )");
+  while (run.Step() == SQLITE_ROW) {
+    CameraStatsRow row;
+    row.camera_id = run.ColumnInt64(0);
+    row.present = run.ColumnType(1) != SQLITE_NULL;
+    if (row.present) {
+      row.min_start_time_90k =
+          run.ColumnType(2) == SQLITE_NULL ? -1 : run.ColumnInt64(2);
+      row.max_end_time_90k =
+          run.ColumnType(3) == SQLITE_NULL ? -1 : run.ColumnInt64(3);
+      row.total_duration_90k = run.ColumnInt64(4);
+      row.total_sample_file_bytes = run.ColumnInt64(5);
+    }
+    rows->push_back(row);
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("sqlite query failed: ", run.error_message());
+    return false;
+  }
+  return true;
+}
+
+bool MoonfireDatabase::ListActivityIntervals(
+    int64_t start_time_90k, int64_t end_time_90k, int min_activity,
+    std::function<IterationControl(const ActivityIntervalRow &)> row_cb,
+    std::string *error_message) {
+  DatabaseContext ctx(db_, DatabaseAccess::kReadOnly);
+  for (const auto &camera : cameras_by_uuid_) {
+    auto run = ctx.UsePrepared(list_activity_intervals_sql_);
+    run.BindInt64(":camera_id", camera.second.id);
+    run.BindInt64(":start_time_90k", start_time_90k);
+    run.BindInt64(":end_time_90k", end_time_90k);
+    run.BindInt64(":min_activity", min_activity);
+    ActivityIntervalRow interval;
+    interval.camera_uuid = camera.first;
+    interval.camera_id = camera.second.id;
+    while (run.Step() == SQLITE_ROW) {
+      int64_t recording_start_90k = run.ColumnInt64(0);
+      int64_t recording_end_90k = recording_start_90k + run.ColumnInt64(1);
+      re2::StringPiece activity = run.ColumnBlob(2);
+      for (int64_t i = 0; i < static_cast<int64_t>(activity.size()); ++i) {
+        int64_t second_start_90k =
+            std::max(start_time_90k,
+                     recording_start_90k + i * kTimeUnitsPerSecond);
+        int64_t second_end_90k = std::min(
+            {end_time_90k, recording_end_90k,
+             recording_start_90k + (i + 1) * kTimeUnitsPerSecond});
+        int score = static_cast<uint8_t>(activity[i]);
+        if (second_start_90k >= second_end_90k || score < min_activity) {
+          continue;
+        }
+        if (interval.start_time_90k != -1 &&
+            interval.end_time_90k == second_start_90k) {
+          interval.end_time_90k = second_end_90k;
+          interval.max_activity = std::max(interval.max_activity, score);
+          continue;
+        }
+        if (interval.start_time_90k != -1 &&
+            row_cb(interval) == IterationControl::kBreak) {
+          return true;
+        }
+        interval.start_time_90k = second_start_90k;
+        interval.end_time_90k = second_end_90k;
+        interval.max_activity = score;
+      }
+    }
+    if (run.status() != SQLITE_DONE) {
+      *error_message = StrCat("sqlite query failed: ", run.error_message());
+      return false;
+    }
+    if (interval.start_time_90k != -1 &&
+        row_cb(interval) == IterationControl::kBreak) {
+      return true;
+    }
+  }
   return true;
 }
 
@@ -40,8 +40,9 @@
 //   invoked with the database lock. Thus, the caller mustn't perform database
 //   operations or other long-running operations.
 //
-// * startup may be slow, as it scans the entire index for the recording
-//   table. This seems acceptable.
+// * startup reads each camera's recording aggregates from the camera_stats
+//   table rather than scanning the recording table, except for cameras
+//   which lack a row.
 //
 // * the operations used for web file serving should return results with
 //   acceptable latency.
@@ -61,13 +62,18 @@
 #define MOONFIRE_NVR_MOONFIRE_DB_H
 
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "common.h"
 #include "http.h"
+#include "key-frame-cache.h"
 #include "mp4.h"
+#include "recording-index.h"
 #include "sqlite.h"
 #include "uuid.h"
 
@@ -85,6 +91,7 @@ struct ListCamerasRow {
   std::string main_rtsp_path;
   std::string sub_rtsp_path;
   int64_t retain_bytes = -1;
+  int64_t thin_age_sec = -1;  // -1 if recordings are never thinned.
 
   // Aggregates summarizing completed recordings.
   int64_t min_start_time_90k = -1;
@@ -94,9 +101,8 @@ struct ListCamerasRow {
 };
 
 // For use with MoonfireDatabase::GetCamera.
-// This includes everything in ListCamerasRow. In the future, it will include
-// more data. Likely, that will mean a list of calendar days (in the system
-// time zone) in which there is any data.
+// This includes everything in ListCamerasRow. The days with recordings are
+// available from ListCameraRollups.
 struct GetCameraRow {
   std::string short_name;
   std::string description;
@@ -105,8 +111,21 @@ struct GetCameraRow {
   int64_t max_end_time_90k = -1;
   int64_t total_duration_90k = -1;
   int64_t total_sample_file_bytes = -1;
+};
+
+// The periods summarized by the recording_rollup table: UTC hours and days.
+enum class RollupPeriod { kHour = 0, kDay = 1 };
 
-  // TODO: std::vector<std::string> days;  // keys: YYYY-mm-dd.
+// The length of |period| in 90 kHz units.
+int64_t RollupPeriodDuration90k(RollupPeriod period);
+
+// For use with MoonfireDatabase::ListCameraRollups.
+struct CameraRollupRow {
+  int64_t start_time_90k = -1;  // the start of the hour or day.
+  int64_t duration_90k = 0;     // covered by recordings.
+  int64_t sample_file_bytes = 0;
+  int64_t video_samples = 0;
+  int64_t gaps = 0;  // runs of back-to-back recordings starting here.
 };
 
 // For use with MoonfireDatabase::ListCameraRecordings.
@@ -124,24 +143,125 @@ struct ListCameraRecordingsRow {
   uint16_t height = 0;
 };
 
-// For use with MoonfireDatabase::ListOldestSampleFiles.
+// For use with MoonfireDatabase::ListOldestSampleFiles and
+// MoonfireDatabase::ListOldestHotSampleFiles.
 struct ListOldestSampleFilesRow {
   int64_t camera_id = -1;
   int64_t recording_id = -1;
   Uuid sample_file_uuid;
   int64_t duration_90k = -1;
   int64_t sample_file_bytes = -1;
+  SampleFileTier sample_file_tier = SampleFileTier::kHot;
+};
+
+// For use with MoonfireDatabase::GetNewestContainer.
+struct ContainerRow {
+  int64_t id = -1;
+  Uuid uuid;
+  int64_t size_bytes = -1;
+
+  // The end of the last recording within the container, and thus the offset
+  // at which to append the next one.
+  int64_t used_bytes = 0;
+};
+
+// For use with MoonfireDatabase::ListOldestContainers.
+struct ListOldestContainersRow {
+  int64_t camera_id = -1;
+  int64_t container_id = -1;
+  Uuid uuid;
+
+  // Aggregates of the recordings within the container.
+  int64_t duration_90k = 0;
+  int64_t sample_file_bytes = 0;
+};
+
+// The state of a reserved_sample_files row; see schema.sql.
+enum class ReservationState {
+  kWriting = 0,
+  kDeleting = 1,
+  kMovingToCold = 2,
+  kMovedToCold = 3,
+  kThinning = 4,
+  kWritingThinned = 5
+};
+
+// For use with MoonfireDatabase::ListReservedSampleFiles.
+struct ListReservedSampleFilesRow {
+  Uuid uuid;
+  ReservationState state = ReservationState::kWriting;
+};
+
+// For use with MoonfireDatabase::ListJournal.
+struct ListJournalRow {
+  // The prefix of the sample file which is known to be durable, as a
+  // recording. |prefix.id| is that of the completed recording, or -1 if the
+  // sample file was still being written. |prefix.sample_file_hash| is unset.
+  Recording prefix;
+
+  // If the recording was completed, its full size, duration, and hash.
+  int64_t recording_bytes = -1;
+  int64_t recording_duration_90k = -1;
+  std::string recording_hash;
+};
+
+// For use with MoonfireDatabase::GetScrubState and
+// MoonfireDatabase::UpdateScrubState. See the scrub_state table in schema.sql.
+struct ScrubState {
+  int64_t cursor_recording_id = 0;
+  int64_t pass_start_time_90k = -1;  // -1 between passes.
+  int64_t pass_recordings = 0;
+  int64_t pass_bytes = 0;
+  int64_t completed_passes = 0;
+  int64_t last_pass_end_time_90k = -1;  // -1 if no pass has completed.
+};
+
+// For use with MoonfireDatabase::UpdateScrubState and
+// MoonfireDatabase::ListScrubMismatches.
+struct ScrubMismatchRow {
+  int64_t recording_id = -1;
+  int64_t camera_id = -1;
+  Uuid sample_file_uuid;
+  int64_t start_time_90k = -1;
+  int64_t detected_time_90k = -1;
+  std::string error;
+};
+
+// For use with MoonfireDatabase::ListCameraStats.
+struct CameraStatsRow {
+  int64_t camera_id = -1;
+  bool present = false;  // false if the camera has no camera_stats row.
+  int64_t min_start_time_90k = -1;
+  int64_t max_end_time_90k = -1;
+  int64_t total_duration_90k = -1;
+  int64_t total_sample_file_bytes = -1;
+};
+
+// For use with MoonfireDatabase::ListActivityIntervals.
+struct ActivityIntervalRow {
+  Uuid camera_uuid;
+  int64_t camera_id = -1;
+  int64_t start_time_90k = -1;
+  int64_t end_time_90k = -1;
+  int max_activity = 0;
 };
 
 // Thread-safe after Init.
-// (Uses a DatabaseContext for locking.)
+// (Uses a DatabaseContext for locking.) ListCameras, GetCamera,
+// ListCameraRecordings, and ListOldestSampleFiles instead read an in-memory
+// snapshot, taking no lock and running no queries, except that the first
+// ListCameraRecordings or ListOldestSampleFiles call for a camera reads its
+// recordings under the lock. ListMp4Recordings and ListCameraRollups use
+// read-only contexts, so if the Database has reader connections, they don't
+// wait on writes.
 class MoonfireDatabase {
  public:
   MoonfireDatabase() {}
   MoonfireDatabase(const MoonfireDatabase &) = delete;
   void operator=(const MoonfireDatabase &) = delete;
 
-  // |db| must outlive the MoonfireDatabase.
+  // |db| must outlive the MoonfireDatabase. Fails if the database's schema
+  // version isn't kSchemaVersion (see upgrade.h).
   bool Init(Database *db, std::string *error_message);
 
   // List all cameras in the system, ordered by short name.
@@ -163,8 +283,20 @@ class MoonfireDatabase {
           row_cb,
       std::string *error_message);
 
+  // List a camera's rollups of |period| which start within
+  // [start_time_90k, end_time_90k), newest first. Periods without recordings
+  // are skipped.
+  bool ListCameraRollups(
+      Uuid camera_uuid, RollupPeriod period, int64_t start_time_90k,
+      int64_t end_time_90k,
+      std::function<IterationControl(const CameraRollupRow &)> row_cb,
+      std::string *error_message);
+
   bool ListReservedSampleFiles(std::vector<Uuid> *reserved,
                                std::string *error_message);
+  bool ListReservedSampleFiles(
+      std::vector<ListReservedSampleFilesRow> *reserved,
+      std::string *error_message);
 
   // Reserve |n| new sample file uuids.
   // Returns an empty vector on error.
@@ -181,33 +313,225 @@ class MoonfireDatabase {
   // On success, |recording->id| is filled in.
   bool InsertRecording(Recording *recording, std::string *error_message);
 
+  // As InsertRecording, for a recording written with relaxed durability
+  // whose sample file hasn't been synced yet. The sample file is journaled
+  // (keeping any durable prefix already journaled by UpdateJournal) until a
+  // later UpdateJournal call lists it as synced. See design/schema.md.
+  bool InsertUnsyncedRecording(Recording *recording,
+                               std::string *error_message);
+
+  // Call after syncing the sample file directory's filesystem. Atomically
+  // removes the journal rows of the |synced| sample files and, if
+  // |in_progress| is non-null and has samples, journals its fields as the
+  // durable prefix of its sample file (which is still being written).
+  bool UpdateJournal(const std::vector<Uuid> &synced,
+                     const Recording *in_progress, std::string *error_message);
+
+  // List all journaled sample files, for crash recovery.
+  bool ListJournal(std::vector<ListJournalRow> *rows,
+                   std::string *error_message);
+
+  // Crash recovery: atomically replace a journaled sample file's recording
+  // with |row->prefix| and remove the journal row. If the recording wasn't
+  // completed, this inserts it as InsertRecording does. The caller should
+  // first truncate the sample file to the prefix, sync it, and fill in
+  // |row->prefix.sample_file_hash|; on success, |row->prefix.id| is filled
+  // in.
+  bool RecoverJournaledRecording(ListJournalRow *row,
+                                 std::string *error_message);
+
   // List sample files, starting from the oldest.
   // The caller is expected to supply a |row_cb| that returns kBreak when
   // enough have been listed.
+  // Recordings within containers are not listed; see ListOldestContainers.
   bool ListOldestSampleFiles(
       Uuid camera_uuid,
       std::function<IterationControl(const ListOldestSampleFilesRow &)> row_cb,
       std::string *error_message);
 
-  // Delete recording rows, moving their sample file uuids to the deleting
-  // state.
-  bool DeleteRecordings(const std::vector<ListOldestSampleFilesRow> &rows,
+  // Delete recording rows (and any journal rows), moving their sample file
+  // uuids to the deleting state. Recordings whose sample files have been
+  // reserved since they were listed (as by BeginMoveToCold) are skipped and
+  // removed from |rows|, so on return it holds exactly those deleted.
+  bool DeleteRecordings(std::vector<ListOldestSampleFilesRow> *rows,
                         std::string *error_message);
 
   // Mark a set of sample files as deleted.
   // This shouldn't be called until the files have been unlinke()ed and the
   // parent directory fsync()ed.
   // Returns error if any sample files are not in the deleting state.
+  //
+  // This is also used to finish moving recordings to the cold tier, after
+  // the hot copies have been unlink()ed and the hot directory fsync()ed.
   bool MarkSampleFilesDeleted(const std::vector<Uuid> &uuids,
                               std::string *error_message);
 
+  // Insert a new container, which must have been already reserved with
+  // ReserveSampleFiles and created at its full size.
+  // On success, |row->id| is filled in.
+  bool InsertContainer(int64_t camera_id, ContainerRow *row,
+                       std::string *error_message);
+
+  // Get the camera's most recently inserted container, if any.
+  // On success, sets |found| and (if found) fills |row|.
+  bool GetNewestContainer(Uuid camera_uuid, ContainerRow *row, bool *found,
+                          std::string *error_message);
+
+  // List the camera's containers other than |exclude_container_id|, starting
+  // from the oldest. The caller is expected to supply a |row_cb| that returns
+  // kBreak when enough have been listed.
+  bool ListOldestContainers(
+      Uuid camera_uuid, int64_t exclude_container_id,
+      std::function<IterationControl(const ListOldestContainersRow &)> row_cb,
+      std::string *error_message);
+
+  // Delete containers and all their recordings, moving the containers' uuids
+  // to the deleting state. Afterward, the caller should proceed as with
+  // DeleteRecordings.
+  bool DeleteContainers(const std::vector<ListOldestContainersRow> &rows,
+                        std::string *error_message);
+
+  // List hot-tier sample files of all cameras which ended before
+  // |end_time_90k|, starting from the oldest. As with ListOldestSampleFiles,
+  // recordings within containers are not listed; neither are those not yet
+  // synced (see InsertUnsyncedRecording).
+  // The caller is expected to supply a |row_cb| that returns kBreak when
+  // enough have been listed.
+  bool ListOldestHotSampleFiles(
+      int64_t end_time_90k,
+      std::function<IterationControl(const ListOldestSampleFilesRow &)> row_cb,
+      std::string *error_message);
+
+  // Begin moving hot-tier recordings to the cold tier, reserving their uuids
+  // in the moving state. After this returns successfully, the caller should
+  // write and fsync() the cold copies and fsync() the cold directory, then
+  // call FinishMoveToCold.
+  bool BeginMoveToCold(const std::vector<ListOldestSampleFilesRow> &rows,
+                       std::string *error_message);
+
+  // Atomically mark recordings as held by the cold tier and move their
+  // reservations to the moved state. After this returns successfully, the
+  // caller should unlink() the hot copies, fsync() the hot directory, and
+  // call MarkSampleFilesDeleted.
+  bool FinishMoveToCold(const std::vector<ListOldestSampleFilesRow> &rows,
+                        std::string *error_message);
+
+  // List the camera's recordings which ended before |end_time_90k| and can be
+  // thinned to key frames only, starting from the oldest. These are the
+  // recordings with non-key frames which aren't in containers, reserved, or
+  // journaled.
+  // The caller is expected to supply a |row_cb| that returns kBreak when
+  // enough have been listed.
+  bool ListRecordingsToThin(int64_t camera_id, int64_t end_time_90k,
+                            std::function<IterationControl(Recording &)> row_cb,
+                            std::string *error_message);
+
+  // Begin thinning |recording|, reserving its uuid in the thinning state and
+  // a fresh uuid (returned in |new_uuid|) in the thinned copy state. After
+  // this returns successfully, the caller should write and fsync() the
+  // thinned copy and fsync() its directory, then call FinishThin. To abandon
+  // the attempt instead, unlink() any partial copy, fsync() the directory,
+  // and call MarkSampleFilesDeleted on both uuids.
+  bool BeginThin(const Recording &recording, Uuid *new_uuid,
+                 std::string *error_message);
+
+  // Atomically replace the |original| recording's sample file with the
+  // |thinned| copy (which has the same id and times) and move the original
+  // uuid's reservation to the deleting state. Afterward, the caller should
+  // proceed as with DeleteRecordings.
+  bool FinishThin(const Recording &original, const Recording &thinned,
+                  std::string *error_message);
+
+  // List up to |limit| recordings with ids greater than |after_id| in id
+  // order, for the scrubber. Recordings whose sample files are reserved or
+  // journaled are skipped. Each has its id, camera id, times, and sample file
+  // fields filled.
+  bool ListRecordingsToScrub(int64_t after_id, int limit,
+                             std::vector<Recording> *recordings,
+                             std::string *error_message);
+
+  // Set |current| to whether |recording| (as listed by ListRecordingsToScrub)
+  // still exists with the same sample file, hash, and tier. If not, a failure
+  // to verify it is due to a race with deletion, moving, or thinning rather
+  // than a real mismatch.
+  bool IsRecordingCurrent(const Recording &recording, bool *current,
+                          std::string *error_message);
+
+  // Get the scrubber's progress, leaving |state| at its defaults if none has
+  // been saved.
+  bool GetScrubState(ScrubState *state, std::string *error_message);
+
+  // Save the scrubber's progress and insert |mismatches| found since the last
+  // save, atomically.
+  bool UpdateScrubState(const ScrubState &state,
+                        const std::vector<ScrubMismatchRow> &mismatches,
+                        std::string *error_message);
+
+  // List all scrub mismatches, most recently detected first.
+  bool ListScrubMismatches(
+      std::function<IterationControl(const ScrubMismatchRow &)> row_cb,
+      std::string *error_message);
+
+  // Count the recordings (and their bytes) with ids greater than |after_id|:
+  // those remaining in the scrubber's current pass.
+  bool CountRecordingsAfter(int64_t after_id, int64_t *recordings,
+                            int64_t *bytes, std::string *error_message);
+
+  // List every recording in id order with the same fields as
+  // ListRecordingsToScrub, including those whose sample files are reserved or
+  // journaled. For fsck.
+  bool ListAllRecordings(
+      std::function<IterationControl(const Recording &)> row_cb,
+      std::string *error_message);
+
+  // List all containers, with |used_bytes| filled. For fsck.
+  bool ListContainers(std::vector<ContainerRow> *rows,
+                      std::string *error_message);
+
+  // List each camera's camera_stats row as stored, ordered by camera id. For
+  // fsck, which compares them to the recordings.
+  bool ListCameraStats(std::vector<CameraStatsRow> *rows,
+                       std::string *error_message);
+
+  // List each camera's intervals within [start_time_90k, end_time_90k) in
+  // which every second's activity score is at least |min_activity|, merging
+  // adjacent seconds even across recordings. Cameras are listed in uuid
+  // order and each camera's intervals in time order. This reads only the
+  // database; recordings without a recording_activity row are skipped.
+  bool ListActivityIntervals(
+      int64_t start_time_90k, int64_t end_time_90k, int min_activity,
+      std::function<IterationControl(const ActivityIntervalRow &)> row_cb,
+      std::string *error_message);
+
+  // Keep |cache| current: add each newly inserted recording's key frames
+  // and remove those of recordings which are deleted or rewritten. |cache|
+  // must outlive the MoonfireDatabase. Not thread-safe; call before use.
+  void SetKeyFrameCache(KeyFrameCache *cache) { key_frame_cache_ = cache; }
+
   // Replace the default real UUID generator with the supplied one.
   // Exposed only for testing; not thread-safe.
   void SetUuidGeneratorForTesting(UuidGenerator *uuidgen) {
     uuidgen_ = uuidgen;
   }
 
+  // Call |hook| while GetRecordingIndex reads a camera's recordings, after
+  // their transaction has begun. Given reader connections, it's called
+  // without the database lock, so tests can commit meanwhile. Exposed only
+  // for testing; not thread-safe.
+  void SetIndexingHookForTesting(std::function<void()> hook) {
+    indexing_hook_ = hook;
+  }
+
  private:
+  // Aggregates of all recordings associated with a camera, as kept in the
+  // camera_stats table.
+  struct CameraStats {
+    int64_t min_start_time_90k = -1;
+    int64_t max_end_time_90k = -1;
+    int64_t total_sample_file_bytes = 0;
+    int64_t total_duration_90k = 0;
+  };
+
   struct CameraData {
     // Cached values of the matching fields from the camera row.
     int64_t id = -1;
@@ -219,37 +543,205 @@ class MoonfireDatabase {
     std::string main_rtsp_path;
     std::string sub_rtsp_path;
     int64_t retain_bytes = -1;
+    int64_t thin_age_sec = -1;
 
-    // Aggregates of all recordings associated with the camera.
-    int64_t min_start_time_90k = -1;
-    int64_t max_end_time_90k = -1;
-    int64_t total_sample_file_bytes = -1;
-    int64_t total_duration_90k = -1;
+    // As of the latest commit; readers use the snapshot's copy instead.
+    CameraStats stats;
+  };
+
+  // An immutable view of the cameras' aggregates and recordings and of the
+  // reserved uuids as of the latest commit, so that readers need neither the
+  // database lock nor a query. Readers take the current one with
+  // std::atomic_load. Writers, holding the database lock, publish the next
+  // with std::atomic_store after each commit (see PublishSnapshot); it shares
+  // everything unchanged with the previous one.
+  //
+  // A camera's recordings are indexed on first use (see GetRecordingIndex)
+  // rather than at startup; until then |recordings| is null and commits
+  // update only |stats| (and log their changes to |indexing_| while the
+  // index is being read).
+  struct CameraSnapshot {
+    CameraStats stats;
+    std::shared_ptr<const RecordingIndex> recordings;
   };
+  struct Snapshot {
+    std::map<int64_t, std::shared_ptr<const CameraSnapshot>> cameras_by_id;
+    std::shared_ptr<const std::set<Uuid>> reserved_uuids;
+  };
+
+  // A transaction's changes to one camera's recordings. Erased recordings
+  // need only their ids and start times.
+  struct CameraChanges {
+    std::vector<IndexedRecording> upserted;
+    std::vector<IndexedRecording> erased;
+  };
+
+  // A transaction's changes to the snapshot, by camera id. Erased
+  // recordings need only their ids and start times.
+  struct SnapshotChanges {
+    std::map<int64_t, std::vector<IndexedRecording>> upserted;
+    std::map<int64_t, std::vector<IndexedRecording>> erased;
+    std::vector<Uuid> reserved;
+    std::vector<Uuid> unreserved;
+  };
+
+  // Publish a snapshot with |changes| applied, taking each changed camera's
+  // aggregates from |cameras_by_id_|. Call with the database lock held, after
+  // committing.
+  void PublishSnapshot(const SnapshotChanges &changes);
+
+  // The camera's recordings from the current snapshot, reading and
+  // publishing them first if they aren't indexed yet. The read runs on a
+  // reader connection if there is one, holding the database lock only
+  // while its transaction begins and while the index is published; commits
+  // in between are logged by PublishSnapshot and applied before publishing.
+  // Don't call with the database lock held. Returns null on failure.
+  std::shared_ptr<const RecordingIndex> GetRecordingIndex(
+      int64_t camera_id, std::string *error_message);
+
+  // Fill |recording| from the current snapshot, failing if it isn't there.
+  // If the camera isn't indexed yet, leaves |recording| alone and succeeds;
+  // PublishSnapshot ignores such cameras' recordings. For writers, which
+  // hold the database lock.
+  bool FindIndexedRecording(int64_t camera_id, int64_t start_time_90k,
+                            int64_t id, IndexedRecording *recording,
+                            std::string *error_message);
+
+  // The fields of a recording summarized by recording_rollup.
+  struct RollupRecording {
+    int64_t id = -1;
+    int64_t camera_id = -1;
+    int64_t start_time_90k = -1;
+    int64_t end_time_90k = -1;
+    int64_t sample_file_bytes = 0;
+    int64_t video_samples = 0;
+  };
+
+  // Fill |recording| from recording row |id|.
+  bool GetRollupRecording(DatabaseContext *ctx, int64_t id,
+                          RollupRecording *recording,
+                          std::string *error_message);
+
+  // Add (|sign| 1) or remove (|sign| -1) |recording|'s share of its camera's
+  // rollups within the current transaction. |recording|'s own row is ignored
+  // whether present or not, but the camera's other recordings must be as of
+  // the change, so that gaps are counted consistently.
+  bool UpdateRollups(DatabaseContext *ctx, const RollupRecording &recording,
+                     int sign, std::string *error_message);
+
+  // Add |delta| to a single rollup row, removing the row if it becomes empty.
+  bool AddToRollup(DatabaseContext *ctx, int64_t camera_id,
+                   RollupPeriod period, const CameraRollupRow &delta,
+                   std::string *error_message);
+
+  // Replace |camera_id|'s rollups with ones computed from its recordings.
+  bool RebuildRollups(DatabaseContext *ctx, int64_t camera_id,
+                      std::string *error_message);
+
+  // Compute |camera_id|'s aggregates from the recording table.
+  bool ComputeCameraStats(DatabaseContext *ctx, int64_t camera_id,
+                          CameraStats *stats, std::string *error_message);
 
-  enum class ReservationState { kWriting = 0, kDeleting = 1 };
+  // Replace |camera_id|'s camera_stats row within the current transaction.
+  bool WriteCameraStats(DatabaseContext *ctx, int64_t camera_id,
+                        const CameraStats &stats, std::string *error_message);
 
   // Efficiently (re-)compute the bounds of recorded time for a given camera.
+  // Each is set to -1 if the camera has no recordings.
   bool ComputeCameraRecordingBounds(DatabaseContext *ctx, int64_t camera_id,
                                     int64_t *min_start_time_90k,
                                     int64_t *max_end_time_90k,
                                     std::string *error_message);
 
+  // Finish a transaction which has deleted recordings: recompute the bounds
+  // of each affected camera, commit, update the cached aggregates, and
+  // publish |changes|. Rolls back on failure.
+  struct DeletedRecordings {
+    int64_t duration_90k = 0;
+    int64_t sample_file_bytes = 0;
+  };
+  bool CommitDeletion(DatabaseContext *ctx,
+                      const std::map<int64_t, DeletedRecordings> &by_camera_id,
+                      const SnapshotChanges &changes,
+                      std::string *error_message);
+
+  // What InsertRecordingInternal should do with the sample file's
+  // recording_journal row, within the same transaction.
+  enum class JournalAction { kNone, kCreate, kDelete };
+  bool InsertRecordingInternal(Recording *recording, JournalAction action,
+                               std::string *error_message);
+
+  // Copy video sample entry |id| to |entry|, returning false if it doesn't
+  // exist. For use without the database lock.
+  bool GetVideoSampleEntry(int64_t id, VideoSampleEntry *entry);
+
+  // Replace the recording_playback row of a recording whose samples have
+  // changed, within |ctx|'s transaction.
+  bool UpdateRecordingPlayback(DatabaseContext *ctx, int64_t recording_id,
+                               re2::StringPiece video_index,
+                               std::string *error_message);
+
+  // Bind the fields of |recording| to a statement inserting a journal row.
+  static void BindJournal(const Recording &recording, RunningStatement *run);
+
   Database *db_ = nullptr;
   UuidGenerator *uuidgen_ = GetRealUuidGenerator();
-  Statement list_camera_recordings_stmt_;
-  Statement build_mp4_stmt_;
+  KeyFrameCache *key_frame_cache_ = nullptr;
+  // Run through reader connections; see Database::OpenReaders.
+  std::string build_mp4_sql_;
+
   Statement insert_reservation_stmt_;
   Statement delete_reservation_stmt_;
+  Statement is_reserved_stmt_;
   Statement insert_video_sample_entry_stmt_;
   Statement insert_recording_stmt_;
-  Statement list_oldest_sample_files_stmt_;
+  Statement insert_recording_playback_stmt_;
+  Statement update_recording_playback_stmt_;
+  Statement list_oldest_hot_sample_files_stmt_;
+  Statement update_recording_tier_stmt_;
+  Statement update_reservation_state_stmt_;
   Statement delete_recording_stmt_;
+  Statement insert_container_stmt_;
+  Statement list_oldest_containers_stmt_;
+  Statement delete_container_recordings_stmt_;
+  Statement delete_container_stmt_;
+  Statement update_recording_thinned_stmt_;
+  Statement insert_journal_stmt_;
+  Statement replace_journal_stmt_;
+  Statement delete_journal_stmt_;
+  Statement update_recording_prefix_stmt_;
   Statement camera_min_start_stmt_;
   Statement camera_max_start_stmt_;
-
+  Statement replace_camera_stats_stmt_;
+  Statement insert_rollup_stmt_;
+  Statement update_rollup_stmt_;
+  Statement delete_empty_rollup_stmt_;
+  Statement count_predecessors_stmt_;
+  Statement count_successors_stmt_;
+  Statement list_container_recordings_stmt_;
+  // Run through reader connections, like build_mp4_sql_.
+  std::string index_camera_recordings_sql_;
+  std::string list_camera_rollups_sql_;
+  std::string list_activity_intervals_sql_;
+
+  // Their structure is fixed by Init; only CameraData::stats changes.
   std::map<Uuid, CameraData> cameras_by_uuid_;
   std::map<int64_t, CameraData *> cameras_by_id_;
+
+  // Access only through std::atomic_load and std::atomic_store.
+  std::shared_ptr<const Snapshot> snapshot_;
+
+  // Held by GetRecordingIndex while indexing, so each camera is read once.
+  std::mutex index_mu_;
+
+  // The changes committed to each camera being indexed since its read began,
+  // in commit order. Guarded by the database lock.
+  std::map<int64_t, std::vector<CameraChanges>> indexing_;
+  std::function<void()> indexing_hook_;
+
+  // Inserts into |video_sample_entries_| hold both the database lock and
+  // |video_sample_entries_mu_|, so lookups need either one.
+  std::mutex video_sample_entries_mu_;
   std::map<int64_t, VideoSampleEntry> video_sample_entries_;
 };
 
@@ -33,7 +33,10 @@
 // googletest framework.
 
 #include <fcntl.h>
+#include <inttypes.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -46,12 +49,20 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "crypto.h"
+#include "disk-stats.h"
 #include "ffmpeg.h"
+#include "fsck.h"
+#include "io-priority.h"
+#include "key-frame-cache.h"
 #include "profiler.h"
 #include "moonfire-db.h"
 #include "moonfire-nvr.h"
+#include "sample-file-dir.h"
 #include "sqlite.h"
 #include "string.h"
+#include "unlinker.h"
+#include "upgrade.h"
 #include "web.h"
 
 using moonfire_nvr::StrCat;
@@ -59,6 +70,28 @@ using moonfire_nvr::StrCat;
 DEFINE_int32(http_port, 0, "");
 DEFINE_string(db_dir, "", "");
 DEFINE_string(sample_file_dir, "", "");
+DEFINE_string(cold_sample_file_dir, "", "");
+DEFINE_int64(cold_tier_age_sec, 24 * 60 * 60, "");
+DEFINE_int32(sample_file_dir_shard_levels, 1, "");
+DEFINE_int64(sample_file_container_bytes, 0, "");
+DEFINE_int64(sample_file_sync_interval_sec, 0, "");
+DEFINE_int32(unlink_concurrency, 4, "");
+DEFINE_double(unlink_max_per_sec, 0, "");
+DEFINE_string(sample_file_hash, "xxh3_128", "");
+DEFINE_string(export_dir, "", "");
+DEFINE_double(disk_time_warn_fraction, 0.8, "");
+DEFINE_double(serving_max_bytes_per_sec, 40e6, "");
+DEFINE_double(maintenance_max_bytes_per_sec, 0, "");
+DEFINE_bool(scrub_sample_files, true, "");
+DEFINE_double(scrub_max_bytes_per_sec, 20e6, "");
+DEFINE_double(scrub_max_cpu_fraction, 0.25, "");
+DEFINE_int32(fsck_concurrency, 16, "");
+DEFINE_int64(key_frame_cache_bytes, 16 << 20, "");
+DEFINE_bool(db_wal, true, "");
+DEFINE_int64(db_wal_truncate_bytes, 64 << 20, "");
+DEFINE_int64(db_cache_size_kib, 16 << 10, "");
+DEFINE_int64(db_mmap_size_bytes, 256 << 20, "");
+DEFINE_int32(db_readers, 4, "");
 
 namespace {
 
@@ -97,6 +130,119 @@ void FlushLogsCallback(evutil_socket_t, short, void* ev) {
            event_add(reinterpret_cast<struct event*>(ev), &kLogFlushInterval));
 }
 
+// Open the sample file directory specified by the given flag, or exit.
+moonfire_nvr::ShardedSampleFileDir* OpenSampleFileDir(const char* flag_name,
+                                                      const std::string& path) {
+  std::unique_ptr<moonfire_nvr::File> dir;
+  int ret = moonfire_nvr::GetRealFilesystem()->Open(
+      path.c_str(), O_DIRECTORY | O_RDONLY, &dir);
+  if (ret != 0) {
+    LOG(ERROR) << "Unable to open --" << flag_name << "=" << path << ": "
+               << strerror(ret) << "; exiting.";
+    exit(1);
+  }
+  auto* sharded = new moonfire_nvr::ShardedSampleFileDir(
+      std::move(dir), FLAGS_sample_file_dir_shard_levels);
+  std::string error_msg;
+  if (!sharded->Init(&error_msg)) {
+    LOG(ERROR) << "Unable to initialize --" << flag_name << "=" << path << ": "
+               << error_msg << "; exiting.";
+    exit(1);
+  }
+  return sharded;
+}
+
+// Run the "export" subcommand, writing the given .mp4 file without starting
+// the NVR. |argv| holds the arguments following "export".
+int RunExport(moonfire_nvr::WebInterface* web, int argc, char** argv) {
+  moonfire_nvr::Uuid camera_uuid;
+  int64_t start_time_90k;
+  int64_t end_time_90k;
+  if (argc != 4 || !camera_uuid.ParseText(argv[0]) ||
+      !moonfire_nvr::Atoi64(argv[1], 10, &start_time_90k) ||
+      !moonfire_nvr::Atoi64(argv[2], 10, &end_time_90k) ||
+      start_time_90k < 0 || start_time_90k >= end_time_90k) {
+    LOG(ERROR) << "usage: moonfire-nvr [flags] export CAMERA_UUID "
+               << "START_TIME_90K END_TIME_90K PATH";
+    return 1;
+  }
+  std::unique_ptr<moonfire_nvr::File> cwd;
+  int ret = moonfire_nvr::GetRealFilesystem()->Open(
+      ".", O_DIRECTORY | O_RDONLY, &cwd);
+  if (ret != 0) {
+    LOG(ERROR) << "Unable to open working directory: " << strerror(ret);
+    return 1;
+  }
+  std::string error_msg;
+  int64_t bytes;
+  if (!web->ExportMp4(camera_uuid, start_time_90k, end_time_90k, cwd.get(),
+                      argv[3], &bytes, &error_msg)) {
+    LOG(ERROR) << "Unable to export: " << error_msg;
+    return 1;
+  }
+  return 0;
+}
+
+// Run the "fsck" subcommand, checking the sample file invariants at the level
+// named in |argv| (by default, "size") without starting the NVR. Returns 0 if
+// no problems were found.
+int RunFsck(moonfire_nvr::MoonfireDatabase* mdb,
+            moonfire_nvr::ShardedSampleFileDir* sample_file_dir,
+            moonfire_nvr::ShardedSampleFileDir* cold_sample_file_dir,
+            int argc, char** argv) {
+  moonfire_nvr::FsckLevel level = moonfire_nvr::FsckLevel::kSize;
+  if (argc > 1 ||
+      (argc == 1 && !moonfire_nvr::ParseFsckLevel(argv[0], &level))) {
+    LOG(ERROR) << "usage: moonfire-nvr [flags] fsck [presence|size|hash]";
+    return 1;
+  }
+  moonfire_nvr::FsckReport report;
+  std::string error_msg;
+  if (!moonfire_nvr::CheckSampleFiles(
+          mdb, sample_file_dir, cold_sample_file_dir,
+          moonfire_nvr::GetRealClock(), level, FLAGS_fsck_concurrency, &report,
+          &error_msg)) {
+    LOG(ERROR) << "Unable to check sample files: " << error_msg;
+    return 1;
+  }
+  for (const auto& problem : report.problems) {
+    printf("%s\n", problem.c_str());
+  }
+  printf("%" PRId64 " recordings, %" PRId64 " containers, %" PRId64
+         " reservations, %" PRId64 " sample files.\n",
+         report.recordings, report.containers, report.reserved, report.files);
+  printf("presence: %.3f sec\n", report.presence_sec);
+  if (report.size_sec >= 0) {
+    printf("size:     %.3f sec\n", report.size_sec);
+  }
+  if (report.hash_sec >= 0) {
+    std::string rate = moonfire_nvr::HumanizeWithBinaryPrefix(
+        report.hash_sec > 0 ? report.hashed_bytes / report.hash_sec : 0,
+        "B/s");
+    printf("hash:     %.3f sec (%s)\n", report.hash_sec, rate.c_str());
+  }
+  printf("%zu problems found.\n", report.problems.size());
+  return report.problems.empty() ? 0 : 1;
+}
+
+// Run the "upgrade" subcommand, bringing the database in --db_dir up to the
+// current schema version without starting the NVR.
+int RunUpgrade(int argc, char** argv) {
+  if (argc != 0) {
+    LOG(ERROR) << "usage: moonfire-nvr [flags] upgrade";
+    return 1;
+  }
+  moonfire_nvr::Database db;
+  std::string error_msg;
+  if (!db.Open(StrCat(FLAGS_db_dir, "/db").c_str(), SQLITE_OPEN_READWRITE,
+               &error_msg) ||
+      !moonfire_nvr::UpgradeSchema(&db, &error_msg)) {
+    LOG(ERROR) << "Unable to upgrade: " << error_msg;
+    return 1;
+  }
+  return 0;
+}
+
 }  // namespace
 
 // Note that main never returns; it calls exit on either success or failure.
@@ -111,8 +257,13 @@ int main(int argc, char** argv) {
   google::InstallFailureSignalHandler();
   signal(SIGPIPE, SIG_IGN);
 
-  if (FLAGS_sample_file_dir.empty()) {
-    LOG(ERROR) << "--sample_file_dir must be specified; exiting.";
+  // The subcommands are "export", "fsck", and "upgrade"; with no arguments,
+  // run the NVR.
+  bool exporting = argc > 1 && strcmp(argv[1], "export") == 0;
+  bool checking = argc > 1 && strcmp(argv[1], "fsck") == 0;
+  bool upgrading = argc > 1 && strcmp(argv[1], "upgrade") == 0;
+  if (argc > 1 && !exporting && !checking && !upgrading) {
+    LOG(ERROR) << "Unknown subcommand " << argv[1] << "; exiting.";
     exit(1);
   }
 
@@ -121,7 +272,17 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
-  if (FLAGS_http_port == 0) {
+  // Upgrading needs only the database.
+  if (upgrading) {
+    exit(RunUpgrade(argc - 2, argv + 2));
+  }
+
+  if (FLAGS_sample_file_dir.empty()) {
+    LOG(ERROR) << "--sample_file_dir must be specified; exiting.";
+    exit(1);
+  }
+
+  if (FLAGS_http_port == 0 && !exporting && !checking) {
     LOG(ERROR) << "--http_port must be specified; exiting.";
     exit(1);
   }
@@ -130,44 +291,201 @@ int main(int argc, char** argv) {
   env.clock = moonfire_nvr::GetRealClock();
   env.video_source = moonfire_nvr::GetRealVideoSource();
 
-  std::unique_ptr<moonfire_nvr::File> sample_file_dir;
-  int ret = moonfire_nvr::GetRealFilesystem()->Open(
-      FLAGS_sample_file_dir.c_str(), O_DIRECTORY | O_RDONLY, &sample_file_dir);
-  if (ret != 0) {
-    LOG(ERROR) << "Unable to open --sample_file_dir=" << FLAGS_sample_file_dir
-               << ": " << strerror(ret) << "; exiting.";
+  if (FLAGS_sample_file_dir_shard_levels < 0 ||
+      FLAGS_sample_file_dir_shard_levels >
+          moonfire_nvr::ShardedSampleFileDir::kMaxLevels) {
+    LOG(ERROR) << "--sample_file_dir_shard_levels must be in [0, "
+               << moonfire_nvr::ShardedSampleFileDir::kMaxLevels
+               << "]; exiting.";
+    exit(1);
+  }
+
+  if (FLAGS_sample_file_container_bytes < 0) {
+    LOG(ERROR) << "--sample_file_container_bytes must be non-negative; "
+               << "exiting.";
+    exit(1);
+  }
+  if (FLAGS_sample_file_container_bytes > 0 &&
+      !FLAGS_cold_sample_file_dir.empty()) {
+    LOG(ERROR) << "--sample_file_container_bytes and --cold_sample_file_dir "
+               << "can't be used together; exiting.";
+    exit(1);
+  }
+  env.container_bytes = FLAGS_sample_file_container_bytes;
+
+  if (FLAGS_sample_file_sync_interval_sec < 0) {
+    LOG(ERROR) << "--sample_file_sync_interval_sec must be non-negative; "
+               << "exiting.";
+    exit(1);
+  }
+  if (FLAGS_sample_file_sync_interval_sec > 0 &&
+      FLAGS_sample_file_container_bytes > 0) {
+    LOG(ERROR) << "--sample_file_sync_interval_sec and "
+               << "--sample_file_container_bytes can't be used together; "
+               << "exiting.";
+    exit(1);
+  }
+  env.sync_interval_sec = FLAGS_sample_file_sync_interval_sec;
+  moonfire_nvr::FilesystemSyncer filesystem_syncer;
+  env.filesystem_syncer = &filesystem_syncer;
+
+  if (FLAGS_unlink_concurrency < 1) {
+    LOG(ERROR) << "--unlink_concurrency must be positive; exiting.";
+    exit(1);
+  }
+  moonfire_nvr::Unlinker unlinker(env.clock,
+                                  FLAGS_unlink_concurrency,
+                                  FLAGS_unlink_max_per_sec);
+  env.unlinker = &unlinker;
+
+  // Retention is limited by --unlink_max_per_sec above; recording never is.
+  moonfire_nvr::IoThrottle io_throttle(env.clock);
+  io_throttle.SetLimit(moonfire_nvr::IoClass::kServing,
+                       FLAGS_serving_max_bytes_per_sec);
+  io_throttle.SetLimit(moonfire_nvr::IoClass::kMaintenance,
+                       FLAGS_maintenance_max_bytes_per_sec);
+  io_throttle.SetLimit(moonfire_nvr::IoClass::kScrubbing,
+                       FLAGS_scrub_max_bytes_per_sec);
+  env.io_throttle = &io_throttle;
+  env.scrub_sample_files = FLAGS_scrub_sample_files;
+  env.scrub_max_cpu_fraction = FLAGS_scrub_max_cpu_fraction;
+
+  if (!moonfire_nvr::ParseHashAlgorithm(FLAGS_sample_file_hash,
+                                        &env.sample_file_hash_algorithm)) {
+    LOG(ERROR) << "--sample_file_hash must be sha1 or xxh3_128; exiting.";
+    exit(1);
+  }
+  moonfire_nvr::DigestWorker digest_worker;
+  env.digest_worker = &digest_worker;
+
+  moonfire_nvr::ShardedSampleFileDir* sample_file_dir =
+      OpenSampleFileDir("sample_file_dir", FLAGS_sample_file_dir);
+  moonfire_nvr::ShardedSampleFileDir* cold_sample_file_dir = nullptr;
+  env.sample_file_dir = sample_file_dir;
+
+  if (!FLAGS_cold_sample_file_dir.empty()) {
+    cold_sample_file_dir =
+        OpenSampleFileDir("cold_sample_file_dir", FLAGS_cold_sample_file_dir);
+    env.cold_sample_file_dir = cold_sample_file_dir;
+    env.cold_tier_age_sec = FLAGS_cold_tier_age_sec;
+  }
+
+  // Count sample file I/O toward each disk, warning as one nears saturation.
+  // The flat layout migration below bypasses this, as it's a one-time cost.
+  if (FLAGS_disk_time_warn_fraction < 0) {
+    LOG(ERROR) << "--disk_time_warn_fraction must be non-negative; exiting.";
     exit(1);
   }
-  env.sample_file_dir = sample_file_dir.release();
+  std::unique_ptr<moonfire_nvr::DiskMonitor> disk_monitor;
+  if (FLAGS_disk_time_warn_fraction > 0) {
+    disk_monitor.reset(new moonfire_nvr::DiskMonitor(
+        env.clock, FLAGS_disk_time_warn_fraction));
+    env.disk_monitor = disk_monitor.get();
+    env.sample_file_dir =
+        disk_monitor->AddDisk("sample_file_dir", sample_file_dir);
+    if (cold_sample_file_dir != nullptr) {
+      env.cold_sample_file_dir =
+          disk_monitor->AddDisk("cold_sample_file_dir", cold_sample_file_dir);
+    }
+  }
 
+  // With write-ahead logging, the main connection leaves checkpoints to a
+  // background thread; it waits on the thread's brief locks if need be.
   moonfire_nvr::Database db;
   std::string error_msg;
   std::string db_path = StrCat(FLAGS_db_dir, "/db");
-  if (!db.Open(db_path.c_str(), SQLITE_OPEN_READWRITE, &error_msg)) {
+  moonfire_nvr::DatabaseOptions db_options;
+  db_options.wal = FLAGS_db_wal;
+  db_options.wal_autocheckpoint = false;
+  db_options.cache_size_kib = FLAGS_db_cache_size_kib;
+  db_options.mmap_size_bytes = FLAGS_db_mmap_size_bytes;
+  db_options.busy_timeout_ms = 5000;
+  if (!db.Open(db_path.c_str(),
+               checking ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE,
+               db_options, &error_msg)) {
     LOG(ERROR) << error_msg << "; exiting.";
     exit(1);
   }
+  moonfire_nvr::WalCheckpointer wal_checkpointer(env.clock,
+                                                 FLAGS_db_wal_truncate_bytes);
+  if (FLAGS_db_wal && !checking) {
+    if (!wal_checkpointer.Open(db_path.c_str(), &error_msg)) {
+      LOG(ERROR) << error_msg << "; exiting.";
+      exit(1);
+    }
+    env.wal_checkpointer = &wal_checkpointer;
+
+    // Web queries read through their own connections.
+    if (FLAGS_db_readers > 0 &&
+        !db.OpenReaders(FLAGS_db_readers, db_options, &error_msg)) {
+      LOG(ERROR) << error_msg << "; exiting.";
+      exit(1);
+    }
+  }
 
   moonfire_nvr::MoonfireDatabase mdb;
-  CHECK(mdb.Init(&db, &error_msg)) << error_msg;
+  if (!mdb.Init(&db, &error_msg)) {
+    LOG(ERROR) << error_msg << "; exiting.";
+    exit(1);
+  }
   env.mdb = &mdb;
+  std::unique_ptr<moonfire_nvr::KeyFrameCache> key_frame_cache;
+  if (FLAGS_key_frame_cache_bytes > 0) {
+    key_frame_cache.reset(
+        new moonfire_nvr::KeyFrameCache(FLAGS_key_frame_cache_bytes));
+    mdb.SetKeyFrameCache(key_frame_cache.get());
+    env.key_frame_cache = key_frame_cache.get();
+  }
+
+  // Streams queue sample files for the Nvr to unlink in the background.
+  moonfire_nvr::SampleFileDeleter sample_file_deleter(&env);
+  env.sample_file_deleter = &sample_file_deleter;
+
+  if (checking) {
+    exit(RunFsck(&mdb, sample_file_dir, cold_sample_file_dir, argc - 2,
+                 argv + 2));
+  }
+
+  std::unique_ptr<moonfire_nvr::File> export_dir;
+  if (!FLAGS_export_dir.empty()) {
+    int ret = moonfire_nvr::GetRealFilesystem()->Open(
+        FLAGS_export_dir.c_str(), O_DIRECTORY | O_RDONLY, &export_dir);
+    if (ret != 0) {
+      LOG(ERROR) << "Unable to open --export_dir=" << FLAGS_export_dir << ": "
+                 << strerror(ret) << "; exiting.";
+      exit(1);
+    }
+    env.export_dir = export_dir.get();
+  }
 
   moonfire_nvr::WebInterface web(&env);
+  if (exporting) {
+    moonfire_nvr::SetThreadIoClass(moonfire_nvr::IoClass::kServing);
+    exit(RunExport(&web, argc - 2, argv + 2));
+  }
 
   event_set_log_callback(&EventLogCallback);
   LOG(INFO) << "libevent: compiled with version " << LIBEVENT_VERSION
             << ", running with version " << event_get_version();
   base = CHECK_NOTNULL(event_base_new());
 
+  for (auto* dir : {sample_file_dir, cold_sample_file_dir}) {
+    if (dir != nullptr) {
+      env.dirs_to_migrate.push_back(dir);
+    }
+  }
   std::unique_ptr<moonfire_nvr::Nvr> nvr(new moonfire_nvr::Nvr(&env));
   if (!nvr->Init(&error_msg)) {
     LOG(ERROR) << "Unable to initialize: " << error_msg << "; exiting.";
     exit(1);
   }
 
+  // The main thread serves HTTP requests, including .mp4 files.
+  moonfire_nvr::SetThreadIoClass(moonfire_nvr::IoClass::kServing);
+
   evhttp* http = CHECK_NOTNULL(evhttp_new(base));
   moonfire_nvr::RegisterProfiler(base, http);
-  web.Register(http);
+  web.Register(base, http);
   if (evhttp_bind_socket(http, "0.0.0.0", FLAGS_http_port) != 0) {
     LOG(ERROR) << "Unable to bind to --http_port=" << FLAGS_http_port
                << "; exiting.";
@@ -34,9 +34,10 @@
 //
 // Currently the recording thread blocks while a just-finished recording
 // is synced to disk and written to the database, which can be 250+ ms.
-// Likewise when recordings are being deleted. It would be better to hand
-// off to a separate syncer thread, only blocking the recording when there
-// would otherwise be insufficient disk space.
+// Likewise when recordings are being deleted from the database, although
+// their sample files are unlinked by the SampleFileDeleter's thread. It would
+// be better to hand off to a separate syncer thread, only blocking the
+// recording when there would otherwise be insufficient disk space.
 //
 // This also commits to the SQLite database potentially several times per
 // minute per camera:
@@ -65,6 +66,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <event2/http.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -85,11 +88,116 @@ namespace {
 
 const int kRotateIntervalSec = 60;
 
+// The most sample files the SampleFileDeleter unlinks before checking for
+// shutdown, and how long it waits after failing.
+const size_t kDeleteBatchFiles = 100;
+const int kDeleteRetrySec = 60;
+
+// How long the SampleFileMover waits after finding nothing to move.
+const int kMoveIntervalSec = 60;
+
+// The SampleFileMover copies recordings in batches of roughly this many
+// bytes, so that the cold tier's directory is fsync()ed once per batch and
+// the hard drive sees long sequential writes.
+const int64_t kMoveBatchBytes = INT64_C(256) << 20;
+
+const size_t kCopyBufferSize = 1 << 20;
+
+// How long the SampleFileThinner waits after finding nothing to thin.
+const int kThinIntervalSec = 60;
+
+// The most recordings of a single camera the SampleFileThinner lists at once.
+const int kThinBatchRecordings = 100;
+
+// The most recordings the SampleFileScrubber verifies before saving its
+// progress.
+const int kScrubBatchRecordings = 100;
+
+// How long the SampleFileScrubber waits between passes, measured from the end
+// of one to the start of the next.
+const int64_t kScrubPassIntervalSec = 24 * 60 * 60;
+
+// How long the SampleFileScrubber waits after finding nothing to scrub.
+const int kScrubIntervalSec = 60;
+
+// How often the disk time fraction is computed. Long enough to average over
+// several recordings' writes and syncs.
+const int kDiskSampleIntervalSec = 10;
+
+// How often the write-ahead log is checkpointed. Each stream commits about
+// once per recording, so the log stays small between checkpoints.
+const int kWalCheckpointIntervalSec = 5;
+
+// Sample files moved out of the flat layout per batch, and the pause after a
+// failed batch.
+const int kMigrationBatchFiles = 1000;
+const int kMigrationRetrySec = 60;
+
+// Hash the first |bytes| bytes of the sample file |filename| within |dir|,
+// first truncating it to that length if |truncate| is set. Returns 0 on
+// success, ENODATA if the file is shorter than |bytes|, or another errno>0 on
+// failure.
+int HashSampleFilePrefix(File *dir, const std::string &filename, int64_t bytes,
+                         bool truncate, HashAlgorithm algorithm,
+                         std::string *hash) {
+  std::unique_ptr<File> f;
+  int ret = dir->Open(filename.c_str(), truncate ? O_RDWR : O_RDONLY, &f);
+  if (ret != 0) {
+    return ret;
+  }
+  struct stat statbuf;
+  ret = f->Stat(&statbuf);
+  if (ret != 0) {
+    return ret;
+  }
+  if (statbuf.st_size < bytes) {
+    return ENODATA;
+  }
+  if (truncate && statbuf.st_size > bytes) {
+    ret = f->Truncate(bytes);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  auto digest = Digest::ForAlgorithm(algorithm);
+  std::string buf(std::min(bytes, static_cast<int64_t>(kCopyBufferSize)), 0);
+  while (bytes > 0) {
+    size_t bytes_read;
+    ret = f->Read(&buf[0], std::min(bytes, static_cast<int64_t>(buf.size())),
+                  &bytes_read);
+    if (ret != 0) {
+      return ret;
+    }
+    if (bytes_read == 0) {
+      return ENODATA;
+    }
+    digest->Update(re2::StringPiece(buf.data(), bytes_read));
+    bytes -= bytes_read;
+  }
+  *hash = digest->Finalize();
+  return 0;
+}
+
 }  // namespace
 
+void Environment::UnlinkAll(File *dir, const std::vector<std::string> &paths,
+                            std::vector<int> *results) const {
+  ScopedIoClass io_class(IoClass::kRetention);
+  if (unlinker != nullptr) {
+    unlinker->UnlinkAll(dir, paths, results);
+    return;
+  }
+  results->clear();
+  for (const auto &path : paths) {
+    results->push_back(dir->Unlink(path.c_str()));
+  }
+}
+
 // Call from dedicated thread. Runs until shutdown requested.
 void Stream::Run() {
+  SetThreadIoClass(IoClass::kRecording);
   std::string error_message;
+  next_sync_time_ = env_->clock->Now().tv_sec + env_->sync_interval_sec;
 
   // Do an initial rotation so that if retain_bytes has been reduced, the
   // bulk deletion happens now, rather than while an input stream is open.
@@ -99,6 +207,12 @@ void Stream::Run() {
   }
 
   while (!signal_->ShouldShutdown()) {
+    // ProcessPackets syncs as frames arrive; while the input is down, keep
+    // syncing on schedule so the last recording and unlinks become durable.
+    if (relaxed_durability() &&
+        env_->clock->Now().tv_sec >= next_sync_time_) {
+      SyncFiles();
+    }
     if (in_ == nullptr && !OpenInput(&error_message)) {
       LOG(WARNING) << row_.short_name
                    << ": Failed to open input; sleeping before retrying: "
@@ -128,6 +242,9 @@ void Stream::Run() {
     }
   }
   CloseOutput(-1);
+  if (relaxed_durability()) {
+    SyncFiles();
+  }
 }
 
 Stream::ProcessPacketsResult Stream::ProcessPackets(
@@ -216,6 +333,10 @@ Stream::ProcessPacketsResult Stream::ProcessPackets(
     prev_pkt_start_time_90k_ = start_time_90k;
     prev_pkt_bytes_ = data.size();
     prev_pkt_key_ = pkt.is_key();
+
+    if (relaxed_durability() && frame_realtime_.tv_sec >= next_sync_time_) {
+      SyncFiles();
+    }
   }
   return kStopped;
 }
@@ -282,53 +403,157 @@ void Stream::CloseOutput(int64_t pts) {
     index_.AddSample(duration_90k > 0 ? duration_90k : 0, prev_pkt_bytes_,
                      prev_pkt_key_);
   }
-  if (!writer_.Close(&recording_.sample_file_sha1, &error_message)) {
+  index_.Flush();
+  if (!writer_.Close(&recording_.sample_file_hash, &error_message)) {
     LOG(ERROR) << row_.short_name << ": Closing output "
                << recording_.sample_file_uuid.UnparseText()
                << " failed with error: " << error_message;
-    uuids_to_unlink_.push_back(recording_.sample_file_uuid);
-    TryUnlink();
+    DiscardOutput();
     return;
   }
-  int ret = env_->sample_file_dir->Sync();
+
+  // A container's directory entry was synced when it was created. With
+  // relaxed durability, the directory is synced later by SyncFiles.
+  bool in_container = recording_.container_id != -1;
+  int ret = in_container || relaxed_durability()
+                ? 0
+                : sample_file_dir_->Sync();
   if (ret != 0) {
     LOG(ERROR) << row_.short_name
                << ": Unable to sync sample file dir after writing "
                << recording_.sample_file_uuid.UnparseText() << ": "
                << strerror(ret);
-    uuids_to_unlink_.push_back(recording_.sample_file_uuid);
-    TryUnlink();
+    DiscardOutput();
     return;
   }
-  if (!env_->mdb->InsertRecording(&recording_, &error_message)) {
+  bool inserted =
+      relaxed_durability()
+          ? env_->mdb->InsertUnsyncedRecording(&recording_, &error_message)
+          : env_->mdb->InsertRecording(&recording_, &error_message);
+  if (!inserted) {
     LOG(ERROR) << row_.short_name << ": Unable to insert recording "
                << recording_.sample_file_uuid.UnparseText() << ": "
                << error_message;
-    uuids_to_unlink_.push_back(recording_.sample_file_uuid);
-    TryUnlink();
+    DiscardOutput();
     return;
   }
+  if (relaxed_durability()) {
+    journaled_uuids_.push_back(recording_.sample_file_uuid);
+  }
+  if (in_container) {
+    container_.used_bytes =
+        recording_.sample_file_offset + recording_.sample_file_bytes;
+  }
   row_.total_sample_file_bytes += recording_.sample_file_bytes;
   VLOG(1) << row_.short_name << ": ...wrote "
           << recording_.sample_file_uuid.UnparseText() << "; usage now "
           << HumanizeWithBinaryPrefix(row_.total_sample_file_bytes, "B");
 }
 
+void Stream::DiscardOutput() {
+  // Within a container, the next recording simply overwrites this one.
+  if (recording_.container_id != -1) {
+    return;
+  }
+  uuids_to_unlink_.emplace_back(recording_.sample_file_uuid,
+                                SampleFileTier::kHot);
+  TryUnlink();
+
+  // Drop any durable prefix journaled while it was being written.
+  if (relaxed_durability()) {
+    journaled_uuids_.push_back(recording_.sample_file_uuid);
+  }
+}
+
+void Stream::SyncFiles() {
+  next_sync_time_ = env_->clock->Now().tv_sec + env_->sync_interval_sec;
+
+  // Copy the in-progress recording's index before syncing, so the journaled
+  // prefix covers only bytes which have been written.
+  Recording in_progress;
+  if (writer_.is_open()) {
+    index_.Flush();
+    in_progress = recording_;
+  }
+  int ret = env_->filesystem_syncer != nullptr
+                ? env_->filesystem_syncer->Sync(sample_file_dir_)
+                : sample_file_dir_->SyncFilesystem();
+  if (ret != 0) {
+    LOG(ERROR) << row_.short_name
+               << ": Unable to sync sample file filesystem: " << strerror(ret);
+    return;
+  }
+  std::string error_message;
+  if (!env_->mdb->UpdateJournal(
+          journaled_uuids_, writer_.is_open() ? &in_progress : nullptr,
+          &error_message)) {
+    LOG(ERROR) << row_.short_name
+               << ": Unable to update journal: " << error_message;
+    return;
+  }
+  VLOG(1) << row_.short_name << ": Synced " << journaled_uuids_.size()
+          << " recordings.";
+  journaled_uuids_.clear();
+  if (!env_->mdb->MarkSampleFilesDeleted(uuids_to_mark_deleted_,
+                                         &error_message)) {
+    LOG(ERROR) << row_.short_name << ": Unable to mark "
+               << uuids_to_mark_deleted_.size()
+               << " sample files as deleted: " << error_message;
+    return;
+  }
+  uuids_to_mark_deleted_.clear();
+}
+
 void Stream::TryUnlink() {
-  std::vector<Uuid> still_not_unlinked;
-  for (const auto &uuid : uuids_to_unlink_) {
-    std::string text = uuid.UnparseText();
-    int ret = env_->sample_file_dir->Unlink(text.c_str());
-    if (ret == ENOENT) {
-      LOG(WARNING) << row_.short_name << ": Sample file " << text
-                   << " already deleted!";
-    } else if (ret != 0) {
-      LOG(WARNING) << row_.short_name << ": Unable to unlink " << text << ": "
-                   << strerror(ret);
-      still_not_unlinked.push_back(uuid);
+  if (env_->sample_file_deleter != nullptr) {
+    for (SampleFileTier tier : {SampleFileTier::kHot, SampleFileTier::kCold}) {
+      std::vector<Uuid> uuids;
+      for (const auto &to_unlink : uuids_to_unlink_) {
+        if (to_unlink.second == tier) {
+          uuids.push_back(to_unlink.first);
+        }
+      }
+      if (!uuids.empty()) {
+        env_->sample_file_deleter->Enqueue(
+            env_->GetStreamSampleFileDir(row_.short_name, tier), uuids);
+      }
+    }
+    uuids_to_unlink_.clear();
+    return;
+  }
+
+  // Group by tier so each directory's files can be unlinked as one batch.
+  std::vector<std::pair<Uuid, SampleFileTier>> still_not_unlinked;
+  for (SampleFileTier tier : {SampleFileTier::kHot, SampleFileTier::kCold}) {
+    std::vector<Uuid> uuids;
+    std::vector<std::string> texts;
+    for (const auto &to_unlink : uuids_to_unlink_) {
+      if (to_unlink.second == tier) {
+        uuids.push_back(to_unlink.first);
+        texts.push_back(to_unlink.first.UnparseText());
+      }
+    }
+    if (uuids.empty()) {
       continue;
     }
-    uuids_to_mark_deleted_.push_back(uuid);
+    File *dir = env_->GetStreamSampleFileDir(row_.short_name, tier);
+    std::vector<int> results(texts.size(), ENOTDIR);
+    if (dir != nullptr) {
+      env_->UnlinkAll(dir, texts, &results);
+    }
+    for (size_t i = 0; i < uuids.size(); ++i) {
+      int ret = results[i];
+      if (ret == ENOENT) {
+        LOG(WARNING) << row_.short_name << ": Sample file " << texts[i]
+                     << " already deleted!";
+      } else if (ret != 0) {
+        LOG(WARNING) << row_.short_name << ": Unable to unlink " << texts[i]
+                     << ": " << strerror(ret);
+        still_not_unlinked.emplace_back(uuids[i], tier);
+        continue;
+      }
+      uuids_to_mark_deleted_.push_back(uuids[i]);
+    }
   }
   uuids_to_unlink_ = std::move(still_not_unlinked);
 }
@@ -341,34 +566,123 @@ bool Stream::OpenOutput(std::string *error_message) {
   if (!RotateFiles(error_message)) {
     return false;
   }
-  std::vector<Uuid> reserved = env_->mdb->ReserveSampleFiles(1, error_message);
-  if (reserved.size() != 1) {
-    return false;
+  bool in_container = env_->container_bytes > 0;
+  Uuid uuid;
+  if (in_container) {
+    if (!PrepareContainer(error_message)) {
+      return false;
+    }
+    uuid = container_.uuid;
+  } else {
+    std::vector<Uuid> reserved =
+        env_->mdb->ReserveSampleFiles(1, error_message);
+    if (reserved.size() != 1) {
+      return false;
+    }
+    uuid = reserved[0];
   }
   CHECK(!writer_.is_open());
-  string filename = reserved[0].UnparseText();
+  string filename = uuid.UnparseText();
   recording_.id = -1;
   recording_.camera_id = row_.id;
-  recording_.sample_file_uuid = reserved[0];
+  recording_.sample_file_uuid = uuid;
+  recording_.container_id = in_container ? container_.id : -1;
+  recording_.sample_file_offset = in_container ? container_.used_bytes : 0;
+  recording_.sample_file_hash_algorithm = env_->sample_file_hash_algorithm;
   recording_.video_sample_entry_id = entry_.id;
   recording_.local_time_90k = frame_localtime_90k;
   index_.Init(&recording_, start_localtime_90k_ + start_pts_);
-  if (!writer_.Open(filename.c_str(), error_message)) {
+  bool opened = in_container
+                    ? writer_.OpenInContainer(filename.c_str(),
+                                              recording_.sample_file_offset,
+                                              error_message)
+                    : writer_.Open(filename.c_str(), error_message);
+  if (!opened) {
     return false;
   }
   prev_pkt_start_time_90k_ = -1;
   prev_pkt_bytes_ = -1;
   prev_pkt_key_ = false;
   LOG(INFO) << row_.short_name << ": Opened output " << filename
+            << (in_container
+                    ? StrCat(" at offset ", recording_.sample_file_offset)
+                    : std::string())
             << ", using start_pts=" << start_pts_
             << ", input timebase=" << in_->stream()->time_base.num << "/"
             << in_->stream()->time_base.den;
   return true;
 }
 
+bool Stream::FindNewestContainer(std::string *error_message) {
+  if (container_.id != -1) {
+    return true;
+  }
+
+  // Resume the newest container, if any, after its last recording. Any bytes
+  // past that are from an interrupted recording and can be reused.
+  bool found;
+  if (!env_->mdb->GetNewestContainer(row_.uuid, &container_, &found,
+                                     error_message)) {
+    return false;
+  }
+  if (found) {
+    LOG(INFO) << row_.short_name << ": Resuming container "
+              << container_.uuid.UnparseText() << " at offset "
+              << container_.used_bytes;
+  }
+  return true;
+}
+
+bool Stream::PrepareContainer(std::string *error_message) {
+  if (!FindNewestContainer(error_message)) {
+    return false;
+  }
+  if (container_.id != -1 && container_.used_bytes < container_.size_bytes) {
+    return true;
+  }
+
+  std::vector<Uuid> reserved = env_->mdb->ReserveSampleFiles(1, error_message);
+  if (reserved.size() != 1) {
+    return false;
+  }
+  ContainerRow container;
+  container.uuid = reserved[0];
+  container.size_bytes = env_->container_bytes;
+  std::string filename = container.uuid.UnparseText();
+  std::unique_ptr<File> f;
+  int ret = sample_file_dir_->Open(
+      filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600, &f);
+  if (ret == 0) {
+    ret = f->Allocate(0, container.size_bytes);
+    if (ret == 0) {
+      ret = f->Sync();
+    }
+    int close_ret = f->Close();
+    if (ret == 0) {
+      ret = close_ret;
+    }
+  }
+  if (ret == 0) {
+    ret = sample_file_dir_->Sync();
+  }
+  if (ret != 0) {
+    *error_message =
+        StrCat("unable to create container ", filename, ": ", strerror(ret));
+  }
+  if (ret != 0 ||
+      !env_->mdb->InsertContainer(row_.id, &container, error_message)) {
+    uuids_to_unlink_.emplace_back(container.uuid, SampleFileTier::kHot);
+    TryUnlink();
+    return false;
+  }
+  LOG(INFO) << row_.short_name << ": Created container " << filename << " of "
+            << HumanizeWithBinaryPrefix(container.size_bytes, "B");
+  container_ = container;
+  return true;
+}
+
 bool Stream::RotateFiles(std::string *error_message) {
   int64_t bytes_needed = row_.total_sample_file_bytes - row_.retain_bytes;
-  int64_t bytes_to_delete = 0;
   if (bytes_needed <= 0) {
     VLOG(1) << row_.short_name << ": have remaining quota of "
             << HumanizeWithBinaryPrefix(-bytes_needed, "B");
@@ -377,40 +691,108 @@ bool Stream::RotateFiles(std::string *error_message) {
   LOG(INFO) << row_.short_name << ": need to delete "
             << HumanizeWithBinaryPrefix(bytes_needed, "B");
   std::vector<ListOldestSampleFilesRow> to_delete;
+  std::vector<ListOldestContainersRow> containers_to_delete;
   auto row_cb = [&](const ListOldestSampleFilesRow &row) {
     bytes_needed -= row.sample_file_bytes;
-    bytes_to_delete += row.sample_file_bytes;
     to_delete.push_back(row);
     return bytes_needed < 0 ? IterationControl::kBreak
                             : IterationControl::kContinue;
   };
-  if (!env_->mdb->ListOldestSampleFiles(row_.uuid, row_cb, error_message)) {
+  auto container_cb = [&](const ListOldestContainersRow &row) {
+    bytes_needed -= row.sample_file_bytes;
+    containers_to_delete.push_back(row);
+    return bytes_needed < 0 ? IterationControl::kBreak
+                            : IterationControl::kContinue;
+  };
+  auto list_files = [&]() {
+    return bytes_needed < 0 ||
+           env_->mdb->ListOldestSampleFiles(row_.uuid, row_cb, error_message);
+  };
+  // The newest container is excluded even before it's reopened, as the next
+  // OpenOutput resumes it.
+  auto list_containers = [&]() {
+    return bytes_needed < 0 ||
+           ((env_->container_bytes == 0 ||
+             FindNewestContainer(error_message)) &&
+            env_->mdb->ListOldestContainers(row_.uuid, container_.id,
+                                            container_cb, error_message));
+  };
+
+  // Recordings in files of their own and in containers are each listed
+  // oldest first. Whichever layout isn't being written holds the older
+  // recordings, so it's deleted from first.
+  bool writing_containers = env_->container_bytes > 0;
+  bool listed = writing_containers ? list_files() && list_containers()
+                                   : list_containers() && list_files();
+  if (!listed) {
     return false;
   }
-  if (bytes_needed > 0) {
+  if (bytes_needed > 0 && writing_containers) {
+    // The container being written can't be deleted until it's full.
+    LOG(WARNING) << row_.short_name << ": can't delete enough; "
+                 << HumanizeWithBinaryPrefix(bytes_needed, "B")
+                 << " left. retain_bytes should be several times the "
+                 << "container size.";
+  } else if (bytes_needed > 0) {
     *error_message =
         StrCat("couldn't find enough files to delete; ",
                HumanizeWithBinaryPrefix(bytes_needed, "B"), " left.");
     return false;
   }
-  if (!env_->mdb->DeleteRecordings(to_delete, error_message)) {
+  // Any recordings reserved since listing are skipped; the next rotation
+  // makes up the difference.
+  size_t listed_count = to_delete.size();
+  if (!env_->mdb->DeleteRecordings(&to_delete, error_message)) {
     return false;
   }
+  if (to_delete.size() != listed_count) {
+    LOG(INFO) << row_.short_name << ": skipped "
+              << listed_count - to_delete.size()
+              << " recordings reserved since listing.";
+  }
+  bool unlinked_cold = false;
   for (const auto &to_delete_row : to_delete) {
-    uuids_to_unlink_.push_back(to_delete_row.sample_file_uuid);
+    uuids_to_unlink_.emplace_back(to_delete_row.sample_file_uuid,
+                                  to_delete_row.sample_file_tier);
+    unlinked_cold |= to_delete_row.sample_file_tier == SampleFileTier::kCold;
+    row_.total_sample_file_bytes -= to_delete_row.sample_file_bytes;
+  }
+  if (!env_->mdb->DeleteContainers(containers_to_delete, error_message)) {
+    return false;
+  }
+  for (const auto &container : containers_to_delete) {
+    uuids_to_unlink_.emplace_back(container.uuid, SampleFileTier::kHot);
+    row_.total_sample_file_bytes -= container.sample_file_bytes;
   }
-  row_.total_sample_file_bytes -= bytes_to_delete;
   TryUnlink();
   if (!uuids_to_unlink_.empty()) {
     *error_message =
         StrCat("failed to unlink ", uuids_to_unlink_.size(), " files.");
     return false;
   }
-  int ret = env_->sample_file_dir->Sync();
+  if (env_->sample_file_deleter != nullptr) {
+    VLOG(1) << row_.short_name << ": ...queued for deletion; usage now "
+            << HumanizeWithBinaryPrefix(row_.total_sample_file_bytes, "B");
+    return true;
+  }
+  if (relaxed_durability() && !unlinked_cold) {
+    // The next SyncFiles makes the unlinks durable and marks the files
+    // deleted.
+    return true;
+  }
+  int ret = sample_file_dir_->Sync();
   if (ret != 0) {
     *error_message = StrCat("fsync sample directory: ", strerror(ret));
     return false;
   }
+  if (unlinked_cold) {
+    ret = env_->GetStreamSampleFileDir(row_.short_name, SampleFileTier::kCold)
+              ->Sync();
+    if (ret != 0) {
+      *error_message = StrCat("fsync cold sample directory: ", strerror(ret));
+      return false;
+    }
+  }
   if (!env_->mdb->MarkSampleFilesDeleted(uuids_to_mark_deleted_,
                                          error_message)) {
     *error_message = StrCat("unable to mark ", uuids_to_mark_deleted_.size(),
@@ -423,24 +805,870 @@ bool Stream::RotateFiles(std::string *error_message) {
   return true;
 }
 
+void SampleFileDeleter::Enqueue(File *dir, const std::vector<Uuid> &uuids) {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (const Uuid &uuid : uuids) {
+    queue_.emplace_back(dir, uuid);
+  }
+}
+
+bool SampleFileDeleter::DeleteBatch(size_t max_files, int *deleted,
+                                    std::string *error_message) {
+  *deleted = 0;
+  std::vector<std::pair<File *, Uuid>> batch;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    while (!queue_.empty() && batch.size() < max_files) {
+      batch.push_back(queue_.front());
+      queue_.pop_front();
+    }
+  }
+  if (batch.empty()) {
+    return true;
+  }
+
+  // Unlink each directory's files together, then sync that directory once.
+  std::vector<Uuid> to_mark_deleted;
+  std::vector<std::pair<File *, Uuid>> failed;
+  std::vector<File *> dirs;
+  for (const auto &file : batch) {
+    if (std::find(dirs.begin(), dirs.end(), file.first) == dirs.end()) {
+      dirs.push_back(file.first);
+    }
+  }
+  for (File *dir : dirs) {
+    std::vector<Uuid> uuids;
+    std::vector<std::string> texts;
+    for (const auto &file : batch) {
+      if (file.first == dir) {
+        uuids.push_back(file.second);
+        texts.push_back(file.second.UnparseText());
+      }
+    }
+    std::vector<int> results(texts.size(), ENOTDIR);
+    if (dir != nullptr) {
+      env_->UnlinkAll(dir, texts, &results);
+    }
+    std::vector<Uuid> unlinked;
+    for (size_t i = 0; i < uuids.size(); ++i) {
+      int ret = results[i];
+      if (ret == ENOENT) {
+        LOG(WARNING) << "Sample file " << texts[i] << " already deleted!";
+      } else if (ret != 0) {
+        *error_message = StrCat("unlink ", texts[i], ": ", strerror(ret));
+        failed.emplace_back(dir, uuids[i]);
+        continue;
+      }
+      unlinked.push_back(uuids[i]);
+    }
+    if (unlinked.empty()) {
+      continue;
+    }
+    int ret = dir->Sync();
+    if (ret != 0) {
+      *error_message = StrCat("fsync sample directory: ", strerror(ret));
+      for (const Uuid &uuid : unlinked) {
+        failed.emplace_back(dir, uuid);
+      }
+      continue;
+    }
+    to_mark_deleted.insert(to_mark_deleted.end(), unlinked.begin(),
+                           unlinked.end());
+  }
+  std::string mark_error;
+  if (!to_mark_deleted.empty() &&
+      !env_->mdb->MarkSampleFilesDeleted(to_mark_deleted, &mark_error)) {
+    *error_message = StrCat("unable to mark ", to_mark_deleted.size(),
+                            " sample files as deleted: ", mark_error);
+    return false;  // they remain reserved until the next startup.
+  }
+  *deleted = to_mark_deleted.size();
+  if (!failed.empty()) {
+    std::lock_guard<std::mutex> lock(mu_);
+    queue_.insert(queue_.end(), failed.begin(), failed.end());
+    *error_message = StrCat("failed to delete ", failed.size(), " of ",
+                            batch.size(), " sample files; last error: ",
+                            *error_message);
+    return false;
+  }
+  return true;
+}
+
+void SampleFileMover::Run() {
+  SetThreadIoClass(IoClass::kMaintenance);
+  std::string error_message;
+  while (!signal_->ShouldShutdown()) {
+    int moved = 0;
+    if (!MoveBatch(&moved, &error_message)) {
+      LOG(WARNING) << "Moving recordings to cold tier failed; sleeping before "
+                   << "retrying: " << error_message;
+    }
+    if (moved > 0) {
+      continue;  // there may be more to move.
+    }
+    for (int i = 0; i < kMoveIntervalSec && !signal_->ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+}
+
+bool SampleFileMover::MoveBatch(int *moved, std::string *error_message) {
+  *moved = 0;
+  int64_t end_time_90k = To90k(env_->clock->Now()) -
+                         env_->cold_tier_age_sec * kTimeUnitsPerSecond;
+  std::vector<ListOldestSampleFilesRow> to_move;
+  int64_t batch_bytes = 0;
+  auto row_cb = [&](const ListOldestSampleFilesRow &row) {
+    to_move.push_back(row);
+    batch_bytes += row.sample_file_bytes;
+    return batch_bytes >= kMoveBatchBytes ? IterationControl::kBreak
+                                          : IterationControl::kContinue;
+  };
+  if (!env_->mdb->ListOldestHotSampleFiles(end_time_90k, row_cb,
+                                           error_message)) {
+    return false;
+  }
+  if (to_move.empty()) {
+    return true;
+  }
+  VLOG(1) << "Moving " << to_move.size() << " recordings ("
+          << HumanizeWithBinaryPrefix(batch_bytes, "B") << ") to cold tier.";
+  if (!env_->mdb->BeginMoveToCold(to_move, error_message)) {
+    return false;
+  }
+
+  // Copy as many as possible. Any which fail are left in the hot tier.
+  std::vector<ListOldestSampleFilesRow> copied;
+  std::vector<Uuid> failed;
+  for (const auto &row : to_move) {
+    if (signal_->ShouldShutdown()) {
+      failed.push_back(row.sample_file_uuid);
+      continue;
+    }
+    std::string copy_error_message;
+    if (!CopyToCold(row, &copy_error_message)) {
+      LOG(WARNING) << "Unable to copy " << row.sample_file_uuid.UnparseText()
+                   << " to cold tier: " << copy_error_message;
+      failed.push_back(row.sample_file_uuid);
+      continue;
+    }
+    copied.push_back(row);
+  }
+  int ret = env_->cold_sample_file_dir->Sync();
+  if (ret != 0) {
+    *error_message = StrCat("fsync cold sample directory: ", strerror(ret));
+    AbandonMove(to_move);
+    return false;
+  }
+  if (!env_->mdb->FinishMoveToCold(copied, error_message)) {
+    AbandonMove(to_move);
+    return false;
+  }
+
+  // Abandon the failed copies, discarding any partial cold-tier files.
+  for (const auto &uuid : failed) {
+    std::string text = uuid.UnparseText();
+    ret = env_->cold_sample_file_dir->Unlink(text.c_str());
+    if (ret != 0 && ret != ENOENT) {
+      *error_message = StrCat("unlink cold ", text, ": ", strerror(ret));
+      return false;
+    }
+  }
+
+  // Discard the hot copies of the successful ones.
+  std::vector<Uuid> to_mark_deleted = failed;
+  std::vector<std::string> hot_texts;
+  for (const auto &row : copied) {
+    hot_texts.push_back(row.sample_file_uuid.UnparseText());
+  }
+  std::vector<int> results;
+  env_->UnlinkAll(env_->sample_file_dir, hot_texts, &results);
+  for (size_t i = 0; i < copied.size(); ++i) {
+    ret = results[i];
+    if (ret != 0 && ret != ENOENT) {
+      *error_message =
+          StrCat("unlink hot ", hot_texts[i], ": ", strerror(ret));
+      return false;
+    }
+    to_mark_deleted.push_back(copied[i].sample_file_uuid);
+  }
+  if (!failed.empty()) {
+    ret = env_->cold_sample_file_dir->Sync();
+    if (ret != 0) {
+      *error_message = StrCat("fsync cold sample directory: ", strerror(ret));
+      return false;
+    }
+  }
+  ret = env_->sample_file_dir->Sync();
+  if (ret != 0) {
+    *error_message = StrCat("fsync sample directory: ", strerror(ret));
+    return false;
+  }
+  if (!env_->mdb->MarkSampleFilesDeleted(to_mark_deleted, error_message)) {
+    return false;
+  }
+  *moved = copied.size();
+  VLOG(1) << "...moved " << copied.size() << " recordings to cold tier.";
+  if (!failed.empty()) {
+    *error_message =
+        StrCat("failed to move ", failed.size(), " of ", to_move.size(),
+               " recordings to cold tier.");
+    return false;
+  }
+  return true;
+}
+
+void SampleFileMover::AbandonMove(
+    const std::vector<ListOldestSampleFilesRow> &rows) {
+  std::vector<Uuid> uuids;
+  for (const auto &row : rows) {
+    std::string text = row.sample_file_uuid.UnparseText();
+    int ret = env_->cold_sample_file_dir->Unlink(text.c_str());
+    if (ret != 0 && ret != ENOENT) {
+      LOG(WARNING) << "Unable to unlink abandoned cold copy " << text << ": "
+                   << strerror(ret);
+      return;
+    }
+    uuids.push_back(row.sample_file_uuid);
+  }
+  std::string error_message;
+  int ret = env_->cold_sample_file_dir->Sync();
+  if (ret != 0 || !env_->mdb->MarkSampleFilesDeleted(uuids, &error_message)) {
+    LOG(WARNING) << "Unable to abandon move of " << uuids.size()
+                 << " recordings to cold tier: "
+                 << (ret != 0 ? strerror(ret) : error_message);
+  }
+}
+
+bool SampleFileMover::CopyToCold(const ListOldestSampleFilesRow &row,
+                                 std::string *error_message) {
+  std::string filename = row.sample_file_uuid.UnparseText();
+  std::unique_ptr<File> in;
+  int ret = env_->sample_file_dir->Open(filename.c_str(), O_RDONLY, &in);
+  if (ret != 0) {
+    *error_message = StrCat("open hot: ", strerror(ret));
+    return false;
+  }
+  std::unique_ptr<File> out;
+  ret = env_->cold_sample_file_dir->Open(
+      filename.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600, &out);
+  if (ret != 0) {
+    *error_message = StrCat("open cold: ", strerror(ret));
+    return false;
+  }
+  buf_.resize(kCopyBufferSize);
+  int64_t total_bytes = 0;
+  TokenBucket *throttle = env_->GetIoBucket(IoClass::kMaintenance);
+  while (true) {
+    if (throttle != nullptr) {
+      throttle->Acquire(buf_.size());
+    }
+    size_t bytes_read;
+    ret = in->Read(&buf_[0], buf_.size(), &bytes_read);
+    if (ret != 0) {
+      *error_message = StrCat("read: ", strerror(ret));
+      return false;
+    }
+    if (bytes_read == 0) {
+      break;
+    }
+    total_bytes += bytes_read;
+    re2::StringPiece data(buf_.data(), bytes_read);
+    while (!data.empty()) {
+      size_t bytes_written;
+      ret = out->Write(data, &bytes_written);
+      if (ret != 0) {
+        *error_message = StrCat("write: ", strerror(ret));
+        return false;
+      }
+      data.remove_prefix(bytes_written);
+    }
+  }
+  if (total_bytes != row.sample_file_bytes) {
+    *error_message = StrCat("copied ", total_bytes, " bytes; expected ",
+                            row.sample_file_bytes);
+    return false;
+  }
+  ret = out->Sync();
+  if (ret != 0) {
+    *error_message = StrCat("fsync: ", strerror(ret));
+    return false;
+  }
+  ret = out->Close();
+  if (ret != 0) {
+    *error_message = StrCat("close: ", strerror(ret));
+    return false;
+  }
+  return true;
+}
+
+void SampleFileThinner::Run() {
+  SetThreadIoClass(IoClass::kMaintenance);
+  std::string error_message;
+  while (!signal_->ShouldShutdown()) {
+    int thinned = 0;
+    if (!ThinBatch(&thinned, &error_message)) {
+      LOG(WARNING) << "Thinning recordings failed; sleeping before retrying: "
+                   << error_message;
+    }
+    if (thinned > 0) {
+      continue;  // there may be more to thin.
+    }
+    for (int i = 0; i < kThinIntervalSec && !signal_->ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+}
+
+bool SampleFileThinner::ThinBatch(int *thinned, std::string *error_message) {
+  *thinned = 0;
+  std::vector<ListCamerasRow> cameras;
+  env_->mdb->ListCameras([&](const ListCamerasRow &row) {
+    if (row.thin_age_sec > 0) {
+      cameras.push_back(row);
+    }
+    return IterationControl::kContinue;
+  });
+  int64_t now_90k = To90k(env_->clock->Now());
+  for (const auto &camera : cameras) {
+    std::vector<Recording> to_thin;
+    auto row_cb = [&](Recording &recording) {
+      // Skip any in an unconfigured cold tier, as there's no way to read them.
+      if (env_->GetSampleFileDir(recording.sample_file_tier) != nullptr) {
+        to_thin.push_back(recording);
+      }
+      return to_thin.size() >= kThinBatchRecordings
+                 ? IterationControl::kBreak
+                 : IterationControl::kContinue;
+    };
+    if (!env_->mdb->ListRecordingsToThin(
+            camera.id, now_90k - camera.thin_age_sec * kTimeUnitsPerSecond,
+            row_cb, error_message)) {
+      return false;
+    }
+    int64_t bytes_before = 0;
+    int64_t bytes_after = 0;
+    int camera_thinned = 0;
+    for (const auto &recording : to_thin) {
+      if (signal_->ShouldShutdown()) {
+        break;
+      }
+      int64_t thinned_bytes;
+      std::string thin_error_message;
+      if (!Thin(recording, &thinned_bytes, &thin_error_message)) {
+        LOG(WARNING) << camera.short_name << ": Unable to thin recording "
+                     << recording.id << ": " << thin_error_message;
+        continue;
+      }
+      bytes_before += recording.sample_file_bytes;
+      bytes_after += thinned_bytes;
+      ++camera_thinned;
+    }
+    if (camera_thinned > 0) {
+      LOG(INFO) << camera.short_name << ": Thinned " << camera_thinned
+                << " recordings from "
+                << HumanizeWithBinaryPrefix(bytes_before, "B") << " to "
+                << HumanizeWithBinaryPrefix(bytes_after, "B") << ".";
+    }
+    *thinned += camera_thinned;
+  }
+  return true;
+}
+
+bool SampleFileThinner::Thin(const Recording &original, int64_t *thinned_bytes,
+                             std::string *error_message) {
+  File *dir = env_->GetSampleFileDir(original.sample_file_tier);
+  Uuid new_uuid;
+  if (!env_->mdb->BeginThin(original, &new_uuid, error_message)) {
+    return false;
+  }
+  Recording thinned;
+  bool ok = WriteThinned(dir, original, new_uuid, &thinned, error_message);
+  int ret;
+  if (ok && (ret = dir->Sync()) != 0) {
+    *error_message = StrCat("fsync sample directory: ", strerror(ret));
+    ok = false;
+  }
+  ok = ok && env_->mdb->FinishThin(original, thinned, error_message);
+  if (!ok) {
+    // Abandon the thinned copy. If this fails, the reservations will be
+    // cleaned up on next startup.
+    std::string new_text = new_uuid.UnparseText();
+    ret = dir->Unlink(new_text.c_str());
+    if (ret != 0 && ret != ENOENT) {
+      LOG(WARNING) << "Unable to unlink abandoned thinned copy " << new_text
+                   << ": " << strerror(ret);
+      return false;
+    }
+    std::string abandon_error_message;
+    if ((ret = dir->Sync()) != 0 ||
+        !env_->mdb->MarkSampleFilesDeleted(
+            {original.sample_file_uuid, new_uuid}, &abandon_error_message)) {
+      LOG(WARNING) << "Unable to abandon thinned copy " << new_text << ": "
+                   << (ret != 0 ? strerror(ret) : abandon_error_message);
+    }
+    return false;
+  }
+
+  // Reclaim the original's space, as with DeleteRecordings.
+  std::string old_text = original.sample_file_uuid.UnparseText();
+  ret = dir->Unlink(old_text.c_str());
+  if (ret != 0 && ret != ENOENT) {
+    *error_message = StrCat("unlink ", old_text, ": ", strerror(ret));
+    return false;  // the reservation will be cleaned up on next startup.
+  }
+  ret = dir->Sync();
+  if (ret != 0) {
+    *error_message = StrCat("fsync sample directory: ", strerror(ret));
+    return false;
+  }
+  if (!env_->mdb->MarkSampleFilesDeleted({original.sample_file_uuid},
+                                         error_message)) {
+    return false;
+  }
+  *thinned_bytes = thinned.sample_file_bytes;
+  return true;
+}
+
+bool SampleFileThinner::WriteThinned(File *dir, const Recording &original,
+                                     const Uuid &new_uuid, Recording *thinned,
+                                     std::string *error_message) {
+  // Sample files are small enough (a few megabytes for a typical recording)
+  // to simply read in full.
+  std::string old_text = original.sample_file_uuid.UnparseText();
+  std::unique_ptr<File> in;
+  int ret = dir->Open(old_text.c_str(), O_RDONLY, &in);
+  if (ret != 0) {
+    *error_message = StrCat("open ", old_text, ": ", strerror(ret));
+    return false;
+  }
+  TokenBucket *throttle = env_->GetIoBucket(IoClass::kMaintenance);
+  if (throttle != nullptr) {
+    throttle->Acquire(original.sample_file_bytes);
+  }
+  buf_.resize(original.sample_file_bytes);
+  size_t total_bytes = 0;
+  while (total_bytes < buf_.size()) {
+    size_t bytes_read;
+    ret = in->Read(&buf_[total_bytes], buf_.size() - total_bytes, &bytes_read);
+    if (ret != 0) {
+      *error_message = StrCat("read ", old_text, ": ", strerror(ret));
+      return false;
+    }
+    if (bytes_read == 0) {
+      *error_message = StrCat(old_text, " has ", total_bytes,
+                              " bytes; expected ", buf_.size());
+      return false;
+    }
+    total_bytes += bytes_read;
+  }
+
+  std::string new_text = new_uuid.UnparseText();
+  SampleFileWriter writer(dir, nullptr, env_->sample_file_hash_algorithm);
+  if (!writer.Open(new_text.c_str(), error_message)) {
+    return false;
+  }
+  thinned->id = original.id;
+  thinned->camera_id = original.camera_id;
+  thinned->sample_file_uuid = new_uuid;
+  thinned->sample_file_tier = original.sample_file_tier;
+  thinned->sample_file_hash_algorithm = env_->sample_file_hash_algorithm;
+  thinned->video_sample_entry_id = original.video_sample_entry_id;
+  SampleIndexEncoder encoder;
+  encoder.Init(thinned, original.start_time_90k);
+
+  // Each key frame is extended to cover the non-key frames which follow it,
+  // so the recording's duration is unchanged. Any non-key frames before the
+  // first key frame are covered by it instead.
+  re2::StringPiece data(buf_);
+  int32_t key_start_90k = 0;
+  re2::StringPiece key_data;
+  SampleIndexIterator it(original.video_index);
+  for (; !it.done(); it.Next()) {
+    if (!it.is_key()) {
+      continue;
+    }
+    if (it.pos() + it.bytes() > static_cast<int64_t>(data.size())) {
+      *error_message = StrCat("sample at ", it.pos(), " extends past end of ",
+                              old_text);
+      return false;
+    }
+    if (!key_data.empty()) {
+      if (!writer.Write(key_data, error_message)) {
+        return false;
+      }
+      encoder.AddSample(it.start_90k() - key_start_90k, key_data.size(), true);
+      key_start_90k = it.start_90k();
+    }
+    key_data = data.substr(it.pos(), it.bytes());
+  }
+  if (it.has_error()) {
+    *error_message = StrCat("bad video index: ", it.error());
+    return false;
+  }
+  if (key_data.empty()) {
+    *error_message = "no key frames";
+    return false;
+  }
+  if (!writer.Write(key_data, error_message)) {
+    return false;
+  }
+  int32_t duration_90k =
+      static_cast<int32_t>(original.end_time_90k - original.start_time_90k);
+  encoder.AddSample(duration_90k - key_start_90k, key_data.size(), true);
+  encoder.Flush();
+  if (!writer.Close(&thinned->sample_file_hash, error_message)) {
+    return false;
+  }
+  if (thinned->end_time_90k != original.end_time_90k) {
+    *error_message =
+        StrCat("thinned recording ends at ", thinned->end_time_90k,
+               "; expected ", original.end_time_90k);
+    return false;
+  }
+  return true;
+}
+
+void SampleFileScrubber::Run() {
+  SetThreadIoClass(IoClass::kScrubbing);
+  std::string error_message;
+  while (!signal_->ShouldShutdown()) {
+    int scrubbed = 0;
+    if (!ScrubBatch(&scrubbed, &error_message)) {
+      LOG(WARNING) << "Scrubbing sample files failed; sleeping before "
+                   << "retrying: " << error_message;
+    }
+    if (scrubbed > 0) {
+      continue;  // there may be more to scrub.
+    }
+    for (int i = 0; i < kScrubIntervalSec && !signal_->ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+}
+
+bool SampleFileScrubber::ScrubBatch(int *scrubbed,
+                                    std::string *error_message) {
+  *scrubbed = 0;
+  ScrubState state;
+  if (!env_->mdb->GetScrubState(&state, error_message)) {
+    return false;
+  }
+  int64_t now_90k = To90k(env_->clock->Now());
+  if (state.pass_start_time_90k == -1) {
+    if (state.last_pass_end_time_90k != -1 &&
+        now_90k - state.last_pass_end_time_90k <
+            kScrubPassIntervalSec * kTimeUnitsPerSecond) {
+      return true;  // not yet time for the next pass.
+    }
+    state.cursor_recording_id = 0;
+    state.pass_start_time_90k = now_90k;
+    state.pass_recordings = 0;
+    state.pass_bytes = 0;
+    LOG(INFO) << "Starting sample file scrub pass "
+              << state.completed_passes + 1 << ".";
+  }
+
+  std::vector<Recording> to_scrub;
+  if (!env_->mdb->ListRecordingsToScrub(state.cursor_recording_id,
+                                        kScrubBatchRecordings, &to_scrub,
+                                        error_message)) {
+    return false;
+  }
+  std::vector<ScrubMismatchRow> mismatches;
+  for (const auto &recording : to_scrub) {
+    if (signal_->ShouldShutdown()) {
+      break;
+    }
+    std::string verify_error_message;
+    // Skip any in an unconfigured cold tier, as there's no way to read them.
+    if (env_->GetSampleFileDir(recording.sample_file_tier) != nullptr &&
+        !Verify(recording, &verify_error_message)) {
+      // The recording may have been deleted, moved, or thinned while it was
+      // being read; only report it if it's still as listed.
+      bool current;
+      if (!env_->mdb->IsRecordingCurrent(recording, &current, error_message)) {
+        return false;
+      }
+      if (current) {
+        LOG(ERROR) << "Recording " << recording.id << " (sample file "
+                   << recording.sample_file_uuid.UnparseText()
+                   << ") failed scrub: " << verify_error_message;
+        ScrubMismatchRow mismatch;
+        mismatch.recording_id = recording.id;
+        mismatch.camera_id = recording.camera_id;
+        mismatch.sample_file_uuid = recording.sample_file_uuid;
+        mismatch.start_time_90k = recording.start_time_90k;
+        mismatch.detected_time_90k = To90k(env_->clock->Now());
+        mismatch.error = verify_error_message;
+        mismatches.push_back(mismatch);
+      }
+    }
+    state.cursor_recording_id = recording.id;
+    ++state.pass_recordings;
+    state.pass_bytes += recording.sample_file_bytes;
+    ++*scrubbed;
+  }
+
+  if (to_scrub.empty()) {
+    ++state.completed_passes;
+    state.cursor_recording_id = 0;
+    state.pass_start_time_90k = -1;
+    state.last_pass_end_time_90k = now_90k;
+    LOG(INFO) << "Finished sample file scrub pass " << state.completed_passes
+              << ": verified " << state.pass_recordings << " recordings ("
+              << HumanizeWithBinaryPrefix(state.pass_bytes, "B") << ").";
+  }
+  return env_->mdb->UpdateScrubState(state, mismatches, error_message);
+}
+
+bool SampleFileScrubber::Verify(const Recording &recording,
+                                std::string *error_message) {
+  File *dir = env_->GetSampleFileDir(recording.sample_file_tier);
+  std::string filename = recording.sample_file_uuid.UnparseText();
+  int fd;
+  int ret = dir->Open(filename.c_str(), O_RDONLY, &fd);
+  if (ret != 0) {
+    *error_message = StrCat("open: ", strerror(ret));
+    return false;
+  }
+
+  // Read sequentially, and drop each chunk from the page cache once hashed:
+  // the scrubber reads everything once, and shouldn't evict what's useful to
+  // recording and serving.
+  posix_fadvise(fd, recording.sample_file_offset, recording.sample_file_bytes,
+                POSIX_FADV_SEQUENTIAL);
+  buf_.resize(kCopyBufferSize);
+  TokenBucket *throttle = env_->GetIoBucket(IoClass::kScrubbing);
+  auto digest = Digest::ForAlgorithm(recording.sample_file_hash_algorithm);
+  int64_t pos = recording.sample_file_offset;
+  int64_t end = pos + recording.sample_file_bytes;
+  bool ok = true;
+  while (pos < end) {
+    size_t count = std::min(end - pos, static_cast<int64_t>(buf_.size()));
+    if (throttle != nullptr) {
+      throttle->Acquire(count);
+    }
+    ssize_t bytes_read = pread(fd, &buf_[0], count, pos);
+    if (bytes_read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes_read < 0) {
+      *error_message = StrCat("read at ", pos, ": ", strerror(errno));
+      ok = false;
+      break;
+    }
+    if (bytes_read == 0) {
+      *error_message = StrCat("file ends at ", pos, "; expected ", end);
+      ok = false;
+      break;
+    }
+    dir->NoteRawRead(bytes_read);
+
+    // Limit hashing's CPU use by sleeping in proportion to the time spent.
+    struct timespec cpu_start;
+    struct timespec cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    digest->Update(re2::StringPiece(buf_.data(), bytes_read));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    posix_fadvise(fd, pos, bytes_read, POSIX_FADV_DONTNEED);
+    pos += bytes_read;
+    if (env_->scrub_max_cpu_fraction > 0 && env_->scrub_max_cpu_fraction < 1) {
+      double cpu_sec = (cpu_end.tv_sec - cpu_start.tv_sec) +
+                       1e-9 * (cpu_end.tv_nsec - cpu_start.tv_nsec);
+      double sleep_sec = cpu_sec * (1 / env_->scrub_max_cpu_fraction - 1);
+      struct timespec delay;
+      delay.tv_sec = static_cast<time_t>(sleep_sec);
+      delay.tv_nsec = static_cast<long>((sleep_sec - delay.tv_sec) * 1e9);
+      env_->clock->Sleep(delay);
+    }
+  }
+  close(fd);
+  if (!ok) {
+    return false;
+  }
+  std::string hash = digest->Finalize();
+  if (hash != recording.sample_file_hash) {
+    *error_message = StrCat("hash mismatch: expected ",
+                            ToHex(recording.sample_file_hash), "; got ",
+                            ToHex(hash));
+    return false;
+  }
+  return true;
+}
+
+bool RecoverJournal(Environment *env, std::string *error_message) {
+  std::vector<ListJournalRow> rows;
+  if (!env->mdb->ListJournal(&rows, error_message)) {
+    return false;
+  }
+  if (rows.empty()) {
+    return true;
+  }
+
+  // Sample files are always written to the hot tier, and journaled ones
+  // aren't moved until they've been synced.
+  File *dir = env->sample_file_dir;
+  std::vector<Uuid> unjournal;
+  std::vector<ListJournalRow *> truncated;
+  std::vector<ListOldestSampleFilesRow> to_delete;
+  for (auto &row : rows) {
+    Recording &prefix = row.prefix;
+    std::string text = prefix.sample_file_uuid.UnparseText();
+    if (prefix.id != -1) {
+      // The recording was completed; its file may have become durable
+      // anyway.
+      std::string hash;
+      int ret = HashSampleFilePrefix(dir, text, row.recording_bytes, false,
+                                     prefix.sample_file_hash_algorithm, &hash);
+      if (ret == 0 && hash == row.recording_hash) {
+        unjournal.push_back(prefix.sample_file_uuid);
+        continue;
+      }
+    }
+    if (prefix.video_samples > 0) {
+      int ret = HashSampleFilePrefix(dir, text, prefix.sample_file_bytes, true,
+                                     prefix.sample_file_hash_algorithm,
+                                     &prefix.sample_file_hash);
+      if (ret == 0) {
+        truncated.push_back(&row);
+        continue;
+      }
+      LOG(WARNING) << "Unable to recover journaled prefix of " << text << ": "
+                   << strerror(ret);
+    }
+    if (prefix.id != -1) {
+      ListOldestSampleFilesRow to_delete_row;
+      to_delete_row.camera_id = prefix.camera_id;
+      to_delete_row.recording_id = prefix.id;
+      to_delete_row.sample_file_uuid = prefix.sample_file_uuid;
+      to_delete_row.duration_90k = row.recording_duration_90k;
+      to_delete_row.sample_file_bytes = row.recording_bytes;
+      to_delete.push_back(to_delete_row);
+    } else {
+      // The file's reservation remains, so it's discarded with the others.
+      unjournal.push_back(prefix.sample_file_uuid);
+    }
+  }
+
+  // Make the truncated and verified files durable before recording them.
+  int ret = dir->SyncFilesystem();
+  if (ret != 0) {
+    *error_message = StrCat("sync sample file filesystem: ", strerror(ret));
+    return false;
+  }
+  for (ListJournalRow *row : truncated) {
+    if (!env->mdb->RecoverJournaledRecording(row, error_message)) {
+      return false;
+    }
+  }
+  if (!env->mdb->UpdateJournal(unjournal, nullptr, error_message) ||
+      !env->mdb->DeleteRecordings(&to_delete, error_message)) {
+    return false;
+  }
+  LOG(INFO) << "Recovered journal of " << rows.size() << " sample files: "
+            << unjournal.size() << " complete or discarded, "
+            << truncated.size() << " truncated, " << to_delete.size()
+            << " lost.";
+  return true;
+}
+
 Nvr::~Nvr() {
   signal_.Shutdown();
   for (auto &thread : stream_threads_) {
     thread.join();
   }
+  if (mover_thread_.joinable()) {
+    mover_thread_.join();
+  }
+  if (thinner_thread_.joinable()) {
+    thinner_thread_.join();
+  }
+  if (scrubber_thread_.joinable()) {
+    scrubber_thread_.join();
+  }
+  if (disk_monitor_thread_.joinable()) {
+    disk_monitor_thread_.join();
+  }
+  if (wal_checkpointer_thread_.joinable()) {
+    wal_checkpointer_thread_.join();
+  }
+  if (sample_file_deleter_thread_.joinable()) {
+    sample_file_deleter_thread_.join();
+  }
+  for (auto &thread : migration_threads_) {
+    thread.join();
+  }
   // TODO: cleanup reservations?
 }
 
 bool Nvr::Init(std::string *error_msg) {
-  std::vector<Uuid> all_reserved;
+  // Crash recovery: first keep what's durable of sample files written with
+  // relaxed durability, then discard whichever copies of reserved sample
+  // files may be incomplete or are no longer referenced. See
+  // design/schema.md.
+  if (!RecoverJournal(env_, error_msg)) {
+    return false;
+  }
+  std::vector<ListReservedSampleFilesRow> all_reserved;
   if (!env_->mdb->ListReservedSampleFiles(&all_reserved, error_msg)) {
     return false;
   }
+  std::vector<Uuid> to_mark_deleted;
   for (const auto &reserved : all_reserved) {
-    int ret = env_->sample_file_dir->Unlink(reserved.UnparseText().c_str());
-    if (ret != 0 && ret != ENOENT) {
-      LOG(WARNING) << "Unable to remove reserved sample file: "
-                   << reserved.UnparseText();
+    std::vector<SampleFileTier> tiers;
+    switch (reserved.state) {
+      case ReservationState::kWriting:
+      case ReservationState::kMovedToCold:
+        tiers = {SampleFileTier::kHot};
+        break;
+      case ReservationState::kMovingToCold:
+        tiers = {SampleFileTier::kCold};
+        break;
+      case ReservationState::kDeleting:
+      case ReservationState::kWritingThinned:
+        // The recording row (and thus its tier) is gone or doesn't reference
+        // this file; try both.
+        tiers = {SampleFileTier::kHot, SampleFileTier::kCold};
+        break;
+      case ReservationState::kThinning:
+        // The recording row still references this file; keep it.
+        break;
+    }
+    std::string text = reserved.uuid.UnparseText();
+    bool ok = true;
+    for (SampleFileTier tier : tiers) {
+      File *dir = env_->GetSampleFileDir(tier);
+      if (dir == nullptr) {
+        if (reserved.state != ReservationState::kDeleting &&
+            reserved.state != ReservationState::kWritingThinned) {
+          LOG(WARNING) << "Reserved sample file " << text
+                       << " is in the cold tier, which isn't configured.";
+          ok = false;
+        }
+        continue;
+      }
+      int ret = dir->Unlink(text.c_str());
+      if (ret != 0 && ret != ENOENT) {
+        LOG(WARNING) << "Unable to remove reserved sample file: " << text
+                     << ": " << strerror(ret);
+        ok = false;
+      }
+    }
+    if (ok) {
+      to_mark_deleted.push_back(reserved.uuid);
+    }
+  }
+  if (!to_mark_deleted.empty()) {
+    for (File *dir : {env_->sample_file_dir, env_->cold_sample_file_dir}) {
+      int ret = dir == nullptr ? 0 : dir->Sync();
+      if (ret != 0) {
+        *error_msg = StrCat("fsync sample directory: ", strerror(ret));
+        return false;
+      }
+    }
+    if (!env_->mdb->MarkSampleFilesDeleted(to_mark_deleted, error_msg)) {
+      return false;
     }
   }
 
@@ -456,7 +1684,110 @@ bool Nvr::Init(std::string *error_msg) {
     streams_.emplace_back(stream);
     stream_threads_.emplace_back([stream]() { stream->Run(); });
   };
+  if (env_->cold_sample_file_dir != nullptr) {
+    mover_.reset(new SampleFileMover(&signal_, env_));
+    SampleFileMover *mover = mover_.get();
+    mover_thread_ = std::thread([mover]() { mover->Run(); });
+  }
+  bool any_thinned = false;
+  for (const auto &camera : cameras) {
+    any_thinned |= camera.thin_age_sec > 0;
+  }
+  if (any_thinned) {
+    thinner_.reset(new SampleFileThinner(&signal_, env_));
+    SampleFileThinner *thinner = thinner_.get();
+    thinner_thread_ = std::thread([thinner]() { thinner->Run(); });
+  }
+  if (env_->scrub_sample_files) {
+    scrubber_.reset(new SampleFileScrubber(&signal_, env_));
+    SampleFileScrubber *scrubber = scrubber_.get();
+    scrubber_thread_ = std::thread([scrubber]() { scrubber->Run(); });
+  }
+  if (env_->disk_monitor != nullptr) {
+    disk_monitor_thread_ = std::thread([this]() { RunDiskMonitor(); });
+  }
+  if (env_->wal_checkpointer != nullptr) {
+    wal_checkpointer_thread_ =
+        std::thread([this]() { RunWalCheckpointer(); });
+  }
+  if (env_->sample_file_deleter != nullptr) {
+    sample_file_deleter_thread_ =
+        std::thread([this]() { RunSampleFileDeleter(); });
+  }
+  for (ShardedSampleFileDir *dir : env_->dirs_to_migrate) {
+    migration_threads_.emplace_back([this, dir]() { RunFlatMigration(dir); });
+  }
   return true;
 }
 
+void Nvr::RunDiskMonitor() {
+  env_->disk_monitor->Sample();
+  while (!signal_.ShouldShutdown()) {
+    for (int i = 0; i < kDiskSampleIntervalSec && !signal_.ShouldShutdown();
+         ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+    env_->disk_monitor->Sample();
+  }
+}
+
+void Nvr::RunWalCheckpointer() {
+  std::string error_message;
+  while (!signal_.ShouldShutdown()) {
+    if (!env_->wal_checkpointer->Checkpoint(&error_message)) {
+      LOG(WARNING) << "Unable to checkpoint database: " << error_message;
+    }
+    for (int i = 0;
+         i < kWalCheckpointIntervalSec && !signal_.ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+}
+
+void Nvr::RunSampleFileDeleter() {
+  SetThreadIoClass(IoClass::kRetention);
+  std::string error_message;
+  while (!signal_.ShouldShutdown()) {
+    int deleted;
+    int sleep_sec = 1;
+    if (!env_->sample_file_deleter->DeleteBatch(kDeleteBatchFiles, &deleted,
+                                                &error_message)) {
+      LOG(WARNING) << "Deleting sample files failed; sleeping before "
+                   << "retrying: " << error_message;
+      sleep_sec = kDeleteRetrySec;
+    } else if (deleted > 0) {
+      continue;  // there may be more to delete.
+    }
+    for (int i = 0; i < sleep_sec && !signal_.ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+}
+
+void Nvr::RunFlatMigration(ShardedSampleFileDir *dir) {
+  SetThreadIoClass(IoClass::kMaintenance);
+  int64_t batches = 0;
+  while (!signal_.ShouldShutdown()) {
+    bool done;
+    std::string error_message;
+    int sleep_sec = 1;
+    if (!dir->MigrateFromFlat(kMigrationBatchFiles, &done, &error_message)) {
+      LOG(WARNING) << "Sample file migration failed; sleeping before "
+                   << "retrying: " << error_message;
+      sleep_sec = kMigrationRetrySec;
+    } else if (done) {
+      break;
+    } else {
+      ++batches;
+    }
+    for (int i = 0; i < sleep_sec && !signal_.ShouldShutdown(); ++i) {
+      env_->clock->Sleep({1, 0});
+    }
+  }
+  if (batches > 0) {
+    LOG(INFO) << "Migrated " << batches << " batches of sample files to the "
+              << "sharded layout.";
+  }
+}
+
 }  // namespace moonfire_nvr
@@ -37,18 +37,26 @@
 #include <time.h>
 
 #include <atomic>
+#include <deque>
 #include <map>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include <event2/http.h>
 
+#include "crypto.h"
+#include "disk-stats.h"
 #include "filesystem.h"
+#include "io-priority.h"
+#include "key-frame-cache.h"
 #include "moonfire-db.h"
 #include "ffmpeg.h"
+#include "sample-file-dir.h"
 #include "time.h"
+#include "unlinker.h"
 
 namespace moonfire_nvr {
 
@@ -69,12 +77,112 @@ class ShutdownSignal {
   std::atomic_bool shutdown_{false};
 };
 
+class SampleFileDeleter;
+
 // The Nvr's environment. This is supplied for testability.
 struct Environment {
   WallClock *clock = nullptr;
   VideoSource *video_source = nullptr;
   File *sample_file_dir = nullptr;
   MoonfireDatabase *mdb = nullptr;
+
+  // If non-null, used to seek within recordings served through the web
+  // interface. |mdb| should keep it current; see
+  // MoonfireDatabase::SetKeyFrameCache.
+  KeyFrameCache *key_frame_cache = nullptr;
+
+  // If non-null, recordings are written to |sample_file_dir| (the hot tier,
+  // typically a SSD) and moved here (the cold tier, typically a hard drive)
+  // once they are |cold_tier_age_sec| old.
+  File *cold_sample_file_dir = nullptr;
+  int64_t cold_tier_age_sec = 24 * 60 * 60;
+
+  // If positive, each stream appends its recordings to container files of
+  // this size rather than writing a file per recording. Containers aren't
+  // supported in combination with the cold tier.
+  int64_t container_bytes = 0;
+
+  // The algorithm used to hash newly written sample files.
+  HashAlgorithm sample_file_hash_algorithm = HashAlgorithm::kSha1;
+
+  // If non-null, sample files' hashes are computed on this worker
+  // rather than on each stream's own thread.
+  DigestWorker *digest_worker = nullptr;
+
+  // If non-null, used to unlink sample files in bulk. Otherwise they are
+  // unlinked one at a time.
+  Unlinker *unlinker = nullptr;
+
+  // If non-null, streams hand sample files to be deleted to this, and the Nvr
+  // deletes them on a background thread. Otherwise each stream deletes them
+  // on its own thread, delaying recording.
+  SampleFileDeleter *sample_file_deleter = nullptr;
+
+  // If positive, sample files are written with relaxed durability: rather
+  // than syncing each recording as it's completed, each stream syncs the
+  // whole filesystem once per this interval, journaling recordings which
+  // haven't been synced yet. A crash loses up to this much video. Not
+  // supported in combination with containers. See design/schema.md.
+  int64_t sync_interval_sec = 0;
+
+  // If non-null, the streams' relaxed durability syncs go through this, so
+  // that streams which are due at the same time share one syncfs().
+  FilesystemSyncer *filesystem_syncer = nullptr;
+
+  // If non-null, .mp4 files exported through the web interface are written
+  // here. Otherwise, exporting through the web interface is disabled.
+  File *export_dir = nullptr;
+
+  // If non-null, limits the rate of each class of sample file I/O. Each
+  // thread also sets its kernel I/O priority by class; see io-priority.h.
+  IoThrottle *io_throttle = nullptr;
+
+  // If non-null, tracks the disk time used by sample file I/O. The sample
+  // file directories above should be those returned by its AddDisk.
+  DiskMonitor *disk_monitor = nullptr;
+
+  // If non-null, the Nvr checkpoints the database's write-ahead log through
+  // this every few seconds, and |mdb|'s connection shouldn't checkpoint on
+  // commit. See WalCheckpointer.
+  WalCheckpointer *wal_checkpointer = nullptr;
+
+  // Sample file directories which may still hold files in the flat layout.
+  // The Nvr moves them into their shards in the background.
+  std::vector<ShardedSampleFileDir *> dirs_to_migrate;
+
+  // If true, the Nvr periodically verifies every sample file against its
+  // recorded hash in the background; see SampleFileScrubber. Hashing is
+  // limited to |scrub_max_cpu_fraction| of a core, and reading to the
+  // kScrubbing limit of |io_throttle|.
+  bool scrub_sample_files = false;
+  double scrub_max_cpu_fraction = 1.;
+
+  // Returns the directory holding sample files of the given tier, or nullptr
+  // if that tier isn't configured.
+  File *GetSampleFileDir(SampleFileTier tier) const {
+    return tier == SampleFileTier::kHot ? sample_file_dir
+                                        : cold_sample_file_dir;
+  }
+
+  // As GetSampleFileDir, but I/O through the result is also counted toward
+  // the stream |stream_name| if |disk_monitor| is set.
+  File *GetStreamSampleFileDir(const std::string &stream_name,
+                               SampleFileTier tier) const {
+    File *dir = GetSampleFileDir(tier);
+    return disk_monitor == nullptr || dir == nullptr
+               ? dir
+               : disk_monitor->GetStreamDir(stream_name, dir);
+  }
+
+  // Returns the token bucket limiting |io_class|, or nullptr if unlimited.
+  TokenBucket *GetIoBucket(IoClass io_class) const {
+    return io_throttle == nullptr ? nullptr : io_throttle->bucket(io_class);
+  }
+
+  // Unlinks each of |paths| within |dir| via |unlinker| if supplied, filling
+  // |results| with 0 or errno>0 for each.
+  void UnlinkAll(File *dir, const std::vector<std::string> &paths,
+                 std::vector<int> *results) const;
 };
 
 // A single video stream, currently always a camera's "main" (as opposed to
@@ -90,7 +198,12 @@ class Stream {
         row_(row),
         rotate_offset_sec_(rotate_offset_sec),
         rotate_interval_sec_(rotate_interval_sec),
-        writer_(env->sample_file_dir) {}
+        sample_file_dir_(
+            env->GetStreamSampleFileDir(row.short_name, SampleFileTier::kHot)),
+        writer_(sample_file_dir_, env->digest_worker,
+                env->sample_file_hash_algorithm) {
+    writer_.set_sync_on_close(!relaxed_durability());
+  }
   Stream(const Stream &) = delete;
   Stream &operator=(const Stream &) = delete;
 
@@ -107,16 +220,41 @@ class Stream {
   // due to normal rotation, or -1 if closing abruptly.
   void CloseOutput(int64_t pts);
 
+  // Discard the current output segment after a failure to close it.
+  void DiscardOutput();
+
   bool OpenOutput(std::string *error_message);
+
+  // If no container is open, set |container_| to the camera's newest one (if
+  // any) so that it's resumed rather than deleted.
+  bool FindNewestContainer(std::string *error_message);
+
+  // Ensure |container_| refers to a container with space remaining, creating
+  // a new one if necessary.
+  bool PrepareContainer(std::string *error_message);
+
   bool RotateFiles(std::string *error_message);
+
+  // Unlink |uuids_to_unlink_|, leaving any failures there to retry and adding
+  // the rest to |uuids_to_mark_deleted_|. If env_->sample_file_deleter is
+  // set, instead hand them all to it, which also syncs and marks them.
   void TryUnlink();
 
+  bool relaxed_durability() const { return env_->sync_interval_sec > 0; }
+
+  // With relaxed durability, make everything written and unlinked so far
+  // durable with a single filesystem sync, then update the journal to match.
+  void SyncFiles();
+
   const ShutdownSignal *signal_;
   const Environment *env_;
   ListCamerasRow row_;
   const int rotate_offset_sec_;
   const int rotate_interval_sec_;
 
+  // env_->sample_file_dir, counting I/O toward this stream.
+  File *const sample_file_dir_;
+
   //
   // State below is used only by the thread in Run().
   //
@@ -131,9 +269,18 @@ class Stream {
 
   VideoSampleEntry entry_;
   std::string transform_tmp_;
-  std::vector<Uuid> uuids_to_unlink_;
+  std::vector<std::pair<Uuid, SampleFileTier>> uuids_to_unlink_;
   std::vector<Uuid> uuids_to_mark_deleted_;
 
+  // With relaxed durability, the uuids whose journal rows should be removed
+  // at the next sync, and when (in seconds since epoch) that sync is due.
+  std::vector<Uuid> journaled_uuids_;
+  time_t next_sync_time_ = 0;
+
+  // The container being appended to, if env_->container_bytes > 0. id is -1
+  // if none has been loaded or created yet.
+  ContainerRow container_;
+
   // Current output segment.
   Recording recording_;
   moonfire_nvr::SampleFileWriter writer_;
@@ -156,6 +303,138 @@ class Stream {
   struct timespec frame_realtime_ = {0, 0};
 };
 
+// Unlinks sample files whose recordings have already been deleted from the
+// database, then fsync()s their directories and marks them deleted. A burst
+// of retention can take minutes to unlink, particularly with
+// --unlink_max_per_sec, so this lets streams queue the files and return to
+// recording. Files not yet deleted at shutdown remain reserved and are
+// deleted on the next startup. Thread-safe; the Nvr should call DeleteBatch
+// repeatedly from a dedicated thread.
+class SampleFileDeleter {
+ public:
+  explicit SampleFileDeleter(const Environment *env) : env_(env) {}
+  SampleFileDeleter(const SampleFileDeleter &) = delete;
+  SampleFileDeleter &operator=(const SampleFileDeleter &) = delete;
+
+  // Queue the sample files |uuids| within |dir| for deletion.
+  void Enqueue(File *dir, const std::vector<Uuid> &uuids);
+
+  // Delete up to |max_files| of the oldest queued files, setting |deleted|
+  // to the number deleted. Files which couldn't be deleted are queued again.
+  bool DeleteBatch(size_t max_files, int *deleted, std::string *error_message);
+
+ private:
+  const Environment *env_;
+  std::mutex mu_;
+  std::deque<std::pair<File *, Uuid>> queue_;  // protected by mu_.
+};
+
+// Moves aged recordings from the hot tier to the cold tier in large batches,
+// using the procedure described in design/schema.md. Methods are
+// thread-compatible rather than thread-safe; the Nvr should call Run in a
+// dedicated thread.
+class SampleFileMover {
+ public:
+  // |env->cold_sample_file_dir| must be non-null.
+  SampleFileMover(const ShutdownSignal *signal, Environment *const env)
+      : signal_(signal), env_(env) {}
+  SampleFileMover(const SampleFileMover &) = delete;
+  SampleFileMover &operator=(const SampleFileMover &) = delete;
+
+  // Call from dedicated thread. Runs until shutdown requested.
+  void Run();
+
+  // Move a single batch of the oldest eligible recordings, setting |moved| to
+  // the number moved. Exposed for testing.
+  bool MoveBatch(int *moved, std::string *error_message);
+
+ private:
+  // Release the reservations of |rows| after BeginMoveToCold, discarding
+  // any cold-tier copies, so retention can delete them again. If this fails,
+  // the reservations will be cleaned up on next startup.
+  void AbandonMove(const std::vector<ListOldestSampleFilesRow> &rows);
+
+  // Copy a sample file from the hot tier to the cold tier and fsync() it.
+  bool CopyToCold(const ListOldestSampleFilesRow &row,
+                  std::string *error_message);
+
+  const ShutdownSignal *signal_;
+  const Environment *env_;
+  std::string buf_;
+};
+
+// Thins aged recordings of cameras with a |thin_age_sec| to key frames only,
+// using the procedure described in design/schema.md. Methods are
+// thread-compatible rather than thread-safe; the Nvr should call Run in a
+// dedicated thread.
+class SampleFileThinner {
+ public:
+  SampleFileThinner(const ShutdownSignal *signal, Environment *const env)
+      : signal_(signal), env_(env) {}
+  SampleFileThinner(const SampleFileThinner &) = delete;
+  SampleFileThinner &operator=(const SampleFileThinner &) = delete;
+
+  // Call from dedicated thread. Runs until shutdown requested.
+  void Run();
+
+  // Thin a batch of the oldest eligible recordings of each camera, setting
+  // |thinned| to the number thinned. Exposed for testing.
+  bool ThinBatch(int *thinned, std::string *error_message);
+
+ private:
+  // Replace a single recording with a thinned copy, reclaiming the original.
+  // On success, fills |thinned_bytes| with the copy's size.
+  bool Thin(const Recording &original, int64_t *thinned_bytes,
+            std::string *error_message);
+
+  // Write and fsync() a thinned copy of |original| in |dir| as |new_uuid|,
+  // filling |thinned| with its recording.
+  bool WriteThinned(File *dir, const Recording &original, const Uuid &new_uuid,
+                    Recording *thinned, std::string *error_message);
+
+  const ShutdownSignal *signal_;
+  const Environment *env_;
+  std::string buf_;
+};
+
+// Verifies sample files against their recorded hashes, oldest recording
+// first, so that silent corruption is noticed while there's still time to
+// do something about it. A pass over all recordings is resumable across
+// restarts via the scrub_state table; mismatches are recorded in the
+// scrub_mismatch table. Methods are thread-compatible rather than
+// thread-safe; the Nvr should call Run in a dedicated thread.
+class SampleFileScrubber {
+ public:
+  SampleFileScrubber(const ShutdownSignal *signal, Environment *const env)
+      : signal_(signal), env_(env) {}
+  SampleFileScrubber(const SampleFileScrubber &) = delete;
+  SampleFileScrubber &operator=(const SampleFileScrubber &) = delete;
+
+  // Call from dedicated thread. Runs until shutdown requested.
+  void Run();
+
+  // Verify the next batch of recordings in the current pass, starting a new
+  // pass if one is due, and save progress. Sets |scrubbed| to the number of
+  // recordings verified. Exposed for testing.
+  bool ScrubBatch(int *scrubbed, std::string *error_message);
+
+ private:
+  // Read |recording|'s sample data and compare its hash. Returns false with
+  // a description of the problem on failure or mismatch.
+  bool Verify(const Recording &recording, std::string *error_message);
+
+  const ShutdownSignal *signal_;
+  const Environment *env_;
+  std::string buf_;
+};
+
+// Crash recovery for sample files written with relaxed durability: keeps
+// each journaled sample file which turns out to be complete, truncates the
+// others to their durable prefixes, and deletes the recordings of any with
+// no durable prefix. See design/schema.md. Called by Nvr::Init before
+// reserved sample files are discarded; exposed for testing.
+bool RecoverJournal(Environment *env, std::string *error_message);
+
 // The main network video recorder, which manages a collection of streams.
 class Nvr {
  public:
@@ -176,9 +455,34 @@ class Nvr {
  private:
   void HttpCallbackForTopLevel(evhttp_request *req);
 
+  // Periodically sample env_->disk_monitor until shutdown.
+  void RunDiskMonitor();
+
+  // Periodically checkpoint through env_->wal_checkpointer until shutdown.
+  void RunWalCheckpointer();
+
+  // Delete the sample files queued to env_->sample_file_deleter until
+  // shutdown.
+  void RunSampleFileDeleter();
+
+  // Migrate all of |dir|'s sample files from the flat layout, in batches with
+  // pauses between them to limit the impact on recording. Runs until done or
+  // shutdown.
+  void RunFlatMigration(ShardedSampleFileDir *dir);
+
   Environment *const env_;
   std::vector<std::unique_ptr<Stream>> streams_;
   std::vector<std::thread> stream_threads_;
+  std::unique_ptr<SampleFileMover> mover_;
+  std::thread mover_thread_;
+  std::unique_ptr<SampleFileThinner> thinner_;
+  std::thread thinner_thread_;
+  std::unique_ptr<SampleFileScrubber> scrubber_;
+  std::thread scrubber_thread_;
+  std::thread disk_monitor_thread_;
+  std::thread wal_checkpointer_thread_;
+  std::thread sample_file_deleter_thread_;
+  std::vector<std::thread> migration_threads_;
   ShutdownSignal signal_;
 };
 
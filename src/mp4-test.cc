@@ -95,6 +95,7 @@ TEST(Mp4SampleTablePiecesTest, AllSyncFrames) {
     int64_t sample_bytes = 3 * i;
     encoder.AddSample(sample_duration_90k, sample_bytes, true);
   }
+  encoder.Flush();
 
   Mp4SampleTablePieces pieces;
   std::string error_message;
@@ -129,6 +130,7 @@ TEST(Mp4SampleTablePiecesTest, HalfSyncFrames) {
     int64_t sample_bytes = 3 * i;
     encoder.AddSample(sample_duration_90k, sample_bytes, (i % 2) == 1);
   }
+  encoder.Flush();
 
   Mp4SampleTablePieces pieces;
   std::string error_message;
@@ -163,6 +165,7 @@ TEST(Mp4SampleTablePiecesTest, FastPath) {
     int64_t sample_bytes = 3 * i;
     encoder.AddSample(sample_duration_90k, sample_bytes, (i % 2) == 1);
   }
+  encoder.Flush();
   auto total_duration_90k = recording.end_time_90k - recording.start_time_90k;
 
   Mp4SampleTablePieces pieces;
@@ -193,6 +196,78 @@ TEST(Mp4SampleTablePiecesTest, FastPath) {
   EXPECT_EQ(kExpectedStsz, ToHex(pieces.stsz_entries(), true));
 }
 
+TEST(Mp4SampleTablePiecesTest, SeeksAcrossKeyFrames) {
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 42);
+  for (int i = 0; i < 30; ++i) {
+    encoder.AddSample(10, i + 1, (i % 5) == 0);
+  }
+  encoder.Flush();
+
+  Mp4SampleTablePieces pieces;
+  std::string error_message;
+  // Time range [123, 217) starts within the key frame at 100 (the 11th
+  // sample) and ends with the frame at 210 (the 22nd).
+  ASSERT_TRUE(pieces.Init(&recording, 2, 1, 123, 217, &error_message))
+      << error_message;
+  EXPECT_EQ(100, pieces.start_90k());
+  EXPECT_EQ(220, pieces.end_90k());
+  EXPECT_EQ(12, pieces.samples());
+  EXPECT_EQ(55, pieces.sample_pos().begin);  // 1 + 2 + ... + 10
+  EXPECT_EQ(253, pieces.sample_pos().end);   // 1 + 2 + ... + 22
+
+  EXPECT_EQ(3, pieces.stss_entry_count());
+  const char kExpectedStss[] = "00 00 00 01 00 00 00 06 00 00 00 0b";
+  EXPECT_EQ(kExpectedStss, ToHex(pieces.stss_entries(), true));
+
+  EXPECT_EQ(12, pieces.stsz_entry_count());
+  const char kExpectedStsz[] =
+      "00 00 00 0b 00 00 00 0c 00 00 00 0d 00 00 00 0e 00 00 00 0f "
+      "00 00 00 10 00 00 00 11 00 00 00 12 00 00 00 13 00 00 00 14 "
+      "00 00 00 15 00 00 00 16";
+  EXPECT_EQ(kExpectedStsz, ToHex(pieces.stsz_entries(), true));
+
+  // Seeking through a KeyFrameCache should find the same range, building the
+  // recording's table on the first use only.
+  KeyFrameCache cache(1 << 20);
+  for (int i = 0; i < 2; ++i) {
+    Mp4SampleTablePieces cached_pieces;
+    ASSERT_TRUE(cached_pieces.Init(&recording, 2, 1, 123, 217, &cache,
+                                   &error_message))
+        << error_message;
+    EXPECT_EQ(100, cached_pieces.start_90k());
+    EXPECT_EQ(220, cached_pieces.end_90k());
+    EXPECT_EQ(12, cached_pieces.samples());
+    EXPECT_EQ(55, cached_pieces.sample_pos().begin);
+    EXPECT_EQ(253, cached_pieces.sample_pos().end);
+    EXPECT_EQ(kExpectedStss, ToHex(cached_pieces.stss_entries(), true));
+    EXPECT_EQ(kExpectedStsz, ToHex(cached_pieces.stsz_entries(), true));
+  }
+  EXPECT_EQ(1, cache.misses());
+  EXPECT_EQ(1, cache.hits());
+
+  // If the cache can't build a table, here because a version 1 index ends
+  // with a truncated varint, seeking should fall back to scanning the index,
+  // which stops before reaching the bad byte.
+  Recording truncated;
+  truncated.id = recording.id + 1;
+  truncated.start_time_90k = 0;
+  truncated.end_time_90k = 50;
+  truncated.video_index =
+      std::string("\x29\xd0\x0f\x02\x14\x08\x0a\x02\x05\x01\x64\x80");
+  Mp4SampleTablePieces fallback_pieces;
+  ASSERT_TRUE(fallback_pieces.Init(&truncated, 2, 1, 0, 30, &cache,
+                                   &error_message))
+      << error_message;
+  EXPECT_EQ(0, fallback_pieces.start_90k());
+  EXPECT_EQ(30, fallback_pieces.end_90k());
+  EXPECT_EQ(3, fallback_pieces.samples());
+  EXPECT_EQ(0, fallback_pieces.sample_pos().begin);
+  EXPECT_EQ(1025, fallback_pieces.sample_pos().end);  // 1000 + 10 + 15
+  EXPECT_EQ(1, cache.size());
+}
+
 class IntegrationTest : public testing::Test {
  protected:
   IntegrationTest() {
@@ -248,8 +323,9 @@ class IntegrationTest : public testing::Test {
       }
       index.AddSample(pkt.pkt()->duration, pkt.pkt()->size, pkt.is_key());
     }
+    index.Flush();
 
-    if (!writer.Close(&recording.sample_file_sha1, &error_message)) {
+    if (!writer.Close(&recording.sample_file_hash, &error_message)) {
       ADD_FAILURE() << "Close: " << error_message;
     }
     return recording;
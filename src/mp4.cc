@@ -360,10 +360,11 @@ class ScopedMp4Box {
 // * mdat (media data container)
 class Mp4File : public VirtualFile {
  public:
-  Mp4File(File *sample_file_dir,
+  Mp4File(File *sample_file_dir, File *cold_sample_file_dir,
           std::vector<std::unique_ptr<Mp4FileSegment>> segments,
           VideoSampleEntry &&video_sample_entry)
       : sample_file_dir_(sample_file_dir),
+        cold_sample_file_dir_(cold_sample_file_dir),
         segments_(std::move(segments)),
         video_sample_entry_(std::move(video_sample_entry)),
         ftyp_(re2::StringPiece(kFtypBox, sizeof(kFtypBox))),
@@ -392,9 +393,23 @@ class Mp4File : public VirtualFile {
     slices_.Append(mdat_.header_slice());
     initial_sample_byte_pos_ = slices_.size();
     for (const auto &segment : segments_) {
-      segment->sample_file_slice.Init(
-          sample_file_dir_, segment->recording.sample_file_uuid.UnparseText(),
-          segment->pieces.sample_pos());
+      // A recording within a container starts at an offset within the file.
+      ByteRange file_range = segment->pieces.sample_pos();
+      file_range.begin += segment->recording.sample_file_offset;
+      file_range.end += segment->recording.sample_file_offset;
+
+      // A hot-tier recording may be moved to the cold tier (and its hot copy
+      // unlinked) before this file is served; a cold-tier recording is never
+      // moved back. See design/schema.md.
+      if (segment->recording.sample_file_tier == SampleFileTier::kCold) {
+        segment->sample_file_slice.Init(
+            cold_sample_file_dir_,
+            segment->recording.sample_file_uuid.UnparseText(), file_range);
+      } else {
+        segment->sample_file_slice.Init(
+            sample_file_dir_, cold_sample_file_dir_,
+            segment->recording.sample_file_uuid.UnparseText(), file_range);
+      }
       slices_.Append(&segment->sample_file_slice, FileSlices::kLazy);
     }
     mdat_.header().largesize = ToNetworkU64(slices_.size() - size_before_mdat);
@@ -408,7 +423,7 @@ class Mp4File : public VirtualFile {
       Append64(segment->pieces.sample_pos().begin, &segment_times);
       Append64(segment->pieces.sample_pos().end, &segment_times);
       etag_digest->Update(segment_times);
-      etag_digest->Update(segment->recording.sample_file_sha1);
+      etag_digest->Update(segment->recording.sample_file_hash);
     }
     etag_ = StrCat("\"", ToHex(etag_digest->Finalize()), "\"");
   }
@@ -421,6 +436,10 @@ class Mp4File : public VirtualFile {
                    std::string *error_message) const final {
     return slices_.AddRange(range, buf, error_message);
   }
+  bool WriteRange(ByteRange range, int fd,
+                  std::string *error_message) const final {
+    return slices_.WriteRange(range, fd, error_message);
+  }
 
  private:
   void AppendMoov(uint32_t net_duration, uint32_t net_creation_ts) {
@@ -545,6 +564,7 @@ class Mp4File : public VirtualFile {
 
   int64_t initial_sample_byte_pos_ = 0;
   File *sample_file_dir_ = nullptr;
+  File *cold_sample_file_dir_ = nullptr;
   std::vector<std::unique_ptr<Mp4FileSegment>> segments_;
   VideoSampleEntry video_sample_entry_;
   FileSlices slices_;
@@ -583,6 +603,7 @@ namespace internal {
 bool Mp4SampleTablePieces::Init(const Recording *recording,
                                 int sample_entry_index, int32_t sample_offset,
                                 int32_t start_90k, int32_t end_90k,
+                                KeyFrameCache *key_frame_cache,
                                 std::string *error_message) {
   sample_entry_index_ = sample_entry_index;
   sample_offset_ = sample_offset;
@@ -604,32 +625,48 @@ bool Mp4SampleTablePieces::Init(const Recording *recording,
       *error_message = "First frame must be a key frame.";
       return false;
     }
-    for (; !it.done(); it.Next()) {
-      VLOG(3) << "Processing frame with start " << it.start_90k()
-              << (it.is_key() ? " (key)" : " (non-key)");
-      // Find boundaries.
-      if (it.start_90k() <= start_90k && it.is_key()) {
-        VLOG(3) << "...new start candidate.";
-        begin_ = it;
-        sample_pos_.begin = begin_.pos();
-        frames_ = 0;
-        key_frames_ = 0;
-      }
-      if (it.start_90k() >= end_90k) {
-        VLOG(3) << "...past end.";
-        break;
-      }
 
-      // Process this frame.
-      frames_++;
-      if (it.is_key()) {
-        key_frames_++;
+    // Find the boundaries: the last key frame starting at or before
+    // |start_90k|, and the first frame starting at or after |end_90k|. For
+    // the latter, seek to the last key frame before |end_90k| and scan from
+    // there.
+    begin_ = it;
+    // The cache is only an optimization; if its table can't be built, scan
+    // the index instead and let any real problem surface below.
+    std::shared_ptr<const KeyFrameTable> key_frames;
+    if (key_frame_cache != nullptr) {
+      std::string cache_error;
+      key_frames = key_frame_cache->Get(*recording, &cache_error);
+      if (key_frames == nullptr) {
+        LOG(WARNING) << "Unable to get key frames of recording "
+                     << recording->id << "; scanning its index instead: "
+                     << cache_error;
       }
-
-      // This is the current best candidate to end.
+    }
+    if (key_frames != nullptr) {
+      begin_.SeekToKeyFrame(start_90k, *key_frames);
+      it.SeekToKeyFrame(end_90k - 1, *key_frames);
+    } else {
+      begin_.SeekToKeyFrame(start_90k);
+      it.SeekToKeyFrame(end_90k - 1);
+    }
+    if (it.sample_num() < begin_.sample_num()) {
+      it = begin_;
+    }
+    actual_end_90k_ = begin_.start_90k();
+    for (; !it.done() && it.start_90k() < end_90k; it.Next()) {
+      VLOG(3) << "Processing frame with start " << it.start_90k()
+              << (it.is_key() ? " (key)" : " (non-key)");
       actual_end_90k_ = it.end_90k();
     }
+    sample_pos_.begin = begin_.pos();
     sample_pos_.end = it.pos();
+    frames_ = it.sample_num() - begin_.sample_num();
+    key_frames_ = it.key_frames_before() - begin_.key_frames_before();
+    if (begin_.has_error()) {
+      *error_message = begin_.error();
+      return false;
+    }
   }
   if (it.has_error()) {
     *error_message = it.error();
@@ -655,36 +692,36 @@ bool Mp4SampleTablePieces::Init(const Recording *recording,
   return true;
 }
 
+bool Mp4SampleTablePieces::DecodeIndex(DecodedSampleIndex *index,
+                                       std::string *error_message) const {
+  if (!index->Decode(begin_, frames_, error_message)) {
+    return false;
+  }
+  if (index->size() != static_cast<size_t>(frames_)) {
+    *error_message = StrCat("video index has ", index->size(),
+                            " samples in range; expected ", frames_);
+    return false;
+  }
+  return true;
+}
+
 bool Mp4SampleTablePieces::FillSttsEntries(std::string *s,
                                            std::string *error_message) const {
-  SampleIndexIterator it;
-  for (it = begin_; !it.done() && it.start_90k() < desired_end_90k_;
-       it.Next()) {
-    AppendU32(1, s);
-    AppendU32(it.duration_90k(), s);
-  }
-  if (it.has_error()) {
-    *error_message = it.error();
+  DecodedSampleIndex index;
+  if (!DecodeIndex(&index, error_message)) {
     return false;
   }
+  index.AppendStts(0, frames_, s);
   return true;
 }
 
 bool Mp4SampleTablePieces::FillStssEntries(std::string *s,
                                            std::string *error_message) const {
-  SampleIndexIterator it;
-  uint32_t sample_num = sample_offset_;
-  for (it = begin_; !it.done() && it.start_90k() < desired_end_90k_;
-       it.Next()) {
-    if (it.is_key()) {
-      Append32(sample_num, s);
-    }
-    sample_num++;
-  }
-  if (it.has_error()) {
-    *error_message = it.error();
+  DecodedSampleIndex index;
+  if (!DecodeIndex(&index, error_message)) {
     return false;
   }
+  index.AppendStss(0, frames_, sample_offset_, s);
   return true;
 }
 
@@ -698,15 +735,11 @@ bool Mp4SampleTablePieces::FillStscEntries(std::string *s,
 
 bool Mp4SampleTablePieces::FillStszEntries(std::string *s,
                                            std::string *error_message) const {
-  SampleIndexIterator it;
-  for (it = begin_; !it.done() && it.start_90k() < desired_end_90k_;
-       it.Next()) {
-    Append32(it.bytes(), s);
-  }
-  if (it.has_error()) {
-    *error_message = it.error();
+  DecodedSampleIndex index;
+  if (!DecodeIndex(&index, error_message)) {
     return false;
   }
+  index.AppendStsz(0, frames_, s);
   return true;
 }
 
@@ -739,10 +772,18 @@ std::shared_ptr<VirtualFile> Mp4FileBuilder::Build(std::string *error_message) {
       return std::shared_ptr<VirtualFile>();
     }
 
+    if (segment->recording.sample_file_tier == SampleFileTier::kCold &&
+        cold_sample_file_dir_ == nullptr) {
+      *error_message = StrCat("recording ", segment->recording.id,
+                              " is in the cold tier, which isn't configured");
+      return std::shared_ptr<VirtualFile>();
+    }
+
     if (!segment->pieces.Init(&segment->recording,
                               1,  // sample entry index
                               sample_offset, segment->rel_start_90k,
-                              segment->rel_end_90k, error_message)) {
+                              segment->rel_end_90k, key_frame_cache_,
+                              error_message)) {
       return std::shared_ptr<VirtualFile>();
     }
     sample_offset += segment->pieces.samples();
@@ -753,8 +794,9 @@ std::shared_ptr<VirtualFile> Mp4FileBuilder::Build(std::string *error_message) {
     return std::shared_ptr<VirtualFile>();
   }
 
-  return std::shared_ptr<VirtualFile>(new Mp4File(
-      sample_file_dir_, std::move(segments_), std::move(video_sample_entry_)));
+  return std::shared_ptr<VirtualFile>(
+      new Mp4File(sample_file_dir_, cold_sample_file_dir_, std::move(segments_),
+                  std::move(video_sample_entry_)));
 }
 
 }  // namespace moonfire_nvr
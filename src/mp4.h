@@ -39,6 +39,7 @@
 #include <memory>
 #include <vector>
 
+#include "key-frame-cache.h"
 #include "recording.h"
 #include "http.h"
 
@@ -70,9 +71,18 @@ class Mp4SampleTablePieces {
   // from the last sync sample <= |start_90k| to the last sample with start time
   // <= |end_90k|. TODO: support edit lists and duration trimming to produce
   // the exact correct time range.
+  //
+  // If |key_frame_cache| is non-null, a partial recording's boundaries are
+  // found through its KeyFrameTable rather than the index itself.
+  bool Init(const Recording *recording, int sample_entry_index,
+            int32_t sample_offset, int32_t start_90k, int32_t end_90k,
+            std::string *error_message) {
+    return Init(recording, sample_entry_index, sample_offset, start_90k,
+                end_90k, nullptr, error_message);
+  }
   bool Init(const Recording *recording, int sample_entry_index,
             int32_t sample_offset, int32_t start_90k, int32_t end_90k,
-            std::string *error_message);
+            KeyFrameCache *key_frame_cache, std::string *error_message);
 
   int32_t stts_entry_count() const { return frames_; }
   const FileSlice *stts_entries() const { return &stts_entries_; }
@@ -99,8 +109,13 @@ class Mp4SampleTablePieces {
   bool FillStscEntries(std::string *s, std::string *error_message) const;
   bool FillStszEntries(std::string *s, std::string *error_message) const;
 
-  // After Init(), |begin_| will be on the first sample after the start of the
-  // range (or it will be done()).
+  // Decodes the range's samples for one of the Fill*Entries methods. They're
+  // decoded again on each fill rather than kept around, so that a long .mp4
+  // file doesn't hold every segment's decoded samples in memory.
+  bool DecodeIndex(DecodedSampleIndex *index, std::string *error_message) const;
+
+  // After Init(), |begin_| will be on the first sample of the range (or it
+  // will be done()).
   SampleIndexIterator begin_;
 
   ByteRange sample_pos_;
@@ -134,6 +149,11 @@ class Mp4FileBuilder {
   // VirtualFile.
   explicit Mp4FileBuilder(File *sample_file_dir)
       : sample_file_dir_(sample_file_dir) {}
+
+  // As above, also reading cold-tier recordings from |cold_sample_file_dir|.
+  Mp4FileBuilder(File *sample_file_dir, File *cold_sample_file_dir)
+      : sample_file_dir_(sample_file_dir),
+        cold_sample_file_dir_(cold_sample_file_dir) {}
   Mp4FileBuilder(const Mp4FileBuilder &) = delete;
   void operator=(const Mp4FileBuilder &) = delete;
 
@@ -146,6 +166,13 @@ class Mp4FileBuilder {
   // TODO: support multiple sample entries?
   Mp4FileBuilder &SetSampleEntry(const VideoSampleEntry &entry);
 
+  // Use |cache| (if non-null) when seeking within recordings; it must
+  // outlive the Mp4FileBuilder.
+  Mp4FileBuilder &SetKeyFrameCache(KeyFrameCache *cache) {
+    key_frame_cache_ = cache;
+    return *this;
+  }
+
   // Set if a subtitle track should be added with timestamps.
   // TODO: unimplemented.
   Mp4FileBuilder &include_timestamp_subtitle_track(bool);
@@ -167,6 +194,8 @@ class Mp4FileBuilder {
 
  private:
   File *sample_file_dir_;
+  File *cold_sample_file_dir_ = nullptr;
+  KeyFrameCache *key_frame_cache_ = nullptr;
   std::vector<std::unique_ptr<internal::Mp4FileSegment>> segments_;
   VideoSampleEntry video_sample_entry_;
 };
@@ -0,0 +1,191 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// recording-index-test.cc: tests of the recording-index.h interface.
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "recording-index.h"
+
+DECLARE_bool(alsologtostderr);
+
+namespace moonfire_nvr {
+namespace {
+
+// A 60-second recording; ids and start times both ascend.
+IndexedRecording MakeRecording(int64_t id) {
+  IndexedRecording recording;
+  recording.id = id;
+  recording.start_time_90k = id * 60 * kTimeUnitsPerSecond;
+  recording.end_time_90k = recording.start_time_90k + 60 * kTimeUnitsPerSecond;
+  recording.sample_file_bytes = 1000 + id;
+  recording.video_samples = 1800;
+  recording.video_sample_entry_id = 1;
+  recording.sample_file_uuid = GetRealUuidGenerator()->Generate();
+  return recording;
+}
+
+std::vector<IndexedRecording> MakeRecordings(int64_t first, int64_t n) {
+  std::vector<IndexedRecording> recordings;
+  for (int64_t id = first; id < first + n; ++id) {
+    recordings.push_back(MakeRecording(id));
+  }
+  return recordings;
+}
+
+// The ids visited by ForEach.
+std::vector<int64_t> Ids(const RecordingIndex &index, int64_t start_time_90k,
+                         int64_t end_time_90k, bool newest_first) {
+  std::vector<int64_t> ids;
+  index.ForEach(start_time_90k, end_time_90k, newest_first,
+                [&](const IndexedRecording &recording) {
+                  ids.push_back(recording.id);
+                  return IterationControl::kContinue;
+                });
+  return ids;
+}
+
+TEST(RecordingIndexTest, FindAndForEach) {
+  RecordingIndex index(MakeRecordings(1, 3));
+  EXPECT_EQ(3u, index.size());
+
+  IndexedRecording expected = MakeRecording(2);
+  IndexedRecording recording;
+  ASSERT_TRUE(index.Find(expected.start_time_90k, 2, &recording));
+  EXPECT_EQ(2, recording.id);
+  EXPECT_EQ(expected.end_time_90k, recording.end_time_90k);
+  EXPECT_EQ(1002, recording.sample_file_bytes);
+  EXPECT_EQ(1800, recording.video_samples);
+  EXPECT_EQ(SampleFileTier::kHot, recording.sample_file_tier);
+  EXPECT_FALSE(recording.in_container);
+  EXPECT_FALSE(index.Find(expected.start_time_90k, 3, &recording));
+
+  const int64_t minute = 60 * kTimeUnitsPerSecond;
+  EXPECT_EQ(std::vector<int64_t>({1, 2, 3}),
+            Ids(index, 0, 10 * minute, false));
+  EXPECT_EQ(std::vector<int64_t>({3, 2, 1}), Ids(index, 0, 10 * minute, true));
+  EXPECT_EQ(std::vector<int64_t>({2}), Ids(index, 2 * minute, 3 * minute, true));
+  EXPECT_EQ(std::vector<int64_t>(), Ids(index, 3 * minute, 3 * minute, false));
+  EXPECT_EQ(std::vector<int64_t>(), Ids(RecordingIndex(), 0, minute, false));
+
+  std::vector<int64_t> ids;
+  index.ForEach(0, 10 * minute, true, [&](const IndexedRecording &recording) {
+    ids.push_back(recording.id);
+    return IterationControl::kBreak;
+  });
+  EXPECT_EQ(std::vector<int64_t>({3}), ids);
+}
+
+TEST(RecordingIndexTest, ApplyLeavesOriginalUnchanged) {
+  RecordingIndex index(MakeRecordings(1, 3));
+  IndexedRecording cold = MakeRecording(2);
+  cold.sample_file_tier = SampleFileTier::kCold;
+  cold.in_container = true;
+  IndexedRecording erased;
+  erased.id = 1;
+  erased.start_time_90k = MakeRecording(1).start_time_90k;
+  auto next = index.Apply({cold, MakeRecording(4)}, {erased});
+
+  EXPECT_EQ(3u, next->size());
+  EXPECT_EQ(std::vector<int64_t>({2, 3, 4}),
+            Ids(*next, 0, std::numeric_limits<int64_t>::max(), false));
+  IndexedRecording recording;
+  ASSERT_TRUE(next->Find(cold.start_time_90k, 2, &recording));
+  EXPECT_EQ(SampleFileTier::kCold, recording.sample_file_tier);
+  EXPECT_TRUE(recording.in_container);
+
+  EXPECT_EQ(3u, index.size());
+  EXPECT_EQ(std::vector<int64_t>({1, 2, 3}),
+            Ids(index, 0, std::numeric_limits<int64_t>::max(), false));
+  ASSERT_TRUE(index.Find(cold.start_time_90k, 2, &recording));
+  EXPECT_EQ(SampleFileTier::kHot, recording.sample_file_tier);
+}
+
+TEST(RecordingIndexTest, ManyChunks) {
+  const int64_t n = 5 * RecordingIndex::kChunkRows / 2;
+  std::shared_ptr<const RecordingIndex> index(
+      new RecordingIndex(MakeRecordings(0, n)));
+
+  // Append enough to split the last chunk, then erase every other recording
+  // and all of the first chunk.
+  index = index->Apply(MakeRecordings(n, 2 * RecordingIndex::kChunkRows),
+                       std::vector<IndexedRecording>());
+  const int64_t total = n + 2 * RecordingIndex::kChunkRows;
+  EXPECT_EQ(static_cast<size_t>(total), index->size());
+  std::vector<IndexedRecording> erased;
+  for (int64_t id = 0; id < total; ++id) {
+    if (id < static_cast<int64_t>(RecordingIndex::kChunkRows) || id % 2 == 1) {
+      erased.push_back(MakeRecording(id));
+    }
+  }
+  index = index->Apply(std::vector<IndexedRecording>(), erased);
+
+  std::vector<int64_t> expected;
+  for (int64_t id = RecordingIndex::kChunkRows; id < total; id += 2) {
+    expected.push_back(id);
+  }
+  EXPECT_EQ(expected.size(), index->size());
+  EXPECT_EQ(expected, Ids(*index, 0, std::numeric_limits<int64_t>::max(),
+                          false));
+  std::reverse(expected.begin(), expected.end());
+  EXPECT_EQ(expected, Ids(*index, 0, std::numeric_limits<int64_t>::max(),
+                          true));
+  IndexedRecording recording;
+  for (int64_t id = 0; id < total; ++id) {
+    EXPECT_EQ(
+        id >= static_cast<int64_t>(RecordingIndex::kChunkRows) && id % 2 == 0,
+        index->Find(MakeRecording(id).start_time_90k, id, &recording))
+        << id;
+  }
+
+  // An erased recording can be added back.
+  index = index->Apply({MakeRecording(total - 1)},
+                       std::vector<IndexedRecording>());
+  EXPECT_EQ(std::vector<int64_t>({total - 1, total - 2}),
+            Ids(*index, MakeRecording(total - 2).start_time_90k,
+                std::numeric_limits<int64_t>::max(), true));
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
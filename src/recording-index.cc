@@ -0,0 +1,260 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// recording-index.cc: see recording-index.h.
+
+#include "recording-index.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <glog/logging.h>
+
+namespace moonfire_nvr {
+
+const size_t RecordingIndex::kChunkRows;
+
+IndexedRecording RecordingIndex::Chunk::Get(size_t i) const {
+  IndexedRecording recording;
+  recording.id = id[i];
+  recording.start_time_90k = start_time_90k[i];
+  recording.end_time_90k = start_time_90k[i] + duration_90k[i];
+  recording.sample_file_bytes = sample_file_bytes[i];
+  recording.video_samples = video_samples[i];
+  recording.video_sample_entry_id = video_sample_entry_id[i];
+  recording.sample_file_uuid = sample_file_uuid[i];
+  recording.sample_file_tier = (flags[i] & kColdFlag) ? SampleFileTier::kCold
+                                                      : SampleFileTier::kHot;
+  recording.in_container = (flags[i] & kContainerFlag) != 0;
+  return recording;
+}
+
+void RecordingIndex::Chunk::Set(size_t i, const IndexedRecording &recording) {
+  id[i] = recording.id;
+  start_time_90k[i] = recording.start_time_90k;
+  duration_90k[i] = recording.end_time_90k - recording.start_time_90k;
+  video_samples[i] = recording.video_samples;
+  sample_file_bytes[i] = recording.sample_file_bytes;
+  video_sample_entry_id[i] = recording.video_sample_entry_id;
+  sample_file_uuid[i] = recording.sample_file_uuid;
+  flags[i] =
+      (recording.sample_file_tier == SampleFileTier::kCold ? kColdFlag : 0) |
+      (recording.in_container ? kContainerFlag : 0);
+}
+
+void RecordingIndex::Chunk::Insert(size_t i,
+                                   const IndexedRecording &recording) {
+  id.insert(id.begin() + i, 0);
+  start_time_90k.insert(start_time_90k.begin() + i, 0);
+  duration_90k.insert(duration_90k.begin() + i, 0);
+  video_samples.insert(video_samples.begin() + i, 0);
+  sample_file_bytes.insert(sample_file_bytes.begin() + i, 0);
+  video_sample_entry_id.insert(video_sample_entry_id.begin() + i, 0);
+  sample_file_uuid.insert(sample_file_uuid.begin() + i, Uuid());
+  flags.insert(flags.begin() + i, 0);
+  Set(i, recording);
+}
+
+void RecordingIndex::Chunk::Erase(size_t i) {
+  id.erase(id.begin() + i);
+  start_time_90k.erase(start_time_90k.begin() + i);
+  duration_90k.erase(duration_90k.begin() + i);
+  video_samples.erase(video_samples.begin() + i);
+  sample_file_bytes.erase(sample_file_bytes.begin() + i);
+  video_sample_entry_id.erase(video_sample_entry_id.begin() + i);
+  sample_file_uuid.erase(sample_file_uuid.begin() + i);
+  flags.erase(flags.begin() + i);
+}
+
+size_t RecordingIndex::Chunk::LowerBound(int64_t start, int64_t rec_id) const {
+  size_t lo = std::lower_bound(start_time_90k.begin(), start_time_90k.end(),
+                               start) -
+              start_time_90k.begin();
+  while (lo < size() && start_time_90k[lo] == start && id[lo] < rec_id) {
+    ++lo;
+  }
+  return lo;
+}
+
+RecordingIndex::RecordingIndex(
+    const std::vector<IndexedRecording> &recordings) {
+  for (const auto &recording : recordings) {
+    if (chunks_.empty() || chunks_.back()->size() == kChunkRows) {
+      chunks_.push_back(std::make_shared<Chunk>());
+    }
+    Chunk *chunk = chunks_.back().get();
+    chunk->Insert(chunk->size(), recording);
+  }
+  size_ = recordings.size();
+}
+
+size_t RecordingIndex::FindChunk(
+    const std::vector<std::shared_ptr<Chunk>> &chunks, int64_t start_time_90k,
+    int64_t id) {
+  // The last chunk whose first recording isn't after the key, or the first.
+  auto it = std::upper_bound(
+      chunks.begin() + 1, chunks.end(), std::make_pair(start_time_90k, id),
+      [](const std::pair<int64_t, int64_t> &key,
+         const std::shared_ptr<Chunk> &chunk) {
+        return key < std::make_pair(chunk->start_time_90k[0], chunk->id[0]);
+      });
+  return it - chunks.begin() - 1;
+}
+
+std::shared_ptr<const RecordingIndex> RecordingIndex::Apply(
+    const std::vector<IndexedRecording> &upserted,
+    const std::vector<IndexedRecording> &erased) const {
+  std::shared_ptr<RecordingIndex> next(new RecordingIndex);
+  std::vector<std::shared_ptr<Chunk>> &chunks = next->chunks_;
+  chunks = chunks_;
+  next->size_ = size_;
+
+  // Chunks copied for this call, which may be modified in place.
+  std::vector<bool> owned(chunks.size(), false);
+  auto own = [&](size_t i) {
+    if (!owned[i]) {
+      chunks[i] = std::make_shared<Chunk>(*chunks[i]);
+      owned[i] = true;
+    }
+    return chunks[i].get();
+  };
+
+  for (const auto &recording : erased) {
+    if (chunks.empty()) {
+      break;
+    }
+    size_t c = FindChunk(chunks, recording.start_time_90k, recording.id);
+    size_t i = chunks[c]->LowerBound(recording.start_time_90k, recording.id);
+    if (i == chunks[c]->size() || chunks[c]->id[i] != recording.id ||
+        chunks[c]->start_time_90k[i] != recording.start_time_90k) {
+      continue;
+    }
+    Chunk *chunk = own(c);
+    chunk->Erase(i);
+    --next->size_;
+    if (chunk->size() == 0) {
+      chunks.erase(chunks.begin() + c);
+      owned.erase(owned.begin() + c);
+    }
+  }
+
+  for (const auto &recording : upserted) {
+    if (chunks.empty()) {
+      chunks.push_back(std::make_shared<Chunk>());
+      owned.push_back(true);
+    }
+    size_t c = FindChunk(chunks, recording.start_time_90k, recording.id);
+    Chunk *chunk = own(c);
+    size_t i = chunk->LowerBound(recording.start_time_90k, recording.id);
+    if (i < chunk->size() && chunk->id[i] == recording.id &&
+        chunk->start_time_90k[i] == recording.start_time_90k) {
+      chunk->Set(i, recording);
+      continue;
+    }
+    chunk->Insert(i, recording);
+    ++next->size_;
+    if (chunk->size() == 2 * kChunkRows) {
+      // Split in half, so appending doesn't copy a full chunk each time.
+      auto back = std::make_shared<Chunk>();
+      for (size_t j = kChunkRows; j < chunk->size(); ++j) {
+        back->Insert(back->size(), chunk->Get(j));
+      }
+      while (chunk->size() > kChunkRows) {
+        chunk->Erase(chunk->size() - 1);
+      }
+      chunks.insert(chunks.begin() + c + 1, back);
+      owned.insert(owned.begin() + c + 1, true);
+    }
+  }
+  return next;
+}
+
+bool RecordingIndex::Find(int64_t start_time_90k, int64_t id,
+                          IndexedRecording *recording) const {
+  if (chunks_.empty()) {
+    return false;
+  }
+  const Chunk &chunk = *chunks_[FindChunk(chunks_, start_time_90k, id)];
+  size_t i = chunk.LowerBound(start_time_90k, id);
+  if (i == chunk.size() || chunk.id[i] != id ||
+      chunk.start_time_90k[i] != start_time_90k) {
+    return false;
+  }
+  *recording = chunk.Get(i);
+  return true;
+}
+
+void RecordingIndex::ForEach(
+    int64_t start_time_90k, int64_t end_time_90k, bool newest_first,
+    std::function<IterationControl(const IndexedRecording &)> cb) const {
+  if (chunks_.empty() || start_time_90k >= end_time_90k) {
+    return;
+  }
+
+  // Positions as (chunk, row) of the first recording starting at or after
+  // |start_time_90k| and of the first starting at or after |end_time_90k|.
+  auto bound = [&](int64_t t) {
+    size_t c = FindChunk(chunks_, t, std::numeric_limits<int64_t>::min());
+    size_t i = chunks_[c]->LowerBound(t, std::numeric_limits<int64_t>::min());
+    if (i == chunks_[c]->size() && c + 1 < chunks_.size()) {
+      ++c;
+      i = 0;
+    }
+    return std::make_pair(c, i);
+  };
+  auto begin = bound(start_time_90k);
+  auto end = bound(end_time_90k);
+  if (newest_first) {
+    for (size_t c = end.first + 1; c-- > begin.first;) {
+      const Chunk &chunk = *chunks_[c];
+      size_t first = c == begin.first ? begin.second : 0;
+      size_t last = c == end.first ? end.second : chunk.size();
+      for (size_t i = last; i-- > first;) {
+        if (cb(chunk.Get(i)) == IterationControl::kBreak) {
+          return;
+        }
+      }
+    }
+  } else {
+    for (size_t c = begin.first; c <= end.first; ++c) {
+      const Chunk &chunk = *chunks_[c];
+      size_t first = c == begin.first ? begin.second : 0;
+      size_t last = c == end.first ? end.second : chunk.size();
+      for (size_t i = first; i < last; ++i) {
+        if (cb(chunk.Get(i)) == IterationControl::kBreak) {
+          return;
+        }
+      }
+    }
+  }
+}
+
+}  // namespace moonfire_nvr
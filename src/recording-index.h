@@ -0,0 +1,135 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// recording-index.h: immutable in-memory index of a camera's recordings.
+
+#ifndef MOONFIRE_NVR_RECORDING_INDEX_H
+#define MOONFIRE_NVR_RECORDING_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "recording.h"
+#include "uuid.h"
+
+namespace moonfire_nvr {
+
+// The fields of a recording row needed to list recordings and to choose which
+// to delete: everything but the sample index and hash.
+struct IndexedRecording {
+  int64_t id = -1;
+  int64_t start_time_90k = -1;
+  int64_t end_time_90k = -1;
+  int64_t sample_file_bytes = -1;
+  int64_t video_samples = -1;
+  int64_t video_sample_entry_id = -1;
+  Uuid sample_file_uuid;
+  SampleFileTier sample_file_tier = SampleFileTier::kHot;
+  bool in_container = false;
+};
+
+// An immutable index of one camera's recordings, ordered by start time (then
+// id). Recordings are stored by column, about 57 bytes each, in chunks of
+// roughly kChunkRows. Apply returns a new index sharing every chunk it doesn't
+// change with the old one, so a change costs O(kChunkRows + size() /
+// kChunkRows) however many recordings the camera has.
+//
+// Thread-safe: any number of threads may read an index at once.
+class RecordingIndex {
+ public:
+  static const size_t kChunkRows = 1024;
+
+  RecordingIndex() {}
+
+  // |recordings| must be sorted by start time and id.
+  explicit RecordingIndex(const std::vector<IndexedRecording> &recordings);
+
+  size_t size() const { return size_; }
+
+  // Return a copy without the recordings matching |erased|'s start times and
+  // ids (others are ignored) and with |upserted| added, each replacing any
+  // recording with the same start time and id.
+  std::shared_ptr<const RecordingIndex> Apply(
+      const std::vector<IndexedRecording> &upserted,
+      const std::vector<IndexedRecording> &erased) const;
+
+  // Fill |recording| with the recording of the given start time and id,
+  // returning false if there is none.
+  bool Find(int64_t start_time_90k, int64_t id,
+            IndexedRecording *recording) const;
+
+  // Visit the recordings starting within [start_time_90k, end_time_90k),
+  // oldest first or newest first.
+  void ForEach(int64_t start_time_90k, int64_t end_time_90k, bool newest_first,
+               std::function<IterationControl(const IndexedRecording &)> cb)
+      const;
+
+ private:
+  // A run of recordings, one vector per field. Never modified once it's
+  // part of a returned index.
+  struct Chunk {
+    std::vector<int64_t> id;
+    std::vector<int64_t> start_time_90k;
+    std::vector<int32_t> duration_90k;
+    std::vector<int32_t> video_samples;
+    std::vector<int64_t> sample_file_bytes;
+    std::vector<int64_t> video_sample_entry_id;
+    std::vector<Uuid> sample_file_uuid;
+    std::vector<uint8_t> flags;  // kColdFlag | kContainerFlag
+
+    size_t size() const { return id.size(); }
+    IndexedRecording Get(size_t i) const;
+    void Set(size_t i, const IndexedRecording &recording);
+    void Insert(size_t i, const IndexedRecording &recording);
+    void Erase(size_t i);
+
+    // The position of the first recording not before (start_time_90k, id).
+    size_t LowerBound(int64_t start_time_90k, int64_t id) const;
+  };
+  static const uint8_t kColdFlag = 1;
+  static const uint8_t kContainerFlag = 2;
+
+  // The index within |chunks| (which must be non-empty) of the chunk which
+  // holds or would hold (start_time_90k, id).
+  static size_t FindChunk(const std::vector<std::shared_ptr<Chunk>> &chunks,
+                          int64_t start_time_90k, int64_t id);
+
+  std::vector<std::shared_ptr<Chunk>> chunks_;  // none empty.
+  size_t size_ = 0;
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_RECORDING_INDEX_H
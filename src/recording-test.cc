@@ -34,10 +34,13 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+
 #include <gflags/gflags.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "coding.h"
 #include "recording.h"
 #include "string.h"
 
@@ -62,8 +65,13 @@ TEST(SampleIndexTest, EncodeExample) {
   encoder.AddSample(11, 15, false);
   encoder.AddSample(10, 12, false);
   encoder.AddSample(10, 1050, true);
-  EXPECT_EQ("29 d0 0f 02 14 08 0a 02 05 01 64",
-            ToHex(recording.video_index, true));
+  encoder.Flush();
+  EXPECT_EQ(
+      "00 00 02 00 00 00 02 "  // header, checkpoint count.
+      "00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 00 "
+      "00 00 00 28 00 00 00 00 00 00 04 0d 00 00 00 04 00 00 00 09 "
+      "29 d0 0f 02 14 08 0a 02 05 29 b4 10",  // rows.
+      ToHex(recording.video_index, true));
   EXPECT_EQ(1000, recording.start_time_90k);
   EXPECT_EQ(1000 + 10 + 9 + 11 + 10 + 10, recording.end_time_90k);
   EXPECT_EQ(1000 + 10 + 15 + 12 + 1050, recording.sample_file_bytes);
@@ -71,6 +79,60 @@ TEST(SampleIndexTest, EncodeExample) {
   EXPECT_EQ(2, recording.video_sync_samples);
 }
 
+// The layout of design/schema.md, byte for byte, with enough key frames that
+// the checkpoint table and rows are both large, flushing partway through as a
+// Stream does when syncing.
+TEST(SampleIndexTest, EncodeManyKeyFrames) {
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 1000);
+  std::string checkpoints;
+  std::string rows;
+  auto expected_index = [&](uint32_t key_frames) {
+    std::string index("\x00\x00\x02", 3);
+    AppendU32(key_frames, &index);
+    return index + checkpoints + rows;
+  };
+  int32_t prev_duration_90k = 0;
+  int32_t prev_bytes_key = 0;
+  int32_t prev_bytes_nonkey = 0;
+  int32_t start_90k = 0;
+  int64_t pos = 0;
+  uint32_t key_frames = 0;
+  for (int i = 0; i < 3000; ++i) {
+    bool is_key = i % 3 == 0;
+    int32_t duration_90k = 3000 + i % 5;
+    int32_t bytes = is_key ? 50000 + i : 100 + i % 300;
+    if (is_key) {
+      AppendU32(start_90k, &checkpoints);
+      AppendU64(pos, &checkpoints);
+      AppendU32(i, &checkpoints);
+      AppendU32(rows.size(), &checkpoints);
+      prev_duration_90k = prev_bytes_key = prev_bytes_nonkey = 0;
+      ++key_frames;
+    }
+    int32_t &prev_bytes = is_key ? prev_bytes_key : prev_bytes_nonkey;
+    AppendVar32((Zigzag32(duration_90k - prev_duration_90k) << 1) | is_key,
+                &rows);
+    AppendVar32(Zigzag32(bytes - prev_bytes), &rows);
+    prev_duration_90k = duration_90k;
+    prev_bytes = bytes;
+    start_90k += duration_90k;
+    pos += bytes;
+
+    encoder.AddSample(duration_90k, bytes, is_key);
+    if (i == 1500) {
+      encoder.Flush();
+      ASSERT_EQ(expected_index(key_frames), recording.video_index);
+    }
+  }
+  encoder.Flush();
+  EXPECT_EQ(1000u, key_frames);
+  EXPECT_EQ(expected_index(key_frames), recording.video_index);
+  EXPECT_EQ(3000, recording.video_samples);
+  EXPECT_EQ(1000, recording.video_sync_samples);
+}
+
 TEST(SampleIndexTest, RoundTrip) {
   Recording recording;
   SampleIndexEncoder encoder;
@@ -79,6 +141,7 @@ TEST(SampleIndexTest, RoundTrip) {
   encoder.AddSample(9, 1000, false);
   encoder.AddSample(11, 1100, false);
   encoder.AddSample(18, 31000, true);
+  encoder.Flush();
 
   SampleIndexIterator it = SampleIndexIterator(recording.video_index);
   std::string error_message;
@@ -110,6 +173,190 @@ TEST(SampleIndexTest, RoundTrip) {
   ASSERT_FALSE(it.has_error()) << it.error();
 }
 
+TEST(SampleIndexTest, ReadsVersion1) {
+  // The version 1 encoding of the EncodeExample index, from before key frames
+  // had checkpoints.
+  std::string index("\x29\xd0\x0f\x02\x14\x08\x0a\x02\x05\x01\x64");
+  const int32_t kDurations[] = {10, 9, 11, 10, 10};
+  const int32_t kBytes[] = {1000, 10, 15, 12, 1050};
+  SampleIndexIterator it(index);
+  for (int i = 0; i < 5; ++i, it.Next()) {
+    ASSERT_FALSE(it.done()) << it.error();
+    EXPECT_EQ(i, it.sample_num());
+    EXPECT_EQ(kDurations[i], it.duration_90k()) << i;
+    EXPECT_EQ(kBytes[i], it.bytes()) << i;
+    EXPECT_EQ(i == 0 || i == 4, it.is_key()) << i;
+  }
+  ASSERT_TRUE(it.done());
+  ASSERT_FALSE(it.has_error()) << it.error();
+  EXPECT_EQ(1000 + 10 + 15 + 12 + 1050, it.pos());
+  EXPECT_EQ(2, it.key_frames_before());
+
+  it = SampleIndexIterator(index);
+  it.SeekToKeyFrame(39);
+  ASSERT_FALSE(it.done()) << it.error();
+  EXPECT_EQ(0, it.sample_num());
+  it = SampleIndexIterator(index);
+  it.SeekToKeyFrame(40);
+  ASSERT_FALSE(it.done()) << it.error();
+  EXPECT_EQ(4, it.sample_num());
+  EXPECT_EQ(40, it.start_90k());
+  EXPECT_EQ(1037, it.pos());
+  EXPECT_EQ(1050, it.bytes());
+}
+
+TEST(SampleIndexTest, KeyFrameTable) {
+  Recording v2;
+  SampleIndexEncoder encoder;
+  encoder.Init(&v2, 1000);
+  for (int i = 0; i < 30; ++i) {
+    encoder.AddSample(10 + i % 3, i % 7 == 0 ? 1000 + i : 10 + i, i % 7 == 0);
+  }
+  encoder.Flush();
+
+  // The version 1 index of ReadsVersion1, and a version 2 index.
+  for (const std::string &index :
+       {std::string("\x29\xd0\x0f\x02\x14\x08\x0a\x02\x05\x01\x64"),
+        v2.video_index}) {
+    KeyFrameTable table;
+    std::string error_message;
+    ASSERT_TRUE(table.Init(index, &error_message)) << error_message;
+
+    // Each entry should describe a key frame.
+    SampleIndexIterator it(index);
+    size_t key_frames = 0;
+    for (; !it.done(); it.Next()) {
+      if (!it.is_key()) {
+        continue;
+      }
+      ASSERT_LT(key_frames, table.entries().size());
+      const KeyFrameEntry &entry = table.entries()[key_frames++];
+      EXPECT_EQ(it.start_90k(), entry.start_90k);
+      EXPECT_EQ(it.pos(), entry.pos);
+      EXPECT_EQ(it.sample_num(), entry.sample_num);
+    }
+    ASSERT_FALSE(it.has_error()) << it.error();
+    EXPECT_EQ(key_frames, table.entries().size());
+
+    // Seeking through the table should match seeking without it, both at the
+    // seek point and when iterating from there.
+    for (int32_t ts = -1; ts <= it.start_90k() + 1; ++ts) {
+      SampleIndexIterator expected(index);
+      expected.SeekToKeyFrame(ts);
+      SampleIndexIterator actual(index);
+      actual.SeekToKeyFrame(ts, table);
+      EXPECT_EQ(expected.key_frames_before(), actual.key_frames_before());
+      for (; !expected.done(); expected.Next(), actual.Next()) {
+        ASSERT_FALSE(actual.done()) << ts << ": " << actual.error();
+        EXPECT_EQ(expected.sample_num(), actual.sample_num()) << ts;
+        EXPECT_EQ(expected.start_90k(), actual.start_90k()) << ts;
+        EXPECT_EQ(expected.duration_90k(), actual.duration_90k()) << ts;
+        EXPECT_EQ(expected.bytes(), actual.bytes()) << ts;
+        EXPECT_EQ(expected.is_key(), actual.is_key()) << ts;
+        EXPECT_EQ(expected.pos(), actual.pos()) << ts;
+      }
+      EXPECT_TRUE(actual.done()) << ts;
+      EXPECT_FALSE(actual.has_error()) << ts << ": " << actual.error();
+    }
+  }
+
+  KeyFrameTable table;
+  std::string error_message;
+  EXPECT_FALSE(table.Init(std::string("\x00\x00\x01", 3), &error_message));
+  EXPECT_EQ("bad video index header", error_message);
+}
+
+TEST(SampleIndexTest, SeekToKeyFrame) {
+  // Key frames every 10 samples of 100 units each; key frames are 1000 bytes,
+  // others 10.
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 1000);
+  for (int i = 0; i < 95; ++i) {
+    encoder.AddSample(100, i % 10 == 0 ? 1000 : 10, i % 10 == 0);
+  }
+  encoder.Flush();
+
+  for (int32_t ts : {-1, 0, 999, 1000, 5050, 9499, 100000}) {
+    SampleIndexIterator it(recording.video_index);
+    it.SeekToKeyFrame(ts);
+    ASSERT_FALSE(it.done()) << ts << ": " << it.error();
+    int expected_key = std::min(std::max(ts, 0) / 1000, 9);
+    EXPECT_EQ(expected_key * 10, it.sample_num()) << ts;
+    EXPECT_EQ(expected_key, it.key_frames_before()) << ts;
+    EXPECT_EQ(expected_key * 1000, it.start_90k()) << ts;
+    EXPECT_EQ(expected_key * (1000 + 9 * 10), it.pos()) << ts;
+    EXPECT_TRUE(it.is_key()) << ts;
+    EXPECT_EQ(1000, it.bytes()) << ts;
+
+    // Iterating from the seek point should match iterating from the start.
+    SampleIndexIterator expected(recording.video_index);
+    while (expected.sample_num() < it.sample_num()) {
+      expected.Next();
+    }
+    for (; !expected.done(); expected.Next(), it.Next()) {
+      ASSERT_FALSE(it.done()) << it.error();
+      EXPECT_EQ(expected.start_90k(), it.start_90k());
+      EXPECT_EQ(expected.duration_90k(), it.duration_90k());
+      EXPECT_EQ(expected.bytes(), it.bytes());
+      EXPECT_EQ(expected.is_key(), it.is_key());
+      EXPECT_EQ(expected.pos(), it.pos());
+    }
+    EXPECT_TRUE(it.done());
+    EXPECT_FALSE(it.has_error()) << it.error();
+    EXPECT_EQ(95, it.sample_num());
+    EXPECT_EQ(10, it.key_frames_before());
+
+    // A bulk decode from the seek point should match too.
+    it = SampleIndexIterator(recording.video_index);
+    it.SeekToKeyFrame(ts);
+    DecodedSampleIndex index;
+    std::string error_message;
+    ASSERT_TRUE(index.Decode(it, 12, &error_message)) << error_message;
+    ASSERT_EQ(static_cast<size_t>(std::min(12, 95 - expected_key * 10)),
+              index.size());
+    EXPECT_EQ(it.pos(), index.pos(0));
+    EXPECT_TRUE(index.is_key(0));
+    if (index.size() > 10) {
+      EXPECT_TRUE(index.is_key(10));
+      EXPECT_EQ(1000, index.bytes(10));
+    }
+    EXPECT_EQ(10, index.bytes(1));
+  }
+}
+
+TEST(SampleIndexTest, Activity) {
+  // Each second has a large key frame and nine non-key frames, which are
+  // 1000 bytes except during the busy second.
+  auto add_second = [](SampleIndexEncoder *encoder, int32_t nonkey_bytes) {
+    encoder->AddSample(9000, 50000, true);
+    for (int i = 0; i < 9; ++i) {
+      encoder->AddSample(9000, nonkey_bytes, false);
+    }
+  };
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 1000);
+  for (int i = 0; i < 5; ++i) {
+    add_second(&encoder, 1000);
+  }
+  add_second(&encoder, 8000);
+  add_second(&encoder, 1000);
+  EXPECT_EQ(std::string("\x00\x00\x00\x00\x00\x60\x00", 7),
+            recording.activity);
+
+  // The baseline has moved only a little toward the busy second, and it
+  // carries over to the next recording, where a second of twice the quiet
+  // size scores 32. A second without non-key frames scores 0.
+  encoder.Init(&recording, 1000 + 7 * kTimeUnitsPerSecond);
+  EXPECT_NEAR(1000, encoder.quiet_bytes_per_frame(), 10);
+  EXPECT_EQ("", recording.activity);
+  add_second(&encoder, 2000);
+  encoder.AddSample(2 * kTimeUnitsPerSecond, 50000, true);
+  encoder.AddSample(9000, 1000, false);
+  EXPECT_EQ(std::string("\x20\x00\x00\x00", 4), recording.activity);
+}
+
 TEST(SampleIndexTest, IteratorErrors) {
   std::string bad_first_varint("\x80");
   SampleIndexIterator it(bad_first_varint);
@@ -135,6 +382,95 @@ TEST(SampleIndexTest, IteratorErrors) {
   it = SampleIndexIterator(non_positive_bytes);
   EXPECT_TRUE(it.has_error());
   EXPECT_THAT(it.error(), HasSubstr("non-positive bytes"));
+
+  std::string bad_version("\x00\x00\x03\x00\x00\x00\x00", 7);
+  it = SampleIndexIterator(bad_version);
+  EXPECT_TRUE(it.has_error());
+  EXPECT_EQ("bad video index header", it.error());
+
+  std::string truncated_checkpoints("\x00\x00\x02\x00\x00\x00\x01\x00", 8);
+  it = SampleIndexIterator(truncated_checkpoints);
+  EXPECT_TRUE(it.has_error());
+  EXPECT_THAT(it.error(), HasSubstr("truncated"));
+}
+
+TEST(SampleIndexTest, DecodedMatchesIterator) {
+  // Include sizes and durations with multi-byte varints and a zero duration
+  // at the end, as well as enough samples to use several bitmap words.
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 1000);
+  for (int i = 0; i < 200; ++i) {
+    bool is_key = i % 30 == 0;
+    encoder.AddSample(i == 199 ? 0 : 3000 + (i % 7) * 100,
+                      is_key ? 50000 + i : 1 + i * i, is_key);
+  }
+  encoder.Flush();
+
+  DecodedSampleIndex index;
+  std::string error_message;
+  ASSERT_TRUE(index.Decode(recording.video_index, &error_message))
+      << error_message;
+  ASSERT_EQ(200u, index.size());
+  std::string expected_stts;
+  std::string expected_stsz;
+  std::string expected_stss;
+  size_t i = 0;
+  SampleIndexIterator it;
+  for (it = SampleIndexIterator(recording.video_index); !it.done();
+       it.Next(), ++i) {
+    ASSERT_LT(i, index.size());
+    EXPECT_EQ(it.duration_90k(), index.duration_90k(i)) << i;
+    EXPECT_EQ(it.bytes(), index.bytes(i)) << i;
+    EXPECT_EQ(it.is_key(), index.is_key(i)) << i;
+    EXPECT_EQ(it.pos(), index.pos(i)) << i;
+    if (i >= 10) {
+      AppendU32(1, &expected_stts);
+      AppendU32(it.duration_90k(), &expected_stts);
+      AppendU32(it.bytes(), &expected_stsz);
+      if (it.is_key()) {
+        AppendU32(5 + i - 10, &expected_stss);
+      }
+    }
+  }
+  ASSERT_FALSE(it.has_error()) << it.error();
+  EXPECT_EQ(it.pos(), index.pos(i));
+  EXPECT_EQ(recording.sample_file_bytes, index.pos(index.size()));
+
+  std::string stts("prefix");
+  index.AppendStts(10, 200, &stts);
+  EXPECT_EQ("prefix" + expected_stts, stts);
+  std::string stsz;
+  index.AppendStsz(10, 200, &stsz);
+  EXPECT_EQ(expected_stsz, stsz);
+  std::string stss;
+  index.AppendStss(10, 200, 5, &stss);
+  EXPECT_EQ(expected_stss, stss);
+}
+
+TEST(SampleIndexTest, DecodedErrors) {
+  DecodedSampleIndex index;
+  std::string error_message;
+  EXPECT_FALSE(index.Decode(re2::StringPiece("\x80", 1), &error_message));
+  EXPECT_EQ("buffer underrun", error_message);
+  EXPECT_FALSE(
+      index.Decode(re2::StringPiece("\x00\x80", 2), &error_message));
+  EXPECT_EQ("buffer underrun", error_message);
+  EXPECT_FALSE(index.Decode(re2::StringPiece("\x00\x02\x00\x00", 4),
+                            &error_message));
+  EXPECT_THAT(error_message, HasSubstr("zero duration"));
+  EXPECT_FALSE(index.Decode(re2::StringPiece("\x02\x02", 2), &error_message));
+  EXPECT_THAT(error_message, HasSubstr("negative duration"));
+  EXPECT_FALSE(index.Decode(re2::StringPiece("\x04\x00", 2), &error_message));
+  EXPECT_THAT(error_message, HasSubstr("non-positive bytes"));
+
+  // Errors past the word-at-a-time decoder's first eight bytes.
+  EXPECT_FALSE(index.Decode(
+      re2::StringPiece("\x04\x02\x00\x02\x00\x02\x00\x02\x80\x80\x80"
+                       "\x80\x10\x00",
+                       14),
+      &error_message));
+  EXPECT_EQ("integer overflow", error_message);
 }
 
 TEST(SampleFileWriterTest, Simple) {
@@ -163,6 +499,33 @@ TEST(SampleFileWriterTest, Simple) {
   EXPECT_EQ("6bc37325b36fb5fd205e57284429e75764338618", ToHex(sha1));
 }
 
+TEST(SampleFileWriterTest, HashesOnWorkerWithXxh3) {
+  testing::StrictMock<MockFile> parent;
+  auto *f = new testing::StrictMock<MockFile>;
+
+  re2::StringPiece write_1("write 1");
+  re2::StringPiece write_2("write 2");
+
+  EXPECT_CALL(parent, OpenRaw("foo", O_WRONLY | O_EXCL | O_CREAT, 0600, _))
+      .WillOnce(DoAll(SetArgPointee<3>(f), Return(0)));
+  EXPECT_CALL(*f, Write(write_1, _))
+      .WillOnce(DoAll(SetArgPointee<1>(7), Return(0)));
+  EXPECT_CALL(*f, Write(write_2, _))
+      .WillOnce(DoAll(SetArgPointee<1>(7), Return(0)));
+  EXPECT_CALL(*f, Sync()).WillOnce(Return(0));
+  EXPECT_CALL(*f, Close()).WillOnce(Return(0));
+
+  DigestWorker worker;
+  SampleFileWriter writer(&parent, &worker, HashAlgorithm::kXxh3_128);
+  std::string error_message;
+  std::string sha1;
+  ASSERT_TRUE(writer.Open("foo", &error_message)) << error_message;
+  EXPECT_TRUE(writer.Write(write_1, &error_message)) << error_message;
+  EXPECT_TRUE(writer.Write(write_2, &error_message)) << error_message;
+  EXPECT_TRUE(writer.Close(&sha1, &error_message)) << error_message;
+  EXPECT_EQ("78321df9035a69def8debf7026491e84", ToHex(sha1));
+}
+
 TEST(SampleFileWriterTest, PartialWriteIsRetried) {
   testing::StrictMock<MockFile> parent;
   auto *f = new testing::StrictMock<MockFile>;
@@ -251,6 +614,39 @@ TEST(SampleFileWriterTest, PartialWriteTruncateFailureCausesCloseToFail) {
   EXPECT_FALSE(writer.Close(&sha1, &error_message)) << error_message;
 }
 
+TEST(SampleFileWriterTest, ContainerPartialWriteIsRewound) {
+  testing::StrictMock<MockFile> parent;
+  auto *f = new testing::StrictMock<MockFile>;
+
+  re2::StringPiece write_1("write 1");
+  re2::StringPiece write_2("write 2");
+  re2::StringPiece write_2b(write_2);
+  write_2b.remove_prefix(3);
+
+  // The container is never created or truncated by the writer.
+  EXPECT_CALL(parent, OpenRaw("foo", O_WRONLY, _))
+      .WillOnce(DoAll(SetArgPointee<2>(f), Return(0)));
+  EXPECT_CALL(*f, Seek(100)).WillOnce(Return(0));
+  EXPECT_CALL(*f, Write(write_1, _))
+      .WillOnce(DoAll(SetArgPointee<1>(7), Return(0)));
+  EXPECT_CALL(*f, Write(write_2, _))
+      .WillOnce(DoAll(SetArgPointee<1>(3), Return(0)));
+  EXPECT_CALL(*f, Write(write_2b, _)).WillOnce(Return(ENOSPC));
+  EXPECT_CALL(*f, Seek(107)).WillOnce(Return(0));
+  EXPECT_CALL(*f, Sync()).WillOnce(Return(0));
+  EXPECT_CALL(*f, Close()).WillOnce(Return(0));
+
+  SampleFileWriter writer(&parent);
+  std::string error_message;
+  std::string sha1;
+  ASSERT_TRUE(writer.OpenInContainer("foo", 100, &error_message))
+      << error_message;
+  EXPECT_TRUE(writer.Write(write_1, &error_message)) << error_message;
+  EXPECT_FALSE(writer.Write(write_2, &error_message)) << error_message;
+  EXPECT_TRUE(writer.Close(&sha1, &error_message)) << error_message;
+  EXPECT_EQ("b1ccee339b935587c09997a9ec8bb2374e02b5d0", ToHex(sha1));
+}
+
 }  // namespace
 }  // namespace moonfire_nvr
 
@@ -33,14 +33,58 @@
 #include "recording.h"
 
 #include <fcntl.h>
+#include <math.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <limits>
+
 #include "coding.h"
 #include "string.h"
 
 namespace moonfire_nvr {
 
+namespace {
+
+// A version 2 video index starts with this header, then a big-endian 32-bit
+// count of checkpoints, then the checkpoints, then the sample rows. No
+// version 1 index can start with two zero bytes: they'd be a non-key frame of
+// zero bytes. See design/schema.md.
+const char kIndexV2Header[] = {0, 0, 2};
+constexpr size_t kIndexV2HeaderBytes = sizeof(kIndexV2Header) + 4;
+
+// Each checkpoint is start_90k, pos, sample_num, and row_offset, big-endian.
+constexpr size_t kCheckpointBytes = 4 + 8 + 4 + 4;
+
+struct Checkpoint {
+  int32_t start_90k;
+  int64_t pos;
+  int32_t sample_num;
+  uint32_t row_offset;  // within the sample rows.
+};
+
+Checkpoint ReadCheckpoint(re2::StringPiece checkpoints, size_t i) {
+  const char *p = checkpoints.data() + i * kCheckpointBytes;
+  Checkpoint c;
+  c.start_90k = static_cast<int32_t>(ReadU32(p));
+  c.pos = static_cast<int64_t>(ReadU64(p + 4));
+  c.sample_num = static_cast<int32_t>(ReadU32(p + 12));
+  c.row_offset = ReadU32(p + 16);
+  return c;
+}
+
+// Activity scoring. The baseline quickly follows quieter seconds down and
+// slowly follows busier ones up, so it tracks a camera's quiet level. A score
+// is 32 * log2(mean non-key frame size / baseline), so 32 means twice the
+// baseline and 64 four times.
+constexpr double kQuietFallRate = 1. / 4;
+constexpr double kQuietRiseRate = 1. / 600;
+constexpr double kActivityScorePerDoubling = 32;
+
+}  // namespace
+
 void SampleIndexEncoder::Init(Recording *recording, int64_t start_time_90k) {
   recording_ = recording;
   recording_->start_time_90k = start_time_90k;
@@ -48,16 +92,36 @@ void SampleIndexEncoder::Init(Recording *recording, int64_t start_time_90k) {
   recording_->sample_file_bytes = 0;
   recording_->video_samples = 0;
   recording_->video_sync_samples = 0;
+  FinishSecond();
   recording_->video_index.clear();
+  recording_->activity.clear();
+  checkpoints_.clear();
+  rows_.clear();
   prev_duration_90k_ = 0;
   prev_bytes_key_ = 0;
   prev_bytes_nonkey_ = 0;
+  second_nonkey_bytes_ = 0;
+  second_nonkey_frames_ = 0;
 }
 
 void SampleIndexEncoder::AddSample(int32_t duration_90k, int32_t bytes,
                                    bool is_key) {
   CHECK_GE(duration_90k, 0);
   CHECK_GT(bytes, 0);
+  AddActivity(recording_->end_time_90k - recording_->start_time_90k, bytes,
+              is_key);
+  if (is_key) {
+    // Each key frame's row is encoded from scratch, so that decoding can
+    // start at its checkpoint.
+    prev_duration_90k_ = 0;
+    prev_bytes_key_ = 0;
+    prev_bytes_nonkey_ = 0;
+    AppendU32(recording_->end_time_90k - recording_->start_time_90k,
+              &checkpoints_);
+    AppendU64(recording_->sample_file_bytes, &checkpoints_);
+    AppendU32(recording_->video_samples, &checkpoints_);
+    AppendU32(rows_.size(), &checkpoints_);
+  }
   int32_t duration_delta = duration_90k - prev_duration_90k_;
   prev_duration_90k_ = duration_90k;
   int32_t bytes_delta;
@@ -73,21 +137,113 @@ void SampleIndexEncoder::AddSample(int32_t duration_90k, int32_t bytes,
     prev_bytes_nonkey_ = bytes;
   }
   uint32_t zigzagged_bytes_delta = Zigzag32(bytes_delta);
-  AppendVar32((Zigzag32(duration_delta) << 1) | is_key,
-              &recording_->video_index);
-  AppendVar32(zigzagged_bytes_delta, &recording_->video_index);
+  AppendVar32((Zigzag32(duration_delta) << 1) | is_key, &rows_);
+  AppendVar32(zigzagged_bytes_delta, &rows_);
+}
+
+void SampleIndexEncoder::Flush() {
+  std::string *index = &recording_->video_index;
+  index->clear();
+  if (recording_->video_samples == 0) {
+    return;
+  }
+  index->reserve(kIndexV2HeaderBytes + checkpoints_.size() + rows_.size());
+  index->append(kIndexV2Header, sizeof(kIndexV2Header));
+  AppendU32(recording_->video_sync_samples, index);
+  index->append(checkpoints_);
+  index->append(rows_);
+}
+
+uint8_t SampleIndexEncoder::ActivityScore(double bytes_per_frame) const {
+  if (quiet_bytes_per_frame_ <= 0 || bytes_per_frame <= quiet_bytes_per_frame_) {
+    return 0;
+  }
+  double score = kActivityScorePerDoubling *
+                 log2(bytes_per_frame / quiet_bytes_per_frame_);
+  return static_cast<uint8_t>(std::min(255., round(score)));
+}
+
+void SampleIndexEncoder::FinishSecond() {
+  if (second_nonkey_frames_ > 0) {
+    double bytes_per_frame =
+        static_cast<double>(second_nonkey_bytes_) / second_nonkey_frames_;
+    if (quiet_bytes_per_frame_ <= 0) {
+      quiet_bytes_per_frame_ = bytes_per_frame;
+    } else {
+      quiet_bytes_per_frame_ +=
+          (bytes_per_frame - quiet_bytes_per_frame_) *
+          (bytes_per_frame < quiet_bytes_per_frame_ ? kQuietFallRate
+                                                    : kQuietRiseRate);
+    }
+  }
+  second_nonkey_bytes_ = 0;
+  second_nonkey_frames_ = 0;
+}
+
+void SampleIndexEncoder::AddActivity(int32_t start_90k, int32_t bytes,
+                                     bool is_key) {
+  std::string *activity = &recording_->activity;
+  size_t second = start_90k / kTimeUnitsPerSecond;
+  if (activity->empty() || second >= activity->size()) {
+    FinishSecond();
+    activity->resize(second + 1, 0);  // skipped seconds have no activity.
+  }
+  if (!is_key) {
+    // Keep the score of this second up to date, so the recording is
+    // consistent after every sample. It's final once the next second starts,
+    // as the baseline is updated only then.
+    second_nonkey_bytes_ += bytes;
+    ++second_nonkey_frames_;
+    activity->back() = ActivityScore(static_cast<double>(second_nonkey_bytes_) /
+                                     second_nonkey_frames_);
+  }
+}
+
+SampleIndexIterator::SampleIndexIterator(re2::StringPiece index) {
+  Clear();
+  if (index.size() >= 2 && index[0] == 0 && index[1] == 0) {
+    if (index.size() < kIndexV2HeaderBytes ||
+        index.substr(0, sizeof(kIndexV2Header)) !=
+            re2::StringPiece(kIndexV2Header, sizeof(kIndexV2Header))) {
+      error_ = "bad video index header";
+      return;
+    }
+    size_t checkpoints_bytes =
+        ReadU32(index.data() + sizeof(kIndexV2Header)) * kCheckpointBytes;
+    index.remove_prefix(kIndexV2HeaderBytes);
+    if (checkpoints_bytes > index.size()) {
+      error_ = StrCat("video index checkpoint table of ", checkpoints_bytes,
+                      " bytes is truncated to ", index.size());
+      return;
+    }
+    checkpoints_ = index.substr(0, checkpoints_bytes);
+    index.remove_prefix(checkpoints_bytes);
+    v2_ = true;
+  }
+  rows_ = index;
+  data_ = index;
+  Next();
 }
 
 void SampleIndexIterator::Next() {
   uint32_t raw1;
   uint32_t raw2;
   pos_ += bytes_internal();
+  ++sample_num_;
+  if (is_key_) {
+    ++key_frames_before_;
+  }
   if (data_.empty() || !DecodeVar32(&data_, &raw1, &error_) ||
       !DecodeVar32(&data_, &raw2, &error_)) {
     done_ = true;
     return;
   }
   start_90k_ += duration_90k_;
+  if (v2_ && (raw1 & 0x01)) {
+    duration_90k_ = 0;
+    bytes_key_ = 0;
+    bytes_nonkey_ = 0;
+  }
   int32_t duration_90k_delta = Unzigzag32(raw1 >> 1);
   duration_90k_ += duration_90k_delta;
   if (duration_90k_ < 0) {
@@ -120,10 +276,251 @@ void SampleIndexIterator::Next() {
   return;
 }
 
+namespace {
+
+// Decode the varint at |*p|, advancing it, for DecodedSampleIndex::Decode.
+inline bool DecodeIndexVar32(const uint8_t **p, const uint8_t *end,
+                             uint32_t *out, std::string *error_message) {
+  if (end - *p >= 8) {
+    int len = DecodeVar32Word(*p, out);
+    if (len > 0) {
+      *p += len;
+      return true;
+    }
+  }
+  re2::StringPiece in(reinterpret_cast<const char *>(*p), end - *p);
+  if (!DecodeVar32(&in, out, error_message)) {
+    return false;
+  }
+  *p = reinterpret_cast<const uint8_t *>(in.data());
+  return true;
+}
+
+}  // namespace
+
+bool DecodedSampleIndex::Decode(re2::StringPiece index,
+                                std::string *error_message) {
+  return Decode(SampleIndexIterator(index),
+                std::numeric_limits<size_t>::max(), error_message);
+}
+
+bool DecodedSampleIndex::Decode(const SampleIndexIterator &from,
+                                size_t max_samples,
+                                std::string *error_message) {
+  duration_90k_.clear();
+  bytes_.clear();
+  pos_.clear();
+  key_bits_.clear();
+  if (from.has_error()) {
+    *error_message = from.error();
+    return false;
+  }
+  pos_.push_back(from.pos());
+  if (from.done() || max_samples == 0) {
+    return true;
+  }
+
+  // Each sample takes at least two bytes, so this is an upper bound.
+  max_samples = std::min(max_samples, 1 + from.data_.size() / 2);
+  duration_90k_.reserve(max_samples);
+  bytes_.reserve(max_samples);
+  pos_.reserve(max_samples + 1);
+  key_bits_.assign(max_samples / 64 + 1, 0);
+
+  // Start with |from|'s current sample, then continue from its state.
+  int32_t start_90k = from.start_90k();
+  int32_t duration_90k = from.duration_90k();
+  int32_t bytes_key = from.bytes_key_;
+  int32_t bytes_nonkey = from.bytes_nonkey_;
+  int64_t pos = from.pos() + from.bytes();
+  key_bits_[0] = from.is_key();
+  duration_90k_.push_back(duration_90k);
+  bytes_.push_back(from.bytes());
+  pos_.push_back(pos);
+
+  auto *p = reinterpret_cast<const uint8_t *>(from.data_.data());
+  const uint8_t *end = p + from.data_.size();
+  while (p < end && duration_90k_.size() < max_samples) {
+    uint32_t raw1;
+    uint32_t raw2;
+    if (!DecodeIndexVar32(&p, end, &raw1, error_message) ||
+        !DecodeIndexVar32(&p, end, &raw2, error_message)) {
+      return false;
+    }
+    start_90k += duration_90k;
+    bool is_key = raw1 & 0x01;
+    if (from.v2_ && is_key) {
+      duration_90k = 0;
+      bytes_key = 0;
+      bytes_nonkey = 0;
+    }
+    int32_t duration_90k_delta = Unzigzag32(raw1 >> 1);
+    duration_90k += duration_90k_delta;
+    if (duration_90k < 0) {
+      *error_message = StrCat("negative duration ", duration_90k,
+                              " after applying delta ", duration_90k_delta);
+      return false;
+    }
+    if (duration_90k == 0 && p != end) {
+      *error_message = StrCat("zero duration only allowed at end; have ",
+                              end - p, " bytes left.");
+      return false;
+    }
+    int32_t bytes_delta = Unzigzag32(raw2);
+    int32_t &bytes = is_key ? bytes_key : bytes_nonkey;
+    bytes += bytes_delta;
+    if (bytes <= 0) {
+      *error_message = StrCat("non-positive bytes ", bytes,
+                              " after applying delta ", bytes_delta, " to ",
+                              (is_key ? "key" : "non-key"), " frame at ts ",
+                              start_90k);
+      return false;
+    }
+    size_t i = duration_90k_.size();
+    key_bits_[i / 64] |= static_cast<uint64_t>(is_key) << (i % 64);
+    duration_90k_.push_back(duration_90k);
+    bytes_.push_back(bytes);
+    pos += bytes;
+    pos_.push_back(pos);
+  }
+  return true;
+}
+
+// The Append methods below write through a pointer into a presized string
+// rather than appending entry by entry, so the compiler can vectorize the
+// byte swaps.
+
+void DecodedSampleIndex::AppendStts(size_t begin, size_t end,
+                                    std::string *out) const {
+  size_t old_size = out->size();
+  out->resize(old_size + 2 * sizeof(uint32_t) * (end - begin));
+  char *p = &(*out)[old_size];
+  const uint32_t one = ToNetworkU32(1);
+  for (size_t i = begin; i < end; ++i) {
+    uint32_t duration = ToNetworkU32(duration_90k_[i]);
+    memcpy(p, &one, sizeof(uint32_t));
+    memcpy(p + sizeof(uint32_t), &duration, sizeof(uint32_t));
+    p += 2 * sizeof(uint32_t);
+  }
+}
+
+void DecodedSampleIndex::AppendStsz(size_t begin, size_t end,
+                                    std::string *out) const {
+  size_t old_size = out->size();
+  out->resize(old_size + sizeof(uint32_t) * (end - begin));
+  char *p = &(*out)[old_size];
+  for (size_t i = begin; i < end; ++i) {
+    uint32_t bytes = ToNetworkU32(bytes_[i]);
+    memcpy(p, &bytes, sizeof(uint32_t));
+    p += sizeof(uint32_t);
+  }
+}
+
+void DecodedSampleIndex::AppendStss(size_t begin, size_t end,
+                                    uint32_t first_sample_num,
+                                    std::string *out) const {
+  for (size_t i = begin; i < end; ++i) {
+    if (is_key(i)) {
+      AppendU32(first_sample_num + (i - begin), out);
+    }
+  }
+}
+
+void SampleIndexIterator::SeekToKeyFrame(int32_t start_90k) {
+  if (done_) {
+    return;
+  }
+  DCHECK_EQ(0, sample_num_);
+  if (!v2_) {
+    SampleIndexIterator candidate = *this;
+    for (; !done_ && start_90k_ <= start_90k; Next()) {
+      if (is_key_) {
+        candidate = *this;
+      }
+    }
+    if (!has_error()) {
+      *this = candidate;
+    }
+    return;
+  }
+
+  // Find the number of checkpoints starting at or before |start_90k|.
+  size_t lo = 0;
+  size_t hi = checkpoints_.size() / kCheckpointBytes;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (ReadCheckpoint(checkpoints_, mid).start_90k <= start_90k) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return;
+  }
+  Checkpoint c = ReadCheckpoint(checkpoints_, lo - 1);
+  KeyFrameEntry entry;
+  entry.start_90k = c.start_90k;
+  entry.pos = c.pos;
+  entry.sample_num = c.sample_num;
+  entry.row_offset = c.row_offset;
+  ResumeAtKeyFrame(entry, lo - 1);
+}
+
+void SampleIndexIterator::SeekToKeyFrame(int32_t start_90k,
+                                         const KeyFrameTable &key_frames) {
+  if (done_) {
+    return;
+  }
+  DCHECK_EQ(0, sample_num_);
+  const std::vector<KeyFrameEntry> &entries = key_frames.entries();
+  auto it = std::upper_bound(
+      entries.begin(), entries.end(), start_90k,
+      [](int32_t t, const KeyFrameEntry &e) { return t < e.start_90k; });
+  if (it == entries.begin()) {
+    return;
+  }
+  --it;
+  ResumeAtKeyFrame(*it, it - entries.begin());
+}
+
+void SampleIndexIterator::ResumeAtKeyFrame(const KeyFrameEntry &entry,
+                                           size_t key_frame) {
+  if (entry.row_offset > rows_.size()) {
+    error_ = StrCat("key frame ", key_frame, " has row offset ",
+                    entry.row_offset, " past end of ", rows_.size(),
+                    "-byte video index");
+    done_ = true;
+    return;
+  }
+
+  // Position as if the previous (non-key) sample had just been decoded, then
+  // decode the key frame itself.
+  data_ = rows_.substr(entry.row_offset);
+  sample_num_ = entry.sample_num - 1;
+  key_frames_before_ = key_frame;
+  duration_90k_ = entry.prev_duration_90k;
+  bytes_key_ = entry.prev_bytes_key;
+  bytes_nonkey_ = entry.prev_bytes_nonkey;
+  is_key_ = false;
+  start_90k_ = entry.start_90k - duration_90k_;
+  pos_ = entry.pos - bytes_nonkey_;
+  Next();
+  if (!done_ && !is_key_) {
+    error_ = StrCat("key frame ", key_frame, " doesn't match video index");
+    done_ = true;
+  }
+}
+
 void SampleIndexIterator::Clear() {
+  checkpoints_.clear();
+  rows_.clear();
+  v2_ = false;
   data_.clear();
   error_.clear();
   pos_ = 0;
+  sample_num_ = -1;
+  key_frames_before_ = 0;
   start_90k_ = 0;
   duration_90k_ = 0;
   bytes_key_ = 0;
@@ -132,8 +529,54 @@ void SampleIndexIterator::Clear() {
   done_ = true;
 }
 
-SampleFileWriter::SampleFileWriter(File *parent_dir)
-    : parent_dir_(parent_dir), sha1_(Digest::SHA1()) {}
+bool KeyFrameTable::Init(re2::StringPiece index, std::string *error_message) {
+  entries_.clear();
+  SampleIndexIterator it(index);
+  if (it.v2_) {
+    size_t n = it.checkpoints_.size() / kCheckpointBytes;
+    entries_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      Checkpoint c = ReadCheckpoint(it.checkpoints_, i);
+      KeyFrameEntry &entry = entries_[i];
+      entry.start_90k = c.start_90k;
+      entry.pos = c.pos;
+      entry.sample_num = c.sample_num;
+      entry.row_offset = c.row_offset;
+    }
+  } else {
+    // |next| describes the sample after |it|'s current one.
+    KeyFrameEntry next;
+    for (KeyFrameEntry cur; !it.done(); cur = next) {
+      if (it.is_key_) {
+        entries_.push_back(cur);
+      }
+      next.start_90k = it.start_90k_ + it.duration_90k_;
+      next.pos = it.pos_ + it.bytes_internal();
+      next.sample_num = it.sample_num_ + 1;
+      next.row_offset = it.rows_.size() - it.data_.size();
+      next.prev_duration_90k = it.duration_90k_;
+      next.prev_bytes_key = it.bytes_key_;
+      next.prev_bytes_nonkey = it.bytes_nonkey_;
+      it.Next();
+    }
+    entries_.shrink_to_fit();
+  }
+  if (it.has_error()) {
+    *error_message = it.error();
+    entries_.clear();
+    return false;
+  }
+  return true;
+}
+
+SampleFileWriter::SampleFileWriter(File *parent_dir,
+                                   DigestWorker *digest_worker,
+                                   HashAlgorithm hash_algorithm)
+    : parent_dir_(parent_dir),
+      digest_worker_(digest_worker),
+      hash_algorithm_(hash_algorithm),
+      hash_(new AsyncDigest(digest_worker,
+                            Digest::ForAlgorithm(hash_algorithm))) {}
 
 bool SampleFileWriter::Open(const char *filename, std::string *error_message) {
   if (is_open()) {
@@ -149,6 +592,29 @@ bool SampleFileWriter::Open(const char *filename, std::string *error_message) {
   return true;
 }
 
+bool SampleFileWriter::OpenInContainer(const char *filename, int64_t offset,
+                                       std::string *error_message) {
+  if (is_open()) {
+    *error_message = "already open!";
+    return false;
+  }
+  int ret = parent_dir_->Open(filename, O_WRONLY, &file_);
+  if (ret != 0) {
+    *error_message = StrCat("open ", filename, ": ", strerror(ret));
+    return false;
+  }
+  ret = file_->Seek(offset);
+  if (ret != 0) {
+    *error_message =
+        StrCat("seek ", filename, " to ", offset, ": ", strerror(ret));
+    file_.reset();
+    return false;
+  }
+  pos_ = offset;
+  in_container_ = true;
+  return true;
+}
+
 bool SampleFileWriter::Write(re2::StringPiece pkt, std::string *error_message) {
   if (!is_open()) {
     *error_message = "not open!";
@@ -161,14 +627,21 @@ bool SampleFileWriter::Write(re2::StringPiece pkt, std::string *error_message) {
     int write_ret = file_->Write(remaining, &written);
     if (write_ret != 0) {
       if (pos_ > old_pos) {
-        int truncate_ret = file_->Truncate(old_pos);
+        // A container is preallocated and shared with earlier recordings, so
+        // rather than truncating it, just rewind to overwrite the partial
+        // packet.
+        int truncate_ret = in_container_ ? file_->Seek(old_pos)
+                                         : file_->Truncate(old_pos);
         if (truncate_ret != 0) {
-          *error_message =
-              StrCat("write failed with: ", strerror(write_ret),
-                     " and ftruncate failed with: ", strerror(truncate_ret));
+          *error_message = StrCat(
+              "write failed with: ", strerror(write_ret),
+              in_container_ ? " and lseek failed with: "
+                            : " and ftruncate failed with: ",
+              strerror(truncate_ret));
           corrupt_ = true;
           return false;
         }
+        pos_ = old_pos;
       }
       *error_message = StrCat("write: ", strerror(write_ret));
       return false;
@@ -176,11 +649,11 @@ bool SampleFileWriter::Write(re2::StringPiece pkt, std::string *error_message) {
     remaining.remove_prefix(written);
     pos_ += written;
   }
-  sha1_->Update(pkt);
+  hash_->Update(pkt);
   return true;
 }
 
-bool SampleFileWriter::Close(std::string *sha1, std::string *error_message) {
+bool SampleFileWriter::Close(std::string *hash, std::string *error_message) {
   if (!is_open()) {
     *error_message = "not open!";
     return false;
@@ -188,7 +661,7 @@ bool SampleFileWriter::Close(std::string *sha1, std::string *error_message) {
 
   if (corrupt_) {
     *error_message = "File already corrupted.";
-  } else {
+  } else if (sync_on_close_) {
     int ret = file_->Sync();
     if (ret != 0) {
       *error_message = StrCat("fsync failed with: ", strerror(ret));
@@ -204,9 +677,11 @@ bool SampleFileWriter::Close(std::string *sha1, std::string *error_message) {
 
   bool ok = !corrupt_;
   file_.reset();
-  *sha1 = sha1_->Finalize();
-  sha1_ = Digest::SHA1();
+  *hash = hash_->Finalize();
+  hash_.reset(
+      new AsyncDigest(digest_worker_, Digest::ForAlgorithm(hash_algorithm_)));
   pos_ = 0;
+  in_container_ = false;
   corrupt_ = false;
   return ok;
 }
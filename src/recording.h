@@ -38,6 +38,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include <re2/stringpiece.h>
@@ -59,16 +60,28 @@ constexpr int64_t kTimeUnitsPerSecond = 90000;
 // constraint on duration_90k in schema.sql.
 constexpr int64_t kMaxRecordingDuration = 5 * 60 * kTimeUnitsPerSecond;
 
+// The storage tier holding a recording's sample file.
+// See the recording.sample_file_tier column in schema.sql.
+enum class SampleFileTier { kHot = 0, kCold = 1 };
+
 // Various fields from the "recording" table which are useful when viewing
 // recordings.
 struct Recording {
   int64_t id = -1;
   int64_t camera_id = -1;
-  std::string sample_file_sha1;
+  std::string sample_file_hash;
+  HashAlgorithm sample_file_hash_algorithm = HashAlgorithm::kSha1;
   std::string sample_file_path;
   Uuid sample_file_uuid;
   int64_t video_sample_entry_id = -1;
   int64_t local_time_90k = -1;
+  SampleFileTier sample_file_tier = SampleFileTier::kHot;
+
+  // If not -1, the sample data is stored within a container file shared with
+  // other recordings of the same camera, starting at |sample_file_offset|,
+  // and |sample_file_uuid| names the container. See design/schema.md.
+  int64_t container_id = -1;
+  int64_t sample_file_offset = 0;
 
   // Fields populated by SampleIndexEncoder.
   int64_t start_time_90k = -1;
@@ -77,9 +90,20 @@ struct Recording {
   int64_t video_samples = -1;
   int64_t video_sync_samples = -1;
   std::string video_index;
+
+  // Also populated by SampleIndexEncoder: an activity score for each second
+  // of the recording, estimated from frame sizes. See the recording_activity
+  // table in design/schema.md.
+  std::string activity;
 };
 
 // Reusable object to encode sample index data to a Recording object.
+// Writes version 2 indexes, which have a checkpoint at each key frame; see
+// design/schema.md.
+//
+// Also scores each second's activity, relative to a baseline of the camera's
+// quiet non-key frame size. That baseline carries over between recordings,
+// so a stream should reuse one encoder.
 class SampleIndexEncoder {
  public:
   SampleIndexEncoder() {}
@@ -87,17 +111,66 @@ class SampleIndexEncoder {
   void operator=(const SampleIndexEncoder &) = delete;
 
   void Init(Recording *recording, int64_t start_time_90k);
+
+  // Updates the recording's fields other than |video_index|, which holds all
+  // checkpoints before all rows; rebuilding it for each key frame would move
+  // every row so far. Call Flush() before using the index.
   void AddSample(int32_t duration_90k, int32_t bytes, bool is_key);
 
+  // Writes |video_index| from the samples added since Init. More samples may
+  // be added afterward.
+  void Flush();
+
+  // The current baseline, in bytes per non-key frame, or 0 if no second has
+  // been scored yet. Exposed for testing.
+  double quiet_bytes_per_frame() const { return quiet_bytes_per_frame_; }
+
  private:
+  // Returns the score of a second with the given mean non-key frame size.
+  uint8_t ActivityScore(double bytes_per_frame) const;
+
+  // Folds the second being scored into the baseline and starts a new one.
+  void FinishSecond();
+
+  // Updates |recording_->activity| for a sample starting at |start_90k|
+  // (relative to the recording's start).
+  void AddActivity(int32_t start_90k, int32_t bytes, bool is_key);
+
   Recording *recording_;
   int32_t prev_duration_90k_ = 0;
   int32_t prev_bytes_key_ = 0;
   int32_t prev_bytes_nonkey_ = 0;
+
+  // The index's checkpoint table and sample rows, kept apart until Flush.
+  std::string checkpoints_;
+  std::string rows_;
+
+  // Non-key frames within the last second of |recording_->activity|.
+  int64_t second_nonkey_bytes_ = 0;
+  int32_t second_nonkey_frames_ = 0;
+
+  double quiet_bytes_per_frame_ = 0;
+};
+
+// A key frame's place within a recording and its encoded index, with the
+// decoder state needed to resume decoding there. See KeyFrameTable.
+struct KeyFrameEntry {
+  int32_t start_90k = 0;     // relative to the start of the recording.
+  int64_t pos = 0;           // byte position within the sample file.
+  int32_t sample_num = 0;    // 0-based.
+  uint32_t row_offset = 0;   // within the index's sample rows.
+
+  // The previous sample's decoded fields. Always 0 for a version 2 index,
+  // whose key frame rows don't depend on them.
+  int32_t prev_duration_90k = 0;
+  int32_t prev_bytes_key = 0;
+  int32_t prev_bytes_nonkey = 0;
 };
 
-// Iterates through an encoded index, decoding on the fly. Copyable.
-// Example usage:
+class KeyFrameTable;
+
+// Iterates through an encoded index of either version, decoding on the fly.
+// Copyable. Example usage:
 //
 // SampleIndexIterator it;
 // for (it = index; !it.done(); it.Next()) {
@@ -111,11 +184,7 @@ class SampleIndexIterator {
   SampleIndexIterator() { Clear(); }
 
   // |index| must outlive the iterator.
-  explicit SampleIndexIterator(re2::StringPiece index) {
-    Clear();
-    data_ = index;
-    Next();
-  }
+  explicit SampleIndexIterator(re2::StringPiece index);
 
   // Iteration control.
   void Next();
@@ -123,10 +192,24 @@ class SampleIndexIterator {
   bool has_error() const { return !error_.empty(); }
   const std::string &error() const { return error_; }
 
+  // Moves to the last key frame starting at or before |start_90k|, or leaves
+  // the iterator on the first sample if there is none. This is a binary search
+  // of a version 2 index's checkpoints, or a linear scan of a version 1 index.
+  // PRE: the iterator is on the first sample.
+  void SeekToKeyFrame(int32_t start_90k);
+
+  // As above, but a binary search of |key_frames|, which must have been built
+  // from the same index. This avoids a version 1 index's linear scan.
+  // PRE: the iterator is on the first sample.
+  void SeekToKeyFrame(int32_t start_90k, const KeyFrameTable &key_frames);
+
   // Return properties of the current sample.
-  // Note pos() and start_90k() are valid when done(); the others are not.
+  // Note pos(), start_90k(), sample_num(), and key_frames_before() are valid
+  // when done(); the others are not.
   int64_t pos() const { return pos_; }
   int32_t start_90k() const { return start_90k_; }
+  int32_t sample_num() const { return sample_num_; }  // 0-based.
+  int32_t key_frames_before() const { return key_frames_before_; }
   int32_t duration_90k() const {
     DCHECK(!done_);
     return duration_90k_;
@@ -144,14 +227,28 @@ class SampleIndexIterator {
  private:
   void Clear();
 
+  // Moves to key frame number |key_frame| of the index, described by |entry|.
+  void ResumeAtKeyFrame(const KeyFrameEntry &entry, size_t key_frame);
+
   // Return the bytes taken by the current sample, or 0 after Clear().
   int64_t bytes_internal() const {
     return is_key_ ? bytes_key_ : bytes_nonkey_;
   }
 
+  friend class DecodedSampleIndex;
+  friend class KeyFrameTable;
+
+  // For version 2 indexes, the checkpoint table and the sample rows. |data_|
+  // is the remainder of |rows_|.
+  re2::StringPiece checkpoints_;
+  re2::StringPiece rows_;
+  bool v2_;
+
   re2::StringPiece data_;
   std::string error_;
   int64_t pos_;
+  int32_t sample_num_;
+  int32_t key_frames_before_;
   int32_t start_90k_;
   int32_t duration_90k_;
   int32_t bytes_key_;
@@ -160,42 +257,125 @@ class SampleIndexIterator {
   bool done_;
 };
 
-// Writes a sample file. Can be used repeatedly. Thread-compatible.
+// A whole encoded index decoded at once into parallel arrays, one element
+// per sample. Decoding in bulk avoids SampleIndexIterator's per-sample
+// bookkeeping, so it's much faster when every sample is needed anyway, as
+// for a .mp4 file's sample tables. Copyable.
+class DecodedSampleIndex {
+ public:
+  // Decode |index|, replacing any previous contents. On failure, returns
+  // false, applying the same checks as SampleIndexIterator.
+  bool Decode(re2::StringPiece index, std::string *error_message);
+
+  // As above, but decodes at most |max_samples| samples starting from |from|'s
+  // current one, so that sample 0 here is |from|'s. Positions are still
+  // relative to the start of the recording.
+  bool Decode(const SampleIndexIterator &from, size_t max_samples,
+              std::string *error_message);
+
+  size_t size() const { return duration_90k_.size(); }
+  int32_t duration_90k(size_t i) const { return duration_90k_[i]; }
+  int32_t bytes(size_t i) const { return bytes_[i]; }
+  bool is_key(size_t i) const { return (key_bits_[i / 64] >> (i % 64)) & 1; }
+
+  // The byte position of sample |i| within the sample file. |i| may be
+  // size(), giving the total.
+  int64_t pos(size_t i) const { return pos_[i]; }
+
+  // Append big-endian entries for samples [begin, end) to the given .mp4
+  // sample table: "stts" (each a count of 1 and the duration), "stsz" (each
+  // the size), or "stss" (the 1-based sample number of each key frame,
+  // where |begin| is numbered |first_sample_num|).
+  void AppendStts(size_t begin, size_t end, std::string *out) const;
+  void AppendStsz(size_t begin, size_t end, std::string *out) const;
+  void AppendStss(size_t begin, size_t end, uint32_t first_sample_num,
+                  std::string *out) const;
+
+ private:
+  std::vector<int32_t> duration_90k_;
+  std::vector<int32_t> bytes_;
+  std::vector<int64_t> pos_;
+  std::vector<uint64_t> key_bits_;
+};
+
+// Every key frame of an encoded index, for seeking without the index's
+// checkpoint table or, for a version 1 index, a scan. Small enough to cache
+// in memory for many recordings; see KeyFrameCache. Copyable.
+class KeyFrameTable {
+ public:
+  // List the key frames of |index|, replacing any previous contents. On
+  // failure, returns false. A version 2 index's checkpoints are copied as-is
+  // and checked when seeking; a version 1 index is fully decoded.
+  bool Init(re2::StringPiece index, std::string *error_message);
+
+  const std::vector<KeyFrameEntry> &entries() const { return entries_; }
+
+  // The approximate memory used by this table.
+  size_t bytes() const {
+    return sizeof(*this) + entries_.capacity() * sizeof(KeyFrameEntry);
+  }
+
+ private:
+  std::vector<KeyFrameEntry> entries_;
+};
+
+// Writes a sample file, or a single recording's sample data within a
+// container file. Can be used repeatedly. Thread-compatible.
 class SampleFileWriter {
  public:
-  // |parent_dir| must outlive the writer.
-  SampleFileWriter(File *parent_dir);
+  // |parent_dir| must outlive the writer. If |digest_worker| is non-null, the
+  // hash is computed on its thread rather than within Write; it must also
+  // outlive the writer.
+  explicit SampleFileWriter(File *parent_dir,
+                            DigestWorker *digest_worker = nullptr,
+                            HashAlgorithm hash_algorithm = HashAlgorithm::kSha1);
   SampleFileWriter(const SampleFileWriter &) = delete;
   void operator=(const SampleFileWriter &) = delete;
 
+  // Creates a new sample file.
   // PRE: !is_open().
   bool Open(const char *filename, std::string *error_message);
 
+  // Opens an existing container file, writing from byte |offset|. Any data
+  // at or after |offset| is considered unused and may be overwritten.
+  // PRE: !is_open().
+  bool OpenInContainer(const char *filename, int64_t offset,
+                       std::string *error_message);
+
   // Writes a single packet, returning success.
   // On failure, the stream should be closed. If Close() returns true, the
-  // file contains the results of all packets up to (but not including) this
-  // one.
+  // file (or the container, from the opening offset) contains the results of
+  // all packets up to (but not including) this one.
   //
   // PRE: is_open().
   bool Write(re2::StringPiece pkt, std::string *error_message);
 
-  // fsync() and close() the stream.
+  // fsync() (unless disabled with set_sync_on_close) and close() the stream.
   // Note the caller is still responsible for fsync()ing the parent stream,
   // so that operations can be batched.
-  // On success, |sha1| will be filled with the raw SHA-1 hash of the file.
+  // On success, |hash| will be filled with the raw hash of the file, using
+  // the algorithm given at construction.
   // On failure, the file should be considered corrupt and discarded.
   //
   // PRE: is_open().
-  bool Close(std::string *sha1, std::string *error_message);
+  bool Close(std::string *hash, std::string *error_message);
 
   bool is_open() const { return file_ != nullptr; }
 
+  // If false, Close() doesn't fsync() the file; the caller is responsible
+  // for making it durable some other way, such as File::SyncFilesystem().
+  void set_sync_on_close(bool sync_on_close) { sync_on_close_ = sync_on_close; }
+
  private:
   File *parent_dir_;
+  DigestWorker *digest_worker_;
+  const HashAlgorithm hash_algorithm_;
   std::unique_ptr<File> file_;
-  std::unique_ptr<Digest> sha1_;
+  std::unique_ptr<AsyncDigest> hash_;
   int64_t pos_ = 0;
+  bool in_container_ = false;
   bool corrupt_ = false;
+  bool sync_on_close_ = true;
 };
 
 struct VideoSampleEntry {
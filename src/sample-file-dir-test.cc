@@ -0,0 +1,227 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// sample-file-dir-test.cc: tests of the sample-file-dir.h interface.
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "sample-file-dir.h"
+#include "string.h"
+#include "testutil.h"
+
+DECLARE_bool(alsologtostderr);
+
+using testing::_;
+using testing::DoAll;
+using testing::Return;
+using testing::SetArgPointee;
+using testing::StrEq;
+
+namespace moonfire_nvr {
+namespace {
+
+const char kUuid1[] = "1b4e28ba-2fa1-11d2-883f-0016d3cca427";
+const char kUuid2[] = "1b4f0000-2fa1-11d2-883f-0016d3cca427";
+const char kUuid3[] = "e0e0e0e0-2fa1-11d2-883f-0016d3cca427";
+
+class ShardedSampleFileDirTest : public testing::Test {
+ protected:
+  ShardedSampleFileDirTest() {
+    tmpdir_path_ = PrepareTempDirOrDie("sample-file-dir-test");
+  }
+
+  std::unique_ptr<ShardedSampleFileDir> OpenDir(int levels) {
+    std::unique_ptr<File> dir;
+    int ret = GetRealFilesystem()->Open(tmpdir_path_.c_str(),
+                                        O_DIRECTORY | O_RDONLY, &dir);
+    CHECK_EQ(0, ret) << strerror(ret);
+    return std::unique_ptr<ShardedSampleFileDir>(
+        new ShardedSampleFileDir(std::move(dir), levels));
+  }
+
+  bool Exists(const std::string &relpath) {
+    struct stat buf;
+    return GetRealFilesystem()->Stat(StrCat(tmpdir_path_, "/", relpath).c_str(),
+                                     &buf) == 0;
+  }
+
+  std::string tmpdir_path_;
+};
+
+TEST_F(ShardedSampleFileDirTest, ShardedPath) {
+  ShardedSampleFileDir flat(std::unique_ptr<File>(new MockFile), 0);
+  ShardedSampleFileDir one(std::unique_ptr<File>(new MockFile), 1);
+  ShardedSampleFileDir two(std::unique_ptr<File>(new MockFile), 2);
+  EXPECT_EQ(kUuid1, flat.ShardedPath(kUuid1));
+  EXPECT_EQ(StrCat("1b/", kUuid1), one.ShardedPath(kUuid1));
+  EXPECT_EQ(StrCat("1b/4e/", kUuid1), two.ShardedPath(kUuid1));
+  EXPECT_EQ("foo", two.ShardedPath("foo"));
+}
+
+TEST_F(ShardedSampleFileDirTest, CreateOpenUnlink) {
+  auto dir = OpenDir(2);
+  std::string error_message;
+  ASSERT_TRUE(dir->Init(&error_message)) << error_message;
+
+  int fd;
+  ASSERT_EQ(0, dir->Open(kUuid1, O_WRONLY | O_CREAT | O_EXCL, 0600, &fd));
+  close(fd);
+  ASSERT_EQ(0, dir->Open(kUuid2, O_WRONLY | O_CREAT | O_EXCL, 0600, &fd));
+  close(fd);
+  EXPECT_EQ(0, dir->Sync());
+  EXPECT_TRUE(Exists(StrCat("1b/4e/", kUuid1)));
+  EXPECT_TRUE(Exists(StrCat("1b/4f/", kUuid2)));
+  EXPECT_FALSE(Exists(kUuid1));
+
+  std::unique_ptr<File> f;
+  EXPECT_EQ(0, dir->Open(kUuid1, O_RDONLY, &f));
+  EXPECT_EQ(0, dir->Unlink(kUuid1));
+  EXPECT_EQ(ENOENT, dir->Open(kUuid1, O_RDONLY, &f));
+  EXPECT_EQ(ENOENT, dir->Unlink(kUuid1));
+  EXPECT_EQ(0, dir->Sync());
+}
+
+TEST_F(ShardedSampleFileDirTest, MigrateFromFlat) {
+  WriteFileOrDie(StrCat(tmpdir_path_, "/", kUuid1), "1");
+  WriteFileOrDie(StrCat(tmpdir_path_, "/", kUuid2), "2");
+  WriteFileOrDie(StrCat(tmpdir_path_, "/", kUuid3), "3");
+  WriteFileOrDie(StrCat(tmpdir_path_, "/foo"), "foo");
+  auto dir = OpenDir(1);
+  std::string error_message;
+  ASSERT_TRUE(dir->Init(&error_message)) << error_message;
+
+  // Flat files remain accessible before and during migration.
+  std::unique_ptr<File> f;
+  EXPECT_EQ(0, dir->Open(kUuid1, O_RDONLY, &f));
+
+  bool done = true;
+  ASSERT_TRUE(dir->MigrateFromFlat(2, &done, &error_message))
+      << error_message;
+  EXPECT_FALSE(done);
+  EXPECT_EQ(0, dir->Open(kUuid1, O_RDONLY, &f));
+  EXPECT_EQ(0, dir->Open(kUuid2, O_RDONLY, &f));
+  EXPECT_EQ(0, dir->Open(kUuid3, O_RDONLY, &f));
+
+  ASSERT_TRUE(dir->MigrateFromFlat(2, &done, &error_message))
+      << error_message;
+  EXPECT_TRUE(done);
+  EXPECT_TRUE(Exists(StrCat("1b/", kUuid1)));
+  EXPECT_TRUE(Exists(StrCat("1b/", kUuid2)));
+  EXPECT_TRUE(Exists(StrCat("e0/", kUuid3)));
+  EXPECT_FALSE(Exists(kUuid1));
+  EXPECT_TRUE(Exists("foo"));
+  EXPECT_EQ(0, dir->Open(kUuid3, O_RDONLY, &f));
+  EXPECT_EQ(0, dir->Unlink(kUuid3));
+  EXPECT_FALSE(Exists(StrCat("e0/", kUuid3)));
+
+  // A fresh Init finds nothing left to migrate.
+  dir = OpenDir(1);
+  ASSERT_TRUE(dir->Init(&error_message)) << error_message;
+  ASSERT_TRUE(dir->MigrateFromFlat(2, &done, &error_message))
+      << error_message;
+  EXPECT_TRUE(done);
+}
+
+TEST_F(ShardedSampleFileDirTest, ListSampleFiles) {
+  WriteFileOrDie(StrCat(tmpdir_path_, "/", kUuid1), "1");
+  WriteFileOrDie(StrCat(tmpdir_path_, "/foo"), "foo");
+  auto dir = OpenDir(1);
+  std::string error_message;
+  ASSERT_TRUE(dir->Init(&error_message)) << error_message;
+  std::unique_ptr<File> f;
+  ASSERT_EQ(0, dir->Open(kUuid3, O_WRONLY | O_CREAT | O_EXCL, 0600, &f));
+
+  // Files are found in both the flat and sharded layouts; others are ignored.
+  std::vector<Uuid> uuids;
+  ASSERT_TRUE(dir->ListSampleFiles(&uuids, &error_message)) << error_message;
+  std::vector<std::string> texts;
+  for (const auto &uuid : uuids) {
+    texts.push_back(uuid.UnparseText());
+  }
+  EXPECT_THAT(texts, testing::UnorderedElementsAre(kUuid1, kUuid3));
+}
+
+TEST_F(ShardedSampleFileDirTest, InitRejectsMismatchedLevels) {
+  {
+    auto dir = OpenDir(1);
+    std::string error_message;
+    ASSERT_TRUE(dir->Init(&error_message)) << error_message;
+    int fd;
+    ASSERT_EQ(0, dir->Open(kUuid1, O_WRONLY | O_CREAT | O_EXCL, 0600, &fd));
+    close(fd);
+  }
+  std::string error_message;
+  EXPECT_FALSE(OpenDir(0)->Init(&error_message));
+  EXPECT_FALSE(OpenDir(2)->Init(&error_message));
+  EXPECT_TRUE(OpenDir(1)->Init(&error_message)) << error_message;
+}
+
+TEST_F(ShardedSampleFileDirTest, SyncOnlyDirtyShards) {
+  auto *mock_dir = new MockFile;
+  ShardedSampleFileDir dir(std::unique_ptr<File>(mock_dir), 1);
+  std::string error_message;
+  EXPECT_CALL(*mock_dir, DirForEach(_, _)).WillOnce(Return(true));
+  ASSERT_TRUE(dir.Init(&error_message)) << error_message;
+
+  EXPECT_CALL(*mock_dir, Unlink(StrEq(StrCat("1b/", kUuid1))))
+      .WillOnce(Return(0));
+  EXPECT_EQ(0, dir.Unlink(kUuid1));
+
+  // Only the affected shard, not the top-level directory, is synced.
+  auto *mock_shard = new MockFile;
+  EXPECT_CALL(*mock_shard, Sync()).WillOnce(Return(0));
+  EXPECT_CALL(*mock_dir, OpenRaw(StrEq("1b"), O_DIRECTORY | O_RDONLY, _))
+      .WillOnce(DoAll(SetArgPointee<2>(mock_shard), Return(0)));
+  EXPECT_CALL(*mock_dir, Sync()).Times(0);
+  EXPECT_EQ(0, dir.Sync());
+
+  // Nothing is dirty now.
+  EXPECT_EQ(0, dir.Sync());
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
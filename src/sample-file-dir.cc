@@ -0,0 +1,353 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// sample-file-dir.cc: see sample-file-dir.h.
+//
+// While sample files may remain in the flat layout, lookups try the flat
+// path before the sharded one. Migration only ever moves files from the flat
+// path to the sharded one, so in this order a lookup can't miss a file which
+// is being migrated concurrently.
+
+#include "sample-file-dir.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "string.h"
+#include "uuid.h"
+
+namespace moonfire_nvr {
+
+namespace {
+
+// Each level of shard directory is named by two hex digits.
+const int kShardNameLength = 2;
+
+bool IsShardName(re2::StringPiece name) {
+  if (name.size() != kShardNameLength) {
+    return false;
+  }
+  for (char c : name) {
+    if (!(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'f')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns the directory containing |path|, "." if it's in the top level.
+std::string DirName(const std::string &path) {
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+}  // namespace
+
+ShardedSampleFileDir::ShardedSampleFileDir(std::unique_ptr<File> dir,
+                                           int levels)
+    : dir_(std::move(dir)), levels_(levels) {
+  CHECK_GE(levels, 0);
+  CHECK_LE(levels, kMaxLevels);
+}
+
+bool ShardedSampleFileDir::IsSampleFile(re2::StringPiece filename) {
+  Uuid uuid;
+  return filename.size() == 36 && uuid.ParseText(filename);
+}
+
+std::string ShardedSampleFileDir::ShardedPath(
+    re2::StringPiece filename) const {
+  if (levels_ == 0 || !IsSampleFile(filename)) {
+    return filename.as_string();
+  }
+  std::string path;
+  for (int i = 0; i < levels_; ++i) {
+    path.append(filename.data() + i * kShardNameLength, kShardNameLength);
+    path.push_back('/');
+  }
+  filename.AppendToString(&path);
+  return path;
+}
+
+bool ShardedSampleFileDir::Init(std::string *error_message) {
+  bool found_flat = false;
+  std::vector<std::string> shards;
+  auto entry_cb = [&](const dirent *ent) {
+    if (IsSampleFile(ent->d_name)) {
+      found_flat = true;
+    } else if (IsShardName(ent->d_name)) {
+      shards.push_back(ent->d_name);
+    }
+    return IterationControl::kContinue;
+  };
+  if (!dir_->DirForEach(entry_cb, error_message)) {
+    return false;
+  }
+  if (levels_ == 0 && !shards.empty()) {
+    *error_message = StrCat("found shard directory ", shards[0],
+                            " in a sample file directory with 0 levels");
+    return false;
+  }
+
+  // Check the depth of the first non-empty shard.
+  for (const auto &shard : shards) {
+    std::unique_ptr<File> shard_dir;
+    int ret = dir_->Open(shard.c_str(), O_DIRECTORY | O_RDONLY, &shard_dir);
+    if (ret != 0) {
+      *error_message = StrCat("open ", shard, ": ", strerror(ret));
+      return false;
+    }
+    int actual_levels = -1;
+    auto shard_entry_cb = [&](const dirent *ent) {
+      if (IsSampleFile(ent->d_name)) {
+        actual_levels = 1;
+      } else if (IsShardName(ent->d_name)) {
+        actual_levels = 2;
+      } else {
+        return IterationControl::kContinue;
+      }
+      return IterationControl::kBreak;
+    };
+    if (!shard_dir->DirForEach(shard_entry_cb, error_message)) {
+      return false;
+    }
+    if (actual_levels == -1) {
+      continue;
+    }
+    if (actual_levels != levels_) {
+      *error_message =
+          StrCat("sample file directory has ", actual_levels,
+                 " levels of shard directories; expected ", levels_);
+      return false;
+    }
+    break;
+  }
+
+  std::lock_guard<std::mutex> lock(mu_);
+  may_have_flat_files_ = levels_ > 0 && found_flat;
+  return true;
+}
+
+bool ShardedSampleFileDir::ListSampleFiles(std::vector<Uuid> *uuids,
+                                           std::string *error_message) {
+  uuids->clear();
+  return ListSampleFilesIn(dir_.get(), 0, uuids, error_message);
+}
+
+bool ShardedSampleFileDir::ListSampleFilesIn(File *dir, int level,
+                                             std::vector<Uuid> *uuids,
+                                             std::string *error_message) {
+  std::vector<std::string> shards;
+  auto entry_cb = [&](const dirent *ent) {
+    Uuid uuid;
+    if (IsSampleFile(ent->d_name)) {
+      CHECK(uuid.ParseText(ent->d_name));
+      uuids->push_back(uuid);
+    } else if (level < levels_ && IsShardName(ent->d_name)) {
+      shards.push_back(ent->d_name);
+    }
+    return IterationControl::kContinue;
+  };
+  if (!dir->DirForEach(entry_cb, error_message)) {
+    return false;
+  }
+  for (const auto &shard : shards) {
+    std::unique_ptr<File> shard_dir;
+    int ret = dir->Open(shard.c_str(), O_DIRECTORY | O_RDONLY, &shard_dir);
+    if (ret != 0) {
+      *error_message = StrCat("open shard ", shard, ": ", strerror(ret));
+      return false;
+    }
+    if (!ListSampleFilesIn(shard_dir.get(), level + 1, uuids, error_message)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int ShardedSampleFileDir::MakeShardDirs(const std::string &sharded_path) {
+  for (int i = 1; i <= levels_; ++i) {
+    std::string shard =
+        sharded_path.substr(0, i * (kShardNameLength + 1) - 1);
+    int ret = dir_->Mkdir(shard.c_str(), 0700);
+    if (ret == 0) {
+      MarkDirty(shard);
+    } else if (ret != EEXIST) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+void ShardedSampleFileDir::MarkDirty(const std::string &path) {
+  std::string dir = DirName(path);
+  std::lock_guard<std::mutex> lock(mu_);
+  dirty_dirs_.insert(std::move(dir));
+}
+
+template <typename T>
+int ShardedSampleFileDir::OpenInternal(const char *path, int flags,
+                                       mode_t mode, T *out) {
+  std::string sharded = ShardedPath(path);
+  if ((flags & O_CREAT) != 0) {
+    int ret = dir_->Open(sharded.c_str(), flags, mode, out);
+    if (ret == ENOENT && sharded != path) {
+      ret = MakeShardDirs(sharded);
+      if (ret != 0) {
+        return ret;
+      }
+      ret = dir_->Open(sharded.c_str(), flags, mode, out);
+    }
+    if (ret == 0) {
+      MarkDirty(sharded);
+    }
+    return ret;
+  }
+  if (sharded != path && MayHaveFlatFiles()) {
+    int ret = dir_->Open(path, flags, mode, out);
+    if (ret != ENOENT) {
+      return ret;
+    }
+  }
+  return dir_->Open(sharded.c_str(), flags, mode, out);
+}
+
+int ShardedSampleFileDir::Open(const char *path, int flags, mode_t mode,
+                               int *fd) {
+  return OpenInternal(path, flags, mode, fd);
+}
+
+int ShardedSampleFileDir::Open(const char *path, int flags, mode_t mode,
+                               std::unique_ptr<File> *f) {
+  return OpenInternal(path, flags, mode, f);
+}
+
+int ShardedSampleFileDir::Unlink(const char *path) {
+  std::string sharded = ShardedPath(path);
+  if (sharded != path && MayHaveFlatFiles()) {
+    int ret = dir_->Unlink(path);
+    if (ret == 0) {
+      MarkDirty(path);
+    }
+    if (ret != ENOENT) {
+      return ret;
+    }
+  }
+  int ret = dir_->Unlink(sharded.c_str());
+  if (ret == 0) {
+    MarkDirty(sharded);
+  }
+  return ret;
+}
+
+int ShardedSampleFileDir::Sync() {
+  std::lock_guard<std::mutex> sync_lock(sync_mu_);
+  std::set<std::string> dirty;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    dirty.swap(dirty_dirs_);
+  }
+  for (auto it = dirty.begin(); it != dirty.end(); ++it) {
+    int ret;
+    if (*it == ".") {
+      ret = dir_->Sync();
+    } else {
+      std::unique_ptr<File> shard_dir;
+      ret = dir_->Open(it->c_str(), O_DIRECTORY | O_RDONLY, &shard_dir);
+      if (ret == 0) {
+        ret = shard_dir->Sync();
+      }
+    }
+    if (ret != 0) {
+      // Retry this and the remaining directories on the next call.
+      std::lock_guard<std::mutex> lock(mu_);
+      dirty_dirs_.insert(it, dirty.end());
+      return ret;
+    }
+  }
+  return 0;
+}
+
+bool ShardedSampleFileDir::MigrateFromFlat(int max_files, bool *done,
+                                           std::string *error_message) {
+  if (!MayHaveFlatFiles()) {
+    *done = true;
+    return true;
+  }
+  std::vector<std::string> filenames;
+  auto entry_cb = [&](const dirent *ent) {
+    if (IsSampleFile(ent->d_name)) {
+      filenames.push_back(ent->d_name);
+    }
+    return static_cast<int>(filenames.size()) < max_files
+               ? IterationControl::kContinue
+               : IterationControl::kBreak;
+  };
+  if (!dir_->DirForEach(entry_cb, error_message)) {
+    return false;
+  }
+  for (const auto &filename : filenames) {
+    std::string sharded = ShardedPath(filename);
+    int ret = MakeShardDirs(sharded);
+    if (ret != 0) {
+      *error_message =
+          StrCat("mkdir for ", sharded, ": ", strerror(ret));
+      return false;
+    }
+    ret = dir_->Rename(filename.c_str(), sharded.c_str());
+    if (ret == ENOENT) {
+      continue;  // unlinked concurrently.
+    } else if (ret != 0) {
+      *error_message = StrCat("rename ", filename, " to ", sharded, ": ",
+                              strerror(ret));
+      return false;
+    }
+    MarkDirty(filename);
+    MarkDirty(sharded);
+  }
+  int ret = Sync();
+  if (ret != 0) {
+    *error_message = StrCat("sync: ", strerror(ret));
+    return false;
+  }
+  *done = static_cast<int>(filenames.size()) < max_files;
+  if (*done) {
+    std::lock_guard<std::mutex> lock(mu_);
+    may_have_flat_files_ = false;
+  }
+  return true;
+}
+
+}  // namespace moonfire_nvr
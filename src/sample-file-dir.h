@@ -0,0 +1,170 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// sample-file-dir.h: a sample file directory which spreads sample files across
+// subdirectories named by a prefix of their uuids. See design/schema.md.
+
+#ifndef MOONFIRE_NVR_SAMPLE_FILE_DIR_H
+#define MOONFIRE_NVR_SAMPLE_FILE_DIR_H
+
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <re2/stringpiece.h>
+
+#include "filesystem.h"
+#include "time.h"
+#include "uuid.h"
+
+namespace moonfire_nvr {
+
+// A File decorator for a sample file directory. Callers continue to refer to
+// sample files by the text form of their uuids; with |levels| > 0, these are
+// mapped to paths such as "1b/4e/1b4e28ba-2fa1-11d2-883f-0016d3cca427" (for
+// two levels). Other paths are passed through unchanged.
+//
+// Shard directories are created on demand. Sync() fsync()s only the
+// directories which have changed since the last Sync(), so a batch of new or
+// unlinked sample files costs one fsync() per affected shard rather than one
+// of a single, very large directory.
+//
+// Sample files left in the flat layout (by earlier versions or with |levels|
+// == 0) remain accessible and can be moved into their shards with
+// MigrateFromFlat while the directory is in use.
+//
+// Thread-safe after Init, as is the underlying directory.
+class ShardedSampleFileDir : public File {
+ public:
+  static const int kMaxLevels = 2;
+
+  // |levels| must be in [0, kMaxLevels].
+  ShardedSampleFileDir(std::unique_ptr<File> dir, int levels);
+  ShardedSampleFileDir(const ShardedSampleFileDir &) = delete;
+  void operator=(const ShardedSampleFileDir &) = delete;
+
+  // Examine the existing directory contents, checking that any shard
+  // directories match |levels| and noting if there are any sample files in
+  // the flat layout. Call before any other operation.
+  bool Init(std::string *error_message);
+
+  // Move up to |max_files| sample files from the flat layout into their
+  // shards and sync the affected directories. On success, sets |done| to
+  // indicate whether there are any sample files left in the flat layout.
+  bool MigrateFromFlat(int max_files, bool *done, std::string *error_message);
+
+  // Returns the path relative to this directory for the given sample file.
+  std::string ShardedPath(re2::StringPiece filename) const;
+
+  // Fill |uuids| with every sample file in the directory, in both the flat
+  // and sharded layouts, in no particular order.
+  bool ListSampleFiles(std::vector<Uuid> *uuids, std::string *error_message);
+
+  int Allocate(off_t offset, off_t len) final {
+    return dir_->Allocate(offset, len);
+  }
+  int Close() final { return dir_->Close(); }
+  bool DirForEach(std::function<IterationControl(const dirent *)> fn,
+                  std::string *error_message) final {
+    return dir_->DirForEach(fn, error_message);
+  }
+  int Mkdir(const char *path, mode_t mode) final {
+    return dir_->Mkdir(path, mode);
+  }
+  void NoteRawRead(int64_t bytes) final { dir_->NoteRawRead(bytes); }
+  int Open(const char *path, int flags, int *fd) final {
+    return Open(path, flags, 0, fd);
+  }
+  int Open(const char *path, int flags, std::unique_ptr<File> *f) final {
+    return Open(path, flags, 0, f);
+  }
+  int Open(const char *path, int flags, mode_t mode, int *fd) final;
+  int Open(const char *path, int flags, mode_t mode,
+           std::unique_ptr<File> *f) final;
+  int Read(void *buf, size_t count, size_t *bytes_read) final {
+    return dir_->Read(buf, count, bytes_read);
+  }
+  int Rename(const char *oldpath, const char *newpath) final {
+    return dir_->Rename(oldpath, newpath);
+  }
+  int Seek(off_t offset) final { return dir_->Seek(offset); }
+  int Stat(struct stat *buf) final { return dir_->Stat(buf); }
+  int Sync() final;
+  int SyncFilesystem() final { return dir_->SyncFilesystem(); }
+  int Truncate(off_t length) final { return dir_->Truncate(length); }
+  int Unlink(const char *path) final;
+  int Write(re2::StringPiece data, size_t *bytes_written) final {
+    return dir_->Write(data, bytes_written);
+  }
+
+ private:
+  // Returns true iff |filename| names a sample file.
+  static bool IsSampleFile(re2::StringPiece filename);
+
+  // Append the sample files in |dir|, which is at shard level |level|, and
+  // any shards below it to |uuids|.
+  bool ListSampleFilesIn(File *dir, int level, std::vector<Uuid> *uuids,
+                         std::string *error_message);
+
+  // Create the shard directories for |sharded_path| if necessary.
+  int MakeShardDirs(const std::string &sharded_path);
+
+  // Note that the directory containing |path| must be synced.
+  void MarkDirty(const std::string &path);
+
+  // Returns if any sample files may be in the flat layout.
+  bool MayHaveFlatFiles() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return may_have_flat_files_;
+  }
+
+  template <typename T>
+  int OpenInternal(const char *path, int flags, mode_t mode, T *out);
+
+  const std::unique_ptr<File> dir_;
+  const int levels_;
+
+  // Held throughout Sync(), so that a Sync() call which finds nothing dirty
+  // can't return while another call is still syncing the same changes.
+  std::mutex sync_mu_;
+
+  mutable std::mutex mu_;  // protects below fields.
+  bool may_have_flat_files_ = true;
+
+  // Directories (relative paths; "." for |dir_| itself) with changes not yet
+  // fsync()ed.
+  std::set<std::string> dirty_dirs_;
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_SAMPLE_FILE_DIR_H
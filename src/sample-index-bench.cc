@@ -0,0 +1,141 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// sample-index-bench.cc: a microbenchmark of video index decoding.
+//
+// Encodes a synthetic index of --samples frames (a key frame every
+// --key_interval) and times building its .mp4 "stts", "stss", and "stsz"
+// tables --iterations times, once with SampleIndexIterator (as Mp4FileBuilder
+// used to) and once with DecodedSampleIndex. Prints nanoseconds per sample for
+// each.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "coding.h"
+#include "recording.h"
+
+DEFINE_int32(samples, 1800, "");
+DEFINE_int32(key_interval, 30, "");
+DEFINE_int32(iterations, 10000, "");
+
+namespace moonfire_nvr {
+namespace {
+
+double NowSec() {
+  struct timespec now;
+  CHECK_EQ(0, clock_gettime(CLOCK_MONOTONIC, &now));
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Fills tables the way Mp4SampleTablePieces' Fill*Entries methods once did,
+// returning their total size so the work can't be optimized away.
+size_t BuildWithIterator(const Recording &recording) {
+  std::string stts;
+  std::string stss;
+  std::string stsz;
+  uint32_t sample_num = 1;
+  for (SampleIndexIterator it(recording.video_index); !it.done(); it.Next()) {
+    AppendU32(1, &stts);
+    AppendU32(it.duration_90k(), &stts);
+    if (it.is_key()) {
+      AppendU32(sample_num, &stss);
+    }
+    AppendU32(it.bytes(), &stsz);
+    sample_num++;
+  }
+  return stts.size() + stss.size() + stsz.size();
+}
+
+size_t BuildWithDecoded(const Recording &recording) {
+  DecodedSampleIndex index;
+  std::string error_message;
+  CHECK(index.Decode(recording.video_index, &error_message)) << error_message;
+  std::string stts;
+  std::string stss;
+  std::string stsz;
+  index.AppendStts(0, index.size(), &stts);
+  index.AppendStss(0, index.size(), 1, &stss);
+  index.AppendStsz(0, index.size(), &stsz);
+  return stts.size() + stss.size() + stsz.size();
+}
+
+void Time(const char *name, const Recording &recording,
+          size_t (*build)(const Recording &)) {
+  size_t total = 0;
+  double start = NowSec();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    total += build(recording);
+  }
+  double elapsed = NowSec() - start;
+  printf("%-10s %8.2f ns/sample (%zu bytes of tables)\n", name,
+         elapsed * 1e9 / FLAGS_iterations / FLAGS_samples,
+         total / FLAGS_iterations);
+}
+
+int RunBenchmark() {
+  // Vary durations and sizes a bit so deltas aren't all zero, as with real
+  // cameras, and make key frames large enough to take multi-byte varints.
+  Recording recording;
+  SampleIndexEncoder encoder;
+  encoder.Init(&recording, 0);
+  uint32_t seed = 1;
+  for (int i = 0; i < FLAGS_samples; ++i) {
+    seed = seed * 1103515245 + 12345;
+    bool is_key = i % FLAGS_key_interval == 0;
+    int32_t bytes = (is_key ? 60000 : 4000) + (seed >> 16) % 1000;
+    encoder.AddSample(3000 + (seed >> 8) % 3 - 1, bytes, is_key);
+  }
+  encoder.Flush();
+  printf("%d samples, %zu-byte index.\n", FLAGS_samples,
+         recording.video_index.size());
+  Time("iterator", recording, &BuildWithIterator);
+  Time("decoded", recording, &BuildWithDecoded);
+  return 0;
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_samples < 1 || FLAGS_key_interval < 1 || FLAGS_iterations < 1) {
+    LOG(ERROR) << "--samples, --key_interval, and --iterations must be "
+               << "positive; exiting.";
+    return 1;
+  }
+  return moonfire_nvr::RunBenchmark();
+}
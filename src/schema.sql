@@ -33,6 +33,24 @@
 
 --pragma journal_mode = wal;
 
+-- The schema's version history. Databases created by this file start at the
+-- current version; older ones are brought up to it by the numbered steps of
+-- upgrade.cc, each of which adds a row. Bump the version below, add a step,
+-- and update kSchemaVersion with any change to this file.
+create table version (
+  id integer primary key,
+
+  -- When the database was created or upgraded to this version, in seconds
+  -- since 1970-01-01 00:00:00 UTC.
+  unix_time integer not null,
+
+  -- A description of the change.
+  notes text
+);
+
+insert into version (id, unix_time, notes)
+    values (10, cast(strftime('%s', 'now') as int), 'db creation');
+
 create table camera (
   id integer primary key,
   uuid blob unique,-- not null check (length(uuid) = 16),
@@ -63,7 +81,28 @@ create table camera (
 
   -- The number of bytes of video to retain, excluding the currently-recording
   -- file. Older files will be deleted as necessary to stay within this limit.
-  retain_bytes integer not null check (retain_bytes >= 0)
+  retain_bytes integer not null check (retain_bytes >= 0),
+
+  -- If non-null, recordings older than this many seconds are thinned to key
+  -- frames only, greatly reducing their size. See design/schema.md.
+  thin_age_sec integer check (thin_age_sec > 0)
+);
+
+-- A large, preallocated file in the sample file directory which holds the
+-- sample data of many recordings of a single camera, one after another.
+-- This is an alternative to a file per recording; see design/schema.md.
+create table container (
+  id integer primary key,
+  camera_id integer references camera (id) not null,
+
+  -- The container file's name, in the same form as a sample file's. Like a
+  -- sample file's, it's in reserved_sample_files while the file is being
+  -- created and again once this row is deleted.
+  uuid blob unique not null check (length(uuid) = 16),
+
+  -- The number of bytes preallocated for the file. Recordings are appended
+  -- until they reach this size; the last may extend past it.
+  size_bytes integer not null check (size_bytes > 0)
 );
 
 -- Each row represents a single completed recorded segment of video.
@@ -96,8 +135,31 @@ create table recording (
   video_sample_entry_id integer references video_sample_entry (id),
 
   sample_file_uuid blob not null check (length(sample_file_uuid) = 16),
+  -- A hash of the sample file's contents, computed with the algorithm given by
+  -- sample_file_hash_algorithm. Despite the name, it's SHA-1 only for
+  -- algorithm 0; shorter hashes are zero-padded to 20 bytes.
   sample_file_sha1 blob not null check (length(sample_file_sha1) = 20),
-  video_index blob not null check (length(video_index) > 0)
+
+  -- The storage tier holding the sample file: 0 (hot, the sample file
+  -- directory to which recordings are written) or 1 (cold, the directory to
+  -- which aged recordings are moved).
+  sample_file_tier integer not null default 0
+      check (sample_file_tier in (0, 1)),
+
+  -- If non-null, the sample data is stored in this container (which is also
+  -- named by sample_file_uuid) rather than a file of its own. Such recordings
+  -- are always in the hot tier and are deleted only with their container.
+  container_id integer references container (id),
+
+  -- The byte offset of the sample data within its file; always 0 for a file
+  -- of its own.
+  sample_file_offset integer not null default 0
+      check (sample_file_offset >= 0),
+
+  -- The algorithm of sample_file_sha1: 0 (SHA-1, 20 bytes) or 1 (XXH3-128,
+  -- 16 bytes). Recordings written before the latter was introduced are SHA-1.
+  sample_file_hash_algorithm integer not null default 0
+      check (sample_file_hash_algorithm in (0, 1))
 );
 
 create index recording_cover on recording (
@@ -114,14 +176,169 @@ create index recording_cover on recording (
   sample_file_bytes
 );
 
+-- Used to find the oldest recordings which have not yet been moved to the
+-- cold tier. This stays small: it only covers the hot tier.
+create index recording_hot on recording (start_time_90k)
+    where sample_file_tier = 0;
+
+-- Used to find the recordings within a container.
+create index recording_container on recording (container_id)
+    where container_id is not null;
+
+-- Each recording's sample index (see design/schema.md), which is only needed
+-- to serve or thin the recording. It's kept out of the recording table so that
+-- the rows scanned to list and delete recordings stay small; at several
+-- kilobytes, an inline index spills each row onto overflow pages.
+create table recording_playback (
+  recording_id integer primary key
+      references recording (id) on delete cascade,
+  video_index blob not null check (length(video_index) > 0)
+);
+
+-- A summary of each recording's activity, estimated from its frame sizes as
+-- it was written (see design/schema.md). Recordings written before this table
+-- was added have no row.
+create table recording_activity (
+  recording_id integer primary key
+      references recording (id) on delete cascade,
+
+  -- The maximum of the scores in activity, so that quiet recordings can be
+  -- skipped without reading it.
+  max_activity integer not null check (max_activity between 0 and 255),
+
+  -- One byte per second of the recording (the last may be partial), each a
+  -- score from 0 (no more than the camera's quiet level) to 255.
+  activity blob not null
+);
+
+-- Aggregates of each camera's recordings, updated in the same transactions
+-- which insert, shrink, and delete recordings so that startup needn't scan
+-- the recording table. A camera without a row has its aggregates computed
+-- (and the row inserted) on startup.
+create table camera_stats (
+  camera_id integer primary key references camera (id) on delete cascade,
+
+  -- The bounds of the camera's recordings, or null if it has none.
+  min_start_time_90k integer,
+  max_end_time_90k integer,
+
+  total_duration_90k integer not null,
+  total_sample_file_bytes integer not null
+);
+
+-- Summaries of each camera's recordings by UTC hour and day, updated in the
+-- same transactions as the recording table, for browsing long ranges without
+-- reading every recording. A recording spanning periods is split between
+-- them in proportion to its duration. Periods without recordings have no row.
+-- Rebuilt on startup along with a missing camera_stats row.
+create table recording_rollup (
+  camera_id integer not null references camera (id) on delete cascade,
+
+  -- 0 for an hour, 1 for a day.
+  period integer not null check (period in (0, 1)),
+
+  -- The start of the hour or day, in 90 kHz units since 1970-01-01 00:00:00
+  -- UTC.
+  start_time_90k integer not null,
+
+  -- The time within the period covered by recordings (counting overlaps
+  -- twice), and the recordings' bytes and samples within it.
+  duration_90k integer not null,
+  sample_file_bytes integer not null,
+  video_samples integer not null,
+
+  -- The number of recordings starting in the period which don't start
+  -- exactly where another recording ends, so one per run of back-to-back
+  -- recordings.
+  gaps integer not null,
+
+  primary key (camera_id, period, start_time_90k)
+) without rowid;
+
 -- Files in the sample file directory which may be present but should simply be
 -- discarded on startup. (Recordings which were never completed or have been
 -- marked for completion.)
+--
+-- States 2 and 3 describe a recording which is being moved from the hot to
+-- the cold tier; unlike states 0 and 1, there's also a recording row with
+-- the same uuid. Only one copy is discarded on startup: in state 2 (moving),
+-- the hot copy is complete and the cold copy is discarded; in state 3
+-- (moved), the cold copy is complete and the hot copy is discarded.
+--
+-- States 4 and 5 describe a recording which is being thinned to key frames
+-- only. In state 4 (thinning), the recording row still references the uuid
+-- and its file is kept; state 5 (thinned copy) is the replacement being
+-- written, which is discarded.
 create table reserved_sample_files (
   uuid blob primary key check (length(uuid) = 16),
-  state integer not null  -- 0 (writing) or 1 (deleted)
+  state integer not null  -- 0 (writing), 1 (deleted), 2 (moving), 3 (moved),
+                          -- 4 (thinning), 5 (thinned copy)
 ) without rowid;
 
+-- Sample files written with relaxed durability (see design/schema.md) which
+-- haven't been synced since they were last written. Each row describes the
+-- prefix of the file which is known to be durable, in the same terms as the
+-- recording table. On startup, each file is verified against its recording
+-- row (if it was completed) or else truncated to this prefix.
+create table recording_journal (
+  sample_file_uuid blob primary key check (length(sample_file_uuid) = 16),
+  camera_id integer references camera (id) not null,
+  start_time_90k integer not null check (start_time_90k > 0),
+  local_time_delta_90k integer not null,
+  video_sample_entry_id integer references video_sample_entry (id),
+  sample_file_hash_algorithm integer not null,
+
+  -- The durable prefix. All are 0 (and video_index is empty) if no part of
+  -- the file is known to be durable.
+  sample_file_bytes integer not null check (sample_file_bytes >= 0),
+  duration_90k integer not null
+      check (duration_90k >= 0 and duration_90k < 5*60*90000),
+  video_samples integer not null check (video_samples >= 0),
+  video_sync_samples integer not null check (video_sync_samples >= 0),
+  video_index blob not null
+) without rowid;
+
+-- The progress of the background scrubber, which verifies sample files
+-- against their recordings' hashes (see design/schema.md). There's at most one
+-- row; until the first batch is scrubbed, there's none.
+create table scrub_state (
+  id integer primary key check (id = 1),
+
+  -- Recordings are scrubbed in id order, which is roughly oldest first. The
+  -- current pass has reached every recording with an id up to this one.
+  cursor_recording_id integer not null,
+
+  -- When the current pass started, in 90 kHz units since
+  -- 1970-01-01 00:00:00 UTC, or null between passes.
+  pass_start_time_90k integer,
+
+  -- The recordings and bytes verified so far in the current pass.
+  pass_recordings integer not null,
+  pass_bytes integer not null,
+
+  -- The number of passes completed, and when the last one finished (or null).
+  completed_passes integer not null,
+  last_pass_end_time_90k integer
+);
+
+-- Each row describes a sample file which failed scrubbing: it couldn't be
+-- read or didn't match its recording's sample_file_hash. Rows are kept as a
+-- history, even after the recording is deleted.
+create table scrub_mismatch (
+  id integer primary key,
+  recording_id integer not null,
+  camera_id integer references camera (id) not null,
+  sample_file_uuid blob not null check (length(sample_file_uuid) = 16),
+  start_time_90k integer not null,
+
+  -- When the mismatch was found, in 90 kHz units since
+  -- 1970-01-01 00:00:00 UTC.
+  detected_time_90k integer not null,
+
+  -- A description of the failure, such as the hash actually found.
+  error text not null
+);
+
 -- A concrete box derived from a ISO/IEC 14496-12 section 8.5.2
 -- VisualSampleEntry box. Describes the codec, width, height, etc.
 create table video_sample_entry (
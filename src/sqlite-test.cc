@@ -99,6 +99,126 @@ TEST_F(SqliteTest, BindAndColumn) {
   }
 }
 
+TEST(SqliteWalTest, OpenAndCheckpoint) {
+  std::string tmpdir = PrepareTempDirOrDie("sqlite-wal-test");
+  std::string path = StrCat(tmpdir, "/db");
+  std::string error_message;
+  Database db;
+  DatabaseOptions options;
+  options.wal = true;
+  options.wal_autocheckpoint = false;
+  options.cache_size_kib = 1024;
+  options.mmap_size_bytes = 1 << 20;
+  options.busy_timeout_ms = 1000;
+  ASSERT_TRUE(db.Open(path.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                      options, &error_message))
+      << error_message;
+  {
+    DatabaseContext ctx(&db);
+    auto pragma = [&](const char *sql) {
+      auto run = ctx.UseOnce(sql);
+      EXPECT_EQ(SQLITE_ROW, run.Step()) << sql << ": " << run.error_message();
+      return run.ColumnText(0).as_string();
+    };
+    EXPECT_EQ("wal", pragma("pragma journal_mode;"));
+    EXPECT_EQ("1", pragma("pragma synchronous;"));  // normal
+    EXPECT_EQ("0", pragma("pragma wal_autocheckpoint;"));
+    EXPECT_EQ("-1024", pragma("pragma cache_size;"));
+    ASSERT_TRUE(RunStatements(&ctx, ReadFileOrDie("../src/schema.sql"),
+                              &error_message))
+        << error_message;
+  }
+
+  // A passive checkpoint copies the log back but leaves it in place.
+  WalCheckpointer checkpointer(GetRealClock(), INT64_C(1) << 30);
+  ASSERT_TRUE(checkpointer.Open(path.c_str(), &error_message))
+      << error_message;
+  ASSERT_TRUE(checkpointer.Checkpoint(&error_message)) << error_message;
+  WalCheckpointer::Stats stats = checkpointer.stats();
+  EXPECT_EQ(1, stats.checkpoints);
+  EXPECT_EQ(0, stats.truncations);
+  EXPECT_EQ(0, stats.failures);
+  EXPECT_GT(stats.wal_bytes, 0);
+  EXPECT_EQ(stats.wal_bytes, stats.max_wal_bytes);
+  EXPECT_GE(stats.last_latency_sec, 0);
+
+  // Once the log reaches the limit, it's truncated.
+  WalCheckpointer truncating(GetRealClock(), 1);
+  ASSERT_TRUE(truncating.Open(path.c_str(), &error_message)) << error_message;
+  ASSERT_TRUE(truncating.Checkpoint(&error_message)) << error_message;
+  stats = truncating.stats();
+  EXPECT_EQ(1, stats.checkpoints);
+  EXPECT_EQ(1, stats.truncations);
+  EXPECT_EQ(0, stats.wal_bytes);
+}
+
+TEST_F(SqliteTest, ReadersNeedWal) {
+  std::string error_message;
+  EXPECT_FALSE(db_.OpenReaders(1, DatabaseOptions(), &error_message));
+  EXPECT_THAT(error_message, testing::HasSubstr("write-ahead logging"));
+
+  // Without readers, read-only contexts use the main connection.
+  DatabaseContext ctx(&db_, DatabaseAccess::kReadOnly);
+  auto run = ctx.UsePrepared("select count(*) from camera;");
+  ASSERT_EQ(SQLITE_ROW, run.Step()) << run.error_message();
+  EXPECT_EQ(0, run.ColumnInt64(0));
+}
+
+TEST(SqliteWalTest, Readers) {
+  std::string tmpdir = PrepareTempDirOrDie("sqlite-readers-test");
+  std::string path = StrCat(tmpdir, "/db");
+  std::string error_message;
+  Database db;
+  DatabaseOptions options;
+  options.wal = true;
+  ASSERT_TRUE(db.Open(path.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                      options, &error_message))
+      << error_message;
+  {
+    DatabaseContext ctx(&db);
+    ASSERT_TRUE(RunStatements(&ctx, "create table t (x integer);",
+                              &error_message))
+        << error_message;
+  }
+  ASSERT_TRUE(db.OpenReaders(2, options, &error_message)) << error_message;
+
+  const std::string kCountSql = "select count(*) from t;";
+  auto count = [&]() -> int64_t {
+    DatabaseContext ctx(&db, DatabaseAccess::kReadOnly);
+    auto run = ctx.UsePrepared(kCountSql);
+    EXPECT_EQ(SQLITE_ROW, run.Step()) << run.error_message();
+    return run.ColumnInt64(0);
+  };
+
+  // A reader doesn't wait for the writer's lock; it sees the last commit.
+  {
+    DatabaseContext ctx(&db);
+    ASSERT_TRUE(ctx.BeginTransaction(&error_message)) << error_message;
+    auto run = ctx.UseOnce("insert into t (x) values (1);");
+    ASSERT_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+    EXPECT_EQ(0, count());
+    ASSERT_TRUE(ctx.CommitTransaction(&error_message)) << error_message;
+  }
+  EXPECT_EQ(1, count());
+
+  // Both readers can be in use at once.
+  {
+    DatabaseContext ctx1(&db, DatabaseAccess::kReadOnly);
+    DatabaseContext ctx2(&db, DatabaseAccess::kReadOnly);
+    EXPECT_NE(ctx1.db(), ctx2.db());
+    EXPECT_NE(&db, ctx1.db());
+    auto run1 = ctx1.UsePrepared(kCountSql);
+    auto run2 = ctx2.UsePrepared(kCountSql);
+    ASSERT_EQ(SQLITE_ROW, run1.Step()) << run1.error_message();
+    ASSERT_EQ(SQLITE_ROW, run2.Step()) << run2.error_message();
+
+    // Readers can't write.
+    auto insert_run = ctx1.UseOnce("insert into t (x) values (2);");
+    EXPECT_NE(SQLITE_DONE, insert_run.Step());
+  }
+  EXPECT_EQ(1, count());
+}
+
 }  // namespace
 }  // namespace moonfire_nvr
 
@@ -32,7 +32,11 @@
 
 #include "sqlite.h"
 
+#include <stdlib.h>
+
+#include <algorithm>
 #include <mutex>
+#include <vector>
 
 #include <glog/logging.h>
 
@@ -71,13 +75,27 @@ void Statement::Clear() {
   sqlite3_finalize(me_);
 }
 
-DatabaseContext::DatabaseContext(Database *db) : db_(db), lock_(db->ctx_mu_) {}
+DatabaseContext::DatabaseContext(Database *db, DatabaseAccess access)
+    : db_(db) {
+  if (access == DatabaseAccess::kReadOnly) {
+    Database *reader = db->AcquireReader();
+    if (reader != nullptr) {
+      reader_owner_ = db;
+      db_ = reader;
+    }
+  }
+  lock_ = std::unique_lock<std::mutex>(db_->ctx_mu_);
+}
 
 DatabaseContext::~DatabaseContext() {
   if (transaction_open_) {
     LOG(WARNING) << this << ": transaction left open! closing in destructor.";
     RollbackTransaction();
   }
+  if (reader_owner_ != nullptr) {
+    lock_.unlock();
+    reader_owner_->ReleaseReader(db_);
+  }
 }
 
 bool DatabaseContext::BeginTransaction(std::string *error_message) {
@@ -137,6 +155,20 @@ RunningStatement DatabaseContext::UseOnce(re2::StringPiece sql) {
   return RunningStatement(statement, error_message, true);
 }
 
+RunningStatement DatabaseContext::UsePrepared(const std::string &sql) {
+  auto it = db_->prepared_.find(sql);
+  if (it == db_->prepared_.end()) {
+    std::string error_message;
+    Statement statement = db_->Prepare(sql, nullptr, &error_message);
+    if (!statement.valid()) {
+      return RunningStatement(nullptr, error_message, false);
+    }
+    it = db_->prepared_.insert(std::make_pair(sql, std::move(statement)))
+             .first;
+  }
+  return RunningStatement(&it->second, std::string(), false);
+}
+
 RunningStatement::RunningStatement(Statement *statement,
                                    const std::string &deferred_error,
                                    bool owns_statement)
@@ -293,6 +325,7 @@ re2::StringPiece RunningStatement::ColumnText(int col) {
 }
 
 Database::~Database() {
+  prepared_.clear();
   begin_transaction_ = Statement();
   commit_transaction_ = Statement();
   rollback_transaction_ = Statement();
@@ -301,8 +334,10 @@ Database::~Database() {
 }
 
 bool Database::Open(const char *filename, int flags,
+                    const DatabaseOptions &options,
                     std::string *error_message) {
   std::call_once(global_setup, &GlobalSetup);
+  filename_ = filename;
   int ret = sqlite3_open_v2(filename, &me_, flags, nullptr);
   if (ret != SQLITE_OK) {
     *error_message =
@@ -319,6 +354,43 @@ bool Database::Open(const char *filename, int flags,
     return false;
   }
 
+  if (options.busy_timeout_ms > 0) {
+    sqlite3_busy_timeout(me_, options.busy_timeout_ms);
+  }
+  std::vector<std::string> pragmas;
+  if (options.wal && (flags & SQLITE_OPEN_READWRITE) != 0) {
+    std::string journal_mode;
+    if (!RunPragma("pragma journal_mode = wal;", &journal_mode,
+                   error_message)) {
+      return false;
+    }
+    if (journal_mode != "wal") {
+      sqlite3_close(me_);
+      me_ = nullptr;
+      *error_message =
+          StrCat("unable to use write-ahead logging; journal mode is ",
+                 journal_mode);
+      return false;
+    }
+    pragmas.push_back("pragma synchronous = normal;");
+    if (!options.wal_autocheckpoint) {
+      pragmas.push_back("pragma wal_autocheckpoint = 0;");
+    }
+  }
+  if (options.cache_size_kib > 0) {
+    pragmas.push_back(
+        StrCat("pragma cache_size = -", options.cache_size_kib, ";"));
+  }
+  if (options.mmap_size_bytes > 0) {
+    pragmas.push_back(
+        StrCat("pragma mmap_size = ", options.mmap_size_bytes, ";"));
+  }
+  for (const auto &pragma : pragmas) {
+    if (!RunPragma(pragma, nullptr, error_message)) {
+      return false;
+    }
+  }
+
   Statement pragma_foreignkeys;
   struct StatementToInitialize {
     Statement *p;
@@ -354,6 +426,86 @@ bool Database::Open(const char *filename, int flags,
   return true;
 }
 
+bool Database::OpenReaders(int readers, const DatabaseOptions &options,
+                           std::string *error_message) {
+  CHECK(readers_.empty());
+  std::string journal_mode;
+  {
+    DatabaseContext ctx(this);
+    auto run = ctx.UseOnce("pragma journal_mode;");
+    if (run.Step() != SQLITE_ROW) {
+      *error_message = StrCat("journal mode: ", run.error_message());
+      return false;
+    }
+    journal_mode = run.ColumnText(0).as_string();
+  }
+  if (journal_mode != "wal") {
+    *error_message = StrCat("reader connections need write-ahead logging; ",
+                            filename_, " has journal mode ", journal_mode);
+    return false;
+  }
+  std::vector<std::unique_ptr<Database>> opened;
+  for (int i = 0; i < readers; ++i) {
+    std::unique_ptr<Database> reader(new Database);
+    if (!reader->Open(filename_.c_str(), SQLITE_OPEN_READONLY, options,
+                      error_message)) {
+      *error_message = StrCat("reader ", i, ": ", *error_message);
+      return false;
+    }
+    opened.push_back(std::move(reader));
+  }
+  std::lock_guard<std::mutex> lock(readers_mu_);
+  for (auto &reader : opened) {
+    idle_readers_.push_back(reader.get());
+    readers_.push_back(std::move(reader));
+  }
+  return true;
+}
+
+Database *Database::AcquireReader() {
+  std::unique_lock<std::mutex> lock(readers_mu_);
+  if (readers_.empty()) {
+    return nullptr;
+  }
+  readers_cv_.wait(lock, [this]() { return !idle_readers_.empty(); });
+  Database *reader = idle_readers_.back();
+  idle_readers_.pop_back();
+  return reader;
+}
+
+void Database::ReleaseReader(Database *reader) {
+  {
+    std::lock_guard<std::mutex> lock(readers_mu_);
+    idle_readers_.push_back(reader);
+  }
+  readers_cv_.notify_one();
+}
+
+bool Database::RunPragma(const std::string &sql, std::string *result,
+                         std::string *error_message) {
+  sqlite3_stmt *stmt;
+  int ret = sqlite3_prepare_v2(me_, sql.data(), sql.size(), &stmt, nullptr);
+  if (ret == SQLITE_OK) {
+    ret = sqlite3_step(stmt);
+    if (ret == SQLITE_ROW && result != nullptr) {
+      const unsigned char *text = sqlite3_column_text(stmt, 0);
+      *result = text == nullptr ? "" : reinterpret_cast<const char *>(text);
+    }
+    while (ret == SQLITE_ROW) {
+      ret = sqlite3_step(stmt);
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (ret != SQLITE_DONE) {
+    *error_message = StrCat("while running \"", sql, "\": ",
+                            sqlite3_errstr(ret), " (", ret, ")");
+    sqlite3_close(me_);
+    me_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
 Statement Database::Prepare(re2::StringPiece sql, size_t *used,
                             std::string *error_message) {
   Statement statement;
@@ -405,4 +557,81 @@ bool RunStatements(DatabaseContext *ctx, re2::StringPiece stmts,
   }
 }
 
+bool WalCheckpointer::Open(const char *filename,
+                           std::string *error_message) {
+  // A truncating checkpoint waits up to this long for other connections.
+  DatabaseOptions options;
+  options.busy_timeout_ms = 1000;
+  if (!db_.Open(filename, SQLITE_OPEN_READWRITE, options, error_message)) {
+    return false;
+  }
+  // Reading the journal mode also makes the connection open the log;
+  // until then, checkpoints don't report its size.
+  std::string journal_mode;
+  std::string page_size;
+  if (!db_.RunPragma("pragma journal_mode;", &journal_mode, error_message) ||
+      !db_.RunPragma("pragma page_size;", &page_size, error_message)) {
+    return false;
+  }
+  if (journal_mode != "wal") {
+    *error_message = StrCat(filename, " has journal mode ", journal_mode,
+                            " rather than wal");
+    return false;
+  }
+  page_size_ = atoll(page_size.c_str());
+  return true;
+}
+
+bool WalCheckpointer::Checkpoint(std::string *error_message) {
+  std::lock_guard<std::mutex> lock(mu_);
+  struct timespec start = clock_->Now();
+  int log_frames;
+  int checkpointed_frames;
+  int ret = sqlite3_wal_checkpoint_v2(db_.me_, "main",
+                                      SQLITE_CHECKPOINT_PASSIVE, &log_frames,
+                                      &checkpointed_frames);
+
+  // Each frame is a page plus a 24-byte header, after a 32-byte file header.
+  auto wal_bytes = [this](int frames) -> int64_t {
+    return frames > 0 ? 32 + frames * (page_size_ + 24) : 0;
+  };
+  bool truncated = false;
+  if (ret == SQLITE_OK && wal_bytes(log_frames) >= truncate_bytes_) {
+    // If a reader holds on past the busy timeout, try again next time.
+    int truncated_log_frames;
+    int truncate_ret = sqlite3_wal_checkpoint_v2(
+        db_.me_, "main", SQLITE_CHECKPOINT_TRUNCATE, &truncated_log_frames,
+        &checkpointed_frames);
+    if (truncate_ret == SQLITE_OK) {
+      truncated = true;
+      log_frames = truncated_log_frames;
+    } else if ((truncate_ret & 0xff) != SQLITE_BUSY) {
+      ret = truncate_ret;
+    }
+  }
+  double latency_sec = TimespecToSec(clock_->Now()) - TimespecToSec(start);
+
+  std::lock_guard<std::mutex> stats_lock(stats_mu_);
+  if (ret != SQLITE_OK) {
+    ++stats_.failures;
+    *error_message = StrCat("checkpoint: ", sqlite3_errstr(ret), " (", ret,
+                            ")");
+    return false;
+  }
+  ++stats_.checkpoints;
+  if (truncated) {
+    ++stats_.truncations;
+  }
+  stats_.wal_bytes = wal_bytes(log_frames);
+  stats_.max_wal_bytes = std::max(stats_.max_wal_bytes, stats_.wal_bytes);
+  stats_.last_latency_sec = latency_sec;
+  stats_.max_latency_sec = std::max(stats_.max_latency_sec, latency_sec);
+  return true;
+}
+
+WalCheckpointer::Stats WalCheckpointer::stats() const {
+  std::lock_guard<std::mutex> lock(stats_mu_);
+  return stats_;
+}
+
 }  // namespace moonfire_nvr
@@ -36,15 +36,20 @@
 #ifndef MOONFIRE_NVR_SQLITE_H
 #define MOONFIRE_NVR_SQLITE_H
 
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include <glog/logging.h>
 #include <re2/stringpiece.h>
 #include <sqlite3.h>
 
 #include "common.h"
+#include "time.h"
 
 namespace moonfire_nvr {
 
@@ -74,6 +79,31 @@ class Statement {
   bool borrowed_ = false;
 };
 
+// Options for Database::Open.
+struct DatabaseOptions {
+  // If true, use write-ahead logging with "pragma synchronous = normal", so
+  // that a commit appends to the log with a single fsync rather than syncing
+  // both a rollback journal and the database file. A power loss may lose the
+  // latest commits but can't corrupt the database. See
+  // <https://www.sqlite.org/wal.html>. Ignored when opening read-only.
+  bool wal = false;
+
+  // If false (and |wal| is set), commits on this connection never checkpoint
+  // the log; a WalCheckpointer should do so from another connection.
+  bool wal_autocheckpoint = true;
+
+  // If positive, the size of the page cache in KiB.
+  int64_t cache_size_kib = 0;
+
+  // If positive, the number of bytes of the database file to access through
+  // memory mapping rather than read().
+  int64_t mmap_size_bytes = 0;
+
+  // If positive, how long to retry an operation blocked by another
+  // connection's lock before failing with SQLITE_BUSY.
+  int busy_timeout_ms = 0;
+};
+
 class Database {
  public:
   Database() {}
@@ -89,7 +119,11 @@ class Database {
   //
   // extended result codes will always be enabled via
   // sqlite3_extended_result_codes.
-  bool Open(const char *filename, int flags, std::string *error_message);
+  bool Open(const char *filename, int flags, std::string *error_message) {
+    return Open(filename, flags, DatabaseOptions(), error_message);
+  }
+  bool Open(const char *filename, int flags, const DatabaseOptions &options,
+            std::string *error_message);
 
   // Prepare a statement. Thread-safe.
   //
@@ -101,17 +135,50 @@ class Database {
   Statement Prepare(re2::StringPiece sql, size_t *used,
                     std::string *error_message);
 
+  // Open |readers| read-only connections to the same file, for read-only
+  // DatabaseContexts. Their reads then neither wait for nor block the main
+  // connection's, as write-ahead logging lets a reader continue from a
+  // snapshot while a writer commits. Fails unless the database uses
+  // write-ahead logging. Call at most once, after Open and before any
+  // read-only DatabaseContext is created.
+  bool OpenReaders(int readers, const DatabaseOptions &options,
+                   std::string *error_message);
+
  private:
   friend class DatabaseContext;
   friend class RunningStatement;
+  friend class WalCheckpointer;
+
+  // Run a pragma before any statements are prepared, setting |result| (if
+  // non-null) to the first column of the first row it returns.
+  bool RunPragma(const std::string &sql, std::string *result,
+                 std::string *error_message);
+
+  // Take an idle reader connection, waiting for one if need be, or return
+  // nullptr if there are none.
+  Database *AcquireReader();
+  void ReleaseReader(Database *reader);
+
   sqlite3 *me_ = nullptr;
+  std::string filename_;
   Statement begin_transaction_;
   Statement commit_transaction_;
   Statement rollback_transaction_;
 
+  // Statements prepared by DatabaseContext::UsePrepared, by SQL.
+  std::map<std::string, Statement> prepared_;
+
   std::mutex ctx_mu_;  // used by DatabaseContext.
+
+  std::vector<std::unique_ptr<Database>> readers_;
+  std::mutex readers_mu_;
+  std::condition_variable readers_cv_;
+  std::vector<Database *> idle_readers_;  // protected by readers_mu_.
 };
 
+// Whether a DatabaseContext may write.
+enum class DatabaseAccess { kReadWrite, kReadOnly };
+
 // A running statement; get via DatabaseContext::Borrow or
 // DatabaseContext::UseOnce. Example uses:
 //
@@ -209,14 +276,20 @@ class RunningStatement {
 
 // A scoped database lock and transaction manager.
 //
-// Moonfire NVR does all SQLite operations under a lock, to avoid SQLITE_BUSY
+// Moonfire NVR does all SQLite writes under a lock, to avoid SQLITE_BUSY
 // and so that calls such as sqlite3_last_insert_rowid return useful values.
 // This class implicitly acquires the lock on entry / releases it on exit.
 // In the future, it may have instrumentation to track slow operations.
+//
+// A read-only context instead takes one of the reader connections opened by
+// Database::OpenReaders, if there are any, so that long reads don't hold up
+// writes. Statements borrowed from the main connection can't be used there;
+// use UsePrepared instead.
 class DatabaseContext {
  public:
   // Acquire a lock on |db|, which must already be opened.
-  explicit DatabaseContext(Database *db);
+  explicit DatabaseContext(Database *db,
+                           DatabaseAccess access = DatabaseAccess::kReadWrite);
   DatabaseContext(const DatabaseContext &) = delete;
   void operator=(const DatabaseContext &) = delete;
 
@@ -246,6 +319,12 @@ class DatabaseContext {
   // Note that parse errors are "deferred" until RunningStatement::Step().
   RunningStatement UseOnce(re2::StringPiece sql);
 
+  // Borrow a statement of the given |sql|, preparing it on this context's
+  // connection the first time. Each connection keeps its statements until
+  // it's closed, so |sql| should be one of a fixed set. Parse errors are
+  // deferred as with UseOnce.
+  RunningStatement UsePrepared(const std::string &sql);
+
   // Return the number of changes for the last DML statement (insert, update, or
   // delete), as with sqlite3_changes.
   int64_t changes() { return sqlite3_changes(db_->me_); }
@@ -254,14 +333,72 @@ class DatabaseContext {
   // ROWID", as with sqlite3_last_insert_rowid.
   int64_t last_insert_rowid() { return sqlite3_last_insert_rowid(db_->me_); }
 
+  // Return the connection's count of |op| (such as SQLITE_DBSTATUS_CACHE_HIT,
+  // SQLITE_DBSTATUS_CACHE_MISS, or SQLITE_DBSTATUS_CACHE_WRITE), resetting it
+  // to zero if |reset|, as with sqlite3_db_status.
+  int64_t db_status(int op, bool reset) {
+    int current = 0, highwater = 0;
+    sqlite3_db_status(db_->me_, op, &current, &highwater, reset);
+    return current;
+  }
+
   Database *db() { return db_; }
 
  private:
-  Database *db_;
-  std::lock_guard<std::mutex> lock_;
+  Database *db_;  // the connection in use.
+  Database *reader_owner_ = nullptr;  // if |db_| is a reader, its pool.
+  std::unique_lock<std::mutex> lock_;
   bool transaction_open_ = false;
 };
 
+// Checkpoints a write-ahead-logged database from a dedicated connection, so
+// that commits on the main connection (opened with |wal_autocheckpoint|
+// false) never wait to copy pages back into the database file. Each
+// Checkpoint() is passive, which never blocks other connections, unless the
+// log has grown to |truncate_bytes|; then it waits for readers to finish
+// with the log so it can be emptied and truncated. Call Checkpoint()
+// periodically from a background thread. Thread-safe.
+class WalCheckpointer {
+ public:
+  struct Stats {
+    int64_t checkpoints = 0;
+    int64_t truncations = 0;
+    int64_t failures = 0;
+
+    // The size of the log after the latest checkpoint: frames not yet
+    // reused by the next writer, whether or not they've been copied back.
+    int64_t wal_bytes = 0;
+    int64_t max_wal_bytes = 0;
+
+    double last_latency_sec = 0;
+    double max_latency_sec = 0;
+  };
+
+  // |clock| must outlive the WalCheckpointer.
+  WalCheckpointer(WallClock *clock, int64_t truncate_bytes)
+      : clock_(clock), truncate_bytes_(truncate_bytes) {}
+  WalCheckpointer(const WalCheckpointer &) = delete;
+  void operator=(const WalCheckpointer &) = delete;
+
+  // Open the dedicated connection to |filename|, which should already use
+  // write-ahead logging. Call once, before any other method.
+  bool Open(const char *filename, std::string *error_message);
+
+  bool Checkpoint(std::string *error_message);
+
+  Stats stats() const;
+
+ private:
+  WallClock *const clock_;
+  const int64_t truncate_bytes_;
+  Database db_;
+  int64_t page_size_ = 0;
+
+  std::mutex mu_;  // serializes Checkpoint calls.
+  mutable std::mutex stats_mu_;
+  Stats stats_;  // protected by stats_mu_.
+};
+
 // Convenience routines below.
 
 // Run through all the statements in |stmts|.
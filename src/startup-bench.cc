@@ -0,0 +1,176 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// startup-bench.cc: a benchmark of MoonfireDatabase::Init on a large database.
+//
+// Fills a database in a temporary directory with --recordings synthetic
+// recording rows spread over --cameras cameras, then times Init twice: once
+// reading each camera's aggregates from the camera_stats table, and once after
+// deleting those rows so that Init must compute them from the recording table
+// (as every startup did before camera_stats). It also times one camera's first
+// listing, which indexes that camera's recordings. Run from the build
+// directory so ../src/schema.sql is found.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <string>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "moonfire-db.h"
+#include "recording.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+#include "uuid.h"
+
+DEFINE_int32(recordings, 5000000, "");
+DEFINE_int32(cameras, 4, "");
+
+namespace moonfire_nvr {
+namespace {
+
+double NowSec() {
+  struct timespec now;
+  CHECK_EQ(0, clock_gettime(CLOCK_MONOTONIC, &now));
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void Exec(Database *db, re2::StringPiece sql) {
+  DatabaseContext ctx(db);
+  std::string error_message;
+  CHECK(RunStatements(&ctx, sql, &error_message)) << error_message;
+}
+
+double TimeInit(Database *db) {
+  MoonfireDatabase mdb;
+  std::string error_message;
+  double start = NowSec();
+  CHECK(mdb.Init(db, &error_message)) << error_message;
+  return NowSec() - start;
+}
+
+double TimeFirstListing(Database *db) {
+  MoonfireDatabase mdb;
+  std::string error_message;
+  CHECK(mdb.Init(db, &error_message)) << error_message;
+  Uuid camera_uuid;
+  mdb.ListCameras([&](const ListCamerasRow &row) {
+    camera_uuid = row.uuid;
+    return IterationControl::kBreak;
+  });
+  double start = NowSec();
+  CHECK(mdb.ListOldestSampleFiles(
+      camera_uuid,
+      [](const ListOldestSampleFilesRow &row) {
+        return IterationControl::kBreak;
+      },
+      &error_message))
+      << error_message;
+  return NowSec() - start;
+}
+
+int RunBenchmark() {
+  std::string tmpdir = PrepareTempDirOrDie("startup-bench");
+  std::string path = StrCat(tmpdir, "/db");
+  std::string error_message;
+  Database db;
+  DatabaseOptions options;
+  options.wal = true;
+  CHECK(db.Open(path.c_str(), SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                options, &error_message))
+      << error_message;
+  Exec(&db, ReadFileOrDie("../src/schema.sql"));
+  for (int i = 0; i < FLAGS_cameras; ++i) {
+    DatabaseContext ctx(&db);
+    auto run = ctx.UseOnce(
+        R"(
+        insert into camera (uuid,  short_name,  host,  username,  password,
+                            main_rtsp_path,  sub_rtsp_path,  retain_bytes)
+                    values (:uuid, 'bench', 'bench-camera', 'foo', 'bar',
+                            '/main', '/sub', 0);
+        )");
+    run.BindBlob(":uuid", GetRealUuidGenerator()->Generate().binary_view());
+    CHECK_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+  }
+
+  // One-minute recordings, each camera's back to back.
+  double start = NowSec();
+  Exec(&db, StrCat(R"(
+      insert into video_sample_entry (sha1, width, height, data)
+                              values (zeroblob(20), 1920, 1080, zeroblob(100));
+      with recursive n(i) as (
+        select 0 union all select i + 1 from n where i < )",
+                   FLAGS_recordings - 1, R"(
+      )
+      insert into recording (camera_id, sample_file_bytes, start_time_90k,
+                             duration_90k, local_time_delta_90k, video_samples,
+                             video_sync_samples, video_sample_entry_id,
+                             sample_file_uuid, sample_file_sha1)
+      select
+        (select min(id) from camera) + i % )",
+                   FLAGS_cameras, R"(,
+        1000000,
+        128700576000000 + i / )",
+                   FLAGS_cameras, R"( * 5400000,
+        5400000,
+        0,
+        1800,
+        60,
+        (select id from video_sample_entry),
+        randomblob(16),
+        zeroblob(20)
+      from n;
+      )"));
+  printf("Inserted %d recordings over %d cameras in %.1f sec.\n",
+         FLAGS_recordings, FLAGS_cameras, NowSec() - start);
+
+  TimeInit(&db);  // fills camera_stats and warms the page cache.
+  printf("Init with camera_stats:    %8.3f sec\n", TimeInit(&db));
+  printf("First listing of a camera: %8.3f sec\n", TimeFirstListing(&db));
+  Exec(&db, "delete from camera_stats;");
+  printf("Init without camera_stats: %8.3f sec\n", TimeInit(&db));
+  return 0;
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_recordings < 1 || FLAGS_cameras < 1) {
+    LOG(ERROR) << "--recordings and --cameras must be positive; exiting.";
+    return 1;
+  }
+  return moonfire_nvr::RunBenchmark();
+}
@@ -0,0 +1,426 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// stream-bench.cc: a benchmark of recording under slow or failing disks.
+//
+// Runs Streams against simulated cameras in real time, with sample files in
+// an in-memory filesystem whose operations see the latency and errors given
+// by flags. Each camera replays testdata/clip.mp4 at --fps, buffering up to
+// --socket_buffer_bytes while its Stream isn't reading. Frames beyond that
+// are dropped, and if the Stream doesn't read for --camera_timeout_sec, the
+// camera disconnects, forcing a reconnect. For example, to see how many of
+// 32 cameras keep up when a tenth of fsyncs stall for 500 ms, run this from
+// the build directory (as with the tests) with the flags
+// --cameras=32 --sync_tail_latency_ms=500 --sync_tail_probability=0.1.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "crypto.h"
+#include "ffmpeg.h"
+#include "filesystem.h"
+#include "moonfire-db.h"
+#include "moonfire-nvr.h"
+#include "sample-file-dir.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+#include "time.h"
+
+DEFINE_int32(cameras, 8, "");
+DEFINE_int32(duration_sec, 60, "");
+DEFINE_int32(fps, 10, "");
+DEFINE_int32(rotate_interval_sec, 10, "");
+DEFINE_int64(retain_bytes, 16 << 20, "");
+DEFINE_int64(socket_buffer_bytes, 1 << 20, "");
+DEFINE_int32(camera_timeout_sec, 10, "");
+DEFINE_int64(sample_file_sync_interval_sec, 0, "");
+DEFINE_string(clip, "../src/testdata/clip.mp4", "");
+DEFINE_string(schema, "../src/schema.sql", "");
+
+DEFINE_double(open_latency_ms, 0, "");
+DEFINE_double(open_tail_latency_ms, 0, "");
+DEFINE_double(open_tail_probability, 0, "");
+DEFINE_double(open_error_probability, 0, "");
+DEFINE_double(write_latency_ms, 0, "");
+DEFINE_double(write_tail_latency_ms, 0, "");
+DEFINE_double(write_tail_probability, 0, "");
+DEFINE_double(write_error_probability, 0, "");
+DEFINE_double(sync_latency_ms, 0, "");
+DEFINE_double(sync_tail_latency_ms, 0, "");
+DEFINE_double(sync_tail_probability, 0, "");
+DEFINE_double(sync_error_probability, 0, "");
+DEFINE_double(unlink_latency_ms, 0, "");
+DEFINE_double(unlink_tail_latency_ms, 0, "");
+DEFINE_double(unlink_tail_probability, 0, "");
+DEFINE_double(unlink_error_probability, 0, "");
+
+namespace moonfire_nvr {
+namespace {
+
+// The packets of --clip, read into memory once and shared by all cameras.
+struct Clip {
+  struct Frame {
+    std::string data;
+    bool is_key = false;
+  };
+
+  std::unique_ptr<InputVideoPacketStream> in;  // kept open for stream().
+  std::vector<Frame> frames;
+};
+
+void ReadClipOrDie(const std::string &path, Clip *clip) {
+  std::string error_message;
+  clip->in = GetRealVideoSource()->OpenFile(path, &error_message);
+  CHECK(clip->in != nullptr) << path << ": " << error_message;
+  VideoPacket pkt;
+  while (clip->in->GetNext(&pkt, &error_message)) {
+    Clip::Frame frame;
+    frame.data = pkt.data().as_string();
+    frame.is_key = pkt.is_key();
+    clip->frames.push_back(std::move(frame));
+  }
+  CHECK(error_message.empty()) << path << ": " << error_message;
+  CHECK(!clip->frames.empty() && clip->frames[0].is_key)
+      << path << ": expected to start with a key frame";
+}
+
+struct CameraStats {
+  int64_t frames_sent = 0;
+  int64_t frames_dropped = 0;
+  int64_t reconnects = 0;
+  int64_t max_queue_frames = 0;
+  int64_t queue_samples = 0;
+  double queue_frames_sum = 0;
+};
+
+// A camera which produces a frame every 1/--fps seconds whether or not the
+// Stream is keeping up. Thread-compatible; used only by its Stream's thread.
+class SimulatedCamera : public VideoSource {
+ public:
+  SimulatedCamera(const Clip *clip, WallClock *clock)
+      : clip_(clip), clock_(clock), start_(clock->Now()) {}
+  SimulatedCamera(const SimulatedCamera &) = delete;
+  void operator=(const SimulatedCamera &) = delete;
+
+  std::unique_ptr<InputVideoPacketStream> OpenRtsp(
+      const std::string &url, std::string *error_message) final;
+
+  std::unique_ptr<InputVideoPacketStream> OpenFile(
+      const std::string &filename, std::string *error_message) final {
+    *error_message = "not supported";
+    return nullptr;
+  }
+
+  const CameraStats &stats() const { return stats_; }
+
+ private:
+  friend class SimulatedConnection;
+
+  // The index of the next frame to be produced at |now|.
+  int64_t FramesDue(struct timespec now) const {
+    return static_cast<int64_t>(
+               (TimespecToSec(now) - TimespecToSec(start_)) * FLAGS_fps) +
+           1;
+  }
+
+  bool GetNext(VideoPacket *pkt, std::string *error_message);
+
+  const Clip *const clip_;
+  WallClock *const clock_;
+  const struct timespec start_;
+  int64_t next_frame_ = 0;
+  bool opened_ = false;
+  bool connected_ = false;
+  struct timespec last_read_ = {0, 0};
+  CameraStats stats_;
+};
+
+class SimulatedConnection : public InputVideoPacketStream {
+ public:
+  explicit SimulatedConnection(SimulatedCamera *camera) : camera_(camera) {}
+  ~SimulatedConnection() final { camera_->connected_ = false; }
+
+  bool GetNext(VideoPacket *pkt, std::string *error_message) final {
+    return camera_->GetNext(pkt, error_message);
+  }
+
+  const AVStream *stream() const final { return camera_->clip_->in->stream(); }
+
+ private:
+  SimulatedCamera *const camera_;
+};
+
+std::unique_ptr<InputVideoPacketStream> SimulatedCamera::OpenRtsp(
+    const std::string &url, std::string *error_message) {
+  CHECK(!connected_);
+  struct timespec now = clock_->Now();
+
+  // Start with the most recent frame. Those produced while disconnected are
+  // lost.
+  int64_t due = FramesDue(now);
+  if (opened_) {
+    ++stats_.reconnects;
+    if (next_frame_ < due - 1) {
+      stats_.frames_dropped += due - 1 - next_frame_;
+    }
+  }
+  next_frame_ = std::max(next_frame_, due - 1);
+  opened_ = true;
+  connected_ = true;
+  last_read_ = now;
+  return std::unique_ptr<InputVideoPacketStream>(new SimulatedConnection(this));
+}
+
+bool SimulatedCamera::GetNext(VideoPacket *pkt, std::string *error_message) {
+  struct timespec now = clock_->Now();
+  if (TimespecToSec(now) - TimespecToSec(last_read_) >
+      FLAGS_camera_timeout_sec) {
+    *error_message = "camera timed out waiting for the stream to read";
+    return false;
+  }
+
+  // Account for the frames queued since the last read, dropping the oldest
+  // of those which don't fit in the socket buffer.
+  const auto &frames = clip_->frames;
+  int64_t due = FramesDue(now);
+  int64_t queued_bytes = 0;
+  for (int64_t i = due - 1; i >= next_frame_; --i) {
+    queued_bytes += frames[i % frames.size()].data.size();
+    if (queued_bytes > FLAGS_socket_buffer_bytes) {
+      stats_.frames_dropped += i + 1 - next_frame_;
+      next_frame_ = i + 1;
+      break;
+    }
+  }
+  int64_t queued = std::max<int64_t>(0, due - next_frame_);
+  stats_.max_queue_frames = std::max(stats_.max_queue_frames, queued);
+  stats_.queue_frames_sum += queued;
+  ++stats_.queue_samples;
+
+  if (queued == 0) {
+    double due_sec = TimespecToSec(start_) +
+                     static_cast<double>(next_frame_) / FLAGS_fps;
+    double wait_sec = due_sec - TimespecToSec(now);
+    if (wait_sec > 0) {
+      clock_->Sleep(SecToTimespec(wait_sec));
+    }
+  }
+
+  const Clip::Frame &frame = frames[next_frame_ % frames.size()];
+  av_packet_unref(pkt->pkt());
+  pkt->pkt()->data =
+      reinterpret_cast<uint8_t *>(const_cast<char *>(frame.data.data()));
+  pkt->pkt()->size = frame.data.size();
+  pkt->pkt()->pts = pkt->pkt()->dts =
+      next_frame_ * kTimeUnitsPerSecond / FLAGS_fps;
+  pkt->pkt()->flags = frame.is_key ? AV_PKT_FLAG_KEY : 0;
+  ++next_frame_;
+  ++stats_.frames_sent;
+  last_read_ = clock_->Now();
+  return true;
+}
+
+FaultSpec GetFaultSpec(double latency_ms, double tail_latency_ms,
+                       double tail_probability, double error_probability) {
+  FaultSpec spec;
+  spec.latency = SecToTimespec(latency_ms / 1000);
+  spec.tail_latency = SecToTimespec(tail_latency_ms / 1000);
+  spec.tail_probability = tail_probability;
+  spec.error_probability = error_probability;
+  return spec;
+}
+
+int RunBenchmark() {
+  WallClock *clock = GetRealClock();
+  Clip clip;
+  ReadClipOrDie(FLAGS_clip, &clip);
+
+  FaultInjector injector(clock);
+  injector.set_spec(
+      FaultInjector::Op::kOpen,
+      GetFaultSpec(FLAGS_open_latency_ms, FLAGS_open_tail_latency_ms,
+                   FLAGS_open_tail_probability, FLAGS_open_error_probability));
+  injector.set_spec(
+      FaultInjector::Op::kWrite,
+      GetFaultSpec(FLAGS_write_latency_ms, FLAGS_write_tail_latency_ms,
+                   FLAGS_write_tail_probability,
+                   FLAGS_write_error_probability));
+  injector.set_spec(
+      FaultInjector::Op::kSync,
+      GetFaultSpec(FLAGS_sync_latency_ms, FLAGS_sync_tail_latency_ms,
+                   FLAGS_sync_tail_probability, FLAGS_sync_error_probability));
+  injector.set_spec(
+      FaultInjector::Op::kUnlink,
+      GetFaultSpec(FLAGS_unlink_latency_ms, FLAGS_unlink_tail_latency_ms,
+                   FLAGS_unlink_tail_probability,
+                   FLAGS_unlink_error_probability));
+
+  // Faults are injected only into sample file operations; the database is
+  // kept in memory.
+  auto memory_fs = NewMemoryFilesystem();
+  auto fs = NewFaultInjectingFilesystem(memory_fs.get(), &injector);
+  std::unique_ptr<File> dir;
+  int ret = fs->Open("/", O_DIRECTORY | O_RDONLY, &dir);
+  CHECK_EQ(0, ret) << strerror(ret);
+  ShardedSampleFileDir sample_file_dir(std::move(dir), 1);
+  std::string error_message;
+  CHECK(sample_file_dir.Init(&error_message)) << error_message;
+
+  Database db;
+  CHECK(db.Open(":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                &error_message))
+      << error_message;
+  {
+    DatabaseContext ctx(&db);
+    CHECK(RunStatements(&ctx, ReadFileOrDie(FLAGS_schema), &error_message))
+        << error_message;
+    for (int i = 0; i < FLAGS_cameras; ++i) {
+      auto run = ctx.UseOnce(
+          R"(
+          insert into camera (uuid,  short_name,  host,  username,  password,
+                              main_rtsp_path,  sub_rtsp_path,  retain_bytes)
+                      values (:uuid, :short_name, :host, :username, :password,
+                              :main_rtsp_path, :sub_rtsp_path, :retain_bytes);
+          )");
+      run.BindBlob(":uuid", GetRealUuidGenerator()->Generate().binary_view());
+      run.BindText(":short_name", StrCat("cam", i));
+      run.BindText(":host", StrCat("cam", i));
+      run.BindText(":username", "");
+      run.BindText(":password", "");
+      run.BindText(":main_rtsp_path", "/main");
+      run.BindText(":sub_rtsp_path", "/sub");
+      run.BindInt64(":retain_bytes", FLAGS_retain_bytes);
+      CHECK_EQ(SQLITE_DONE, run.Step()) << run.error_message();
+    }
+  }
+  MoonfireDatabase mdb;
+  CHECK(mdb.Init(&db, &error_message)) << error_message;
+  std::vector<ListCamerasRow> rows;
+  mdb.ListCameras([&](const ListCamerasRow &row) {
+    rows.push_back(row);
+    return IterationControl::kContinue;
+  });
+
+  DigestWorker digest_worker;
+  Environment base_env;
+  base_env.clock = clock;
+  base_env.sample_file_dir = &sample_file_dir;
+  base_env.mdb = &mdb;
+  base_env.sample_file_hash_algorithm = HashAlgorithm::kXxh3_128;
+  base_env.digest_worker = &digest_worker;
+  base_env.sync_interval_sec = FLAGS_sample_file_sync_interval_sec;
+
+  // As in Nvr::Init, but each stream has its own camera.
+  ShutdownSignal signal;
+  std::vector<std::unique_ptr<SimulatedCamera>> cameras;
+  std::vector<std::unique_ptr<Environment>> envs;
+  std::vector<std::unique_ptr<Stream>> streams;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    cameras.emplace_back(new SimulatedCamera(&clip, clock));
+    envs.emplace_back(new Environment(base_env));
+    envs.back()->video_source = cameras.back().get();
+    int rotate_offset_sec = FLAGS_rotate_interval_sec * i / rows.size();
+    auto *stream = new Stream(&signal, envs.back().get(), rows[i],
+                              rotate_offset_sec, FLAGS_rotate_interval_sec);
+    streams.emplace_back(stream);
+    threads.emplace_back([stream]() { stream->Run(); });
+  }
+  clock->Sleep({FLAGS_duration_sec, 0});
+  signal.Shutdown();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  int keeping_up = 0;
+  CameraStats total;
+  printf("%-8s %10s %10s %10s %10s %10s\n", "camera", "sent", "dropped",
+         "reconnects", "max queue", "mean queue");
+  for (size_t i = 0; i < cameras.size(); ++i) {
+    const CameraStats &stats = cameras[i]->stats();
+    double mean_queue = stats.queue_samples == 0
+                            ? 0
+                            : stats.queue_frames_sum / stats.queue_samples;
+    printf("%-8s %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64
+           " %10.2f\n",
+           rows[i].short_name.c_str(), stats.frames_sent, stats.frames_dropped,
+           stats.reconnects, stats.max_queue_frames, mean_queue);
+    if (stats.frames_dropped == 0 && stats.reconnects == 0) {
+      ++keeping_up;
+    }
+    total.frames_sent += stats.frames_sent;
+    total.frames_dropped += stats.frames_dropped;
+    total.reconnects += stats.reconnects;
+    total.max_queue_frames =
+        std::max(total.max_queue_frames, stats.max_queue_frames);
+  }
+  printf("%-8s %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+         "total", total.frames_sent, total.frames_dropped, total.reconnects,
+         total.max_queue_frames);
+  printf("%d of %zu cameras kept up without drops or reconnects.\n",
+         keeping_up, cameras.size());
+  for (const auto &op : {std::make_pair("open", FaultInjector::Op::kOpen),
+                         std::make_pair("write", FaultInjector::Op::kWrite),
+                         std::make_pair("sync", FaultInjector::Op::kSync),
+                         std::make_pair("unlink", FaultInjector::Op::kUnlink)}) {
+    printf("%s: %" PRId64 " tail latencies, %" PRId64 " errors injected.\n",
+           op.first, injector.tail_count(op.second),
+           injector.error_count(op.second));
+  }
+  return 0;
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  if (FLAGS_cameras < 1 || FLAGS_fps < 1 || FLAGS_duration_sec < 1 ||
+      FLAGS_rotate_interval_sec < 1) {
+    LOG(ERROR) << "--cameras, --fps, --duration_sec, and "
+               << "--rotate_interval_sec must be positive; exiting.";
+    return 1;
+  }
+  return moonfire_nvr::RunBenchmark();
+}
@@ -0,0 +1,116 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// unlinker-test.cc: tests of the unlinker.h interface.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "string.h"
+#include "testutil.h"
+#include "unlinker.h"
+
+DECLARE_bool(alsologtostderr);
+
+using testing::_;
+using testing::Return;
+
+namespace moonfire_nvr {
+namespace {
+
+TEST(UnlinkerTest, Parallel) {
+  std::string tmpdir_path = PrepareTempDirOrDie("unlinker-test");
+  std::unique_ptr<File> dir;
+  int ret = GetRealFilesystem()->Open(tmpdir_path.c_str(),
+                                      O_DIRECTORY | O_RDONLY, &dir);
+  ASSERT_EQ(0, ret) << strerror(ret);
+
+  // Create the even-numbered files only; the odd-numbered ones are missing.
+  std::vector<std::string> paths;
+  for (int i = 0; i < 200; ++i) {
+    paths.push_back(StrCat("file", i));
+    if (i % 2 == 0) {
+      WriteFileOrDie(StrCat(tmpdir_path, "/", paths.back()), "x");
+    }
+  }
+
+  SimulatedClock clock;
+  Unlinker unlinker(&clock, 4, 0);
+  std::vector<int> results;
+  unlinker.UnlinkAll(dir.get(), paths, &results);
+  ASSERT_EQ(paths.size(), results.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    EXPECT_EQ(i % 2 == 0 ? 0 : ENOENT, results[i]) << paths[i];
+    struct stat buf;
+    EXPECT_EQ(ENOENT,
+              GetRealFilesystem()->Stat(
+                  StrCat(tmpdir_path, "/", paths[i]).c_str(), &buf));
+  }
+}
+
+TEST(UnlinkerTest, RateLimit) {
+  testing::NiceMock<MockFile> dir;
+  ON_CALL(dir, Unlink(_)).WillByDefault(Return(0));
+  EXPECT_CALL(dir, Unlink(_)).Times(11);
+
+  SimulatedClock clock;
+  clock.Sleep({1000, 0});
+  Unlinker unlinker(&clock, 1, 5);
+  std::vector<std::string> paths(10, "file");
+  std::vector<int> results;
+  unlinker.UnlinkAll(&dir, paths, &results);
+  EXPECT_EQ(std::vector<int>(10, 0), results);
+
+  // The first unlink happens immediately; each of the rest waits 1/5 sec.
+  EXPECT_NEAR(1001.8, TimespecToSec(clock.Now()), 1e-6);
+
+  // A later call doesn't wait, as its turn has already passed.
+  clock.Sleep({10, 0});
+  unlinker.UnlinkAll(&dir, {"file"}, &results);
+  EXPECT_NEAR(1011.8, TimespecToSec(clock.Now()), 1e-6);
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,116 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// unlinker.cc: see unlinker.h.
+
+#include "unlinker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include <glog/logging.h>
+
+#include "io-priority.h"
+#include "string.h"
+
+namespace moonfire_nvr {
+
+namespace {
+
+// Bursts of at least this many files are logged with their rate.
+const size_t kLogMinFiles = 100;
+
+}  // namespace
+
+Unlinker::Unlinker(WallClock *clock, int concurrency, double max_per_sec)
+    : clock_(clock),
+      concurrency_(concurrency),
+      min_interval_sec_(max_per_sec > 0 ? 1. / max_per_sec : 0.) {
+  CHECK_GE(concurrency, 1);
+}
+
+void Unlinker::WaitForTurn() {
+  if (min_interval_sec_ == 0) {
+    return;
+  }
+  double now = TimespecToSec(clock_->Now());
+  double turn;
+  {
+    std::lock_guard<std::mutex> lock(mu_);
+    turn = std::max(now, next_sec_);
+    next_sec_ = turn + min_interval_sec_;
+  }
+  if (turn > now) {
+    clock_->Sleep(SecToTimespec(turn - now));
+  }
+}
+
+void Unlinker::UnlinkAll(File *dir, const std::vector<std::string> &paths,
+                         std::vector<int> *results) {
+  results->assign(paths.size(), 0);
+  if (paths.empty()) {
+    return;
+  }
+  double start = TimespecToSec(clock_->Now());
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    ScopedIoClass io_class(IoClass::kRetention);
+    size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < paths.size()) {
+      WaitForTurn();
+      (*results)[i] = dir->Unlink(paths[i].c_str());
+    }
+  };
+
+  // The calling thread is one of the workers, so a single file (the common
+  // case) doesn't spawn any threads.
+  size_t n_threads = std::min(static_cast<size_t>(concurrency_), paths.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  double elapsed = TimespecToSec(clock_->Now()) - start;
+  int failed = std::count_if(results->begin(), results->end(),
+                             [](int ret) { return ret != 0; });
+  if (paths.size() >= kLogMinFiles || VLOG_IS_ON(1)) {
+    LOG(INFO) << "Unlinked " << paths.size() - failed << " of "
+              << paths.size() << " files in " << elapsed << " sec ("
+              << (elapsed > 0 ? paths.size() / elapsed : 0.)
+              << " files/sec) with " << n_threads << " threads.";
+  }
+}
+
+}  // namespace moonfire_nvr
@@ -0,0 +1,82 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+// unlinker.h: bulk deletion of files.
+
+#ifndef MOONFIRE_NVR_UNLINKER_H
+#define MOONFIRE_NVR_UNLINKER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "filesystem.h"
+#include "time.h"
+
+namespace moonfire_nvr {
+
+// Unlinks files in bulk. A burst of retention (say, after retain_bytes is
+// lowered) may unlink thousands of sample files, and on a large directory
+// each unlink() can take milliseconds, mostly spent waiting on the disk. This
+// keeps several unlink() calls in flight at once. It can also limit their
+// rate so that a burst doesn't starve recording writes to the same disk.
+//
+// Unlinks are done in the retention I/O class; see io-priority.h.
+//
+// Thread-safe. The rate limit applies across all concurrent UnlinkAll calls.
+class Unlinker {
+ public:
+  // |concurrency| is the maximum number of unlink() calls in flight per
+  // UnlinkAll call; it must be at least 1. If |max_per_sec| is positive, it
+  // limits the rate of unlink() calls.
+  Unlinker(WallClock *clock, int concurrency, double max_per_sec);
+  Unlinker(const Unlinker &) = delete;
+  void operator=(const Unlinker &) = delete;
+
+  // Unlink each of |paths| within |dir|, blocking until done. Fills
+  // |results| with 0 on success or errno>0 on failure for each path.
+  void UnlinkAll(File *dir, const std::vector<std::string> &paths,
+                 std::vector<int> *results);
+
+ private:
+  // Block until the rate limit allows another unlink().
+  void WaitForTurn();
+
+  WallClock *const clock_;
+  const int concurrency_;
+  const double min_interval_sec_;  // 0 if unlimited.
+
+  std::mutex mu_;
+  double next_sec_ = 0;  // earliest time for the next unlink(); protected by mu_.
+};
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_UNLINKER_H
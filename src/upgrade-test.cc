@@ -0,0 +1,261 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// upgrade-test.cc: tests of the upgrade.h interface.
+
+#include <string>
+
+#include <gflags/gflags.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "moonfire-db.h"
+#include "sqlite.h"
+#include "string.h"
+#include "testutil.h"
+#include "upgrade.h"
+
+DECLARE_bool(alsologtostderr);
+
+using testing::HasSubstr;
+
+namespace moonfire_nvr {
+namespace {
+
+class UpgradeTest : public testing::Test {
+ protected:
+  UpgradeTest() { tmpdir_ = PrepareTempDirOrDie("upgrade-test"); }
+
+  // Opens |db| as a new database named |name|, created from |schema_path|.
+  void Create(const char *name, const std::string &schema_path,
+              Database *db) {
+    std::string error_message;
+    CHECK(db->Open(StrCat(tmpdir_, "/", name).c_str(),
+                   SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &error_message))
+        << error_message;
+    DatabaseContext ctx(db);
+    CHECK(RunStatements(&ctx, ReadFileOrDie(schema_path), &error_message))
+        << error_message;
+  }
+
+  // Runs |sql| against |db|, which must succeed.
+  void Exec(Database *db, re2::StringPiece sql) {
+    DatabaseContext ctx(db);
+    std::string error_message;
+    CHECK(RunStatements(&ctx, sql, &error_message)) << error_message;
+  }
+
+  // Adds a camera with one recording to a version 0 database.
+  void AddRecording(Database *db) {
+    Exec(db, R"(
+        insert into camera (id, uuid, short_name, retain_bytes)
+                    values (1, x'00112233445566778899aabbccddeeff', 'cam', 42);
+        insert into video_sample_entry (id, sha1, width, height, data)
+                    values (1, zeroblob(20), 1920, 1080, zeroblob(100));
+        insert into recording (id, camera_id, sample_file_bytes,
+                               start_time_90k, duration_90k,
+                               local_time_delta_90k, video_samples,
+                               video_sync_samples, video_sample_entry_id,
+                               sample_file_uuid, sample_file_sha1, video_index)
+                    values (1, 1, 30000, 90000, 5400000, 0, 1800, 60, 1,
+                            x'ffeeddccbbaa99887766554433221100', zeroblob(20),
+                            x'0102030405');
+        )");
+  }
+
+  // Describes the tables' columns and the indexes of |db|, for comparing
+  // upgraded databases to new ones.
+  std::string DescribeSchema(Database *db) {
+    DatabaseContext ctx(db);
+    std::string out;
+    auto run = ctx.UseOnce(
+        R"(
+        select type, name from sqlite_master
+        where name not like 'sqlite_autoindex_%'
+        order by type, name;
+        )");
+    while (run.Step() == SQLITE_ROW) {
+      std::string name = run.ColumnText(1).as_string();
+      out += StrCat(run.ColumnText(0), " ", name, "\n");
+      if (run.ColumnText(0) != "table") {
+        continue;
+      }
+      auto columns_run = ctx.UseOnce(StrCat("pragma table_info(", name, ");"));
+      while (columns_run.Step() == SQLITE_ROW) {
+        out += StrCat("  ", columns_run.ColumnText(1), " ",
+                      columns_run.ColumnText(2), " notnull=",
+                      columns_run.ColumnInt64(3), " default=",
+                      columns_run.ColumnText(4), " pk=",
+                      columns_run.ColumnInt64(5), "\n");
+      }
+      EXPECT_EQ(SQLITE_DONE, columns_run.status())
+          << columns_run.error_message();
+    }
+    EXPECT_EQ(SQLITE_DONE, run.status()) << run.error_message();
+    return out;
+  }
+
+  int GetVersion(Database *db) {
+    DatabaseContext ctx(db);
+    int version = -1;
+    std::string error_message;
+    EXPECT_TRUE(GetSchemaVersion(&ctx, &version, &error_message))
+        << error_message;
+    return version;
+  }
+
+  std::string tmpdir_;
+};
+
+TEST_F(UpgradeTest, UpgradesOriginalSchema) {
+  Database db;
+  Create("db", "../src/testdata/schema-v0.sql", &db);
+  AddRecording(&db);
+  EXPECT_EQ(0, GetVersion(&db));
+
+  {
+    MoonfireDatabase mdb;
+    std::string error_message;
+    EXPECT_FALSE(mdb.Init(&db, &error_message));
+    EXPECT_THAT(error_message, HasSubstr("run \"moonfire-nvr upgrade\""));
+  }
+
+  std::string error_message;
+  ASSERT_TRUE(UpgradeSchema(&db, &error_message)) << error_message;
+  EXPECT_EQ(kSchemaVersion, GetVersion(&db));
+
+  Database new_db;
+  Create("new_db", "../src/schema.sql", &new_db);
+  EXPECT_EQ(DescribeSchema(&new_db), DescribeSchema(&db));
+
+  {
+    DatabaseContext ctx(&db);
+    auto run = ctx.UseOnce(
+        R"(
+        select
+          recording.sample_file_uuid,
+          recording.sample_file_tier,
+          recording.sample_file_hash_algorithm,
+          recording_playback.video_index
+        from
+          recording join recording_playback
+              on (recording.id = recording_playback.recording_id);
+        )");
+    ASSERT_EQ(SQLITE_ROW, run.Step()) << run.error_message();
+    EXPECT_EQ(std::string("\xff\xee\xdd\xcc\xbb\xaa\x99\x88"
+                          "\x77\x66\x55\x44\x33\x22\x11\x00", 16),
+              run.ColumnBlob(0).as_string());
+    EXPECT_EQ(0, run.ColumnInt64(1));
+    EXPECT_EQ(0, run.ColumnInt64(2));
+    EXPECT_EQ("\x01\x02\x03\x04\x05", run.ColumnBlob(3).as_string());
+    EXPECT_EQ(SQLITE_DONE, run.Step());
+  }
+
+  // The next startup computes the camera's totals.
+  MoonfireDatabase mdb;
+  ASSERT_TRUE(mdb.Init(&db, &error_message)) << error_message;
+  int rows = 0;
+  mdb.ListCameras([&](const ListCamerasRow &row) {
+    ++rows;
+    EXPECT_EQ(90000, row.min_start_time_90k);
+    EXPECT_EQ(90000 + 5400000, row.max_end_time_90k);
+    EXPECT_EQ(5400000, row.total_duration_90k);
+    EXPECT_EQ(30000, row.total_sample_file_bytes);
+    return IterationControl::kContinue;
+  });
+  EXPECT_EQ(1, rows);
+
+  // Upgrading again does nothing.
+  ASSERT_TRUE(UpgradeSchema(&db, &error_message)) << error_message;
+  EXPECT_EQ(kSchemaVersion, GetVersion(&db));
+}
+
+TEST_F(UpgradeTest, SkipsChangesMadeByHand) {
+  // Before the upgrade steps, changes were made by hand following the
+  // README, in any subset.
+  Database db;
+  Create("db", "../src/testdata/schema-v0.sql", &db);
+  AddRecording(&db);
+  Exec(&db, R"(
+      alter table recording add column sample_file_tier integer
+          not null default 0 check (sample_file_tier in (0, 1));
+      create index recording_hot on recording (start_time_90k)
+          where sample_file_tier = 0;
+      alter table camera add column thin_age_sec integer
+          check (thin_age_sec > 0);
+      create table camera_stats (
+        camera_id integer primary key references camera (id) on delete cascade,
+        min_start_time_90k integer,
+        max_end_time_90k integer,
+        total_duration_90k integer not null,
+        total_sample_file_bytes integer not null
+      );
+      update recording set sample_file_tier = 1;
+      )");
+
+  std::string error_message;
+  ASSERT_TRUE(UpgradeSchema(&db, &error_message)) << error_message;
+  EXPECT_EQ(kSchemaVersion, GetVersion(&db));
+  Database new_db;
+  Create("new_db", "../src/schema.sql", &new_db);
+  EXPECT_EQ(DescribeSchema(&new_db), DescribeSchema(&db));
+
+  DatabaseContext ctx(&db);
+  auto run = ctx.UseOnce("select sample_file_tier from recording;");
+  ASSERT_EQ(SQLITE_ROW, run.Step()) << run.error_message();
+  EXPECT_EQ(1, run.ColumnInt64(0));
+}
+
+TEST_F(UpgradeTest, RefusesNewerVersion) {
+  Database db;
+  Create("db", "../src/schema.sql", &db);
+  EXPECT_EQ(kSchemaVersion, GetVersion(&db));
+  Exec(&db, StrCat("insert into version (id, unix_time) values (",
+                   kSchemaVersion + 1, ", 0);"));
+
+  std::string error_message;
+  EXPECT_FALSE(UpgradeSchema(&db, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("newer"));
+  MoonfireDatabase mdb;
+  EXPECT_FALSE(mdb.Init(&db, &error_message));
+  EXPECT_THAT(error_message, HasSubstr("newer Moonfire NVR"));
+}
+
+}  // namespace
+}  // namespace moonfire_nvr
+
+int main(int argc, char **argv) {
+  FLAGS_alsologtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  testing::InitGoogleTest(&argc, argv);
+  google::InitGoogleLogging(argv[0]);
+  return RUN_ALL_TESTS();
+}
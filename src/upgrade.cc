@@ -0,0 +1,422 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// upgrade.cc: see upgrade.h.
+//
+// Each step's SQL is a copy of schema.sql as of that version, so that later
+// changes to schema.sql don't alter what an earlier step does.
+
+#include "upgrade.h"
+
+#include <time.h>
+
+#include <glog/logging.h>
+
+#include "string.h"
+
+namespace moonfire_nvr {
+
+namespace {
+
+// Sets |has| to whether the database has a table named |table|.
+bool HasTable(DatabaseContext *ctx, const char *table, bool *has,
+              std::string *error_message) {
+  auto run = ctx->UseOnce(
+      R"(
+      select count(*) from sqlite_master where type = 'table' and name = :name;
+      )");
+  run.BindText(":name", table);
+  if (run.Step() != SQLITE_ROW) {
+    *error_message =
+        StrCat("Unable to look up table ", table, ": ", run.error_message());
+    return false;
+  }
+  *has = run.ColumnInt64(0) > 0;
+  return true;
+}
+
+// Sets |has| to whether |table| has a column named |column|.
+bool HasColumn(DatabaseContext *ctx, const char *table, const char *column,
+               bool *has, std::string *error_message) {
+  auto run = ctx->UseOnce(StrCat("pragma table_info(", table, ");"));
+  *has = false;
+  while (run.Step() == SQLITE_ROW) {
+    if (run.ColumnText(1) == column) {
+      *has = true;
+    }
+  }
+  if (run.status() != SQLITE_DONE) {
+    *error_message = StrCat("Unable to list the columns of ", table, ": ",
+                            run.error_message());
+    return false;
+  }
+  return true;
+}
+
+// Adds |column| to |table| with the given |definition| unless it's already
+// present.
+bool AddColumn(DatabaseContext *ctx, const char *table, const char *column,
+               const char *definition, std::string *error_message) {
+  bool has;
+  if (!HasColumn(ctx, table, column, &has, error_message)) {
+    return false;
+  }
+  return has || RunStatements(ctx, StrCat("alter table ", table,
+                                          " add column ", column, " ",
+                                          definition, ";"),
+                              error_message);
+}
+
+// Step 1: the cold tier.
+bool AddSampleFileTier(DatabaseContext *ctx, std::string *error_message) {
+  return AddColumn(ctx, "recording", "sample_file_tier",
+                   "integer not null default 0 "
+                   "check (sample_file_tier in (0, 1))",
+                   error_message) &&
+         RunStatements(ctx, R"(
+             create index if not exists recording_hot
+                 on recording (start_time_90k) where sample_file_tier = 0;
+             )", error_message);
+}
+
+// Step 2: container files.
+bool AddContainers(DatabaseContext *ctx, std::string *error_message) {
+  return RunStatements(ctx, R"(
+             create table if not exists container (
+               id integer primary key,
+               camera_id integer references camera (id) not null,
+               uuid blob unique not null check (length(uuid) = 16),
+               size_bytes integer not null check (size_bytes > 0)
+             );
+             )", error_message) &&
+         AddColumn(ctx, "recording", "container_id",
+                   "integer references container (id)", error_message) &&
+         AddColumn(ctx, "recording", "sample_file_offset",
+                   "integer not null default 0 "
+                   "check (sample_file_offset >= 0)",
+                   error_message) &&
+         RunStatements(ctx, R"(
+             create index if not exists recording_container
+                 on recording (container_id) where container_id is not null;
+             )", error_message);
+}
+
+// Step 3: XXH3-128 sample file hashes.
+bool AddSampleFileHashAlgorithm(DatabaseContext *ctx,
+                                std::string *error_message) {
+  return AddColumn(ctx, "recording", "sample_file_hash_algorithm",
+                   "integer not null default 0 "
+                   "check (sample_file_hash_algorithm in (0, 1))",
+                   error_message);
+}
+
+// Step 4: thinning.
+bool AddThinAge(DatabaseContext *ctx, std::string *error_message) {
+  return AddColumn(ctx, "camera", "thin_age_sec",
+                   "integer check (thin_age_sec > 0)", error_message);
+}
+
+// Step 5: relaxed durability.
+bool AddRecordingJournal(DatabaseContext *ctx, std::string *error_message) {
+  return RunStatements(ctx, R"(
+      create table if not exists recording_journal (
+        sample_file_uuid blob primary key check (length(sample_file_uuid) = 16),
+        camera_id integer references camera (id) not null,
+        start_time_90k integer not null check (start_time_90k > 0),
+        local_time_delta_90k integer not null,
+        video_sample_entry_id integer references video_sample_entry (id),
+        sample_file_hash_algorithm integer not null,
+        sample_file_bytes integer not null check (sample_file_bytes >= 0),
+        duration_90k integer not null
+            check (duration_90k >= 0 and duration_90k < 5*60*90000),
+        video_samples integer not null check (video_samples >= 0),
+        video_sync_samples integer not null check (video_sync_samples >= 0),
+        video_index blob not null
+      ) without rowid;
+      )", error_message);
+}
+
+// Step 6: scrubbing.
+bool AddScrubTables(DatabaseContext *ctx, std::string *error_message) {
+  return RunStatements(ctx, R"(
+      create table if not exists scrub_state (
+        id integer primary key check (id = 1),
+        cursor_recording_id integer not null,
+        pass_start_time_90k integer,
+        pass_recordings integer not null,
+        pass_bytes integer not null,
+        completed_passes integer not null,
+        last_pass_end_time_90k integer
+      );
+      create table if not exists scrub_mismatch (
+        id integer primary key,
+        recording_id integer not null,
+        camera_id integer references camera (id) not null,
+        sample_file_uuid blob not null check (length(sample_file_uuid) = 16),
+        start_time_90k integer not null,
+        detected_time_90k integer not null,
+        error text not null
+      );
+      )", error_message);
+}
+
+// Step 7: activity scores.
+bool AddRecordingActivity(DatabaseContext *ctx, std::string *error_message) {
+  return RunStatements(ctx, R"(
+      create table if not exists recording_activity (
+        recording_id integer primary key
+            references recording (id) on delete cascade,
+        max_activity integer not null check (max_activity between 0 and 255),
+        activity blob not null
+      );
+      )", error_message);
+}
+
+// Step 8: camera totals. The next startup fills in each camera's row.
+bool AddCameraStats(DatabaseContext *ctx, std::string *error_message) {
+  return RunStatements(ctx, R"(
+      create table if not exists camera_stats (
+        camera_id integer primary key references camera (id) on delete cascade,
+        min_start_time_90k integer,
+        max_end_time_90k integer,
+        total_duration_90k integer not null,
+        total_sample_file_bytes integer not null
+      );
+      )", error_message);
+}
+
+// Step 9: hourly and daily rollups. These are rebuilt on startup only along
+// with a missing camera_stats row, so the camera_stats rows are deleted too.
+bool AddRecordingRollup(DatabaseContext *ctx, std::string *error_message) {
+  bool has;
+  if (!HasTable(ctx, "recording_rollup", &has, error_message)) {
+    return false;
+  }
+  return has || RunStatements(ctx, R"(
+      create table recording_rollup (
+        camera_id integer not null references camera (id) on delete cascade,
+        period integer not null check (period in (0, 1)),
+        start_time_90k integer not null,
+        duration_90k integer not null,
+        sample_file_bytes integer not null,
+        video_samples integer not null,
+        gaps integer not null,
+        primary key (camera_id, period, start_time_90k)
+      ) without rowid;
+      delete from camera_stats;
+      )", error_message);
+}
+
+// Step 10: moves each recording's video_index to recording_playback. SQLite
+// can't drop a column in older versions, so this rebuilds the recording
+// table and its indexes. UpgradeSchema turns off foreign keys and turns on
+// legacy_alter_table so the rename leaves other tables' references alone.
+bool MoveVideoIndex(DatabaseContext *ctx, std::string *error_message) {
+  const char kCreatePlayback[] = R"(
+      create table if not exists recording_playback (
+        recording_id integer primary key
+            references recording (id) on delete cascade,
+        video_index blob not null check (length(video_index) > 0)
+      );
+      )";
+  bool has;
+  if (!HasColumn(ctx, "recording", "video_index", &has, error_message)) {
+    return false;
+  }
+  if (!has) {
+    return RunStatements(ctx, kCreatePlayback, error_message);
+  }
+  return RunStatements(ctx, kCreatePlayback, error_message) &&
+         RunStatements(ctx, R"(
+      insert or replace into recording_playback
+          select id, video_index from recording;
+      drop index if exists recording_cover;
+      drop index if exists recording_hot;
+      drop index if exists recording_container;
+      alter table recording rename to old_recording;
+      create table recording (
+        id integer primary key,
+        camera_id integer references camera (id) not null,
+        sample_file_bytes integer not null check (sample_file_bytes > 0),
+        start_time_90k integer not null check (start_time_90k > 0),
+        duration_90k integer not null
+            check (duration_90k >= 0 and duration_90k < 5*60*90000),
+        local_time_delta_90k integer not null,
+        video_samples integer not null check (video_samples > 0),
+        video_sync_samples integer not null check (video_samples > 0),
+        video_sample_entry_id integer references video_sample_entry (id),
+        sample_file_uuid blob not null check (length(sample_file_uuid) = 16),
+        sample_file_sha1 blob not null check (length(sample_file_sha1) = 20),
+        sample_file_tier integer not null default 0
+            check (sample_file_tier in (0, 1)),
+        container_id integer references container (id),
+        sample_file_offset integer not null default 0
+            check (sample_file_offset >= 0),
+        sample_file_hash_algorithm integer not null default 0
+            check (sample_file_hash_algorithm in (0, 1))
+      );
+      create index recording_cover on recording (
+        camera_id,
+        start_time_90k,
+        duration_90k,
+        video_samples,
+        video_sample_entry_id,
+        sample_file_bytes
+      );
+      create index recording_hot on recording (start_time_90k)
+          where sample_file_tier = 0;
+      create index recording_container on recording (container_id)
+          where container_id is not null;
+      insert into recording
+          select id, camera_id, sample_file_bytes, start_time_90k,
+                 duration_90k, local_time_delta_90k, video_samples,
+                 video_sync_samples, video_sample_entry_id, sample_file_uuid,
+                 sample_file_sha1, sample_file_tier, container_id,
+                 sample_file_offset, sample_file_hash_algorithm
+          from old_recording;
+      drop table old_recording;
+      )", error_message);
+}
+
+struct UpgradeStep {
+  const char *notes;  // saved in the version table.
+  bool (*run)(DatabaseContext *ctx, std::string *error_message);
+};
+
+// kSteps[i] upgrades a database from version i to version i + 1.
+const UpgradeStep kSteps[] = {
+    {"add recording.sample_file_tier", &AddSampleFileTier},
+    {"add container", &AddContainers},
+    {"add recording.sample_file_hash_algorithm", &AddSampleFileHashAlgorithm},
+    {"add camera.thin_age_sec", &AddThinAge},
+    {"add recording_journal", &AddRecordingJournal},
+    {"add scrub_state and scrub_mismatch", &AddScrubTables},
+    {"add recording_activity", &AddRecordingActivity},
+    {"add camera_stats", &AddCameraStats},
+    {"add recording_rollup", &AddRecordingRollup},
+    {"move recording.video_index to recording_playback", &MoveVideoIndex},
+};
+static_assert(sizeof(kSteps) / sizeof(kSteps[0]) == kSchemaVersion,
+              "each version needs an upgrade step");
+
+}  // namespace
+
+bool GetSchemaVersion(DatabaseContext *ctx, int *version,
+                      std::string *error_message) {
+  bool has;
+  if (!HasTable(ctx, "version", &has, error_message)) {
+    return false;
+  }
+  if (!has) {
+    *version = 0;
+    return true;
+  }
+  auto run = ctx->UseOnce("select max(id) from version;");
+  if (run.Step() != SQLITE_ROW) {
+    *error_message =
+        StrCat("Unable to read the schema version: ", run.error_message());
+    return false;
+  }
+  *version = run.ColumnType(0) == SQLITE_NULL ? 0 : run.ColumnInt64(0);
+  return true;
+}
+
+bool UpgradeSchema(Database *db, std::string *error_message) {
+  DatabaseContext ctx(db);
+  int version;
+  if (!GetSchemaVersion(&ctx, &version, error_message)) {
+    return false;
+  }
+  if (version > kSchemaVersion) {
+    *error_message = StrCat("Database schema version ", version,
+                            " is newer than this binary's version ",
+                            kSchemaVersion);
+    return false;
+  }
+  if (version == kSchemaVersion) {
+    LOG(INFO) << "Database is already at schema version " << version << ".";
+    return true;
+  }
+
+  // Neither pragma takes effect within a transaction.
+  if (!RunStatements(&ctx, R"(
+          pragma foreign_keys = off;
+          pragma legacy_alter_table = on;
+          )", error_message)) {
+    return false;
+  }
+  for (; version < kSchemaVersion; ++version) {
+    const UpgradeStep &step = kSteps[version];
+    LOG(INFO) << "Upgrading to schema version " << version + 1 << ": "
+              << step.notes << ".";
+    if (!ctx.BeginTransaction(error_message)) {
+      return false;
+    }
+    bool ok = RunStatements(&ctx, R"(
+        create table if not exists version (
+          id integer primary key,
+          unix_time integer not null,
+          notes text
+        );
+        )", error_message) && step.run(&ctx, error_message);
+    if (ok) {
+      auto run = ctx.UseOnce(
+          R"(
+          insert into version (id, unix_time, notes)
+                       values (:id, :unix_time, :notes);
+          )");
+      run.BindInt64(":id", version + 1);
+      run.BindInt64(":unix_time", time(nullptr));
+      run.BindText(":notes", step.notes);
+      if (run.Step() != SQLITE_DONE) {
+        *error_message = run.error_message();
+        ok = false;
+      }
+    }
+    if (!ok) {
+      ctx.RollbackTransaction();
+      *error_message = StrCat("Unable to upgrade to schema version ",
+                              version + 1, ": ", *error_message);
+      return false;
+    }
+    if (!ctx.CommitTransaction(error_message)) {
+      return false;
+    }
+  }
+
+  // Rebuilt tables leave free pages behind; return them to the filesystem.
+  return RunStatements(&ctx, R"(
+      pragma legacy_alter_table = off;
+      vacuum;
+      )", error_message);
+}
+
+}  // namespace moonfire_nvr
@@ -0,0 +1,63 @@
+// This file is part of Moonfire NVR, a security camera digital video recorder.
+// Copyright (C) 2016 Scott Lamb <slamb@slamb.org>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// In addition, as a special exception, the copyright holders give
+// permission to link the code of portions of this program with the
+// OpenSSL library under certain conditions as described in each
+// individual source file, and distribute linked combinations including
+// the two.
+//
+// You must obey the GNU General Public License in all respects for all
+// of the code used other than OpenSSL. If you modify file(s) with this
+// exception, you may extend this exception to your version of the
+// file(s), but you are not obligated to do so. If you do not wish to do
+// so, delete this exception statement from your version. If you delete
+// this exception statement from all source files in the program, then
+// also delete it here.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//
+// upgrade.h: in-place upgrades of databases created by earlier versions of
+// schema.sql.
+
+#ifndef MOONFIRE_NVR_UPGRADE_H
+#define MOONFIRE_NVR_UPGRADE_H
+
+#include <string>
+
+#include "sqlite.h"
+
+namespace moonfire_nvr {
+
+// The schema version of databases created from schema.sql; see its version
+// table. MoonfireDatabase::Init refuses to open any other version.
+constexpr int kSchemaVersion = 10;
+
+// Reads the schema version of the database into |version|. A database created
+// before the version table was added is version 0.
+bool GetSchemaVersion(DatabaseContext *ctx, int *version,
+                      std::string *error_message);
+
+// Upgrades |db| to kSchemaVersion, one numbered step at a time, each in its
+// own transaction and recorded in the version table. A step skips any part
+// of its change that's already present, as in databases upgraded by hand
+// before these steps existed. |db| must be open for writing and not in use
+// by a running NVR. Returns false if a step failed; the database is then left
+// at the version before that step.
+bool UpgradeSchema(Database *db, std::string *error_message);
+
+}  // namespace moonfire_nvr
+
+#endif  // MOONFIRE_NVR_UPGRADE_H
@@ -32,6 +32,17 @@
 
 #include "web.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+
 #include <glog/logging.h>
 
 #include "recording.h"
@@ -39,10 +50,90 @@
 
 namespace moonfire_nvr {
 
-void WebInterface::Register(evhttp *http) {
+namespace {
+
+// ExportMp4 copies this much at a time.
+const int64_t kExportChunkBytes = INT64_C(8) << 20;
+
+// HandleActivity's defaults: the last day, with seconds at least four times
+// the camera's quiet level.
+const int64_t kDefaultActivityRange90k = 24 * 60 * 60 * kTimeUnitsPerSecond;
+const int64_t kDefaultMinActivity = 64;
+
+// HandleCameraDetail lists this many days per page.
+const int kDaysPerPage = 31;
+
+// Format a time as UTC, matching the rollup periods' boundaries.
+std::string FormatUtc(int64_t time_90k, const char *format) {
+  struct tm mytm;
+  memset(&mytm, 0, sizeof(mytm));
+  time_t ts = time_90k / kTimeUnitsPerSecond;
+  gmtime_r(&ts, &mytm);
+  char buf[64];
+  strftime(buf, sizeof(buf), format, &mytm);
+  return buf;
+}
+
+}  // namespace
+
+struct WebInterface::PendingExport {
+  WebInterface *web = nullptr;
+  evhttp_request *req = nullptr;  // null once the client has gone away.
+  Uuid camera_uuid;
+  int64_t start_time_90k = -1;
+  int64_t end_time_90k = -1;
+  std::string name;
+
+  // Filled in by the export thread.
+  bool ok = false;
+  int64_t bytes = -1;
+  std::string error_message;
+};
+
+WebInterface::~WebInterface() {
+  if (export_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(export_mu_);
+      shutting_down_ = true;
+    }
+    export_cv_.notify_all();
+    export_thread_.join();
+  }
+  for (auto *pending : exports_) {
+    delete pending;
+  }
+  for (auto *pending : done_exports_) {
+    delete pending;
+  }
+  if (done_event_ != nullptr) {
+    event_free(done_event_);
+  }
+  for (int fd : done_fds_) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+}
+
+void WebInterface::Register(event_base *base, evhttp *http) {
+  if (env_->export_dir != nullptr) {
+    CHECK_EQ(0, pipe2(done_fds_, O_CLOEXEC | O_NONBLOCK))
+        << "pipe2: " << strerror(errno);
+    done_event_ = event_new(base, done_fds_[0], EV_READ | EV_PERSIST,
+                            &WebInterface::HandleExportsDone, this);
+    CHECK_EQ(0, event_add(done_event_, nullptr));
+    export_thread_ = std::thread([this]() { RunExports(); });
+  }
+
   evhttp_set_cb(http, "/", &WebInterface::HandleCameraList, this);
   evhttp_set_cb(http, "/camera", &WebInterface::HandleCameraDetail, this);
+  evhttp_set_cb(http, "/rollups", &WebInterface::HandleRollups, this);
   evhttp_set_cb(http, "/view.mp4", &WebInterface::HandleMp4View, this);
+  evhttp_set_cb(http, "/export.mp4", &WebInterface::HandleMp4Export, this);
+  evhttp_set_cb(http, "/disk", &WebInterface::HandleDiskUsage, this);
+  evhttp_set_cb(http, "/scrub", &WebInterface::HandleScrubStatus, this);
+  evhttp_set_cb(http, "/activity", &WebInterface::HandleActivity, this);
+  evhttp_set_cb(http, "/db", &WebInterface::HandleDatabaseStatus, this);
 }
 
 void WebInterface::HandleCameraList(evhttp_request *req, void *arg) {
@@ -101,9 +192,20 @@ void WebInterface::HandleCameraList(evhttp_request *req, void *arg) {
 void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
   auto *this_ = reinterpret_cast<WebInterface *>(arg);
 
+  // With a start time, list that range's hours and recordings. Otherwise,
+  // list the days starting before |end_time_90k|, newest first.
   Uuid camera_uuid;
+  int64_t start_time_90k = -1;
+  int64_t end_time_90k = std::numeric_limits<int64_t>::max();
   QueryParameters params(evhttp_request_get_uri(req));
-  if (!params.ok() || !camera_uuid.ParseText(params.Get("uuid"))) {
+  if (!params.ok() || !camera_uuid.ParseText(params.Get("uuid")) ||
+      (params.Get("start_time_90k") != nullptr &&
+       !Atoi64(params.Get("start_time_90k"), 10, &start_time_90k)) ||
+      (params.Get("end_time_90k") != nullptr &&
+       !Atoi64(params.Get("end_time_90k"), 10, &end_time_90k)) ||
+      (start_time_90k != -1 &&
+       (start_time_90k < 0 || start_time_90k >= end_time_90k ||
+        params.Get("end_time_90k") == nullptr))) {
     return evhttp_send_error(req, HTTP_BADREQUEST, "bad query parameters");
   }
 
@@ -111,6 +213,7 @@ void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
   if (!this_->env_->mdb->GetCamera(camera_uuid, &camera_row)) {
     return evhttp_send_error(req, HTTP_NOTFOUND, "no such camera");
   }
+  std::string uuid_text = camera_uuid.UnparseText();
 
   EvBuffer buf;
   buf.AddPrintf(
@@ -126,15 +229,100 @@ void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
       "</head>\n"
       "<body>\n"
       "<h1>%s</h1>\n"
-      "<p>%s</p>\n"
-      "<table>\n"
-      "<tr><th>start</th><th>end</th><th>resolution</th>"
-      "<th>fps</th><th>size</th><th>bitrate</th>"
-      "</tr>\n",
+      "<p>%s</p>\n",
       EscapeHtml(camera_row.short_name).c_str(),
       EscapeHtml(camera_row.short_name).c_str(),
       EscapeHtml(camera_row.description).c_str());
 
+  std::string error_message;
+  if (start_time_90k == -1) {
+    const int64_t kDay90k = RollupPeriodDuration90k(RollupPeriod::kDay);
+    buf.Add(
+        "<table>\n"
+        "<tr><th>day (UTC)</th><th>recorded</th><th>coverage</th>"
+        "<th>size</th><th>gaps</th></tr>\n");
+    int days = 0;
+    int64_t oldest_day_90k = -1;
+    auto row_cb = [&](const CameraRollupRow &row) {
+      buf.AddPrintf(
+          "<tr><td><a href=\"/camera?uuid=%s&start_time_90k=%" PRId64
+          "&end_time_90k=%" PRId64
+          "\">%s</a></td><td>%s</td><td>%.1f%%</td><td>%s</td><td>%" PRId64
+          "</td></tr>\n",
+          uuid_text.c_str(), row.start_time_90k, row.start_time_90k + kDay90k,
+          FormatUtc(row.start_time_90k, "%a, %d %b %Y").c_str(),
+          EscapeHtml(HumanizeDuration(row.duration_90k / kTimeUnitsPerSecond))
+              .c_str(),
+          100.f * row.duration_90k / kDay90k,
+          EscapeHtml(HumanizeWithBinaryPrefix(row.sample_file_bytes, "B"))
+              .c_str(),
+          row.gaps);
+      oldest_day_90k = row.start_time_90k;
+      return ++days == kDaysPerPage ? IterationControl::kBreak
+                                    : IterationControl::kContinue;
+    };
+    if (!this_->env_->mdb->ListCameraRollups(camera_uuid, RollupPeriod::kDay,
+                                             0, end_time_90k, row_cb,
+                                             &error_message)) {
+      return evhttp_send_error(
+          req, HTTP_INTERNAL,
+          StrCat("sqlite query failed: ", EscapeHtml(error_message)).c_str());
+    }
+    buf.Add("</table>\n<p>");
+    if (params.Get("end_time_90k") != nullptr) {
+      buf.AddPrintf("<a href=\"/camera?uuid=%s\">newest</a> ",
+                    uuid_text.c_str());
+    }
+    if (days == kDaysPerPage) {
+      buf.AddPrintf(
+          "<a href=\"/camera?uuid=%s&end_time_90k=%" PRId64 "\">older</a>",
+          uuid_text.c_str(), oldest_day_90k);
+    }
+    buf.Add(
+        "</p>\n"
+        "</body>\n"
+        "</html>\n");
+    return evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+  }
+
+  int64_t range_90k = end_time_90k - start_time_90k;
+  buf.AddPrintf(
+      "<p><a href=\"/camera?uuid=%s&start_time_90k=%" PRId64
+      "&end_time_90k=%" PRId64 "\">earlier</a> "
+      "<a href=\"/camera?uuid=%s&start_time_90k=%" PRId64
+      "&end_time_90k=%" PRId64 "\">later</a> "
+      "<a href=\"/camera?uuid=%s\">all days</a></p>\n"
+      "<table>\n"
+      "<tr><th>hour (UTC)</th><th>recorded</th><th>size</th><th>gaps</th>"
+      "</tr>\n",
+      uuid_text.c_str(), start_time_90k - range_90k, start_time_90k,
+      uuid_text.c_str(), end_time_90k, end_time_90k + range_90k,
+      uuid_text.c_str());
+  auto hour_cb = [&](const CameraRollupRow &row) {
+    buf.AddPrintf(
+        "<tr><td>%s</td><td>%s</td><td>%s</td><td>%" PRId64 "</td></tr>\n",
+        FormatUtc(row.start_time_90k, "%d %b %H:00").c_str(),
+        EscapeHtml(HumanizeDuration(row.duration_90k / kTimeUnitsPerSecond))
+            .c_str(),
+        EscapeHtml(HumanizeWithBinaryPrefix(row.sample_file_bytes, "B"))
+            .c_str(),
+        row.gaps);
+    return IterationControl::kContinue;
+  };
+  if (!this_->env_->mdb->ListCameraRollups(camera_uuid, RollupPeriod::kHour,
+                                           start_time_90k, end_time_90k,
+                                           hour_cb, &error_message)) {
+    return evhttp_send_error(
+        req, HTTP_INTERNAL,
+        StrCat("sqlite query failed: ", EscapeHtml(error_message)).c_str());
+  }
+  buf.Add(
+      "</table>\n"
+      "<table>\n"
+      "<tr><th>start</th><th>end</th><th>resolution</th>"
+      "<th>fps</th><th>size</th><th>bitrate</th>"
+      "</tr>\n");
+
   // Rather than listing each 60-second recording, generate a HTML row for
   // aggregated .mp4 files of up to kForceSplitDuration90k each, provided
   // there is no gap or change in video parameters between recordings.
@@ -152,7 +340,7 @@ void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
         "&end_time_90k=%" PRId64
         "\">%s</a></td><td>%s</td><td>%dx%d</td>"
         "<td>%.0f</td><td>%s</td><td>%s</td></tr>\n",
-        camera_uuid.UnparseText().c_str(), aggregated.start_time_90k,
+        uuid_text.c_str(), aggregated.start_time_90k,
         aggregated.end_time_90k,
         PrettyTimestamp(aggregated.start_time_90k).c_str(),
         PrettyTimestamp(aggregated.end_time_90k).c_str(),
@@ -180,9 +368,6 @@ void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
     }
     return IterationControl::kContinue;
   };
-  int64_t start_time_90k = 0;
-  int64_t end_time_90k = std::numeric_limits<int64_t>::max();
-  std::string error_message;
   if (!this_->env_->mdb->ListCameraRecordings(camera_uuid, start_time_90k,
                                               end_time_90k, handle_sql_row,
                                               &error_message)) {
@@ -193,6 +378,326 @@ void WebInterface::HandleCameraDetail(evhttp_request *req, void *arg) {
   maybe_finish_html_row();
   buf.Add(
       "</table>\n"
+      "</body>\n"
+      "</html>\n");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+}
+
+void WebInterface::HandleRollups(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+
+  Uuid camera_uuid;
+  RollupPeriod period;
+  int64_t start_time_90k = 0;
+  int64_t end_time_90k = std::numeric_limits<int64_t>::max();
+  QueryParameters params(evhttp_request_get_uri(req));
+  const char *period_name = params.ok() ? params.Get("period") : nullptr;
+  if (period_name != nullptr && strcmp(period_name, "hour") == 0) {
+    period = RollupPeriod::kHour;
+  } else if (period_name != nullptr && strcmp(period_name, "day") == 0) {
+    period = RollupPeriod::kDay;
+  } else {
+    return evhttp_send_error(req, HTTP_BADREQUEST, "bad query parameters");
+  }
+  if (!camera_uuid.ParseText(params.Get("camera_uuid")) ||
+      (params.Get("start_time_90k") != nullptr &&
+       !Atoi64(params.Get("start_time_90k"), 10, &start_time_90k)) ||
+      (params.Get("end_time_90k") != nullptr &&
+       !Atoi64(params.Get("end_time_90k"), 10, &end_time_90k)) ||
+      start_time_90k < 0 || start_time_90k >= end_time_90k) {
+    return evhttp_send_error(req, HTTP_BADREQUEST, "bad query parameters");
+  }
+
+  GetCameraRow camera_row;
+  if (!this_->env_->mdb->GetCamera(camera_uuid, &camera_row)) {
+    return evhttp_send_error(req, HTTP_NOTFOUND, "no such camera");
+  }
+
+  EvBuffer buf;
+  buf.AddPrintf("{\"camera_uuid\": \"%s\", \"period\": \"%s\", \"rollups\": [",
+                camera_uuid.UnparseText().c_str(), period_name);
+  const char *separator = "\n";
+  auto row_cb = [&](const CameraRollupRow &row) {
+    buf.AddPrintf("%s{\"start_time_90k\": %" PRId64
+                  ", \"duration_90k\": %" PRId64
+                  ", \"sample_file_bytes\": %" PRId64
+                  ", \"video_samples\": %" PRId64 ", \"gaps\": %" PRId64 "}",
+                  separator, row.start_time_90k, row.duration_90k,
+                  row.sample_file_bytes, row.video_samples, row.gaps);
+    separator = ",\n";
+    return IterationControl::kContinue;
+  };
+  std::string error_message;
+  if (!this_->env_->mdb->ListCameraRollups(camera_uuid, period,
+                                           start_time_90k, end_time_90k,
+                                           row_cb, &error_message)) {
+    return evhttp_send_error(
+        req, HTTP_INTERNAL,
+        StrCat("sqlite query failed: ", EscapeHtml(error_message)).c_str());
+  }
+  buf.Add("\n]}\n");
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "application/json");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+}
+
+void WebInterface::HandleDiskUsage(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+  if (this_->env_->disk_monitor == nullptr) {
+    return evhttp_send_error(req, HTTP_NOTFOUND, "disk monitoring is disabled");
+  }
+
+  EvBuffer buf;
+  buf.Add(
+      "<!DOCTYPE html>\n"
+      "<html>\n"
+      "<head>\n"
+      "<title>Disk usage</title>\n"
+      "<meta http-equiv=\"Content-Language\" content=\"en\">\n"
+      "<style type=\"text/css\">\n"
+      ".header { background-color: #ddd; }\n"
+      "th, td { padding: 0.5ex 1.5em; text-align: right; }\n"
+      "</style>\n"
+      "</head>\n"
+      "<body>\n"
+      "<p>Disk time fraction is estimated as (seek rate) / (50 seeks/sec) + "
+      "(bandwidth) / (100 MB/sec), as for a hard drive.</p>\n"
+      "<table>\n"
+      "<tr class=header><th>name</th><th>disk time</th><th>read</th>"
+      "<th>write</th><th>seeks/sec</th><th>total read</th>"
+      "<th>total written</th><th>opens</th><th>syncs</th><th>unlinks</th>"
+      "</tr>\n");
+  bool in_streams = false;
+  for (const auto &usage : this_->env_->disk_monitor->GetUsage()) {
+    if (!usage.is_disk && !in_streams) {
+      buf.Add("<tr class=header><td colspan=10>streams</td></tr>\n");
+      in_streams = true;
+    }
+    buf.AddPrintf(
+        "<tr><td>%s</td><td>%.1f%%</td><td>%s</td><td>%s</td><td>%.1f</td>"
+        "<td>%s</td><td>%s</td><td>%" PRId64 "</td><td>%" PRId64
+        "</td><td>%" PRId64 "</td></tr>\n",
+        EscapeHtml(usage.name).c_str(), 100 * usage.disk_time_fraction,
+        EscapeHtml(HumanizeWithBinaryPrefix(usage.read_bytes_per_sec, "B/s"))
+            .c_str(),
+        EscapeHtml(HumanizeWithBinaryPrefix(usage.write_bytes_per_sec, "B/s"))
+            .c_str(),
+        usage.seeks_per_sec,
+        EscapeHtml(HumanizeWithBinaryPrefix(usage.totals.bytes_read, "B"))
+            .c_str(),
+        EscapeHtml(HumanizeWithBinaryPrefix(usage.totals.bytes_written, "B"))
+            .c_str(),
+        usage.totals.opens, usage.totals.syncs, usage.totals.unlinks);
+  }
+  buf.Add(
+      "</table>\n"
+      "</body>\n"
+      "</html>\n");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+}
+
+void WebInterface::HandleScrubStatus(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+  if (!this_->env_->scrub_sample_files) {
+    return evhttp_send_error(req, HTTP_NOTFOUND, "scrubbing is disabled");
+  }
+
+  ScrubState state;
+  int64_t remaining_recordings;
+  int64_t remaining_bytes;
+  std::string error_message;
+  if (!this_->env_->mdb->GetScrubState(&state, &error_message) ||
+      !this_->env_->mdb->CountRecordingsAfter(
+          state.pass_start_time_90k == -1 ? 0 : state.cursor_recording_id,
+          &remaining_recordings, &remaining_bytes, &error_message)) {
+    return evhttp_send_error(req, HTTP_INTERNAL,
+                             EscapeHtml(error_message).c_str());
+  }
+  std::map<int64_t, std::string> camera_names;
+  this_->env_->mdb->ListCameras([&](const ListCamerasRow &row) {
+    camera_names[row.id] = row.short_name;
+    return IterationControl::kContinue;
+  });
+
+  EvBuffer buf;
+  buf.Add(
+      "<!DOCTYPE html>\n"
+      "<html>\n"
+      "<head>\n"
+      "<title>Sample file scrubbing</title>\n"
+      "<meta http-equiv=\"Content-Language\" content=\"en\">\n"
+      "<style type=\"text/css\">\n"
+      ".header { background-color: #ddd; }\n"
+      "th, td { padding: 0.5ex 1.5em; }\n"
+      "</style>\n"
+      "</head>\n"
+      "<body>\n"
+      "<table>\n");
+  buf.AddPrintf("<tr><td>completed passes</td><td>%" PRId64 "</td></tr>\n",
+                state.completed_passes);
+  if (state.last_pass_end_time_90k != -1) {
+    buf.AddPrintf("<tr><td>last pass ended</td><td>%s</td></tr>\n",
+                  EscapeHtml(PrettyTimestamp(state.last_pass_end_time_90k))
+                      .c_str());
+  }
+  if (state.pass_start_time_90k == -1) {
+    buf.Add("<tr><td>current pass</td><td>none</td></tr>\n");
+  } else {
+    int64_t elapsed_sec = std::max(
+        INT64_C(1),
+        (To90k(this_->env_->clock->Now()) - state.pass_start_time_90k) /
+            kTimeUnitsPerSecond);
+    int64_t total_bytes = state.pass_bytes + remaining_bytes;
+    buf.AddPrintf(
+        "<tr><td>current pass started</td><td>%s</td></tr>\n"
+        "<tr><td>progress</td><td>%" PRId64 " of %" PRId64
+        " recordings; %s of %s (%.1f%%)</td></tr>\n"
+        "<tr><td>throughput</td><td>%s</td></tr>\n",
+        EscapeHtml(PrettyTimestamp(state.pass_start_time_90k)).c_str(),
+        state.pass_recordings, state.pass_recordings + remaining_recordings,
+        EscapeHtml(HumanizeWithBinaryPrefix(state.pass_bytes, "B")).c_str(),
+        EscapeHtml(HumanizeWithBinaryPrefix(total_bytes, "B")).c_str(),
+        total_bytes == 0 ? 100. : 100. * state.pass_bytes / total_bytes,
+        EscapeHtml(HumanizeWithBinaryPrefix(state.pass_bytes / elapsed_sec,
+                                            "B/s"))
+            .c_str());
+  }
+  buf.Add(
+      "</table>\n"
+      "<h2>Mismatches</h2>\n"
+      "<table>\n"
+      "<tr class=header><th>detected</th><th>camera</th><th>recording</th>"
+      "<th>recording start</th><th>sample file</th><th>error</th></tr>\n");
+  auto row_cb = [&](const ScrubMismatchRow &row) {
+    buf.AddPrintf(
+        "<tr><td>%s</td><td>%s</td><td>%" PRId64
+        "</td><td>%s</td><td>%s</td><td>%s</td></tr>\n",
+        EscapeHtml(PrettyTimestamp(row.detected_time_90k)).c_str(),
+        EscapeHtml(camera_names[row.camera_id]).c_str(), row.recording_id,
+        EscapeHtml(PrettyTimestamp(row.start_time_90k)).c_str(),
+        row.sample_file_uuid.UnparseText().c_str(),
+        EscapeHtml(row.error).c_str());
+    return IterationControl::kContinue;
+  };
+  if (!this_->env_->mdb->ListScrubMismatches(row_cb, &error_message)) {
+    return evhttp_send_error(req, HTTP_INTERNAL,
+                             EscapeHtml(error_message).c_str());
+  }
+  buf.Add(
+      "</table>\n"
+      "</body>\n"
+      "</html>\n");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+}
+
+void WebInterface::HandleDatabaseStatus(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+  if (this_->env_->wal_checkpointer == nullptr) {
+    return evhttp_send_error(req, HTTP_NOTFOUND,
+                             "write-ahead logging is disabled");
+  }
+  WalCheckpointer::Stats stats = this_->env_->wal_checkpointer->stats();
+
+  EvBuffer buf;
+  buf.Add(
+      "<!DOCTYPE html>\n"
+      "<html>\n"
+      "<head>\n"
+      "<title>Database</title>\n"
+      "<meta http-equiv=\"Content-Language\" content=\"en\">\n"
+      "<style type=\"text/css\">\n"
+      "th, td { padding: 0.5ex 1.5em; }\n"
+      "</style>\n"
+      "</head>\n"
+      "<body>\n"
+      "<table>\n");
+  buf.AddPrintf(
+      "<tr><td>checkpoints</td><td>%" PRId64 " (%" PRId64
+      " truncating, %" PRId64 " failed)</td></tr>\n"
+      "<tr><td>checkpoint latency</td><td>%.3f sec (max %.3f sec)</td></tr>\n"
+      "<tr><td>write-ahead log size</td><td>%s (max %s)</td></tr>\n",
+      stats.checkpoints, stats.truncations, stats.failures,
+      stats.last_latency_sec, stats.max_latency_sec,
+      EscapeHtml(HumanizeWithBinaryPrefix(stats.wal_bytes, "B")).c_str(),
+      EscapeHtml(HumanizeWithBinaryPrefix(stats.max_wal_bytes, "B")).c_str());
+  buf.Add(
+      "</table>\n"
+      "</body>\n"
+      "</html>\n");
+  evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
+}
+
+// Lists intervals of high activity across all cameras, as in
+// "/activity?start_time_90k=...&end_time_90k=...&min_activity=64". Every
+// parameter is optional. Scores come from the recording_activity table, so
+// this doesn't read any sample files.
+void WebInterface::HandleActivity(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+
+  int64_t end_time_90k = To90k(this_->env_->clock->Now());
+  int64_t start_time_90k = end_time_90k - kDefaultActivityRange90k;
+  int64_t min_activity = kDefaultMinActivity;
+  QueryParameters params(evhttp_request_get_uri(req));
+  if (!params.ok() ||
+      (params.Get("start_time_90k") != nullptr &&
+       !Atoi64(params.Get("start_time_90k"), 10, &start_time_90k)) ||
+      (params.Get("end_time_90k") != nullptr &&
+       !Atoi64(params.Get("end_time_90k"), 10, &end_time_90k)) ||
+      (params.Get("min_activity") != nullptr &&
+       !Atoi64(params.Get("min_activity"), 10, &min_activity)) ||
+      start_time_90k < 0 || start_time_90k >= end_time_90k ||
+      min_activity < 0 || min_activity > 255) {
+    return evhttp_send_error(req, HTTP_BADREQUEST, "bad query parameters");
+  }
+  std::map<int64_t, std::string> camera_names;
+  this_->env_->mdb->ListCameras([&](const ListCamerasRow &row) {
+    camera_names[row.id] = row.short_name;
+    return IterationControl::kContinue;
+  });
+
+  EvBuffer buf;
+  buf.AddPrintf(
+      "<!DOCTYPE html>\n"
+      "<html>\n"
+      "<head>\n"
+      "<title>Activity</title>\n"
+      "<meta http-equiv=\"Content-Language\" content=\"en\">\n"
+      "<style type=\"text/css\">\n"
+      ".header { background-color: #ddd; }\n"
+      "th, td { padding: 0.5ex 1.5em; text-align: right; }\n"
+      "</style>\n"
+      "</head>\n"
+      "<body>\n"
+      "<p>Intervals from %s to %s with activity of at least %" PRId64
+      ". A score of 32 means non-key frames are twice the camera's quiet size; "
+      "64, four times.</p>\n"
+      "<table>\n"
+      "<tr class=header><th>camera</th><th>start</th><th>end</th>"
+      "<th>max activity</th></tr>\n",
+      EscapeHtml(PrettyTimestamp(start_time_90k)).c_str(),
+      EscapeHtml(PrettyTimestamp(end_time_90k)).c_str(), min_activity);
+  auto row_cb = [&](const ActivityIntervalRow &row) {
+    buf.AddPrintf(
+        "<tr><td>%s</td><td><a href=\"/view.mp4?camera_uuid=%s&start_time_90k="
+        "%" PRId64 "&end_time_90k=%" PRId64
+        "\">%s</a></td><td>%s</td><td>%d</td></tr>\n",
+        EscapeHtml(camera_names[row.camera_id]).c_str(),
+        row.camera_uuid.UnparseText().c_str(), row.start_time_90k,
+        row.end_time_90k, EscapeHtml(PrettyTimestamp(row.start_time_90k)).c_str(),
+        EscapeHtml(PrettyTimestamp(row.end_time_90k)).c_str(),
+        row.max_activity);
+    return IterationControl::kContinue;
+  };
+  std::string error_message;
+  if (!this_->env_->mdb->ListActivityIntervals(start_time_90k, end_time_90k,
+                                               min_activity, row_cb,
+                                               &error_message)) {
+    return evhttp_send_error(req, HTTP_INTERNAL,
+                             EscapeHtml(error_message).c_str());
+  }
+  buf.Add(
+      "</table>\n"
+      "</body>\n"
       "</html>\n");
   evhttp_send_reply(req, HTTP_OK, "OK", buf.get());
 }
@@ -221,7 +726,170 @@ void WebInterface::HandleMp4View(evhttp_request *req, void *arg) {
                              EscapeHtml(error_message).c_str());
   }
 
-  return HttpServe(file, req);
+  return HttpServe(file, req, this_->env_->GetIoBucket(IoClass::kServing));
+}
+
+// Writes the .mp4 to a file in |export_dir| rather than sending it to the
+// client, as in "POST /export.mp4?camera_uuid=...&start_time_90k=...&
+// end_time_90k=...&name=foo.mp4". The export runs on the export thread, one
+// at a time; the reply is sent when it's done. If the client goes away
+// meanwhile, the export still completes.
+void WebInterface::HandleMp4Export(evhttp_request *req, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return evhttp_send_error(req, HTTP_BADMETHOD, "only POST allowed");
+  }
+  if (this_->env_->export_dir == nullptr) {
+    return evhttp_send_error(req, HTTP_NOTFOUND, "exporting is disabled");
+  }
+
+  Uuid camera_uuid;
+  int64_t start_time_90k;
+  int64_t end_time_90k;
+  QueryParameters params(evhttp_request_get_uri(req));
+  const char *name = params.ok() ? params.Get("name") : nullptr;
+  if (!params.ok() || !camera_uuid.ParseText(params.Get("camera_uuid")) ||
+      !Atoi64(params.Get("start_time_90k"), 10, &start_time_90k) ||
+      !Atoi64(params.Get("end_time_90k"), 10, &end_time_90k) ||
+      start_time_90k < 0 || start_time_90k >= end_time_90k ||
+      name == nullptr || name[0] == '\0' || name[0] == '.' ||
+      strchr(name, '/') != nullptr) {
+    return evhttp_send_error(req, HTTP_BADREQUEST, "bad query parameters");
+  }
+
+  auto *pending = new PendingExport;
+  pending->web = this_;
+  pending->req = req;
+  pending->camera_uuid = camera_uuid;
+  pending->start_time_90k = start_time_90k;
+  pending->end_time_90k = end_time_90k;
+  pending->name = name;
+  evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                &WebInterface::HandleExportClose, pending);
+  {
+    std::lock_guard<std::mutex> lock(this_->export_mu_);
+    this_->exports_.push_back(pending);
+  }
+  this_->export_cv_.notify_one();
+}
+
+void WebInterface::HandleExportClose(evhttp_connection *con, void *arg) {
+  auto *pending = reinterpret_cast<PendingExport *>(arg);
+  LOG(INFO) << pending->req << ": received client abort during export to "
+            << pending->name << "; it will complete anyway.";
+  evhttp_cancel_request(pending->req);
+  pending->req = nullptr;
+}
+
+void WebInterface::RunExports() {
+  SetThreadIoClass(IoClass::kServing);
+  while (true) {
+    PendingExport *pending;
+    {
+      std::unique_lock<std::mutex> lock(export_mu_);
+      export_cv_.wait(lock,
+                      [this]() { return shutting_down_ || !exports_.empty(); });
+      if (shutting_down_) {
+        return;
+      }
+      pending = exports_.front();
+      exports_.pop_front();
+    }
+    pending->ok = ExportMp4(pending->camera_uuid, pending->start_time_90k,
+                            pending->end_time_90k, env_->export_dir,
+                            pending->name, &pending->bytes,
+                            &pending->error_message);
+    {
+      std::lock_guard<std::mutex> lock(export_mu_);
+      done_exports_.push_back(pending);
+    }
+    char c = 0;
+    if (write(done_fds_[1], &c, 1) < 0 && errno != EAGAIN) {
+      PLOG(ERROR) << "write to export pipe";
+    }
+  }
+}
+
+void WebInterface::HandleExportsDone(evutil_socket_t fd, short, void *arg) {
+  auto *this_ = reinterpret_cast<WebInterface *>(arg);
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+  std::deque<PendingExport *> done;
+  {
+    std::lock_guard<std::mutex> lock(this_->export_mu_);
+    done.swap(this_->done_exports_);
+  }
+  for (auto *pending : done) {
+    std::unique_ptr<PendingExport> deleter(pending);
+    if (!pending->ok) {
+      LOG(WARNING) << "ExportMp4 failed: " << pending->error_message;
+    }
+    evhttp_request *req = pending->req;
+    if (req == nullptr) {
+      continue;
+    }
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), nullptr,
+                                  nullptr);
+    if (!pending->ok) {
+      evhttp_send_error(req, HTTP_INTERNAL,
+                        EscapeHtml(pending->error_message).c_str());
+      continue;
+    }
+    EvBuffer reply;
+    reply.AddPrintf("wrote %" PRId64 " bytes to %s\n", pending->bytes,
+                    pending->name.c_str());
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                      "text/plain");
+    evhttp_send_reply(req, HTTP_OK, "OK", reply.get());
+  }
+}
+
+bool WebInterface::ExportMp4(Uuid camera_uuid, int64_t start_time_90k,
+                             int64_t end_time_90k, File *dir,
+                             const std::string &path, int64_t *bytes,
+                             std::string *error_message) {
+  auto file = BuildMp4(camera_uuid, start_time_90k, end_time_90k,
+                       error_message);
+  if (file == nullptr) {
+    return false;
+  }
+
+  int fd;
+  int ret = dir->Open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644, &fd);
+  if (ret != 0) {
+    *error_message = StrCat("open ", path, ": ", strerror(ret));
+    return false;
+  }
+  // Copy in chunks so that the serving throttle applies.
+  TokenBucket *throttle = env_->GetIoBucket(IoClass::kServing);
+  bool ok = true;
+  for (int64_t pos = 0; ok && pos < file->size(); pos += kExportChunkBytes) {
+    ByteRange chunk(pos, std::min(pos + kExportChunkBytes, file->size()));
+    if (throttle != nullptr) {
+      throttle->Acquire(chunk.size());
+    }
+    ok = file->WriteRange(chunk, fd, error_message);
+  }
+  if (ok && fsync(fd) != 0) {
+    int err = errno;
+    *error_message = StrCat("fsync ", path, ": ", strerror(err));
+    ok = false;
+  }
+  if (close(fd) != 0 && ok) {
+    int err = errno;
+    *error_message = StrCat("close ", path, ": ", strerror(err));
+    ok = false;
+  }
+  if (!ok) {
+    dir->Unlink(path.c_str());
+    return false;
+  }
+  *bytes = file->size();
+  LOG(INFO) << "Exported " << HumanizeWithBinaryPrefix(*bytes, "B") << " to "
+            << path;
+  return true;
 }
 
 std::shared_ptr<VirtualFile> WebInterface::BuildMp4(
@@ -231,7 +899,19 @@ std::shared_ptr<VirtualFile> WebInterface::BuildMp4(
             << ", start_time_90k: " << start_time_90k
             << ", end_time_90k: " << end_time_90k;
 
-  Mp4FileBuilder builder(env_->sample_file_dir);
+  // Count the sample file reads toward the camera's stream.
+  File *sample_file_dir = env_->sample_file_dir;
+  File *cold_sample_file_dir = env_->cold_sample_file_dir;
+  GetCameraRow camera_row;
+  if (env_->disk_monitor != nullptr &&
+      env_->mdb->GetCamera(camera_uuid, &camera_row)) {
+    sample_file_dir = env_->GetStreamSampleFileDir(camera_row.short_name,
+                                                   SampleFileTier::kHot);
+    cold_sample_file_dir = env_->GetStreamSampleFileDir(
+        camera_row.short_name, SampleFileTier::kCold);
+  }
+  Mp4FileBuilder builder(sample_file_dir, cold_sample_file_dir);
+  builder.SetKeyFrameCache(env_->key_frame_cache);
   int64_t next_row_start_time_90k = start_time_90k;
   int64_t rows = 0;
   bool ok = true;
@@ -48,8 +48,13 @@
 #ifndef MOONFIRE_NVR_WEB_H
 #define MOONFIRE_NVR_WEB_H
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <string>
+#include <thread>
 
+#include <event2/event.h>
 #include <event2/http.h>
 
 #include "moonfire-db.h"
@@ -64,12 +69,40 @@ class WebInterface {
   WebInterface(const WebInterface &) = delete;
   void operator=(const WebInterface &) = delete;
 
-  void Register(evhttp *http);
+  // Waits for any export in progress.
+  ~WebInterface();
+
+  // Register handlers with |http|, whose requests are dispatched by |base|.
+  // If exporting is enabled, this also starts the export thread.
+  void Register(event_base *base, evhttp *http);
+
+  // Write the .mp4 for the given camera and time range to a new file |path|
+  // within |dir|, failing if it already exists. Sample data is copied within
+  // the kernel (see CopyFileRange), so this is far cheaper than serving the
+  // file over HTTP, though it's still limited to the serving I/O class's
+  // rate. On success, returns true and fills |bytes|.
+  bool ExportMp4(Uuid camera_uuid, int64_t start_time_90k,
+                 int64_t end_time_90k, File *dir, const std::string &path,
+                 int64_t *bytes, std::string *error_message);
 
  private:
   static void HandleCameraList(evhttp_request *req, void *arg);
   static void HandleCameraDetail(evhttp_request *req, void *arg);
+  static void HandleRollups(evhttp_request *req, void *arg);
   static void HandleMp4View(evhttp_request *req, void *arg);
+  static void HandleMp4Export(evhttp_request *req, void *arg);
+  static void HandleDiskUsage(evhttp_request *req, void *arg);
+  static void HandleScrubStatus(evhttp_request *req, void *arg);
+  static void HandleActivity(evhttp_request *req, void *arg);
+  static void HandleDatabaseStatus(evhttp_request *req, void *arg);
+
+  // An export requested through HandleMp4Export. ExportMp4 can take minutes
+  // when limited by the serving throttle, so it runs on |export_thread_|
+  // rather than the event loop, which then sends the reply.
+  struct PendingExport;
+  static void HandleExportClose(evhttp_connection *con, void *arg);
+  static void HandleExportsDone(evutil_socket_t fd, short, void *arg);
+  void RunExports();
 
   // TODO: more nuanced error code for HTTP.
   std::shared_ptr<VirtualFile> BuildMp4(Uuid camera_uuid,
@@ -78,6 +111,18 @@ class WebInterface {
                                         std::string *error_message);
 
   Environment *const env_;
+
+  std::thread export_thread_;
+  std::mutex export_mu_;
+  std::condition_variable export_cv_;  // signalled when exports_ grows.
+  std::deque<PendingExport *> exports_;        // protected by export_mu_.
+  std::deque<PendingExport *> done_exports_;   // protected by export_mu_.
+  bool shutting_down_ = false;                 // protected by export_mu_.
+
+  // The export thread writes a byte to done_fds_[1] after each export, waking
+  // |done_event_| on the event loop.
+  int done_fds_[2] = {-1, -1};
+  event *done_event_ = nullptr;
 };
 
 }  // namespace moonfire_nvr